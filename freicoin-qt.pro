@@ -118,6 +118,10 @@ HEADERS += src/qt/xgui.h \
     src/alert.h \
     src/addrman.h \
     src/base58.h \
+    src/bloom.h \
+    src/blockstore.h \
+    src/kvstore.h \
+    src/lsmstore.h \
     src/bignum.h \
     src/checkpoints.h \
     src/compat.h \
@@ -134,6 +138,7 @@ HEADERS += src/qt/xgui.h \
     src/init.h \
     src/irc.h \
     src/mruset.h \
+    src/checkqueue.h \
     src/json/json_spirit_writer_template.h \
     src/json/json_spirit_writer.h \
     src/json/json_spirit_value.h \
@@ -199,6 +204,9 @@ SOURCES += src/qt/x.cpp src/qt/xgui.cpp \
     src/irc.cpp \
     src/checkpoints.cpp \
     src/addrman.cpp \
+    src/bloom.cpp \
+    src/blockstore.cpp \
+    src/lsmstore.cpp \
     src/db.cpp \
     src/walletdb.cpp \
     src/qt/clientmodel.cpp \
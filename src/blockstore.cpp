@@ -0,0 +1,97 @@
+// Copyright (c) 2009-2012 The Bitcoin developers
+// Copyright (c) 2012 The Xcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#include "blockstore.h"
+#include "main.h"
+
+#ifndef WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+using namespace std;
+
+CBlockStore blockstore;
+
+CMappedBlockFile::~CMappedBlockFile()
+{
+#ifndef WIN32
+    munmap((void*)pbegin, nSize);
+#endif
+}
+
+CBlockStore::~CBlockStore()
+{
+    Flush();
+}
+
+void CBlockStore::Flush()
+{
+    LOCK(cs);
+    for (map<unsigned int, CBlockFile>::iterator mi = mapFiles.begin(); mi != mapFiles.end(); ++mi)
+        fclose((*mi).second.file);
+    mapFiles.clear();
+}
+
+// Caller must hold cs
+CBlockStore::CBlockFile* CBlockStore::GetFile(unsigned int nFile)
+{
+    map<unsigned int, CBlockFile>::iterator mi = mapFiles.find(nFile);
+    if (mi == mapFiles.end())
+    {
+        FILE* file = OpenBlockFile(nFile, 0, "rb");
+        if (!file)
+            return NULL;
+
+        // Close the least recently used file to make room
+        if (mapFiles.size() >= nMaxOpen)
+        {
+            map<unsigned int, CBlockFile>::iterator miOldest = mapFiles.begin();
+            for (map<unsigned int, CBlockFile>::iterator it = mapFiles.begin(); it != mapFiles.end(); ++it)
+                if ((*it).second.nLastUsed < (*miOldest).second.nLastUsed)
+                    miOldest = it;
+            fclose((*miOldest).second.file);
+            mapFiles.erase(miOldest);
+        }
+
+        CBlockFile blockfile;
+        blockfile.file = file;
+        blockfile.fMapFailed = false;
+        mi = mapFiles.insert(make_pair(nFile, blockfile)).first;
+    }
+    (*mi).second.nLastUsed = ++nUseCounter;
+    return &(*mi).second;
+}
+
+// Returns a mapping of nFile that is at least nMinSize bytes long if the
+// file is, or NULL if the file can't be mapped.
+boost::shared_ptr<CMappedBlockFile> CBlockStore::GetMapping(unsigned int nFile, size_t nMinSize)
+{
+    LOCK(cs);
+    CBlockFile* pfile = GetFile(nFile);
+    if (!pfile)
+        return boost::shared_ptr<CMappedBlockFile>();
+    if ((pfile->pmap && pfile->pmap->nSize >= nMinSize) || pfile->fMapFailed)
+        return pfile->pmap;
+
+#ifndef WIN32
+    struct stat st;
+    if (fstat(fileno(pfile->file), &st) != 0 || st.st_size == 0)
+        return pfile->pmap;
+    if (pfile->pmap && (size_t)st.st_size == pfile->pmap->nSize)
+        return pfile->pmap;
+
+    void* p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fileno(pfile->file), 0);
+    if (p == MAP_FAILED)
+    {
+        // e.g. out of address space; fall back to reading the file
+        printf("CBlockStore::GetMapping() : mmap of block file %u failed\n", nFile);
+        pfile->pmap.reset();
+        pfile->fMapFailed = true;
+        return pfile->pmap;
+    }
+    pfile->pmap.reset(new CMappedBlockFile((const char*)p, st.st_size));
+#endif
+    return pfile->pmap;
+}
@@ -0,0 +1,112 @@
+// Copyright (c) 2009-2012 The Bitcoin developers
+// Copyright (c) 2012 The Xcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef XCOIN_BLOCKSTORE_H
+#define XCOIN_BLOCKSTORE_H
+
+#include <map>
+#include <stdio.h>
+
+#include <boost/shared_ptr.hpp>
+
+#include "serialize.h"
+#include "sync.h"
+
+/** A block file mapped read-only into memory.  Unmapped when the last
+ * reader lets go of it, so it may be replaced while reads are in flight.
+ */
+class CMappedBlockFile
+{
+public:
+    const char* pbegin;
+    size_t nSize;
+
+    CMappedBlockFile(const char* pbeginIn, size_t nSizeIn) : pbegin(pbeginIn), nSize(nSizeIn) {}
+    ~CMappedBlockFile();
+};
+
+/** Reads blocks and transactions out of the blk????.dat files.
+ *
+ * Recently used files are kept open and, where the platform allows, mapped
+ * read-only, so most reads deserialize straight out of the page cache
+ * without a system call.  Block files only ever grow: when a read runs
+ * past the end of a mapping, the file is checked for new data and mapped
+ * again.  Where a file can't be mapped, reads go through its cached FILE*.
+ */
+class CBlockStore
+{
+private:
+    struct CBlockFile
+    {
+        FILE* file;
+        boost::shared_ptr<CMappedBlockFile> pmap;
+        bool fMapFailed;
+        int64 nLastUsed;
+    };
+
+    CCriticalSection cs;
+    std::map<unsigned int, CBlockFile> mapFiles;
+    int64 nUseCounter;
+    unsigned int nMaxOpen;
+
+    CBlockFile* GetFile(unsigned int nFile);
+    boost::shared_ptr<CMappedBlockFile> GetMapping(unsigned int nFile, size_t nMinSize);
+
+    template<typename T>
+    static void ReadMapped(const CMappedBlockFile& mapped, unsigned int nPos, T& obj, int nType)
+    {
+        if (nPos >= mapped.nSize)
+            throw std::ios_base::failure("CBlockStore::ReadMapped() : end of data");
+        CMemoryReader(mapped.pbegin + nPos, mapped.pbegin + mapped.nSize, nType, CLIENT_VERSION) >> obj;
+    }
+
+public:
+    CBlockStore(unsigned int nMaxOpenIn=16) : nUseCounter(0), nMaxOpen(nMaxOpenIn) {}
+    ~CBlockStore();
+
+    // Close all files, e.g. before they are replaced
+    void Flush();
+
+    /** Unserialize obj from offset nPos of block file nFile.  Returns false
+     * if the file can't be opened; deserialization errors are thrown.
+     */
+    template<typename T>
+    bool Read(unsigned int nFile, unsigned int nPos, T& obj, int nType)
+    {
+        boost::shared_ptr<CMappedBlockFile> pmap = GetMapping(nFile, nPos + 1);
+        if (pmap)
+        {
+            try {
+                ReadMapped(*pmap, nPos, obj, nType);
+            }
+            catch (std::ios_base::failure &e) {
+                // The object may have been written after the file was mapped
+                boost::shared_ptr<CMappedBlockFile> pmapNew = GetMapping(nFile, pmap->nSize + 1);
+                if (!pmapNew || pmapNew->nSize == pmap->nSize)
+                    throw;
+                ReadMapped(*pmapNew, nPos, obj, nType);
+            }
+            return true;
+        }
+
+        LOCK(cs);
+        CBlockFile* pfile = GetFile(nFile);
+        if (!pfile || fseek(pfile->file, nPos, SEEK_SET) != 0)
+            return false;
+        CAutoFile filein(pfile->file, nType, CLIENT_VERSION);
+        try {
+            filein >> obj;
+        }
+        catch (std::exception &e) {
+            filein.release();
+            throw;
+        }
+        filein.release();
+        return true;
+    }
+};
+
+extern CBlockStore blockstore;
+
+#endif
@@ -0,0 +1,115 @@
+// Copyright (c) 2009-2012 The Bitcoin developers
+// Copyright (c) 2012 The Xcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#include <math.h>
+#include <limits>
+
+#include "bloom.h"
+#include "util.h"
+
+#define LN2SQUARED 0.4804530139182014246671025263266649717305529515945455
+#define LN2 0.6931471805599453094172321214581765680755001343602552
+
+static const unsigned int MAX_BLOOM_HASH_FUNCS = 50;
+
+static inline uint32_t ROTL32(uint32_t x, int8_t r)
+{
+    return (x << r) | (x >> (32 - r));
+}
+
+// MurmurHash3 (x86, 32-bit) of a 256-bit hash
+static unsigned int MurmurHash3(unsigned int nHashSeed, const uint256& hash)
+{
+    uint32_t h1 = nHashSeed;
+    const uint32_t c1 = 0xcc9e2d51;
+    const uint32_t c2 = 0x1b873593;
+
+    const unsigned char* pdata = (const unsigned char*)&hash;
+    for (unsigned int i = 0; i < 32; i += 4)
+    {
+        uint32_t k1 = pdata[i] | (pdata[i+1] << 8) | (pdata[i+2] << 16) | ((uint32_t)pdata[i+3] << 24);
+
+        k1 *= c1;
+        k1 = ROTL32(k1, 15);
+        k1 *= c2;
+
+        h1 ^= k1;
+        h1 = ROTL32(h1, 13);
+        h1 = h1*5+0xe6546b64;
+    }
+
+    h1 ^= 32;
+    h1 ^= h1 >> 16;
+    h1 *= 0x85ebca6b;
+    h1 ^= h1 >> 13;
+    h1 *= 0xc2b2ae35;
+    h1 ^= h1 >> 16;
+
+    return h1;
+}
+
+CRollingBloomFilter::CRollingBloomFilter(unsigned int nElementsIn, double nFPRate) :
+    nElements(std::max(1U, nElementsIn))
+{
+    // Either filter may hold up to two generations of elements
+    unsigned int nFilterBytes = std::max(1U, (unsigned int)(-1 / LN2SQUARED * 2 * nElements * log(nFPRate) / 8));
+    nHashFuncs = std::max(1U, std::min((unsigned int)(nFilterBytes * 8 / (2 * nElements) * LN2), MAX_BLOOM_HASH_FUNCS));
+    vData[0].resize(nFilterBytes);
+    vData[1].resize(nFilterBytes);
+    reset();
+}
+
+unsigned int CRollingBloomFilter::Hash(unsigned int nHashNum, const uint256& hash) const
+{
+    // 0xFBA4C795 chosen as it guarantees a reasonable bit difference between nHashNum values
+    return MurmurHash3(nHashNum * 0xFBA4C795 + nTweak, hash) % (vData[0].size() * 8);
+}
+
+void CRollingBloomFilter::Clear(int nFilter)
+{
+    std::fill(vData[nFilter].begin(), vData[nFilter].end(), 0);
+}
+
+bool CRollingBloomFilter::Contains(int nFilter, const uint256& hash) const
+{
+    for (unsigned int i = 0; i < nHashFuncs; i++)
+    {
+        unsigned int nIndex = Hash(i, hash);
+        if (!(vData[nFilter][nIndex >> 3] & (1 << (7 & nIndex))))
+            return false;
+    }
+    return true;
+}
+
+void CRollingBloomFilter::insert(const uint256& hash)
+{
+    if (nInsertions == 0)
+        Clear(0);
+    else if (nInsertions == nElements)
+        Clear(1);
+
+    for (unsigned int i = 0; i < nHashFuncs; i++)
+    {
+        unsigned int nIndex = Hash(i, hash);
+        vData[0][nIndex >> 3] |= (1 << (7 & nIndex));
+        vData[1][nIndex >> 3] |= (1 << (7 & nIndex));
+    }
+
+    if (++nInsertions == 2 * nElements)
+        nInsertions = 0;
+}
+
+bool CRollingBloomFilter::contains(const uint256& hash) const
+{
+    // Ask whichever filter has been filling up for longer
+    return Contains(nInsertions < nElements ? 1 : 0, hash);
+}
+
+void CRollingBloomFilter::reset()
+{
+    nTweak = (unsigned int)GetRand(std::numeric_limits<unsigned int>::max());
+    nInsertions = 0;
+    Clear(0);
+    Clear(1);
+}
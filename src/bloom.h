@@ -0,0 +1,42 @@
+// Copyright (c) 2009-2012 The Bitcoin developers
+// Copyright (c) 2012 The Xcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef XCOIN_BLOOM_H
+#define XCOIN_BLOOM_H
+
+#include <vector>
+
+#include "uint256.h"
+
+/** Probabilistic set of the most recently inserted hashes.
+ * Two bloom filters are filled side by side and cleared in turn, so that at
+ * least the last nElements and at most the last 2*nElements insertions are
+ * remembered.  contains() never gives a false negative for a remembered hash
+ * and gives a false positive with probability nFPRate.  The hash functions
+ * are keyed with a random tweak, so peers cannot predict collisions.
+ */
+class CRollingBloomFilter
+{
+private:
+    std::vector<unsigned char> vData[2];
+    unsigned int nHashFuncs;
+    unsigned int nTweak;
+    unsigned int nElements;
+    unsigned int nInsertions;
+
+    unsigned int Hash(unsigned int nHashNum, const uint256& hash) const;
+    void Clear(int nFilter);
+    bool Contains(int nFilter, const uint256& hash) const;
+
+public:
+    CRollingBloomFilter(unsigned int nElementsIn, double nFPRate);
+
+    void insert(const uint256& hash);
+    bool contains(const uint256& hash) const;
+
+    // Forget everything and pick a new tweak
+    void reset();
+};
+
+#endif
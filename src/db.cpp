@@ -6,6 +6,7 @@
 #include "db.h"
 #include "util.h"
 #include "main.h"
+#include "lsmstore.h"
 #include <boost/version.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
@@ -45,6 +46,8 @@ CDBEnv::CDBEnv() : dbenv(DB_CXX_NO_EXCEPTIONS)
 {
     fDbEnvInit = false;
     fMockDb = false;
+    fDetachDB = false;
+    fBulkWrite = true;
 }
 
 CDBEnv::~CDBEnv()
@@ -477,21 +480,618 @@ void CDBEnv::Flush(bool fShutdown)
 
 
 
+//
+// CCoinsCache
+//
+
+CCoinsCache coinscache;
+
+size_t CCoinsCache::EntryUsage(const CEntry& entry)
+{
+    // Rough in-memory footprint: node and key overhead, the spent pointers,
+    // and twice the serialized size for the transaction's vectors and scripts
+    size_t nSize = sizeof(CEntry) + sizeof(uint256) + 4 * sizeof(void*);
+    nSize += entry.txindex.vSpent.size() * sizeof(CDiskTxPos);
+    if (entry.fHaveTx)
+        nSize += 2 * ::GetSerializeSize(entry.tx, SER_NETWORK, PROTOCOL_VERSION);
+    return nSize;
+}
+
+CCoinsCache::EntryMap::iterator CCoinsCache::InsertEntry(const uint256& hash)
+{
+    EntryMap::iterator mi = mapEntries.insert(make_pair(hash, CEntry())).first;
+    mi->second.itClean = listClean.insert(listClean.end(), hash);
+    return mi;
+}
+
+void CCoinsCache::EraseEntry(EntryMap::iterator mi)
+{
+    RemoveUsage(mi->second);
+    if (!mi->second.fDirty)
+        listClean.erase(mi->second.itClean);
+    mapEntries.erase(mi);
+}
+
+void CCoinsCache::AddUsage(const CEntry& entry)
+{
+    size_t nSize = EntryUsage(entry);
+    nUsage += nSize;
+    if (entry.fDirty)
+        nDirtyUsage += nSize;
+}
+
+void CCoinsCache::RemoveUsage(const CEntry& entry)
+{
+    size_t nSize = EntryUsage(entry);
+    nUsage -= nSize;
+    if (entry.fDirty)
+        nDirtyUsage -= nSize;
+}
+
+void CCoinsCache::Evict()
+{
+    // Drop the least recently used clean entries until comfortably under
+    // budget; dirty ones stay until the next flush
+    while (nUsage > nMaxUsage / 2 && !listClean.empty())
+        EraseEntry(mapEntries.find(listClean.front()));
+}
+
+void CCoinsCache::SetMaxUsage(size_t nMaxUsageIn)
+{
+    LOCK(cs);
+    nMaxUsage = nMaxUsageIn;
+    if (nUsage > nMaxUsage)
+        Evict();
+}
+
+size_t CCoinsCache::GetUsage() const
+{
+    LOCK(cs);
+    return nUsage;
+}
+
+bool CCoinsCache::IsFull() const
+{
+    LOCK(cs);
+    return nUsage > nMaxUsage || nDirtyUsage > nMaxUsage / 2;
+}
+
+bool CCoinsCache::IsDirty() const
+{
+    LOCK(cs);
+    return hashBestChain != 0 || nDirtyUsage > 0;
+}
+
+bool CCoinsCache::GetTxIndex(const uint256& hash, CTxIndex& txindex, bool& fFound) const
+{
+    LOCK(cs);
+    EntryMap::const_iterator mi = mapEntries.find(hash);
+    if (mi == mapEntries.end() || !mi->second.fHaveIndex)
+        return false;
+    if (!mi->second.fDirty)
+        listClean.splice(listClean.end(), listClean, mi->second.itClean);
+    txindex = mi->second.txindex;
+    fFound = !txindex.IsNull();
+    return true;
+}
+
+void CCoinsCache::SetTxIndex(const uint256& hash, const CTxIndex& txindex, bool fDirty)
+{
+    LOCK(cs);
+    EntryMap::iterator mi = mapEntries.find(hash);
+    if (mi == mapEntries.end())
+        mi = InsertEntry(hash);
+    else
+        RemoveUsage(mi->second);
+
+    CEntry& entry = mi->second;
+    entry.txindex = txindex;
+    entry.fHaveIndex = true;
+    if (fDirty && !entry.fDirty)
+    {
+        listClean.erase(entry.itClean);
+        entry.fDirty = true;
+    }
+    else if (!entry.fDirty)
+        listClean.splice(listClean.end(), listClean, entry.itClean);
+
+    // Once every output is spent the transaction itself is no longer needed
+    bool fUnspent = false;
+    BOOST_FOREACH(const CDiskTxPos& pos, txindex.vSpent)
+        if (pos.IsNull())
+            fUnspent = true;
+    if (!fUnspent && entry.fHaveTx)
+    {
+        entry.tx.SetNull();
+        entry.fHaveTx = false;
+    }
+
+    AddUsage(entry);
+    if (nUsage > nMaxUsage)
+        Evict();
+}
+
+void CCoinsCache::FillTxIndex(const uint256& hash, const CTxIndex& txindex)
+{
+    LOCK(cs);
+    // A reader racing a write may come back with what the write replaced
+    EntryMap::const_iterator mi = mapEntries.find(hash);
+    if (mi != mapEntries.end() && (mi->second.fHaveIndex || mi->second.fDirty))
+        return;
+    SetTxIndex(hash, txindex, false);
+}
+
+bool CCoinsCache::GetTx(const uint256& hash, CTransaction& tx) const
+{
+    LOCK(cs);
+    EntryMap::const_iterator mi = mapEntries.find(hash);
+    if (mi == mapEntries.end() || !mi->second.fHaveTx)
+        return false;
+    if (!mi->second.fDirty)
+        listClean.splice(listClean.end(), listClean, mi->second.itClean);
+    tx = mi->second.tx;
+    return true;
+}
+
+void CCoinsCache::SetTx(const uint256& hash, const CTransaction& tx)
+{
+    LOCK(cs);
+    EntryMap::iterator mi = mapEntries.find(hash);
+    if (mi == mapEntries.end())
+        mi = InsertEntry(hash);
+    else if (mi->second.fHaveTx)
+        return;
+    else
+        RemoveUsage(mi->second);
+
+    mi->second.tx = tx;
+    mi->second.fHaveTx = true;
+    AddUsage(mi->second);
+    if (nUsage > nMaxUsage)
+        Evict();
+}
+
+bool CCoinsCache::GetBestChain(uint256& hashBestChainRet) const
+{
+    LOCK(cs);
+    if (hashBestChain == 0)
+        return false;
+    hashBestChainRet = hashBestChain;
+    return true;
+}
+
+void CCoinsCache::SetBestChain(const uint256& hashBestChainIn)
+{
+    LOCK(cs);
+    hashBestChain = hashBestChainIn;
+}
+
+void CCoinsCache::GetDirty(vector<pair<uint256, CTxIndex> >& vDirty, uint256& hashBestChainRet) const
+{
+    LOCK(cs);
+    BOOST_FOREACH(const EntryMap::value_type& item, mapEntries)
+        if (item.second.fDirty)
+            vDirty.push_back(make_pair(item.first, item.second.txindex));
+    hashBestChainRet = hashBestChain;
+}
+
+void CCoinsCache::MarkClean()
+{
+    LOCK(cs);
+    BOOST_FOREACH(EntryMap::value_type& item, mapEntries)
+    {
+        if (item.second.fDirty)
+        {
+            item.second.fDirty = false;
+            item.second.itClean = listClean.insert(listClean.end(), item.first);
+        }
+    }
+    nDirtyUsage = 0;
+    hashBestChain = 0;
+    if (nUsage > nMaxUsage)
+        Evict();
+}
+
+
+
+//
+// CBDBStore
+//
+
+bool CBDBStore::Read(const string& strKey, string& strValue, const CKVSnapshot* psnapshot)
+{
+    if (!pdb)
+        return false;
+    Dbt datKey((void*)strKey.data(), strKey.size());
+    Dbt datValue;
+    datValue.set_flags(DB_DBT_MALLOC);
+    int ret = pdb->get(NULL, &datKey, &datValue, 0);
+    if (datValue.get_data() == NULL)
+        return false;
+    strValue.assign((const char*)datValue.get_data(), datValue.get_size());
+    free(datValue.get_data());
+    return (ret == 0);
+}
+
+bool CBDBStore::Exists(const string& strKey)
+{
+    if (!pdb)
+        return false;
+    Dbt datKey((void*)strKey.data(), strKey.size());
+    return (pdb->exists(NULL, &datKey, 0) == 0);
+}
+
+bool CBDBStore::Write(const CKVBatch& batch, bool fSync)
+{
+    if (!pdb)
+        return false;
+    if (fReadOnly)
+        assert(!"Write called on database in read-only mode");
+
+    // In bulk mode during initial download, unsynced writes only go to
+    // the in-memory log buffer
+    bool fBulk = !fSync && bitdb.GetBulkWrite() && IsInitialBlockDownload();
+    if (!TxnBegin(fBulk ? DB_TXN_NOSYNC : DB_TXN_WRITE_NOSYNC))
+        return false;
+    const CKVBatch::WriteMap& mapWrites = batch.GetWrites();
+    for (CKVBatch::WriteMap::const_iterator mi = mapWrites.begin(); mi != mapWrites.end(); ++mi)
+    {
+        Dbt datKey((void*)(*mi).first.data(), (*mi).first.size());
+        int ret;
+        if ((*mi).second.first)
+        {
+            ret = pdb->del(activeTxn, &datKey, 0);
+            if (ret == DB_NOTFOUND)
+                ret = 0;
+        }
+        else
+        {
+            Dbt datValue((void*)(*mi).second.second.data(), (*mi).second.second.size());
+            ret = pdb->put(activeTxn, &datKey, &datValue, 0);
+        }
+        if (ret != 0)
+        {
+            TxnAbort();
+            return false;
+        }
+    }
+    return TxnCommit(fSync ? DB_TXN_SYNC : 0);
+}
+
+void CBDBStore::Checkpoint()
+{
+    // Flush database activity from memory pool to disk log
+    bitdb.dbenv.txn_checkpoint(GetArg("-dblogsize", 100)*1024, IsInitialBlockDownload() ? 5 : 2, 0);
+}
+
+class CBDBIterator : public CKVIterator
+{
+private:
+    Dbc* pcursor;
+    bool fValid;
+    string strKey;
+    string strValue;
+
+    void Fetch(Dbt& datKey, unsigned int fFlags)
+    {
+        Dbt datValue;
+        datKey.set_flags(DB_DBT_MALLOC);
+        datValue.set_flags(DB_DBT_MALLOC);
+        fValid = (pcursor && pcursor->get(&datKey, &datValue, fFlags) == 0);
+        if (!fValid)
+            return;
+        strKey.assign((const char*)datKey.get_data(), datKey.get_size());
+        strValue.assign((const char*)datValue.get_data(), datValue.get_size());
+        free(datKey.get_data());
+        free(datValue.get_data());
+    }
+
+public:
+    CBDBIterator(Dbc* pcursorIn) : pcursor(pcursorIn), fValid(false) { }
+    ~CBDBIterator()
+    {
+        if (pcursor)
+            pcursor->close();
+    }
+
+    void Seek(const string& strSeek)
+    {
+        Dbt datKey((void*)strSeek.data(), strSeek.size());
+        Fetch(datKey, DB_SET_RANGE);
+    }
+
+    bool Valid() const { return fValid; }
+
+    void Next()
+    {
+        Dbt datKey;
+        Fetch(datKey, DB_NEXT);
+    }
+
+    const string& GetKey() const { return strKey; }
+    const string& GetValue() const { return strValue; }
+};
+
+CKVIterator* CBDBStore::NewIterator(const CKVSnapshot* psnapshot)
+{
+    return new CBDBIterator(GetCursor());
+}
+
+
+
+//
+// Transaction database storage
+//
+
+CKVStore* ptxdbstore = NULL;
+
+// Copy every record of the Berkeley DB transaction database into store
+static bool CopyTxDB(CBDBStore& storeFrom, CKVStore& storeTo)
+{
+    auto_ptr<CKVIterator> pit(storeFrom.NewIterator());
+    CKVBatch batch;
+    unsigned int nCount = 0;
+    for (pit->Seek(string()); pit->Valid(); pit->Next())
+    {
+        batch.Write(pit->GetKey(), pit->GetValue());
+        nCount++;
+        if (batch.size() >= 10000)
+        {
+            if (!storeTo.Write(batch, false))
+                return false;
+            batch.clear();
+        }
+        if (fRequestShutdown)
+            return false;
+    }
+    if (!storeTo.Write(batch, true))
+        return false;
+    printf("OpenTxDB() : copied %u records from blkindex.dat\n", nCount);
+    return true;
+}
+
+bool OpenTxDB()
+{
+    assert(ptxdbstore == NULL);
+    string strBackend = GetArg("-dbbackend", "lsm");
+    if (strBackend == "bdb")
+    {
+        ptxdbstore = new CBDBStore("blkindex.dat");
+        return true;
+    }
+    if (strBackend != "lsm")
+        return error("OpenTxDB() : unknown -dbbackend %s", strBackend.c_str());
+
+    boost::filesystem::path pathStore = GetDataDir() / "txindex";
+    if (!boost::filesystem::exists(pathStore) && boost::filesystem::exists(GetDataDir() / "blkindex.dat"))
+    {
+        // Move an existing Berkeley DB transaction database over.  The
+        // copy is built aside and only renamed into place when complete,
+        // so an interrupted migration starts over.  blkindex.dat is left
+        // alone so that -dbbackend=bdb keeps working.
+        printf("OpenTxDB() : migrating blkindex.dat to %s\n", pathStore.string().c_str());
+        boost::filesystem::path pathNew = GetDataDir() / "txindex.new";
+        boost::filesystem::remove_all(pathNew);
+        bool fCopied;
+        {
+            CBDBStore storeFrom("blkindex.dat", "r");
+            CLSMStore storeTo(pathNew);
+            fCopied = storeTo.Open() && CopyTxDB(storeFrom, storeTo);
+        }
+        if (!fCopied)
+            return error("OpenTxDB() : migrating blkindex.dat failed");
+        boost::filesystem::rename(pathNew, pathStore);
+    }
+
+    CLSMStore* pstore = new CLSMStore(pathStore);
+    if (!pstore->Open())
+    {
+        delete pstore;
+        return error("OpenTxDB() : opening %s failed", pathStore.string().c_str());
+    }
+    ptxdbstore = pstore;
+    return true;
+}
+
+void CloseTxDB()
+{
+    delete ptxdbstore;
+    ptxdbstore = NULL;
+}
+
+
+
 //
 // CTxDB
 //
 
+CTxDB::CTxDB(const char* pszMode) : pstore(ptxdbstore), fActiveTxn(false), hashTxnBestChain(0), fFlushCoins(false), fTxnBulk(false)
+{
+    if (!pstore)
+        throw runtime_error("CTxDB() : transaction database not open");
+    fReadOnly = (!strchr(pszMode, '+') && !strchr(pszMode, 'w'));
+}
+
+void CTxDB::Close()
+{
+    if (!pstore)
+        return;
+    if (fActiveTxn)
+        TxnAbort();
+    pstore->Checkpoint();
+    pstore = NULL;
+}
+
+// Sync the block data and block index entries up to hashBest to disk
+static void CommitBlockFiles(const uint256& hashBest)
+{
+    blockindexdb.Commit();
+    BlockMap::iterator mi = mapBlockIndex.find(hashBest);
+    if (mi == mapBlockIndex.end())
+        return;
+    FILE* file = OpenBlockFile((*mi).second->nFile, 0, "ab");
+    if (file)
+    {
+        FileCommit(file);
+        fclose(file);
+    }
+}
+
+bool CTxDB::TxnBegin()
+{
+    // During initial download, commits only go to the in-memory log
+    // buffer; TxnCommit syncs the log when the best chain marker is written
+    fTxnBulk = bitdb.GetBulkWrite() && IsInitialBlockDownload();
+    if (!pstore || fActiveTxn)
+        return false;
+    fActiveTxn = true;
+    batch.clear();
+    mapTxnIndex.clear();
+    hashTxnBestChain = 0;
+    fFlushCoins = false;
+    return true;
+}
+
+bool CTxDB::WriteCoins()
+{
+    vector<pair<uint256, CTxIndex> > vDirty;
+    uint256 hashBest;
+    coinscache.GetDirty(vDirty, hashBest);
+
+    // Changes made in this db transaction supersede the cached ones
+    for (map<uint256, CTxIndex>::const_iterator mi = mapTxnIndex.begin(); mi != mapTxnIndex.end(); ++mi)
+        vDirty.push_back(*mi);
+    if (hashTxnBestChain != 0)
+        hashBest = hashTxnBestChain;
+
+    for (vector<pair<uint256, CTxIndex> >::const_iterator it = vDirty.begin(); it != vDirty.end(); ++it)
+    {
+        if (it->second.IsNull())
+        {
+            if (!Erase(make_pair(string("tx"), it->first)))
+                return false;
+        }
+        else if (!Write(make_pair(string("tx"), it->first), it->second))
+            return false;
+    }
+    if (hashBest != 0 && !Write(string("hashBestChain"), hashBest))
+        return false;
+
+    if (fDebug)
+        printf("CTxDB::WriteCoins() : wrote %"PRIszu" tx index entries\n", vDirty.size());
+    return true;
+}
+
+bool CTxDB::TxnCommit()
+{
+    bool fFlush = fFlushCoins || coinscache.IsFull();
+    fFlushCoins = false;
+    if (fFlush && fActiveTxn && !WriteCoins())
+    {
+        TxnAbort();
+        return error("CTxDB::TxnCommit() : writing cached tx index failed");
+    }
+
+    // A flush writes the best chain marker, so the blocks and block index
+    // entries it refers to reach the disk first, whether or not the log
+    // is synced now.  Group commit: when deferred commits end with a new
+    // marker, the log is synced once for all of them.  After a crash, the
+    // db recovers to the last synced marker and the blocks past it are
+    // connected again.
+    bool fGroupCommit = fFlush && fTxnBulk;
+    if (fFlush)
+    {
+        uint256 hashBest;
+        if (ReadHashBestChain(hashBest))
+            CommitBlockFiles(hashBest);
+    }
+    if (!pstore || !fActiveTxn)
+        return false;
+    fActiveTxn = false;
+    bool fWritten = batch.empty() || pstore->Write(batch, fGroupCommit);
+    batch.clear();
+    if (!fWritten)
+    {
+        mapTxnIndex.clear();
+        hashTxnBestChain = 0;
+        return false;
+    }
+
+    // Only now that the db agrees may the changes become visible to others
+    if (fFlush)
+        coinscache.MarkClean();
+    for (map<uint256, CTxIndex>::const_iterator mi = mapTxnIndex.begin(); mi != mapTxnIndex.end(); ++mi)
+        coinscache.SetTxIndex(mi->first, mi->second, !fFlush);
+    if (hashTxnBestChain != 0 && !fFlush)
+        coinscache.SetBestChain(hashTxnBestChain);
+    mapTxnIndex.clear();
+    hashTxnBestChain = 0;
+
+    // Move the synced changes into the data file so the log can be
+    // removed and recovery has little to replay
+    if (fGroupCommit)
+        pstore->Checkpoint();
+    return true;
+}
+
+bool CTxDB::TxnAbort()
+{
+    mapTxnIndex.clear();
+    hashTxnBestChain = 0;
+    fFlushCoins = false;
+    if (!pstore || !fActiveTxn)
+        return false;
+    fActiveTxn = false;
+    batch.clear();
+    return true;
+}
+
+bool CTxDB::FlushCoins()
+{
+    if (!coinscache.IsDirty())
+        return true;
+    if (!TxnBegin())
+        return error("CTxDB::FlushCoins() : TxnBegin failed");
+    FlushCoinsOnCommit();
+    return TxnCommit();
+}
+
 bool CTxDB::ReadTxIndex(uint256 hash, CTxIndex& txindex)
 {
     assert(!fClient);
     txindex.SetNull();
-    return Read(make_pair(string("tx"), hash), txindex);
+
+    if (fActiveTxn)
+    {
+        map<uint256, CTxIndex>::const_iterator mi = mapTxnIndex.find(hash);
+        if (mi != mapTxnIndex.end())
+        {
+            txindex = mi->second;
+            return !txindex.IsNull();
+        }
+    }
+
+    bool fFound;
+    if (coinscache.GetTxIndex(hash, txindex, fFound))
+        return fFound;
+
+    // Cache misses are remembered too, so that repeated lookups for
+    // transactions we have never seen stay off the disk
+    fFound = Read(make_pair(string("tx"), hash), txindex);
+    if (!fFound)
+        txindex.SetNull();
+    coinscache.FillTxIndex(hash, txindex);
+    return fFound;
 }
 
 bool CTxDB::UpdateTxIndex(uint256 hash, const CTxIndex& txindex)
 {
     assert(!fClient);
-    return Write(make_pair(string("tx"), hash), txindex);
+    if (fActiveTxn)
+        mapTxnIndex[hash] = txindex;
+    else
+        coinscache.SetTxIndex(hash, txindex, true);
+    return true;
 }
 
 bool CTxDB::AddTxIndex(const CTransaction& tx, const CDiskTxPos& pos, int nHeight)
@@ -501,7 +1101,7 @@ bool CTxDB::AddTxIndex(const CTransaction& tx, const CDiskTxPos& pos, int nHeigh
     // Add to tx index
     uint256 hash = tx.GetHash();
     CTxIndex txindex(pos, tx.vout.size());
-    return Write(make_pair(string("tx"), hash), txindex);
+    return UpdateTxIndex(hash, txindex);
 }
 
 bool CTxDB::EraseTxIndex(const CTransaction& tx)
@@ -509,13 +1109,14 @@ bool CTxDB::EraseTxIndex(const CTransaction& tx)
     assert(!fClient);
     uint256 hash = tx.GetHash();
 
-    return Erase(make_pair(string("tx"), hash));
+    return UpdateTxIndex(hash, CTxIndex());
 }
 
 bool CTxDB::ContainsTx(uint256 hash)
 {
     assert(!fClient);
-    return Exists(make_pair(string("tx"), hash));
+    CTxIndex txindex;
+    return ReadTxIndex(hash, txindex);
 }
 
 bool CTxDB::ReadDiskTx(uint256 hash, CTransaction& tx, CTxIndex& txindex)
@@ -524,7 +1125,7 @@ bool CTxDB::ReadDiskTx(uint256 hash, CTransaction& tx, CTxIndex& txindex)
     tx.SetNull();
     if (!ReadTxIndex(hash, txindex))
         return false;
-    return (tx.ReadFromDisk(txindex.pos));
+    return ReadCachedTx(hash, txindex.pos, tx);
 }
 
 bool CTxDB::ReadDiskTx(uint256 hash, CTransaction& tx)
@@ -544,19 +1145,51 @@ bool CTxDB::ReadDiskTx(COutPoint outpoint, CTransaction& tx)
     return ReadDiskTx(outpoint.hash, tx, txindex);
 }
 
-bool CTxDB::WriteBlockIndex(const CDiskBlockIndex& blockindex)
+bool CTxDB::ReadCachedTx(uint256 hash, const CDiskTxPos& pos, CTransaction& tx)
+{
+    if (coinscache.GetTx(hash, tx))
+        return true;
+    if (!tx.ReadFromDisk(pos))
+        return false;
+    coinscache.SetTx(hash, tx);
+    return true;
+}
+
+void CTxDB::CacheTx(uint256 hash, const CTransaction& tx)
+{
+    coinscache.SetTx(hash, tx);
+}
+
+bool CTxDB::ReadHashConnectedTip(uint256& hashConnectedTip)
+{
+    return Read(string("hashConnectedTip"), hashConnectedTip);
+}
+
+bool CTxDB::WriteHashConnectedTip(uint256 hashConnectedTip)
 {
-    return Write(make_pair(string("blockindex"), blockindex.GetBlockHash()), blockindex);
+    return Write(string("hashConnectedTip"), hashConnectedTip);
 }
 
 bool CTxDB::ReadHashBestChain(uint256& hashBestChain)
 {
+    if (fActiveTxn && hashTxnBestChain != 0)
+    {
+        hashBestChain = hashTxnBestChain;
+        return true;
+    }
+    if (coinscache.GetBestChain(hashBestChain))
+        return true;
     return Read(string("hashBestChain"), hashBestChain);
 }
 
 bool CTxDB::WriteHashBestChain(uint256 hashBestChain)
 {
-    return Write(string("hashBestChain"), hashBestChain);
+    // Kept with the tx index changes so that both reach the disk together
+    if (fActiveTxn)
+        hashTxnBestChain = hashBestChain;
+    else
+        coinscache.SetBestChain(hashBestChain);
+    return true;
 }
 
 bool CTxDB::ReadBestInvalidWork(CBigNum& bnBestInvalidWork)
@@ -575,14 +1208,12 @@ CBlockIndex static * InsertBlockIndex(uint256 hash)
         return NULL;
 
     // Return existing
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+    BlockMap::iterator mi = mapBlockIndex.find(hash);
     if (mi != mapBlockIndex.end())
         return (*mi).second;
 
     // Create new
-    CBlockIndex* pindexNew = new CBlockIndex();
-    if (!pindexNew)
-        throw runtime_error("LoadBlockIndex() : new CBlockIndex failed");
+    CBlockIndex* pindexNew = NewBlockIndex();
     mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
     pindexNew->phashBlock = &((*mi).first);
 
@@ -597,7 +1228,7 @@ bool CTxDB::LoadBlockIndex()
     if (fRequestShutdown)
         return true;
 
-    // Calculate bnChainWork
+    // Calculate bnChainWork and build skip pointers
     vector<pair<int, CBlockIndex*> > vSortedByHeight;
     vSortedByHeight.reserve(mapBlockIndex.size());
     BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex)
@@ -610,6 +1241,7 @@ bool CTxDB::LoadBlockIndex()
     {
         CBlockIndex* pindex = item.second;
         pindex->bnChainWork = (pindex->pprev ? pindex->pprev->bnChainWork : 0) + pindex->GetBlockWork();
+        pindex->BuildSkip();
     }
 
     // Load hashBestChain pointer to end of best chain
@@ -624,6 +1256,26 @@ bool CTxDB::LoadBlockIndex()
     pindexBest = mapBlockIndex[hashBestChain];
     nBestHeight = pindexBest->nHeight;
     bnBestChainWork = pindexBest->bnChainWork;
+
+    // Blocks connected after the coins cache was last written back are
+    // past hashBestChain; they are connected again below
+    CBlockIndex* pindexConnected = pindexBest;
+    uint256 hashConnectedTip;
+    if (ReadHashConnectedTip(hashConnectedTip) && mapBlockIndex.count(hashConnectedTip))
+        pindexConnected = mapBlockIndex[hashConnectedTip];
+    else
+        while (pindexConnected->pnext) // forward links read from older databases
+            pindexConnected = pindexConnected->pnext;
+    CBlockIndex* pindexUnflushed = NULL;
+    if (pindexConnected->nHeight > pindexBest->nHeight && pindexConnected->GetAncestor(pindexBest->nHeight) == pindexBest)
+        pindexUnflushed = pindexConnected;
+
+    // Rebuild the forward links of the best chain
+    BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex)
+        item.second->pnext = NULL;
+    for (CBlockIndex* pindex = pindexBest; pindex->pprev; pindex = pindex->pprev)
+        pindex->pprev->pnext = pindex;
+    SetMainChainTip(pindexBest);
     printf("LoadBlockIndex(): hashBestChain=%s  height=%d  date=%s\n",
       hashBestChain.ToString().substr(0,20).c_str(), nBestHeight,
       DateTimeStrFormat("%x %H:%M:%S", pindexBest->GetBlockTime()).c_str());
@@ -755,34 +1407,55 @@ bool CTxDB::LoadBlockIndex()
         CTxDB txdb;
         block.SetBestChain(txdb, pindexFork);
     }
+    else if (pindexUnflushed && !fRequestShutdown)
+    {
+        printf("LoadBlockIndex() : reconnecting blocks up to height %d\n", pindexUnflushed->nHeight);
+        CBlock block;
+        if (!block.ReadFromDisk(pindexUnflushed))
+            return error("LoadBlockIndex() : block.ReadFromDisk failed");
+        CTxDB txdb;
+        block.SetBestChain(txdb, pindexUnflushed);
+    }
 
     return true;
 }
 
 
 
+// Version of the blkindex.idx format; recorded in blkindex.dat once the
+// file holds the whole index
+static const int BLOCKINDEX_FILE_VERSION = 1;
+
 bool CTxDB::LoadBlockIndexGuts()
 {
-    // Get database cursor
-    Dbc* pcursor = GetCursor();
-    if (!pcursor)
+    int nFileVersion = 0;
+    if (Read(string("blockindexfile"), nFileVersion) && nFileVersion == BLOCKINDEX_FILE_VERSION)
+        return blockindexdb.Load();
+
+    // Older databases keep the index in "blockindex" records; move it
+    // to the flat file
+    if (!LoadBlockIndexRecords())
+        return false;
+    if (fRequestShutdown)
+        return true;
+    printf("LoadBlockIndex() : writing %"PRIszu" entries to blkindex.idx\n", mapBlockIndex.size());
+    if (!blockindexdb.Rewrite())
         return false;
+    return Write(string("blockindexfile"), BLOCKINDEX_FILE_VERSION);
+}
 
+bool CTxDB::LoadBlockIndexRecords()
+{
     // Load mapBlockIndex
-    unsigned int fFlags = DB_SET_RANGE;
-    loop
-    {
-        // Read next record
-        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
-        if (fFlags == DB_SET_RANGE)
-            ssKey << make_pair(string("blockindex"), uint256(0));
-        CDataStream ssValue(SER_DISK, CLIENT_VERSION);
-        int ret = ReadAtCursor(pcursor, ssKey, ssValue, fFlags);
-        fFlags = DB_NEXT;
-        if (ret == DB_NOTFOUND)
-            break;
-        else if (ret != 0)
-            return false;
+    CDataStream ssStart(SER_DISK, CLIENT_VERSION);
+    ssStart << make_pair(string("blockindex"), uint256(0));
+    auto_ptr<CKVIterator> pit(pstore->NewIterator());
+    for (pit->Seek(string(ssStart.begin(), ssStart.end())); pit->Valid(); pit->Next())
+    {
+        const string& strKey = pit->GetKey();
+        const string& strValue = pit->GetValue();
+        CDataStream ssKey(strKey.data(), strKey.data() + strKey.size(), SER_DISK, CLIENT_VERSION);
+        CDataStream ssValue(strValue.data(), strValue.data() + strValue.size(), SER_DISK, CLIENT_VERSION);
 
         // Unserialize
 
@@ -823,7 +1496,6 @@ bool CTxDB::LoadBlockIndexGuts()
             return error("%s() : deserialize error", __PRETTY_FUNCTION__);
         }
     }
-    pcursor->close();
 
     return true;
 }
@@ -832,6 +1504,228 @@ bool CTxDB::LoadBlockIndexGuts()
 
 
 
+//
+// CBlockIndexDB
+//
+
+CBlockIndexDB blockindexdb;
+
+/** Fixed-size record of one block index entry in blkindex.idx */
+class CBlockIndexRecord
+{
+public:
+    uint256 hash;
+    uint256 hashPrev;
+    unsigned int nFile;
+    unsigned int nBlockPos;
+    int nHeight;
+
+    // block header
+    int nVersion;
+    uint256 hashMerkleRoot;
+    unsigned int nTime;
+    unsigned int nBits;
+    unsigned int nNonce;
+
+    CBlockIndexRecord()
+    {
+        nFile = nBlockPos = nTime = nBits = nNonce = 0;
+        nHeight = nVersion = 0;
+    }
+
+    explicit CBlockIndexRecord(const CBlockIndex* pindex)
+    {
+        hash           = pindex->GetBlockHash();
+        hashPrev       = (pindex->pprev ? pindex->pprev->GetBlockHash() : 0);
+        nFile          = pindex->nFile;
+        nBlockPos      = pindex->nBlockPos;
+        nHeight        = pindex->nHeight;
+        nVersion       = pindex->nVersion;
+        hashMerkleRoot = pindex->hashMerkleRoot;
+        nTime          = pindex->nTime;
+        nBits          = pindex->nBits;
+        nNonce         = pindex->nNonce;
+    }
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(hash);
+        READWRITE(hashPrev);
+        READWRITE(nFile);
+        READWRITE(nBlockPos);
+        READWRITE(nHeight);
+        READWRITE(this->nVersion);
+        READWRITE(hashMerkleRoot);
+        READWRITE(nTime);
+        READWRITE(nBits);
+        READWRITE(nNonce);
+    )
+};
+
+static const unsigned int BLOCKINDEX_RECORD_SIZE = 124;
+static const unsigned int BLOCKINDEX_HEADER_SIZE = 8;
+
+CBlockIndexDB::CBlockIndexDB() : file(NULL)
+{
+}
+
+CBlockIndexDB::~CBlockIndexDB()
+{
+    Close();
+}
+
+void CBlockIndexDB::Close()
+{
+    if (file)
+        fclose(file);
+    file = NULL;
+}
+
+bool CBlockIndexDB::Open()
+{
+    if (file)
+        return true;
+    pathIndex = GetDataDir() / "blkindex.idx";
+    file = fopen(pathIndex.string().c_str(), "ab");
+    if (!file)
+        return error("CBlockIndexDB::Open() : open failed");
+
+    // New file: write header (pchMessageStart magic number and version)
+    if (ftell(file) == 0)
+    {
+        CAutoFile fileout(file, SER_DISK, CLIENT_VERSION);
+        fileout << FLATDATA(pchMessageStart) << BLOCKINDEX_FILE_VERSION;
+        fileout.release();
+        fflush(file);
+    }
+    return true;
+}
+
+bool CBlockIndexDB::Append(const CBlockIndex* pindex, bool fCommit)
+{
+    if (!Open())
+        return false;
+    CAutoFile fileout(file, SER_DISK, CLIENT_VERSION);
+    try {
+        fileout << CBlockIndexRecord(pindex);
+    }
+    catch (std::exception &e) {
+        fileout.release();
+        return error("CBlockIndexDB::Append() : I/O error");
+    }
+    fileout.release();
+    fflush(file);
+    if (fCommit)
+        FileCommit(file);
+    return true;
+}
+
+void CBlockIndexDB::Commit()
+{
+    if (file)
+        FileCommit(file);
+}
+
+bool CBlockIndexDB::Load()
+{
+    Close();
+    pathIndex = GetDataDir() / "blkindex.idx";
+    FILE* filein = fopen(pathIndex.string().c_str(), "rb");
+    if (!filein)
+        return error("CBlockIndexDB::Load() : open failed");
+
+    // Read the whole file at once
+    int nFileSize = GetFilesize(filein);
+    vector<char> vchData(max(nFileSize, 0));
+    bool fRead = vchData.empty() || fread(&vchData[0], 1, vchData.size(), filein) == vchData.size();
+    fclose(filein);
+    if (!fRead || vchData.size() < BLOCKINDEX_HEADER_SIZE)
+        return error("CBlockIndexDB::Load() : I/O error");
+
+    unsigned int nRecords = (vchData.size() - BLOCKINDEX_HEADER_SIZE) / BLOCKINDEX_RECORD_SIZE;
+    mapBlockIndex.rehash(nRecords + nRecords / 4);
+    try {
+        CMemoryReader reader(&vchData[0], &vchData[0] + vchData.size(), SER_DISK, CLIENT_VERSION);
+        unsigned char pchMsgTmp[4];
+        int nVersion;
+        reader >> FLATDATA(pchMsgTmp) >> nVersion;
+        if (memcmp(pchMsgTmp, pchMessageStart, sizeof(pchMsgTmp)) || nVersion != BLOCKINDEX_FILE_VERSION)
+            return error("CBlockIndexDB::Load() : invalid network magic number or version");
+
+        for (unsigned int i = 0; i < nRecords && !fRequestShutdown; i++)
+        {
+            CBlockIndexRecord record;
+            reader >> record;
+
+            // Construct block index object
+            CBlockIndex* pindexNew = InsertBlockIndex(record.hash);
+            pindexNew->pprev          = InsertBlockIndex(record.hashPrev);
+            pindexNew->nFile          = record.nFile;
+            pindexNew->nBlockPos      = record.nBlockPos;
+            pindexNew->nHeight        = record.nHeight;
+            pindexNew->nVersion       = record.nVersion;
+            pindexNew->hashMerkleRoot = record.hashMerkleRoot;
+            pindexNew->nTime          = record.nTime;
+            pindexNew->nBits          = record.nBits;
+            pindexNew->nNonce         = record.nNonce;
+
+            // Watch for genesis block
+            if (pindexGenesisBlock == NULL && record.hash == hashGenesisBlock)
+                pindexGenesisBlock = pindexNew;
+
+            if (!pindexNew->CheckIndex())
+                return error("CBlockIndexDB::Load() : CheckIndex failed at %d", pindexNew->nHeight);
+        }
+    }
+    catch (std::exception &e) {
+        return error("CBlockIndexDB::Load() : deserialize error");
+    }
+
+    // Drop a record cut short by a crash, so that appends line up again
+    if ((vchData.size() - BLOCKINDEX_HEADER_SIZE) % BLOCKINDEX_RECORD_SIZE != 0 && !fRequestShutdown)
+    {
+        printf("CBlockIndexDB::Load() : discarding partial record\n");
+        return Rewrite();
+    }
+    return true;
+}
+
+bool CBlockIndexDB::Rewrite()
+{
+    Close();
+    pathIndex = GetDataDir() / "blkindex.idx";
+
+    // Parents go before their children
+    vector<pair<int, CBlockIndex*> > vSortedByHeight;
+    vSortedByHeight.reserve(mapBlockIndex.size());
+    BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex)
+        vSortedByHeight.push_back(make_pair(item.second->nHeight, item.second));
+    sort(vSortedByHeight.begin(), vSortedByHeight.end());
+
+    boost::filesystem::path pathTmp = GetDataDir() / "blkindex.idx.new";
+    FILE* fileTmp = fopen(pathTmp.string().c_str(), "wb");
+    CAutoFile fileout = CAutoFile(fileTmp, SER_DISK, CLIENT_VERSION);
+    if (!fileout)
+        return error("CBlockIndexDB::Rewrite() : open failed");
+    try {
+        fileout << FLATDATA(pchMessageStart) << BLOCKINDEX_FILE_VERSION;
+        BOOST_FOREACH(const PAIRTYPE(int, CBlockIndex*)& item, vSortedByHeight)
+            fileout << CBlockIndexRecord(item.second);
+    }
+    catch (std::exception &e) {
+        return error("CBlockIndexDB::Rewrite() : I/O error");
+    }
+    FileCommit(fileout);
+    fileout.fclose();
+
+    if (!RenameOver(pathTmp, pathIndex))
+        return error("CBlockIndexDB::Rewrite() : rename failed");
+    return true;
+}
+
+
+
+
 //
 // CAddrDB
 //
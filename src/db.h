@@ -6,13 +6,17 @@
 #define XCOIN_DB_H
 
 #include "main.h"
+#include "kvstore.h"
 
+#include <list>
 #include <map>
 #include <string>
 #include <vector>
 
 #include <db_cxx.h>
 
+#include <boost/unordered_map.hpp>
+
 class CAddress;
 class CAddrMan;
 class CBlockLocator;
@@ -34,6 +38,7 @@ class CDBEnv
 {
 private:
     bool fDetachDB;
+    bool fBulkWrite;
     bool fDbEnvInit;
     bool fMockDb;
     boost::filesystem::path pathEnv;
@@ -76,6 +81,8 @@ public:
     void CheckpointLSN(std::string strFile);
     void SetDetach(bool fDetachDB_) { fDetachDB = fDetachDB_; }
     bool GetDetach() { return fDetachDB; }
+    void SetBulkWrite(bool fBulkWrite_) { fBulkWrite = fBulkWrite_; }
+    bool GetBulkWrite() { return fBulkWrite; }
 
     void CloseDb(const std::string& strFile);
     bool RemoveDb(const std::string& strFile);
@@ -268,22 +275,22 @@ protected:
     }
 
 public:
-    bool TxnBegin()
+    bool TxnBegin(int flags=DB_TXN_WRITE_NOSYNC)
     {
         if (!pdb || activeTxn)
             return false;
-        DbTxn* ptxn = bitdb.TxnBegin();
+        DbTxn* ptxn = bitdb.TxnBegin(flags);
         if (!ptxn)
             return false;
         activeTxn = ptxn;
         return true;
     }
 
-    bool TxnCommit()
+    bool TxnCommit(u_int32_t flags=0)
     {
         if (!pdb || !activeTxn)
             return false;
-        int ret = activeTxn->commit(0);
+        int ret = activeTxn->commit(flags);
         activeTxn = NULL;
         return (ret == 0);
     }
@@ -317,15 +324,219 @@ public:
 
 
 
-/** Access to the transaction database (blkindex.dat) */
-class CTxDB : public CDB
+/** In-memory cache of the transaction index records of blkindex.dat, and
+ * of the transactions they point to for as long as those still have unspent
+ * outputs.  Index changes made while connecting and disconnecting blocks are
+ * kept here as dirty entries and written back to disk in batches, together
+ * with the best chain pointer, so block connection only touches the disk on
+ * cache misses.
+ */
+class CCoinsCache
+{
+public:
+    class CEntry
+    {
+    public:
+        CTxIndex txindex;       // null if the transaction is known not to be indexed
+        CTransaction tx;
+        bool fHaveIndex;
+        bool fHaveTx;
+        bool fDirty;
+        std::list<uint256>::iterator itClean;  // position in listClean unless dirty
+
+        CEntry() : fHaveIndex(false), fHaveTx(false), fDirty(false) { }
+    };
+
+    typedef boost::unordered_map<uint256, CEntry, uint256Hasher> EntryMap;
+
+private:
+    mutable CCriticalSection cs;
+    EntryMap mapEntries;
+    mutable std::list<uint256> listClean;  // clean entries, least recently used first
+    uint256 hashBestChain;      // non-zero while the best chain pointer awaits writing
+    size_t nUsage;
+    size_t nDirtyUsage;
+    size_t nMaxUsage;
+
+    static size_t EntryUsage(const CEntry& entry);
+    EntryMap::iterator InsertEntry(const uint256& hash);
+    void EraseEntry(EntryMap::iterator mi);
+    void AddUsage(const CEntry& entry);
+    void RemoveUsage(const CEntry& entry);
+    void Evict();
+
+public:
+    CCoinsCache() : hashBestChain(0), nUsage(0), nDirtyUsage(0), nMaxUsage(25 << 20) { }
+
+    void SetMaxUsage(size_t nMaxUsageIn);
+    size_t GetUsage() const;
+    /** True when the cache is over budget, or half of it can't be evicted
+     * until the dirty entries are written */
+    bool IsFull() const;
+    bool IsDirty() const;
+
+    /** Returns false if hash is not cached; otherwise fFound tells whether it is indexed */
+    bool GetTxIndex(const uint256& hash, CTxIndex& txindex, bool& fFound) const;
+    void SetTxIndex(const uint256& hash, const CTxIndex& txindex, bool fDirty);
+    /** Caches an index read from disk, unless the cache already holds one */
+    void FillTxIndex(const uint256& hash, const CTxIndex& txindex);
+    bool GetTx(const uint256& hash, CTransaction& tx) const;
+    void SetTx(const uint256& hash, const CTransaction& tx);
+    bool GetBestChain(uint256& hashBestChainRet) const;
+    void SetBestChain(const uint256& hashBestChainIn);
+
+    /** Copy out everything that has yet to be written to disk */
+    void GetDirty(std::vector<std::pair<uint256, CTxIndex> >& vDirty, uint256& hashBestChainRet) const;
+    /** Called once the dirty entries have been committed to disk */
+    void MarkClean();
+};
+
+extern CCoinsCache coinscache;
+
+
+
+/** CKVStore on a Berkeley DB file.  There are no snapshots; iterators see
+ * writes made while they are in use.
+ */
+class CBDBStore : public CDB, public CKVStore
+{
+public:
+    explicit CBDBStore(const char* pszFile, const char* pszMode="cr+") : CDB(pszFile, pszMode) { }
+
+    bool Read(const std::string& strKey, std::string& strValue, const CKVSnapshot* psnapshot=NULL);
+    bool Exists(const std::string& strKey);
+    bool Write(const CKVBatch& batch, bool fSync);
+    CKVIterator* NewIterator(const CKVSnapshot* psnapshot=NULL);
+    boost::shared_ptr<CKVSnapshot> GetSnapshot() { return boost::shared_ptr<CKVSnapshot>(); }
+    void Checkpoint();
+};
+
+/** The storage engine holding the transaction database, selected with
+ * -dbbackend; opened by OpenTxDB() before the block index is loaded */
+extern CKVStore* ptxdbstore;
+bool OpenTxDB();
+void CloseTxDB();
+
+/** Access to the transaction database (ptxdbstore) */
+class CTxDB
 {
 public:
-    CTxDB(const char* pszMode="r+") : CDB("blkindex.dat", pszMode) { }
+    CTxDB(const char* pszMode="r+");
+    ~CTxDB() { Close(); }
+    void Close();
 private:
     CTxDB(const CTxDB&);
     void operator=(const CTxDB&);
+
+    CKVStore* pstore;
+    bool fReadOnly;
+
+    // Writes of the active db transaction, applied at once on commit
+    CKVBatch batch;
+    bool fActiveTxn;
+
+    // Changes made inside the active db transaction; they only reach
+    // coinscache once the transaction commits.
+    std::map<uint256, CTxIndex> mapTxnIndex;
+    uint256 hashTxnBestChain;
+    bool fFlushCoins;
+    bool fTxnBulk;
+
+    bool WriteCoins();
+
+protected:
+    template<typename K, typename T>
+    bool Read(const K& key, T& value)
+    {
+        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+        ssKey << key;
+        std::string strKey(ssKey.begin(), ssKey.end());
+
+        // Writes of the active db transaction come first
+        std::string strValue;
+        bool fErased;
+        if (fActiveTxn && batch.Get(strKey, strValue, fErased))
+        {
+            if (fErased)
+                return false;
+        }
+        else if (!pstore->Read(strKey, strValue))
+            return false;
+
+        // Unserialize value
+        try {
+            CDataStream ssValue(strValue.data(), strValue.data() + strValue.size(), SER_DISK, CLIENT_VERSION);
+            ssValue >> value;
+        }
+        catch (std::exception &e) {
+            return false;
+        }
+        return true;
+    }
+
+    template<typename K, typename T>
+    bool Write(const K& key, const T& value)
+    {
+        if (fReadOnly)
+            assert(!"Write called on database in read-only mode");
+
+        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+        ssKey << key;
+        CDataStream ssValue(SER_DISK, CLIENT_VERSION);
+        ssValue.reserve(10000);
+        ssValue << value;
+
+        if (fActiveTxn)
+        {
+            batch.Write(std::string(ssKey.begin(), ssKey.end()), std::string(ssValue.begin(), ssValue.end()));
+            return true;
+        }
+        CKVBatch batchOne;
+        batchOne.Write(std::string(ssKey.begin(), ssKey.end()), std::string(ssValue.begin(), ssValue.end()));
+        return pstore->Write(batchOne, false);
+    }
+
+    template<typename K>
+    bool Erase(const K& key)
+    {
+        if (fReadOnly)
+            assert(!"Erase called on database in read-only mode");
+
+        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+        ssKey << key;
+
+        if (fActiveTxn)
+        {
+            batch.Erase(std::string(ssKey.begin(), ssKey.end()));
+            return true;
+        }
+        CKVBatch batchOne;
+        batchOne.Erase(std::string(ssKey.begin(), ssKey.end()));
+        return pstore->Write(batchOne, false);
+    }
+
+    template<typename K>
+    bool Exists(const K& key)
+    {
+        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+        ssKey << key;
+        std::string strKey(ssKey.begin(), ssKey.end());
+
+        std::string strValue;
+        bool fErased;
+        if (fActiveTxn && batch.Get(strKey, strValue, fErased))
+            return !fErased;
+        return pstore->Exists(strKey);
+    }
+
 public:
+    bool TxnBegin();
+    bool TxnCommit();
+    bool TxnAbort();
+    /** Write coinscache back to disk when the active db transaction commits */
+    void FlushCoinsOnCommit() { fFlushCoins = true; }
+    bool FlushCoins();
+
     bool ReadTxIndex(uint256 hash, CTxIndex& txindex);
     bool UpdateTxIndex(uint256 hash, const CTxIndex& txindex);
     bool AddTxIndex(const CTransaction& tx, const CDiskTxPos& pos, int nHeight);
@@ -335,7 +546,10 @@ public:
     bool ReadDiskTx(uint256 hash, CTransaction& tx);
     bool ReadDiskTx(COutPoint outpoint, CTransaction& tx, CTxIndex& txindex);
     bool ReadDiskTx(COutPoint outpoint, CTransaction& tx);
-    bool WriteBlockIndex(const CDiskBlockIndex& blockindex);
+    bool ReadCachedTx(uint256 hash, const CDiskTxPos& pos, CTransaction& tx);
+    void CacheTx(uint256 hash, const CTransaction& tx);
+    bool ReadHashConnectedTip(uint256& hashConnectedTip);
+    bool WriteHashConnectedTip(uint256 hashConnectedTip);
     bool ReadHashBestChain(uint256& hashBestChain);
     bool WriteHashBestChain(uint256 hashBestChain);
     bool ReadBestInvalidWork(CBigNum& bnBestInvalidWork);
@@ -343,9 +557,38 @@ public:
     bool LoadBlockIndex();
 private:
     bool LoadBlockIndexGuts();
+    bool LoadBlockIndexRecords();
 };
 
 
+/** Flat file of block index entries (blkindex.idx).
+ *
+ * Entries are appended as blocks are added to the index and never change
+ * afterwards; every record has the same size, so the whole index is loaded
+ * with one sequential read.  The forward links of the main chain are not
+ * stored but rebuilt from the best chain when loading.
+ */
+class CBlockIndexDB
+{
+private:
+    boost::filesystem::path pathIndex;
+    FILE* file;
+
+    bool Open();
+public:
+    CBlockIndexDB();
+    ~CBlockIndexDB();
+    void Close();
+    bool Append(const CBlockIndex* pindex, bool fCommit);
+    void Commit();
+    bool Load();
+    // Replace the file with the entries now in mapBlockIndex
+    bool Rewrite();
+};
+
+extern CBlockIndexDB blockindexdb;
+
+
 
 
 /** Access to the (IP) address database (peers.dat) */
@@ -24,7 +24,9 @@
 #include <boost/asio/ssl.hpp>
 #include <boost/filesystem/fstream.hpp>
 #include <boost/shared_ptr.hpp>
+#include <boost/function.hpp>
 #include <list>
+#include <deque>
 
 #define printf OutputDebugStringF
 
@@ -201,10 +203,10 @@ static const CRPCCommand vRPCCommands[] =
   //  ------------------------  -----------------------  ------  --------
     { "help",                   &help,                   true,   true },
     { "stop",                   &stop,                   true,   true },
-    { "getblockcount",          &getblockcount,          true,   false },
-    { "getconnectioncount",     &getconnectioncount,     true,   false },
-    { "getpeerinfo",            &getpeerinfo,            true,   false },
-    { "getdifficulty",          &getdifficulty,          true,   false },
+    { "getblockcount",          &getblockcount,          true,   true },
+    { "getconnectioncount",     &getconnectioncount,     true,   true },
+    { "getpeerinfo",            &getpeerinfo,            true,   true },
+    { "getdifficulty",          &getdifficulty,          true,   true },
     { "getgenerate",            &getgenerate,            true,   false },
     { "setgenerate",            &setgenerate,            true,   false },
     { "gethashespersec",        &gethashespersec,        true,   false },
@@ -232,22 +234,22 @@ static const CRPCCommand vRPCCommands[] =
     { "sendfrom",               &sendfrom,               false,  false },
     { "sendmany",               &sendmany,               false,  false },
     { "addmultisigaddress",     &addmultisigaddress,     false,  false },
-    { "getrawmempool",          &getrawmempool,          true,   false },
-    { "getblock",               &getblock,               false,  false },
-    { "getblockhash",           &getblockhash,           false,  false },
+    { "getrawmempool",          &getrawmempool,          true,   true },
+    { "getblock",               &getblock,               false,  true },
+    { "getblockhash",           &getblockhash,           false,  true },
     { "gettransaction",         &gettransaction,         false,  false },
     { "listtransactions",       &listtransactions,       false,  false },
     { "listaddressgroupings",   &listaddressgroupings,   false,  false },
     { "signmessage",            &signmessage,            false,  false },
     { "verifymessage",          &verifymessage,          false,  false },
-    { "getwork",                &getwork,                true,   false },
+    { "getwork",                &getwork,                true,   true },
     { "listaccounts",           &listaccounts,           false,  false },
     { "settxfee",               &settxfee,               false,  false },
-    { "getblocktemplate",       &getblocktemplate,       true,   false },
+    { "getblocktemplate",       &getblocktemplate,       true,   true },
     { "submitblock",            &submitblock,            false,  false },
     { "listsinceblock",         &listsinceblock,         false,  false },
     { "dumpprivkey",            &dumpprivkey,            false,  false },
-    { "importprivkey",          &importprivkey,          false,  false },
+    { "importprivkey",          &importprivkey,          false,  true },
     { "listunspent",            &listunspent,            false,  false },
     { "getrawtransaction",      &getrawtransaction,      false,  false },
     { "createrawtransaction",   &createrawtransaction,   false,  false },
@@ -338,6 +340,7 @@ static string HTTPReply(int nStatus, const string& strMsg, bool keepalive)
     else if (nStatus == HTTP_FORBIDDEN) cStatus = "Forbidden";
     else if (nStatus == HTTP_NOT_FOUND) cStatus = "Not Found";
     else if (nStatus == HTTP_INTERNAL_SERVER_ERROR) cStatus = "Internal Server Error";
+    else if (nStatus == HTTP_SERVICE_UNAVAILABLE) cStatus = "Service Unavailable";
     else cStatus = "";
     return strprintf(
             "HTTP/1.1 %d %s\r\n"
@@ -574,6 +577,11 @@ public:
     virtual std::iostream& stream() = 0;
     virtual std::string peer_address_to_string() const = 0;
     virtual void close() = 0;
+
+    // Whether part of the next request has already been read off the socket
+    virtual bool buffered() = 0;
+    // Call handler from the listener thread once the client sends more
+    virtual void async_wait_readable(boost::function<void (const boost::system::error_code&)> handler) = 0;
 };
 
 template <typename Protocol>
@@ -605,6 +613,16 @@ public:
         _stream.close();
     }
 
+    virtual bool buffered()
+    {
+        return _stream.rdbuf()->in_avail() > 0;
+    }
+
+    virtual void async_wait_readable(boost::function<void (const boost::system::error_code&)> handler)
+    {
+        sslStream.lowest_layer().async_read_some(asio::null_buffers(), handler);
+    }
+
     typename Protocol::endpoint peer;
     asio::ssl::stream<typename Protocol::socket> sslStream;
 
@@ -613,6 +631,46 @@ private:
     iostreams::stream< SSLIOStreamDevice<Protocol> > _stream;
 };
 
+//
+// Accepted connections wait here for one of the -rpcthreads workers.  The
+// queue is kept short so that a flood of clients is turned away instead of
+// being answered minutes late.  Between requests, keep-alive connections
+// are parked on the listener's io_service rather than tying up a worker.
+//
+static boost::mutex csRPCQueue;
+static boost::condition_variable condRPCQueue;
+static std::deque<AcceptedConnection*> queueRPCConn;
+static unsigned int nRPCQueueMax = 16;
+
+static void RPCQueueConnection(AcceptedConnection* conn, bool fUseSSL)
+{
+    {
+        boost::unique_lock<boost::mutex> lock(csRPCQueue);
+        if (queueRPCConn.size() < nRPCQueueMax)
+        {
+            queueRPCConn.push_back(conn);
+            condRPCQueue.notify_one();
+            return;
+        }
+    }
+
+    printf("ThreadRPCServer work queue full, dropping connection from %s\n", conn->peer_address_to_string().c_str());
+    // Only reply without SSL, the handshake could block the listener
+    if (!fUseSSL)
+        conn->stream() << HTTPReply(HTTP_SERVICE_UNAVAILABLE, "", false) << std::flush;
+    delete conn;
+}
+
+static void RPCReadableHandler(AcceptedConnection* conn, bool fUseSSL, const boost::system::error_code& error)
+{
+    if (error || fShutdown)
+    {
+        delete conn;
+        return;
+    }
+    RPCQueueConnection(conn, fUseSSL);
+}
+
 void ThreadRPCServer(void* parg)
 {
     // Make this thread recognisable as the RPC listener
@@ -701,11 +759,9 @@ static void RPCAcceptHandler(boost::shared_ptr< basic_socket_acceptor<Protocol,
         delete conn;
     }
 
-    // start HTTP client thread
-    else if (!NewThread(ThreadRPCServer3, conn)) {
-        printf("Failed to create RPC server client thread\n");
-        delete conn;
-    }
+    // hand it to a worker thread
+    else
+        RPCQueueConnection(conn, fUseSSL);
 
     vnThreadsRunning[THREAD_RPCLISTENER]--;
 }
@@ -831,11 +887,18 @@ void ThreadRPCServer2(void* parg)
         return;
     }
 
+    nRPCQueueMax = max((int)GetArg("-rpcworkqueue", 16), 1);
+    int nThreads = max((int)GetArg("-rpcthreads", 4), 1);
+    for (int i = 0; i < nThreads; i++)
+        if (!NewThread(ThreadRPCServer3, NULL))
+            printf("Error: NewThread(ThreadRPCServer3) failed\n");
+
     vnThreadsRunning[THREAD_RPCLISTENER]--;
     while (!fShutdown)
         io_service.run_one();
     vnThreadsRunning[THREAD_RPCLISTENER]++;
     StopRequests();
+    condRPCQueue.notify_all();
 }
 
 class JSONRequest
@@ -914,95 +977,120 @@ static string JSONRPCExecBatch(const Array& vReq)
 
 static CCriticalSection cs_THREAD_RPCHANDLER;
 
-void ThreadRPCServer3(void* parg)
+// Read and answer one request.  Returns whether the client asked for the
+// connection to be kept open.
+static bool RPCServiceRequest(AcceptedConnection* conn)
 {
-    // Make this thread recognisable as the RPC handler
-    RenameThread("x-rpchand");
+    map<string, string> mapHeaders;
+    string strRequest;
 
+    ReadHTTP(conn->stream(), mapHeaders, strRequest);
+    if (!conn->stream())
+        return false;
+
+    // Check authorization
+    if (mapHeaders.count("authorization") == 0)
     {
-        LOCK(cs_THREAD_RPCHANDLER);
-        vnThreadsRunning[THREAD_RPCHANDLER]++;
+        conn->stream() << HTTPReply(HTTP_UNAUTHORIZED, "", false) << std::flush;
+        return false;
     }
-    AcceptedConnection *conn = (AcceptedConnection *) parg;
+    if (!HTTPAuthorized(mapHeaders))
+    {
+        printf("ThreadRPCServer incorrect password attempt from %s\n", conn->peer_address_to_string().c_str());
+        /* Deter brute-forcing short passwords.
+           If this results in a DOS the user really
+           shouldn't have their RPC port exposed.*/
+        if (mapArgs["-rpcpassword"].size() < 20)
+            Sleep(250);
+
+        conn->stream() << HTTPReply(HTTP_UNAUTHORIZED, "", false) << std::flush;
+        return false;
+    }
+    bool fKeepAlive = (mapHeaders["connection"] != "close");
 
-    bool fRun = true;
-    loop {
-        if (fShutdown || !fRun)
-        {
-            conn->close();
-            delete conn;
-            {
-                LOCK(cs_THREAD_RPCHANDLER);
-                --vnThreadsRunning[THREAD_RPCHANDLER];
-            }
-            return;
-        }
-        map<string, string> mapHeaders;
-        string strRequest;
+    JSONRequest jreq;
+    try
+    {
+        // Parse request
+        Value valRequest;
+        if (!read_string(strRequest, valRequest))
+            throw JSONRPCError(RPC_PARSE_ERROR, "Parse error");
 
-        ReadHTTP(conn->stream(), mapHeaders, strRequest);
+        string strReply;
 
-        // Check authorization
-        if (mapHeaders.count("authorization") == 0)
-        {
-            conn->stream() << HTTPReply(HTTP_UNAUTHORIZED, "", false) << std::flush;
-            break;
-        }
-        if (!HTTPAuthorized(mapHeaders))
-        {
-            printf("ThreadRPCServer incorrect password attempt from %s\n", conn->peer_address_to_string().c_str());
-            /* Deter brute-forcing short passwords.
-               If this results in a DOS the user really
-               shouldn't have their RPC port exposed.*/
-            if (mapArgs["-rpcpassword"].size() < 20)
-                Sleep(250);
-
-            conn->stream() << HTTPReply(HTTP_UNAUTHORIZED, "", false) << std::flush;
-            break;
-        }
-        if (mapHeaders["connection"] == "close")
-            fRun = false;
+        // singleton request
+        if (valRequest.type() == obj_type) {
+            jreq.parse(valRequest);
 
-        JSONRequest jreq;
-        try
-        {
-            // Parse request
-            Value valRequest;
-            if (!read_string(strRequest, valRequest))
-                throw JSONRPCError(RPC_PARSE_ERROR, "Parse error");
+            Value result = tableRPC.execute(jreq.strMethod, jreq.params);
 
-            string strReply;
+            // Send reply
+            strReply = JSONRPCReply(result, Value::null, jreq.id);
 
-            // singleton request
-            if (valRequest.type() == obj_type) {
-                jreq.parse(valRequest);
+        // array of requests
+        } else if (valRequest.type() == array_type)
+            strReply = JSONRPCExecBatch(valRequest.get_array());
+        else
+            throw JSONRPCError(RPC_PARSE_ERROR, "Top-level object parse error");
 
-                Value result = tableRPC.execute(jreq.strMethod, jreq.params);
+        conn->stream() << HTTPReply(HTTP_OK, strReply, fKeepAlive) << std::flush;
+    }
+    catch (Object& objError)
+    {
+        ErrorReply(conn->stream(), objError, jreq.id);
+        return false;
+    }
+    catch (std::exception& e)
+    {
+        ErrorReply(conn->stream(), JSONRPCError(RPC_PARSE_ERROR, e.what()), jreq.id);
+        return false;
+    }
+    return fKeepAlive;
+}
 
-                // Send reply
-                strReply = JSONRPCReply(result, Value::null, jreq.id);
+void ThreadRPCServer3(void* parg)
+{
+    // Make this thread recognisable as the RPC handler
+    RenameThread("x-rpchand");
 
-            // array of requests
-            } else if (valRequest.type() == array_type)
-                strReply = JSONRPCExecBatch(valRequest.get_array());
-            else
-                throw JSONRPCError(RPC_PARSE_ERROR, "Top-level object parse error");
+    {
+        LOCK(cs_THREAD_RPCHANDLER);
+        vnThreadsRunning[THREAD_RPCHANDLER]++;
+    }
+    const bool fUseSSL = GetBoolArg("-rpcssl");
 
-            conn->stream() << HTTPReply(HTTP_OK, strReply, fRun) << std::flush;
-        }
-        catch (Object& objError)
+    loop
+    {
+        AcceptedConnection* conn;
         {
-            ErrorReply(conn->stream(), objError, jreq.id);
-            break;
+            boost::unique_lock<boost::mutex> lock(csRPCQueue);
+            while (queueRPCConn.empty() && !fShutdown)
+                condRPCQueue.timed_wait(lock, boost::posix_time::seconds(1));
+            if (fShutdown)
+                break;
+            conn = queueRPCConn.front();
+            queueRPCConn.pop_front();
         }
-        catch (std::exception& e)
+
+        try
         {
-            ErrorReply(conn->stream(), JSONRPCError(RPC_PARSE_ERROR, e.what()), jreq.id);
-            break;
+            // Answer whatever the client has sent, then wait for more
+            // without holding on to this thread
+            bool fKeepAlive = RPCServiceRequest(conn);
+            while (fKeepAlive && !fShutdown && conn->buffered())
+                fKeepAlive = RPCServiceRequest(conn);
+
+            if (fKeepAlive && !fShutdown)
+                conn->async_wait_readable(boost::bind(&RPCReadableHandler, conn, fUseSSL, asio::placeholders::error));
+            else
+                delete conn;
+        }
+        catch (std::exception& e) {
+            delete conn;
+            PrintExceptionContinue(&e, "ThreadRPCServer3()");
         }
     }
 
-    delete conn;
     {
         LOCK(cs_THREAD_RPCHANDLER);
         vnThreadsRunning[THREAD_RPCHANDLER]--;
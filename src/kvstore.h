@@ -0,0 +1,104 @@
+// Copyright (c) 2009-2012 The Bitcoin developers
+// Copyright (c) 2012 The Xcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef XCOIN_KVSTORE_H
+#define XCOIN_KVSTORE_H
+
+#include <map>
+#include <string>
+#include <utility>
+
+#include <boost/shared_ptr.hpp>
+
+/** A set of writes that a CKVStore applies atomically.  Later writes to a
+ * key replace earlier ones.
+ */
+class CKVBatch
+{
+public:
+    // Pending value of each key; erased keys map to (true, "")
+    typedef std::map<std::string, std::pair<bool, std::string> > WriteMap;
+
+private:
+    WriteMap mapWrites;
+
+public:
+    void Write(const std::string& strKey, const std::string& strValue)
+    {
+        mapWrites[strKey] = std::make_pair(false, strValue);
+    }
+
+    void Erase(const std::string& strKey)
+    {
+        mapWrites[strKey] = std::make_pair(true, std::string());
+    }
+
+    /** Returns false if the batch doesn't touch strKey; otherwise fErased
+     * tells whether it is erased, or strValue receives its new value. */
+    bool Get(const std::string& strKey, std::string& strValue, bool& fErased) const
+    {
+        WriteMap::const_iterator mi = mapWrites.find(strKey);
+        if (mi == mapWrites.end())
+            return false;
+        fErased = (*mi).second.first;
+        strValue = (*mi).second.second;
+        return true;
+    }
+
+    const WriteMap& GetWrites() const { return mapWrites; }
+    bool empty() const { return mapWrites.empty(); }
+    size_t size() const { return mapWrites.size(); }
+    void clear() { mapWrites.clear(); }
+};
+
+/** Walks the keys of a CKVStore in ascending byte order */
+class CKVIterator
+{
+public:
+    virtual ~CKVIterator() {}
+
+    // Position at the first key that is not less than strKey
+    virtual void Seek(const std::string& strKey) = 0;
+    virtual bool Valid() const = 0;
+    virtual void Next() = 0;
+    virtual const std::string& GetKey() const = 0;
+    virtual const std::string& GetValue() const = 0;
+};
+
+/** A consistent view of a CKVStore as of the moment it was taken */
+class CKVSnapshot
+{
+public:
+    virtual ~CKVSnapshot() {}
+};
+
+/** Storage engine interface of the transaction database */
+class CKVStore
+{
+public:
+    virtual ~CKVStore() {}
+
+    /** Reads strKey as of psnapshot, or the latest write if NULL */
+    virtual bool Read(const std::string& strKey, std::string& strValue, const CKVSnapshot* psnapshot=NULL) = 0;
+    virtual bool Exists(const std::string& strKey)
+    {
+        std::string strValue;
+        return Read(strKey, strValue);
+    }
+
+    /** Applies batch atomically; with fSync it is on disk before returning */
+    virtual bool Write(const CKVBatch& batch, bool fSync) = 0;
+
+    /** The caller owns the iterator.  Without a snapshot, the iterator sees
+     * the store as of its creation where the engine supports it. */
+    virtual CKVIterator* NewIterator(const CKVSnapshot* psnapshot=NULL) = 0;
+
+    /** Returns an empty pointer if the engine has no snapshots */
+    virtual boost::shared_ptr<CKVSnapshot> GetSnapshot() = 0;
+
+    /** Called when a user of the store is done with it for a while */
+    virtual void Checkpoint() {}
+};
+
+#endif
@@ -0,0 +1,751 @@
+// Copyright (c) 2009-2012 The Bitcoin developers
+// Copyright (c) 2012 The Xcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#include "lsmstore.h"
+#include "serialize.h"
+#include "util.h"
+
+#include <set>
+
+#include <boost/foreach.hpp>
+
+using namespace std;
+namespace fs = boost::filesystem;
+
+// Table files are read a block at a time; the index holds the first key
+// of every block
+static const unsigned int LSM_BLOCK_SIZE = 4096;
+// Number of tables of one generation that are merged into one
+static const unsigned int LSM_MERGE_WIDTH = 4;
+// Failed merges are retried after 1, 2, 4, ... seconds before giving up
+static const unsigned int LSM_MERGE_RETRIES = 5;
+static const char pchTableMagic[4] = { 'L', 'S', 'M', 'T' };
+
+static fs::path TablePath(const fs::path& pathDir, unsigned int nFile)
+{
+    return pathDir / strprintf("%06u.tbl", nFile);
+}
+
+static fs::path LogPath(const fs::path& pathDir, unsigned int nFile)
+{
+    return pathDir / strprintf("%06u.log", nFile);
+}
+
+static unsigned int Checksum(const char* pbegin, const char* pend)
+{
+    uint256 hash = Hash(pbegin, pend);
+    unsigned int nChecksum;
+    memcpy(&nChecksum, &hash, sizeof(nChecksum));
+    return nChecksum;
+}
+
+struct CLSMRecord
+{
+    std::string strKey;
+    bool fErased;
+    std::string strValue;
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(strKey);
+        READWRITE(fErased);
+        READWRITE(strValue);
+    )
+};
+
+
+/** An immutable sorted table file.  The file is removed once the table is
+ * obsolete and no reader holds it any more. */
+class CLSMTable
+{
+private:
+    fs::path pathTable;
+    boost::mutex cs;
+    FILE* file;
+    std::vector<std::pair<std::string, uint64> > vIndex;
+    uint64 nIndexPos;
+    bool fObsolete;
+
+public:
+    unsigned int nFile;
+    int nLevel;
+
+    CLSMTable(const fs::path& pathDir, unsigned int nFileIn, int nLevelIn) :
+        pathTable(TablePath(pathDir, nFileIn)), file(NULL), nIndexPos(0), fObsolete(false), nFile(nFileIn), nLevel(nLevelIn) {}
+
+    ~CLSMTable()
+    {
+        if (file)
+            fclose(file);
+        if (fObsolete)
+            fs::remove(pathTable);
+    }
+
+    void SetObsolete() { fObsolete = true; }
+    unsigned int GetBlockCount() const { return vIndex.size(); }
+
+    bool Open()
+    {
+        file = fopen(pathTable.string().c_str(), "rb");
+        if (!file)
+            return error("CLSMTable::Open() : open %s failed", pathTable.string().c_str());
+        char pchMagic[4];
+        if (fseek(file, -(long)(sizeof(nIndexPos) + sizeof(pchMagic)), SEEK_END) != 0 ||
+            fread(&nIndexPos, sizeof(nIndexPos), 1, file) != 1 ||
+            fread(pchMagic, sizeof(pchMagic), 1, file) != 1 ||
+            memcmp(pchMagic, pchTableMagic, sizeof(pchMagic)) != 0 ||
+            fseek(file, nIndexPos, SEEK_SET) != 0)
+            return error("CLSMTable::Open() : %s is not a table", pathTable.string().c_str());
+        CAutoFile filein(file, SER_DISK, CLIENT_VERSION);
+        try {
+            filein >> vIndex;
+        }
+        catch (std::exception &e) {
+            filein.release();
+            return error("CLSMTable::Open() : reading index of %s failed", pathTable.string().c_str());
+        }
+        filein.release();
+        return true;
+    }
+
+    // Index of the block that would hold strKey
+    unsigned int FindBlock(const std::string& strKey) const
+    {
+        unsigned int nBegin = 0, nEnd = vIndex.size();
+        while (nEnd - nBegin > 1)
+        {
+            unsigned int nMid = (nBegin + nEnd) / 2;
+            if (vIndex[nMid].first <= strKey)
+                nBegin = nMid;
+            else
+                nEnd = nMid;
+        }
+        return nBegin;
+    }
+
+    bool ReadBlock(unsigned int nBlock, std::vector<CLSMRecord>& vRecords)
+    {
+        vRecords.clear();
+        if (nBlock >= vIndex.size())
+            return true;
+        uint64 nBegin = vIndex[nBlock].second;
+        uint64 nEnd = (nBlock + 1 < vIndex.size() ? vIndex[nBlock + 1].second : nIndexPos);
+        std::vector<char> vchBlock(nEnd - nBegin);
+        {
+            boost::unique_lock<boost::mutex> lock(cs);
+            if (fseek(file, nBegin, SEEK_SET) != 0 ||
+                fread(&vchBlock[0], 1, vchBlock.size(), file) != vchBlock.size())
+                return error("CLSMTable::ReadBlock() : read from %s failed", pathTable.string().c_str());
+        }
+        try {
+            CMemoryReader reader(&vchBlock[0], &vchBlock[0] + vchBlock.size(), SER_DISK, CLIENT_VERSION);
+            while (!reader.empty())
+            {
+                vRecords.push_back(CLSMRecord());
+                reader >> vRecords.back();
+            }
+        }
+        catch (std::exception &e) {
+            return error("CLSMTable::ReadBlock() : corrupt block in %s", pathTable.string().c_str());
+        }
+        return true;
+    }
+
+    /** Returns false if the table doesn't have strKey */
+    bool Get(const std::string& strKey, std::string& strValue, bool& fErased)
+    {
+        if (vIndex.empty() || strKey < vIndex[0].first)
+            return false;
+        std::vector<CLSMRecord> vRecords;
+        if (!ReadBlock(FindBlock(strKey), vRecords))
+            return false;
+        BOOST_FOREACH(const CLSMRecord& record, vRecords)
+        {
+            if (record.strKey == strKey)
+            {
+                fErased = record.fErased;
+                strValue = record.strValue;
+                return true;
+            }
+        }
+        return false;
+    }
+};
+
+
+/** A sorted sequence of records, possibly including erased keys */
+class CLSMSource
+{
+public:
+    virtual ~CLSMSource() {}
+    virtual void Seek(const std::string& strKey) = 0;
+    virtual bool Valid() const = 0;
+    virtual void Next() = 0;
+    virtual const std::string& GetKey() const = 0;
+    virtual bool IsErased() const = 0;
+    virtual const std::string& GetValue() const = 0;
+};
+
+class CMemTableSource : public CLSMSource
+{
+private:
+    boost::shared_ptr<const CLSMStore::MemTable> pmem;
+    CLSMStore::MemTable::const_iterator it;
+
+public:
+    CMemTableSource(boost::shared_ptr<const CLSMStore::MemTable> pmemIn) : pmem(pmemIn), it(pmem->begin()) {}
+
+    void Seek(const std::string& strKey) { it = pmem->lower_bound(strKey); }
+    bool Valid() const { return it != pmem->end(); }
+    void Next() { ++it; }
+    const std::string& GetKey() const { return (*it).first; }
+    bool IsErased() const { return (*it).second.first; }
+    const std::string& GetValue() const { return (*it).second.second; }
+};
+
+class CTableSource : public CLSMSource
+{
+private:
+    boost::shared_ptr<CLSMTable> ptable;
+    unsigned int nBlock;
+    std::vector<CLSMRecord> vRecords;
+    unsigned int nPos;
+
+    // Skip forward over empty or finished blocks
+    void SkipToValid()
+    {
+        while (nPos >= vRecords.size() && nBlock < ptable->GetBlockCount())
+        {
+            nBlock++;
+            nPos = 0;
+            if (!ptable->ReadBlock(nBlock, vRecords))
+                vRecords.clear();
+        }
+    }
+
+public:
+    CTableSource(boost::shared_ptr<CLSMTable> ptableIn) : ptable(ptableIn), nBlock(0), nPos(0)
+    {
+        if (!ptable->ReadBlock(0, vRecords))
+            vRecords.clear();
+        SkipToValid();
+    }
+
+    void Seek(const std::string& strKey)
+    {
+        nBlock = ptable->FindBlock(strKey);
+        nPos = 0;
+        if (!ptable->ReadBlock(nBlock, vRecords))
+            vRecords.clear();
+        while (nPos < vRecords.size() && vRecords[nPos].strKey < strKey)
+            nPos++;
+        SkipToValid();
+    }
+
+    bool Valid() const { return nPos < vRecords.size(); }
+    void Next() { nPos++; SkipToValid(); }
+    const std::string& GetKey() const { return vRecords[nPos].strKey; }
+    bool IsErased() const { return vRecords[nPos].fErased; }
+    const std::string& GetValue() const { return vRecords[nPos].strValue; }
+};
+
+/** Merges sources given newest first; where several have a key, the
+ * newest one's record is the one seen */
+class CMergedSource : public CLSMSource
+{
+private:
+    std::vector<CLSMSource*> vSources;
+    int nCurrent;
+
+    void FindCurrent()
+    {
+        nCurrent = -1;
+        for (unsigned int i = 0; i < vSources.size(); i++)
+            if (vSources[i]->Valid() && (nCurrent == -1 || vSources[i]->GetKey() < vSources[nCurrent]->GetKey()))
+                nCurrent = i;
+    }
+
+public:
+    CMergedSource(const std::vector<CLSMSource*>& vSourcesIn) : vSources(vSourcesIn) { FindCurrent(); }
+
+    ~CMergedSource()
+    {
+        BOOST_FOREACH(CLSMSource* psource, vSources)
+            delete psource;
+    }
+
+    void Seek(const std::string& strKey)
+    {
+        BOOST_FOREACH(CLSMSource* psource, vSources)
+            psource->Seek(strKey);
+        FindCurrent();
+    }
+
+    bool Valid() const { return nCurrent != -1; }
+
+    void Next()
+    {
+        std::string strKey = GetKey();
+        BOOST_FOREACH(CLSMSource* psource, vSources)
+            if (psource->Valid() && psource->GetKey() == strKey)
+                psource->Next();
+        FindCurrent();
+    }
+
+    const std::string& GetKey() const { return vSources[nCurrent]->GetKey(); }
+    bool IsErased() const { return vSources[nCurrent]->IsErased(); }
+    const std::string& GetValue() const { return vSources[nCurrent]->GetValue(); }
+};
+
+
+class CLSMSnapshot : public CKVSnapshot
+{
+public:
+    boost::shared_ptr<const CLSMStore::MemTable> pmem;
+    std::vector<boost::shared_ptr<CLSMTable> > vTables;
+
+    CMergedSource* NewSource() const
+    {
+        std::vector<CLSMSource*> vSources;
+        vSources.push_back(new CMemTableSource(pmem));
+        BOOST_REVERSE_FOREACH(const boost::shared_ptr<CLSMTable>& ptable, vTables)
+            vSources.push_back(new CTableSource(ptable));
+        return new CMergedSource(vSources);
+    }
+};
+
+class CLSMIterator : public CKVIterator
+{
+private:
+    boost::shared_ptr<CKVSnapshot> psnapshot;   // keeps the tables alive
+    CMergedSource* psource;
+
+    void SkipErased()
+    {
+        while (psource->Valid() && psource->IsErased())
+            psource->Next();
+    }
+
+public:
+    CLSMIterator(boost::shared_ptr<CKVSnapshot> psnapshotIn, const CLSMSnapshot& snapshot) : psnapshot(psnapshotIn)
+    {
+        psource = snapshot.NewSource();
+        SkipErased();
+    }
+
+    ~CLSMIterator() { delete psource; }
+
+    void Seek(const std::string& strKey) { psource->Seek(strKey); SkipErased(); }
+    bool Valid() const { return psource->Valid(); }
+    void Next() { psource->Next(); SkipErased(); }
+    const std::string& GetKey() const { return psource->GetKey(); }
+    const std::string& GetValue() const { return psource->GetValue(); }
+};
+
+
+// Write the records of source to a new table file
+static bool WriteTable(const fs::path& pathTable, CLSMSource& source, bool fKeepErased)
+{
+    FILE* file = fopen(pathTable.string().c_str(), "wb");
+    CAutoFile fileout(file, SER_DISK, CLIENT_VERSION);
+    if (!fileout)
+        return error("WriteTable() : open %s failed", pathTable.string().c_str());
+
+    std::vector<std::pair<std::string, uint64> > vIndex;
+    uint64 nPos = 0, nBlockPos = 0;
+    try {
+        CLSMRecord record;
+        for (; source.Valid(); source.Next())
+        {
+            if (source.IsErased() && !fKeepErased)
+                continue;
+            if (vIndex.empty() || nPos - nBlockPos >= LSM_BLOCK_SIZE)
+            {
+                vIndex.push_back(make_pair(source.GetKey(), nPos));
+                nBlockPos = nPos;
+            }
+            record.strKey = source.GetKey();
+            record.fErased = source.IsErased();
+            record.strValue = source.GetValue();
+            fileout << record;
+            nPos += ::GetSerializeSize(record, SER_DISK, CLIENT_VERSION);
+        }
+        fileout << vIndex;
+        fileout.write((const char*)&nPos, sizeof(nPos));
+        fileout.write(pchTableMagic, sizeof(pchTableMagic));
+    }
+    catch (std::exception &e) {
+        return error("WriteTable() : I/O error writing %s", pathTable.string().c_str());
+    }
+    FileCommit(fileout);
+    return true;
+}
+
+
+CLSMStore::CLSMStore(const fs::path& pathDirIn, size_t nMemTableMaxIn) :
+    pathDir(pathDirIn), nMemTableMax(nMemTableMaxIn), pmem(new MemTable()), nMemUsage(0),
+    fileLog(NULL), nLogNumber(0), nNextFile(1), fStop(false), fCompacting(false), fCompactFailed(false), pthreadCompact(NULL)
+{
+}
+
+CLSMStore::~CLSMStore()
+{
+    if (pthreadCompact)
+    {
+        {
+            boost::unique_lock<boost::mutex> lock(cs);
+            fStop = true;
+        }
+        condCompact.notify_all();
+        pthreadCompact->join();
+        delete pthreadCompact;
+    }
+    if (fileLog)
+        fclose(fileLog);
+}
+
+bool CLSMStore::WriteManifest()
+{
+    std::vector<std::pair<unsigned int, int> > vTableFiles;
+    BOOST_FOREACH(const boost::shared_ptr<CLSMTable>& ptable, vTables)
+        vTableFiles.push_back(make_pair(ptable->nFile, ptable->nLevel));
+
+    fs::path pathTmp = pathDir / "MANIFEST.tmp";
+    FILE* file = fopen(pathTmp.string().c_str(), "wb");
+    CAutoFile fileout(file, SER_DISK, CLIENT_VERSION);
+    if (!fileout)
+        return error("CLSMStore::WriteManifest() : open failed");
+    try {
+        fileout << nNextFile << nLogNumber << vTableFiles;
+    }
+    catch (std::exception &e) {
+        return error("CLSMStore::WriteManifest() : I/O error");
+    }
+    FileCommit(fileout);
+    fileout.fclose();
+    if (!RenameOver(pathTmp, pathDir / "MANIFEST"))
+        return error("CLSMStore::WriteManifest() : rename failed");
+    return true;
+}
+
+// Start a new, empty log; the old one is removed once MANIFEST no longer
+// refers to it
+bool CLSMStore::NewLog()
+{
+    unsigned int nOldLog = nLogNumber;
+    nLogNumber = nNextFile++;
+    FILE* file = fopen(LogPath(pathDir, nLogNumber).string().c_str(), "wb");
+    if (!file)
+        return error("CLSMStore::NewLog() : open failed");
+    if (!WriteManifest())
+    {
+        fclose(file);
+        return false;
+    }
+    if (fileLog)
+        fclose(fileLog);
+    fileLog = file;
+    if (nOldLog != 0)
+        fs::remove(LogPath(pathDir, nOldLog));
+    return true;
+}
+
+bool CLSMStore::FlushMemTable()
+{
+    if (!pmem->empty())
+    {
+        boost::shared_ptr<CLSMTable> ptable(new CLSMTable(pathDir, nNextFile++, 0));
+        CMemTableSource source(pmem);
+        // With nothing older to hide, erased keys can be dropped
+        if (!WriteTable(TablePath(pathDir, ptable->nFile), source, !vTables.empty()) || !ptable->Open())
+            return false;
+        vTables.push_back(ptable);
+    }
+    if (!NewLog())
+        return false;
+    pmem.reset(new MemTable());
+    nMemUsage = 0;
+    condCompact.notify_all();
+    return true;
+}
+
+// Find the oldest run of LSM_MERGE_WIDTH tables of the same generation
+bool CLSMStore::PickCompaction(unsigned int& nBeginRet)
+{
+    unsigned int nRun = 0;
+    for (unsigned int i = 0; i < vTables.size(); i++)
+    {
+        if (i > 0 && vTables[i]->nLevel == vTables[i-1]->nLevel)
+            nRun++;
+        else
+            nRun = 1;
+        if (nRun == LSM_MERGE_WIDTH)
+        {
+            nBeginRet = i + 1 - LSM_MERGE_WIDTH;
+            return true;
+        }
+    }
+    return false;
+}
+
+void CLSMStore::ThreadCompact()
+{
+    RenameThread("xcoin-lsmcompact");
+    boost::unique_lock<boost::mutex> lock(cs);
+    unsigned int nFailures = 0;
+    loop
+    {
+        unsigned int nBegin;
+        while (!fStop && !PickCompaction(nBegin))
+            condCompact.wait(lock);
+        if (fStop)
+            return;
+
+        // Merge without holding cs; the tables don't change
+        std::vector<boost::shared_ptr<CLSMTable> > vMerge(vTables.begin() + nBegin, vTables.begin() + nBegin + LSM_MERGE_WIDTH);
+        bool fBottom = (nBegin == 0);
+        boost::shared_ptr<CLSMTable> ptable(new CLSMTable(pathDir, nNextFile++, vMerge[0]->nLevel + 1));
+        fCompacting = true;
+        lock.unlock();
+
+        std::vector<CLSMSource*> vSources;
+        BOOST_REVERSE_FOREACH(const boost::shared_ptr<CLSMTable>& ptableMerge, vMerge)
+            vSources.push_back(new CTableSource(ptableMerge));
+        CMergedSource source(vSources);
+        bool fOk = WriteTable(TablePath(pathDir, ptable->nFile), source, !fBottom) && ptable->Open();
+
+        lock.lock();
+        fCompacting = false;
+        if (fOk)
+        {
+            // New tables may have been added after the merged ones, but
+            // nothing before them has changed
+            vTables.erase(vTables.begin() + nBegin, vTables.begin() + nBegin + LSM_MERGE_WIDTH);
+            vTables.insert(vTables.begin() + nBegin, ptable);
+            fOk = WriteManifest();
+            if (!fOk)
+            {
+                vTables.erase(vTables.begin() + nBegin);
+                vTables.insert(vTables.begin() + nBegin, vMerge.begin(), vMerge.end());
+            }
+        }
+        if (!fOk)
+        {
+            // Leave the tables as they are; reads still work.  Table files
+            // pile up while merges fail, so past a few tries writes are
+            // refused instead of getting ever slower to read back.
+            ptable->SetObsolete();
+            condCompact.notify_all();
+            if (++nFailures > LSM_MERGE_RETRIES)
+            {
+                printf("CLSMStore : merge of %s failed, giving up\n", pathDir.string().c_str());
+                fCompactFailed = true;
+                return;
+            }
+            printf("CLSMStore : merge of %s failed, retrying\n", pathDir.string().c_str());
+            boost::system_time deadline = boost::get_system_time() + boost::posix_time::seconds(1 << (nFailures - 1));
+            while (!fStop && condCompact.timed_wait(lock, deadline))
+                ;
+            continue;
+        }
+        nFailures = 0;
+        BOOST_FOREACH(const boost::shared_ptr<CLSMTable>& ptableMerged, vMerge)
+            ptableMerged->SetObsolete();
+        condCompact.notify_all();
+    }
+}
+
+bool CLSMStore::ReplayLog(const fs::path& pathLog)
+{
+    FILE* file = fopen(pathLog.string().c_str(), "rb");
+    if (!file)
+        return true;
+
+    // A record cut short by a crash ends the log, as does a size running
+    // past the end of the file, which can only be garbage
+    boost::uintmax_t nFileSize = fs::file_size(pathLog);
+    unsigned int nRecords = 0;
+    loop
+    {
+        unsigned int nSize, nChecksum;
+        if (fread(&nSize, sizeof(nSize), 1, file) != 1 || fread(&nChecksum, sizeof(nChecksum), 1, file) != 1)
+            break;
+        long nPos = ftell(file);
+        if (nPos < 0 || nSize > nFileSize - nPos)
+            break;
+        std::vector<char> vchData(nSize);
+        if (nSize == 0 || fread(&vchData[0], 1, nSize, file) != nSize || Checksum(&vchData[0], &vchData[0] + nSize) != nChecksum)
+            break;
+        try {
+            CMemoryReader reader(&vchData[0], &vchData[0] + nSize, SER_DISK, CLIENT_VERSION);
+            MemTable mapWrites;
+            reader >> mapWrites;
+            for (MemTable::iterator mi = mapWrites.begin(); mi != mapWrites.end(); ++mi)
+                (*pmem)[(*mi).first] = (*mi).second;
+        }
+        catch (std::exception &e) {
+            break;
+        }
+        nRecords++;
+    }
+    fclose(file);
+    printf("CLSMStore : replayed %u log records of %s\n", nRecords, pathDir.string().c_str());
+    return true;
+}
+
+bool CLSMStore::Open()
+{
+    boost::unique_lock<boost::mutex> lock(cs);
+    fs::create_directories(pathDir);
+
+    // Tables and log of the last complete state
+    std::set<unsigned int> setLive;
+    FILE* file = fopen((pathDir / "MANIFEST").string().c_str(), "rb");
+    if (file)
+    {
+        CAutoFile filein(file, SER_DISK, CLIENT_VERSION);
+        std::vector<std::pair<unsigned int, int> > vTableFiles;
+        try {
+            filein >> nNextFile >> nLogNumber >> vTableFiles;
+        }
+        catch (std::exception &e) {
+            return error("CLSMStore::Open() : MANIFEST of %s corrupt", pathDir.string().c_str());
+        }
+        for (unsigned int i = 0; i < vTableFiles.size(); i++)
+        {
+            boost::shared_ptr<CLSMTable> ptable(new CLSMTable(pathDir, vTableFiles[i].first, vTableFiles[i].second));
+            if (!ptable->Open())
+                return false;
+            vTables.push_back(ptable);
+            setLive.insert(ptable->nFile);
+        }
+    }
+
+    // Remove files left over from an interrupted flush or merge
+    for (fs::directory_iterator it(pathDir); it != fs::directory_iterator(); ++it)
+    {
+        std::string strName = it->path().filename().string();
+        unsigned int nFile;
+        char pszExt[4];
+        if (sscanf(strName.c_str(), "%u.%3s", &nFile, pszExt) == 2 &&
+            ((strcmp(pszExt, "tbl") == 0 && !setLive.count(nFile)) ||
+             (strcmp(pszExt, "log") == 0 && nFile != nLogNumber)))
+            fs::remove(it->path());
+    }
+
+    if (nLogNumber != 0 && !ReplayLog(LogPath(pathDir, nLogNumber)))
+        return false;
+
+    // Start from a clean log, so that appends never follow a torn record
+    if (!FlushMemTable())
+        return false;
+
+    pthreadCompact = new boost::thread(boost::bind(&CLSMStore::ThreadCompact, this));
+    return true;
+}
+
+bool CLSMStore::Read(const std::string& strKey, std::string& strValue, const CKVSnapshot* psnapshot)
+{
+    std::vector<boost::shared_ptr<CLSMTable> > vSearch;
+    bool fErased;
+    if (psnapshot)
+    {
+        const CLSMSnapshot* plsmsnapshot = (const CLSMSnapshot*)psnapshot;
+        MemTable::const_iterator mi = plsmsnapshot->pmem->find(strKey);
+        if (mi != plsmsnapshot->pmem->end())
+        {
+            strValue = (*mi).second.second;
+            return !(*mi).second.first;
+        }
+        vSearch = plsmsnapshot->vTables;
+    }
+    else
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        MemTable::const_iterator mi = pmem->find(strKey);
+        if (mi != pmem->end())
+        {
+            strValue = (*mi).second.second;
+            return !(*mi).second.first;
+        }
+        vSearch = vTables;
+    }
+
+    BOOST_REVERSE_FOREACH(const boost::shared_ptr<CLSMTable>& ptable, vSearch)
+        if (ptable->Get(strKey, strValue, fErased))
+            return !fErased;
+    return false;
+}
+
+bool CLSMStore::Write(const CKVBatch& batch, bool fSync)
+{
+    if (batch.empty())
+        return true;
+
+    CDataStream ssBatch(SER_DISK, CLIENT_VERSION);
+    ssBatch << batch.GetWrites();
+    unsigned int nSize = ssBatch.size();
+    unsigned int nChecksum = Checksum(&ssBatch[0], &ssBatch[0] + nSize);
+
+    boost::unique_lock<boost::mutex> lock(cs);
+    if (!fileLog)
+        return error("CLSMStore::Write() : store not open");
+    if (fCompactFailed)
+        return error("CLSMStore::Write() : merging tables of %s failed", pathDir.string().c_str());
+    if (fwrite(&nSize, sizeof(nSize), 1, fileLog) != 1 ||
+        fwrite(&nChecksum, sizeof(nChecksum), 1, fileLog) != 1 ||
+        fwrite(&ssBatch[0], 1, nSize, fileLog) != nSize ||
+        fflush(fileLog) != 0)
+        return error("CLSMStore::Write() : writing log failed");
+    if (fSync)
+        FileCommit(fileLog);
+
+    // Snapshots keep the old table
+    if (!pmem.unique())
+        pmem.reset(new MemTable(*pmem));
+    const MemTable& mapWrites = batch.GetWrites();
+    for (MemTable::const_iterator mi = mapWrites.begin(); mi != mapWrites.end(); ++mi)
+    {
+        (*pmem)[(*mi).first] = (*mi).second;
+        nMemUsage += (*mi).first.size() + (*mi).second.second.size() + 64;
+    }
+
+    if (nMemUsage > nMemTableMax)
+        return FlushMemTable();
+    return true;
+}
+
+boost::shared_ptr<CKVSnapshot> CLSMStore::GetSnapshot()
+{
+    CLSMSnapshot* psnapshot = new CLSMSnapshot();
+    boost::unique_lock<boost::mutex> lock(cs);
+    psnapshot->pmem = pmem;
+    psnapshot->vTables = vTables;
+    return boost::shared_ptr<CKVSnapshot>(psnapshot);
+}
+
+CKVIterator* CLSMStore::NewIterator(const CKVSnapshot* psnapshot)
+{
+    if (psnapshot)
+        return new CLSMIterator(boost::shared_ptr<CKVSnapshot>(), *(const CLSMSnapshot*)psnapshot);
+    boost::shared_ptr<CKVSnapshot> psnapshotNew = GetSnapshot();
+    return new CLSMIterator(psnapshotNew, *(const CLSMSnapshot*)psnapshotNew.get());
+}
+
+bool CLSMStore::Compact()
+{
+    boost::unique_lock<boost::mutex> lock(cs);
+    if (!FlushMemTable())
+        return false;
+    unsigned int nBegin;
+    while (!fStop && !fCompactFailed && (fCompacting || PickCompaction(nBegin)))
+        condCompact.wait(lock);
+    return !fStop && !fCompactFailed;
+}
+
+size_t CLSMStore::GetTableCount()
+{
+    boost::unique_lock<boost::mutex> lock(cs);
+    return vTables.size();
+}
@@ -0,0 +1,79 @@
+// Copyright (c) 2009-2012 The Bitcoin developers
+// Copyright (c) 2012 The Xcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef XCOIN_LSMSTORE_H
+#define XCOIN_LSMSTORE_H
+
+#include <stdio.h>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+#include <boost/thread.hpp>
+
+#include "kvstore.h"
+
+class CLSMTable;
+
+/** Log-structured merge-tree storage engine.
+ *
+ * Writes are appended to a log and applied to a sorted in-memory table.
+ * When that grows past its limit it is written out as an immutable sorted
+ * table file and a new log is started.  Reads look in memory first and
+ * then in the table files from newest to oldest.  A background thread
+ * merges runs of four table files of the same generation into one, so a
+ * key is written O(log n) times over its life and lookups only search a
+ * few files.  Random writes thus turn into sequential ones.
+ *
+ * The table files in use are listed in MANIFEST, which is replaced
+ * atomically.  After a crash, the log is replayed on top of the tables
+ * listed there.
+ */
+class CLSMStore : public CKVStore
+{
+public:
+    typedef CKVBatch::WriteMap MemTable;
+
+private:
+    boost::filesystem::path pathDir;
+    size_t nMemTableMax;
+
+    boost::mutex cs;
+    boost::condition_variable condCompact;
+    boost::shared_ptr<MemTable> pmem;   // copied on write while snapshots hold it
+    size_t nMemUsage;
+    std::vector<boost::shared_ptr<CLSMTable> > vTables;  // oldest first
+    FILE* fileLog;
+    unsigned int nLogNumber;
+    unsigned int nNextFile;
+    bool fStop;
+    bool fCompacting;
+    bool fCompactFailed;    // merges gave up; writes fail from then on
+    boost::thread* pthreadCompact;
+
+    // Caller must hold cs
+    bool WriteManifest();
+    bool NewLog();
+    bool FlushMemTable();
+    bool PickCompaction(unsigned int& nBeginRet);
+
+    bool ReplayLog(const boost::filesystem::path& pathLog);
+    void ThreadCompact();
+
+public:
+    CLSMStore(const boost::filesystem::path& pathDirIn, size_t nMemTableMaxIn=(8 << 20));
+    ~CLSMStore();
+
+    bool Open();
+
+    bool Read(const std::string& strKey, std::string& strValue, const CKVSnapshot* psnapshot=NULL);
+    bool Write(const CKVBatch& batch, bool fSync);
+    CKVIterator* NewIterator(const CKVSnapshot* psnapshot=NULL);
+    boost::shared_ptr<CKVSnapshot> GetSnapshot();
+
+    // Write the in-memory table out and wait for merges to finish
+    bool Compact();
+    size_t GetTableCount();
+};
+
+#endif
@@ -5,6 +5,8 @@
 
 #include "alert.h"
 #include "checkpoints.h"
+#include "bloom.h"
+#include "checkqueue.h"
 #include "db.h"
 #include "net.h"
 #include "init.h"
@@ -12,6 +14,7 @@
 #include <boost/algorithm/string/replace.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
+#include <deque>
 
 using namespace std;
 using namespace boost;
@@ -28,7 +31,7 @@ CCriticalSection cs_main;
 CTxMemPool mempool;
 unsigned int nTransactionsUpdated = 0;
 
-map<uint256, CBlockIndex*> mapBlockIndex;
+BlockMap mapBlockIndex;
 uint256 hashGenesisBlock("0x000000005b1e3d23ecfd2dd4a6e1a35238aa0392c0a8528c40df52376d7efe2c");
 static CBigNum bnProofOfWorkLimit(~uint256(0) >> 32);
 CBlockIndex* pindexGenesisBlock = NULL;
@@ -36,6 +39,11 @@ int nBestHeight = -1;
 CBigNum bnBestChainWork = 0;
 CBigNum bnBestInvalidWork = 0;
 uint256 hashBestChain = 0;
+
+// Tip of vMainChain for waiters that don't take cs_main
+static boost::mutex csBlockChange;
+static boost::condition_variable condBlockChange;
+static uint256 hashBlockChange = 0;
 CBlockIndex* pindexBest = NULL;
 int64 nTimeBestReceived = 0;
 
@@ -44,9 +52,26 @@ CMedianFilter<int> cPeerBlockCounts(5, 0); // Amount of blocks that other nodes
 map<uint256, CBlock*> mapOrphanBlocks;
 multimap<uint256, CBlock*> mapOrphanBlocksByPrev;
 
+// Headers-first download, see ScheduleBlockDownloads()
+bool fHeadersFirst = true;
+BlockMap mapHeaderIndex;
+vector<CBlockIndex*> vHeaderChain;
+static int nHeaderChainHave = 0;
+set<uint256> setHeadersInvalid;
+static map<uint256, CNode*> mapBlocksInFlight;
+map<uint256, CBlock*> mapDownloadedBlocks;
+multimap<uint256, CBlock*> mapDownloadedBlocksByPrev;
+static int64 nLastHeadersTime = 0;
+
 map<uint256, CDataStream*> mapOrphanTransactions;
 map<uint256, map<uint256, CDataStream*> > mapOrphanTransactionsByPrev;
 
+// Transactions recently confirmed in the best chain, and recently rejected
+// from the memory pool, so that inventory can be answered without the txdb
+static CRollingBloomFilter filterRecentConfirmed(120000, 0.000001);
+static CRollingBloomFilter filterRecentRejects(120000, 0.000001);
+static uint256 hashRecentRejectsChainTip;
+
 // Constant stuff for coinbase transactions we create:
 CScript COINBASE_FLAGS;
 
@@ -57,6 +82,7 @@ int64 nHPSTimerStart;
 
 // Settings
 mpq nTransactionFee = 0;
+int nScriptCheckThreads = 0;
 
 
 
@@ -244,7 +270,7 @@ bool CTransaction::ReadFromDisk(CTxDB& txdb, COutPoint prevout, CTxIndex& txinde
     SetNull();
     if (!txdb.ReadTxIndex(prevout.hash, txindexRet))
         return false;
-    if (!ReadFromDisk(txindexRet.pos))
+    if (!txdb.ReadCachedTx(prevout.hash, txindexRet.pos, *this))
         return false;
     if (prevout.n >= vout.size())
     {
@@ -413,7 +439,7 @@ int CMerkleTx::SetMerkleBranch(const CBlock* pblock)
     }
 
     // Is the tx in a block that's in the main chain
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+    BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
     if (mi == mapBlockIndex.end())
         return 0;
     CBlockIndex* pindex = (*mi).second;
@@ -604,6 +630,13 @@ bool CTxMemPool::accept(CTxDB& txdb, CTransaction &tx, bool fCheckInputs,
                 *pfMissingInputs = true;
             return false;
         }
+        unsigned int nSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
+
+        // Long chains of unconfirmed transactions make every ancestor walk
+        // in the memory pool and the miner expensive; turn them away before
+        // any signature is checked
+        if (!CheckAncestorLimits(tx, nSize))
+            return error("CTxMemPool::accept() : too many unconfirmed ancestors %s", hash.ToString().substr(0,10).c_str());
 
         // Check for non-standard pay-to-script-hash in inputs
         if (!tx.AreInputsStandard(mapInputs) && !fTestNet)
@@ -614,7 +647,6 @@ bool CTxMemPool::accept(CTxDB& txdb, CTransaction &tx, bool fCheckInputs,
         // reasonable number of ECDSA signature verifications.
 
         mpq nFees = tx.GetValueIn(mapInputs) - tx.GetValueOut();
-        unsigned int nSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
 
         // Don't accept it if it can't get into a block
         mpq txMinFee = tx.GetMinFee(1000, true, GMF_RELAY);
@@ -692,6 +724,12 @@ bool CTxMemPool::addUnchecked(const uint256& hash, CTransaction &tx)
         mapTx[hash] = tx;
         for (unsigned int i = 0; i < tx.vin.size(); i++)
             mapNextTx[tx.vin[i].prevout] = CInPoint(&mapTx[hash], i);
+        mapEntry[hash] = CTxMemPoolEntry();
+        setStale.insert(hash);
+
+        // When a block is disconnected, its transactions come back under
+        // ones already spending them
+        MarkDependentsStale(tx);
         nTransactionsUpdated++;
     }
     return true;
@@ -708,6 +746,14 @@ bool CTxMemPool::remove(CTransaction &tx)
         {
             BOOST_FOREACH(const CTxIn& txin, tx.vin)
                 mapNextTx.erase(txin.prevout);
+            MarkDependentsStale(tx);
+            map<uint256, CTxMemPoolEntry>::iterator mi = mapEntry.find(hash);
+            if (mi != mapEntry.end())
+            {
+                setByFeeRate.erase(make_pair((*mi).second.dFeeRateKey, hash));
+                mapEntry.erase(mi);
+            }
+            setStale.erase(hash);
             mapTx.erase(hash);
             nTransactionsUpdated++;
         }
@@ -720,9 +766,214 @@ void CTxMemPool::clear()
     LOCK(cs);
     mapTx.clear();
     mapNextTx.clear();
+    mapEntry.clear();
+    setStale.clear();
+    setByFeeRate.clear();
     ++nTransactionsUpdated;
 }
 
+// Descendants of a stale entry are stale too, so the walk can stop there
+void CTxMemPool::MarkStale(const uint256& hash)
+{
+    if (!setStale.insert(hash).second)
+        return;
+    map<uint256, CTxMemPoolEntry>::iterator mi = mapEntry.find(hash);
+    if (mi != mapEntry.end())
+        setByFeeRate.erase(make_pair((*mi).second.dFeeRateKey, hash));
+    map<uint256, CTransaction>::iterator mitx = mapTx.find(hash);
+    if (mitx != mapTx.end())
+        MarkDependentsStale((*mitx).second);
+}
+
+void CTxMemPool::MarkDependentsStale(const CTransaction& tx)
+{
+    uint256 hash = tx.GetHash();
+    for (unsigned int i = 0; i < tx.vout.size(); i++)
+    {
+        map<COutPoint, CInPoint>::iterator mi = mapNextTx.find(COutPoint(hash, i));
+        if (mi != mapNextTx.end())
+            MarkStale((*mi).second.ptx->GetHash());
+    }
+}
+
+// Multiplying a fee valued at nHeight by this gives its value at height
+// zero, which doesn't depend on when the fee is looked at
+static double GetFeeScale(int nHeight)
+{
+    return exp(-nHeight * log1p(-1.0 / DEMURRAGE_RATE));
+}
+
+double CTxMemPoolEntry::GetFeeRateWithAncestors(int nHeight) const
+{
+    return dScaledFeeWithAncestors / GetFeeScale(nHeight) / (nSizeWithAncestors / 1000.0);
+}
+
+void CTxMemPool::RefreshEntry(CTxDB& txdb, const uint256& hash, CTxMemPoolEntry& entry)
+{
+    const CTransaction& tx = mapTx[hash];
+    entry = CTxMemPoolEntry();
+    entry.nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
+
+    mpq nValueIn = 0;
+    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+    {
+        map<uint256, CTransaction>::iterator mi = mapTx.find(txin.prevout.hash);
+        if (mi != mapTx.end())
+        {
+            const CTransaction& txPrev = (*mi).second;
+            if (txin.prevout.n >= txPrev.vout.size())
+            {
+                entry.fMissingInputs = true;
+                break;
+            }
+            entry.setDependsOn.insert(txin.prevout.hash);
+            nValueIn += GetPresentValue(txPrev, txPrev.vout[txin.prevout.n], tx.nRefHeight);
+            continue;
+        }
+
+        CTransaction txPrev;
+        CTxIndex txindex;
+        if (!txPrev.ReadFromDisk(txdb, txin.prevout, txindex))
+        {
+            // This should never happen; all transactions in the memory
+            // pool should connect to either transactions in the chain
+            // or other transactions in the memory pool.
+            printf("ERROR: mempool transaction missing input\n");
+            entry.fMissingInputs = true;
+            break;
+        }
+        mpq nValue = GetPresentValue(txPrev, txPrev.vout[txin.prevout.n], tx.nRefHeight);
+        nValueIn += nValue;
+        int nHeightIn = nBestHeight + 1 - txindex.GetDepthInMainChain();
+        entry.dValueIn += nValue.get_d();
+        entry.dValueInHeight += nValue.get_d() * nHeightIn;
+    }
+    if (entry.fMissingInputs)
+        return;
+    entry.nFee = nValueIn - tx.GetValueOut();
+
+    // Sum over the ancestors; each counted once however many paths lead
+    // to it
+    set<uint256> setAncestors;
+    vector<uint256> vWork(entry.setDependsOn.begin(), entry.setDependsOn.end());
+    entry.nSizeWithAncestors = entry.nTxSize;
+    entry.dScaledFeeWithAncestors = entry.nFee.get_d() * GetFeeScale(tx.nRefHeight);
+    while (!vWork.empty())
+    {
+        uint256 hashAncestor = vWork.back();
+        vWork.pop_back();
+        if (!setAncestors.insert(hashAncestor).second)
+            continue;
+        const CTxMemPoolEntry& entryAncestor = mapEntry[hashAncestor];
+        if (entryAncestor.fMissingInputs)
+        {
+            entry.fMissingInputs = true;
+            return;
+        }
+        entry.nSizeWithAncestors += entryAncestor.nTxSize;
+        entry.dScaledFeeWithAncestors += entryAncestor.nFee.get_d() * GetFeeScale(mapTx[hashAncestor].nRefHeight);
+        vWork.insert(vWork.end(), entryAncestor.setDependsOn.begin(), entryAncestor.setDependsOn.end());
+    }
+    entry.dFeeRateKey = entry.dScaledFeeWithAncestors / entry.nSizeWithAncestors;
+}
+
+void CTxMemPool::Refresh(CTxDB& txdb)
+{
+    if (setStale.empty())
+        return;
+
+    // Parents before children, as a child sums up its ancestors
+    vector<uint256> vToDo(setStale.begin(), setStale.end());
+    set<uint256> setDone;
+    while (!vToDo.empty())
+    {
+        uint256 hash = vToDo.back();
+        if (setDone.count(hash))
+        {
+            vToDo.pop_back();
+            continue;
+        }
+        bool fReady = true;
+        const CTransaction& tx = mapTx[hash];
+        BOOST_FOREACH(const CTxIn& txin, tx.vin)
+        {
+            if (setStale.count(txin.prevout.hash) && !setDone.count(txin.prevout.hash))
+            {
+                vToDo.push_back(txin.prevout.hash);
+                fReady = false;
+            }
+        }
+        if (!fReady)
+            continue;
+        vToDo.pop_back();
+        setDone.insert(hash);
+
+        CTxMemPoolEntry& entry = mapEntry[hash];
+        RefreshEntry(txdb, hash, entry);
+        if (!entry.fMissingInputs)
+            setByFeeRate.insert(make_pair(entry.dFeeRateKey, hash));
+    }
+    setStale.clear();
+}
+
+bool CTxMemPool::GetPackage(const uint256& hash, const set<uint256>& setExclude, vector<uint256>& vPackage)
+{
+    // Depth first; a transaction is appended once its parents are, which
+    // the second time it comes up on the stack
+    set<uint256> setVisited(vPackage.begin(), vPackage.end());
+    vector<pair<uint256, bool> > vStack;
+    vStack.push_back(make_pair(hash, false));
+    while (!vStack.empty())
+    {
+        uint256 hashTx = vStack.back().first;
+        if (vStack.back().second)
+        {
+            vStack.pop_back();
+            vPackage.push_back(hashTx);
+            continue;
+        }
+        if (setExclude.count(hashTx) || setVisited.count(hashTx))
+        {
+            vStack.pop_back();
+            continue;
+        }
+        map<uint256, CTxMemPoolEntry>::const_iterator mi = mapEntry.find(hashTx);
+        if (mi == mapEntry.end() || (*mi).second.fMissingInputs)
+            return false;
+        setVisited.insert(hashTx);
+        vStack.back().second = true;
+        BOOST_FOREACH(const uint256& hashParent, (*mi).second.setDependsOn)
+            if (!setExclude.count(hashParent) && !setVisited.count(hashParent))
+                vStack.push_back(make_pair(hashParent, false));
+    }
+    return true;
+}
+
+bool CTxMemPool::CheckAncestorLimits(const CTransaction& tx, unsigned int nSize)
+{
+    LOCK(cs);
+    set<uint256> setAncestors;
+    vector<uint256> vWork;
+    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+        vWork.push_back(txin.prevout.hash);
+    unsigned int nSizeWithAncestors = nSize;
+    while (!vWork.empty())
+    {
+        uint256 hash = vWork.back();
+        vWork.pop_back();
+        map<uint256, CTransaction>::const_iterator mi = mapTx.find(hash);
+        if (mi == mapTx.end() || !setAncestors.insert(hash).second)
+            continue;
+        const CTransaction& txAncestor = (*mi).second;
+        nSizeWithAncestors += ::GetSerializeSize(txAncestor, SER_NETWORK, PROTOCOL_VERSION);
+        if (setAncestors.size() > MAX_MEMPOOL_ANCESTORS || nSizeWithAncestors > MAX_MEMPOOL_ANCESTOR_SIZE)
+            return false;
+        BOOST_FOREACH(const CTxIn& txin, txAncestor.vin)
+            vWork.push_back(txin.prevout.hash);
+    }
+    return true;
+}
+
 void CTxMemPool::queryHashes(std::vector<uint256>& vtxid)
 {
     vtxid.clear();
@@ -742,7 +993,7 @@ int CMerkleTx::GetDepthInMainChain(CBlockIndex* &pindexRet) const
         return 0;
 
     // Find the block it claims to be in
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+    BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
     if (mi == mapBlockIndex.end())
         return 0;
     CBlockIndex* pindex = (*mi).second;
@@ -825,7 +1076,7 @@ int CTxIndex::GetDepthInMainChain() const
     if (!block.ReadFromDisk(pos.nFile, pos.nBlockPos, false))
         return 0;
     // Find the block in the index
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(block.GetHash());
+    BlockMap::iterator mi = mapBlockIndex.find(block.GetHash());
     if (mi == mapBlockIndex.end())
         return 0;
     CBlockIndex* pindex = (*mi).second;
@@ -872,22 +1123,98 @@ bool GetTransaction(const uint256 &hash, CTransaction &tx, uint256 &hashBlock)
 // CBlock and CBlockIndex
 //
 
-static CBlockIndex* pblockindexFBBHLast;
+// Entries of mapBlockIndex are never freed, so they are carved out of
+// large blocks instead of being allocated one at a time
+static vector<CBlockIndex*> vBlockIndexArena;
+static unsigned int nBlockIndexArenaUsed = 0;
+static const unsigned int BLOCK_INDEX_ARENA_SIZE = 4096;
+
+CBlockIndex* NewBlockIndex()
+{
+    if (vBlockIndexArena.empty() || nBlockIndexArenaUsed == BLOCK_INDEX_ARENA_SIZE)
+    {
+        vBlockIndexArena.push_back(new CBlockIndex[BLOCK_INDEX_ARENA_SIZE]);
+        nBlockIndexArenaUsed = 0;
+    }
+    return &vBlockIndexArena.back()[nBlockIndexArenaUsed++];
+}
+
+// The main chain by height, kept in step with the pnext links
+static vector<CBlockIndex*> vMainChain;
+
 CBlockIndex* FindBlockByHeight(int nHeight)
 {
-    CBlockIndex *pblockindex;
-    if (nHeight < nBestHeight / 2)
-        pblockindex = pindexGenesisBlock;
-    else
-        pblockindex = pindexBest;
-    if (pblockindexFBBHLast && abs(nHeight - pblockindex->nHeight) > abs(nHeight - pblockindexFBBHLast->nHeight))
-        pblockindex = pblockindexFBBHLast;
-    while (pblockindex->nHeight > nHeight)
-        pblockindex = pblockindex->pprev;
-    while (pblockindex->nHeight < nHeight)
-        pblockindex = pblockindex->pnext;
-    pblockindexFBBHLast = pblockindex;
-    return pblockindex;
+    if (nHeight < 0 || nHeight >= (int)vMainChain.size())
+        return NULL;
+    return vMainChain[nHeight];
+}
+
+// Make pindexTip the end of vMainChain
+void SetMainChainTip(CBlockIndex* pindexTip)
+{
+    vMainChain.resize(pindexTip->nHeight + 1, NULL);
+    for (CBlockIndex* pindex = pindexTip; pindex && vMainChain[pindex->nHeight] != pindex; pindex = pindex->pprev)
+        vMainChain[pindex->nHeight] = pindex;
+
+    {
+        boost::unique_lock<boost::mutex> lock(csBlockChange);
+        hashBlockChange = pindexTip->GetBlockHash();
+        condBlockChange.notify_all();
+    }
+}
+
+// Turn the lowest '1' bit in the binary representation of a number into a '0'
+static inline int InvertLowestOne(int n) { return n & (n - 1); }
+
+// Height the skip pointer of a block at nHeight points to.  Any number
+// strictly lower than nHeight would do, but this one makes GetAncestor
+// take O(log n) steps.
+static inline int GetSkipHeight(int nHeight)
+{
+    if (nHeight < 2)
+        return 0;
+    // Jump back far for odd heights and a little for even heights, so that
+    // a walk never needs more than ~2 steps per bit of the height
+    return (nHeight & 1) ? InvertLowestOne(InvertLowestOne(nHeight - 1)) + 1 : InvertLowestOne(nHeight);
+}
+
+const CBlockIndex* CBlockIndex::GetAncestor(int nHeightIn) const
+{
+    if (nHeightIn > nHeight || nHeightIn < 0)
+        return NULL;
+
+    const CBlockIndex* pindexWalk = this;
+    int nHeightWalk = nHeight;
+    while (nHeightWalk > nHeightIn)
+    {
+        int nHeightSkip = GetSkipHeight(nHeightWalk);
+        int nHeightSkipPrev = GetSkipHeight(nHeightWalk - 1);
+        if (pindexWalk->pskip != NULL &&
+            (nHeightSkip == nHeightIn ||
+             (nHeightSkip > nHeightIn && !(nHeightSkipPrev < nHeightSkip - 2 && nHeightSkipPrev >= nHeightIn))))
+        {
+            // Only follow pskip if pprev->pskip isn't better than pskip->pprev
+            pindexWalk = pindexWalk->pskip;
+            nHeightWalk = nHeightSkip;
+        }
+        else
+        {
+            pindexWalk = pindexWalk->pprev;
+            nHeightWalk--;
+        }
+    }
+    return pindexWalk;
+}
+
+CBlockIndex* CBlockIndex::GetAncestor(int nHeightIn)
+{
+    return const_cast<CBlockIndex*>(static_cast<const CBlockIndex*>(this)->GetAncestor(nHeightIn));
+}
+
+void CBlockIndex::BuildSkip()
+{
+    if (pprev)
+        pskip = pprev->GetAncestor(GetSkipHeight(nHeight));
 }
 
 bool CBlock::ReadFromDisk(const CBlockIndex* pindex, bool fReadTransactions)
@@ -1493,9 +1820,7 @@ unsigned int static GetNextWorkRequired(const CBlockIndex* pindexLast, const CBl
             blockstogoback = nInterval;
 
         // Go back by what we want to be 14 days worth of blocks
-        const CBlockIndex* pindexFirst = pindexLast;
-        for (int i = 0; pindexFirst && i < blockstogoback; i++)
-            pindexFirst = pindexFirst->pprev;
+        const CBlockIndex* pindexFirst = pindexLast->GetAncestor(pindexLast->nHeight - blockstogoback);
         assert(pindexFirst);
 
         // Limit adjustment step
@@ -1603,6 +1928,23 @@ void CBlock::UpdateTime(const CBlockIndex* pindexPrev)
 
 
 
+static CCheckQueue<CScriptCheck> scriptcheckqueue(128);
+
+void ThreadScriptCheck(void* parg)
+{
+    // Make this thread recognisable as a script checking thread
+    RenameThread("x-scriptch");
+
+    vnThreadsRunning[THREAD_SCRIPTCHECK]++;
+    scriptcheckqueue.Thread();
+    vnThreadsRunning[THREAD_SCRIPTCHECK]--;
+}
+
+void ThreadScriptCheckQuit()
+{
+    scriptcheckqueue.Quit();
+}
+
 bool CTransaction::DisconnectInputs(CTxDB& txdb)
 {
     // Relinquish previous transactions' spent pointers
@@ -1689,8 +2031,8 @@ bool CTransaction::FetchInputs(CTxDB& txdb, const map<uint256, CTxIndex>& mapTes
         }
         else
         {
-            // Get prev tx from disk
-            if (!txPrev.ReadFromDisk(txindex.pos))
+            // Get prev tx from the coins cache, or from disk
+            if (!txdb.ReadCachedTx(prevout.hash, txindex.pos, txPrev))
                 return error("FetchInputs() : %s ReadFromDisk prev tx %s failed", GetHash().ToString().substr(0,10).c_str(),  prevout.hash.ToString().substr(0,10).c_str());
         }
     }
@@ -1738,11 +2080,8 @@ mpq GetTimeAdjustedValue(const mpz &zInitialValue, int nRelativeDepth)
     return GetTimeAdjustedValue(initial_value, nRelativeDepth);
 }
 
-mpq GetTimeAdjustedValue(const mpq& qInitialValue, int nRelativeDepth)
+mpq ComputeDemurrageFactor(int nRelativeDepth)
 {
-    if ( 0 == nRelativeDepth )
-        return qInitialValue;
-
     mpfr_t rate, mp;
     mpfr_inits2(113, rate, mp, (mpfr_ptr) 0);
     mpfr_set_ui(mp,       DEMURRAGE_RATE-1, GMP_RNDN);
@@ -1770,7 +2109,57 @@ mpq GetTimeAdjustedValue(const mpq& qInitialValue, int nRelativeDepth)
     mpz_clear(numerator);
     mpz_clear(denominator);
 
-    return adjustment * qInitialValue;
+    return adjustment;
+}
+
+//
+// The same handful of relative depths are looked up over and over again
+// (every output of every transaction in a block shares the block's height,
+// and wallet balance refreshes revisit the same coins), so the factors are
+// memoized.  Entries are evicted in insertion order once the cache is full.
+//
+static CCriticalSection cs_mapDemurrageFactors;
+static map<int, mpq> mapDemurrageFactors;
+static deque<int> vDemurrageFactorsOrder;
+
+mpq GetDemurrageFactor(int nRelativeDepth)
+{
+    if ( 0 == nRelativeDepth )
+        return 1;
+
+    {
+        LOCK(cs_mapDemurrageFactors);
+        map<int, mpq>::const_iterator mi = mapDemurrageFactors.find(nRelativeDepth);
+        if (mi != mapDemurrageFactors.end())
+            return mi->second;
+    }
+
+    // Computed outside the lock; a racing thread arriving at the same
+    // depth produces the same value, so the duplicate insert is harmless.
+    mpq factor = ComputeDemurrageFactor(nRelativeDepth);
+
+    {
+        LOCK(cs_mapDemurrageFactors);
+        if (mapDemurrageFactors.insert(make_pair(nRelativeDepth, factor)).second)
+        {
+            vDemurrageFactorsOrder.push_back(nRelativeDepth);
+            while (vDemurrageFactorsOrder.size() > MAX_DEMURRAGE_FACTOR_CACHE)
+            {
+                mapDemurrageFactors.erase(vDemurrageFactorsOrder.front());
+                vDemurrageFactorsOrder.pop_front();
+            }
+        }
+    }
+
+    return factor;
+}
+
+mpq GetTimeAdjustedValue(const mpq& qInitialValue, int nRelativeDepth)
+{
+    if ( 0 == nRelativeDepth )
+        return qInitialValue;
+
+    return GetDemurrageFactor(nRelativeDepth) * qInitialValue;
 }
 
 mpq GetPresentValue(const CTransaction& tx, const CTxOut& output, int nBlockHeight)
@@ -1820,9 +2209,18 @@ unsigned int CTransaction::GetP2SHSigOpCount(const MapPrevTx& inputs) const
     return nSigOps;
 }
 
+bool CScriptCheck::operator()() const
+{
+    const CScript &scriptSig = ptxTo->vin[nIn].scriptSig;
+    if (!VerifyScript(scriptSig, scriptPubKey, *ptxTo, nIn, fStrictPayToScriptHash, nHashType, psighashctx.get()))
+        return error("CScriptCheck() : %s VerifySignature failed", ptxTo->GetHash().ToString().substr(0,10).c_str());
+    return true;
+}
+
 bool CTransaction::ConnectInputs(MapPrevTx inputs,
                                  map<uint256, CTxIndex>& mapTestPool, const CDiskTxPos& posThisTx,
-                                 const CBlockIndex* pindexBlock, bool fBlock, bool fMiner, bool fStrictPayToScriptHash)
+                                 const CBlockIndex* pindexBlock, bool fBlock, bool fMiner, bool fStrictPayToScriptHash,
+                                 std::vector<CScriptCheck> *pvChecks)
 {
     // Take over previous transactions' spent pointers
     // fBlock is true when this is called from AcceptBlock when a new best-block is added to the blockchain
@@ -1855,6 +2253,7 @@ bool CTransaction::ConnectInputs(MapPrevTx inputs,
         // The first loop above does all the inexpensive checks.
         // Only if ALL inputs pass do we perform expensive ECDSA signature checks.
         // Helps prevent CPU exhaustion attacks.
+        boost::shared_ptr<const CSignatureHashContext> psighashctx;
         for (unsigned int i = 0; i < vin.size(); i++)
         {
             COutPoint prevout = vin[i].prevout;
@@ -1876,12 +2275,18 @@ bool CTransaction::ConnectInputs(MapPrevTx inputs,
             // still computed and checked, and any change will be caught at the next checkpoint.
             if (!(fBlock && (nBestHeight < Checkpoints::GetTotalBlocksEstimate())))
             {
-                // Verify signature
-                if (!VerifySignature(txPrev, *this, i, fStrictPayToScriptHash, 0))
+                // Inputs of one transaction share their signature hash serialization
+                if (!psighashctx && vin.size() > 1)
+                    psighashctx.reset(new CSignatureHashContext(*this));
+
+                // Verify signature, or leave it to the caller's script check queue
+                if (pvChecks)
+                    pvChecks->push_back(CScriptCheck(txPrev, *this, i, fStrictPayToScriptHash, 0, psighashctx));
+                else if (!VerifySignature(txPrev, *this, i, fStrictPayToScriptHash, 0, psighashctx.get()))
                 {
                     // only during transition phase for P2SH: do not invoke anti-DoS code for
                     // potentially old clients relaying bad P2SH transactions
-                    if (fStrictPayToScriptHash && VerifySignature(txPrev, *this, i, false, 0))
+                    if (fStrictPayToScriptHash && VerifySignature(txPrev, *this, i, false, 0, psighashctx.get()))
                         return error("ConnectInputs() : %s P2SH VerifySignature failed", GetHash().ToString().substr(0,10).c_str());
 
                     return DoS(100,error("ConnectInputs() : %s VerifySignature failed", GetHash().ToString().substr(0,10).c_str()));
@@ -1975,15 +2380,11 @@ bool CBlock::DisconnectBlock(CTxDB& txdb, CBlockIndex* pindex)
         if (!vtx[i].DisconnectInputs(txdb))
             return false;
 
-    // Update block index on disk without changing it in memory.
+    // Record the new end of the connected chain without changing memory.
     // The memory index structure will be changed after the db commits.
     if (pindex->pprev)
-    {
-        CDiskBlockIndex blockindexPrev(pindex->pprev);
-        blockindexPrev.hashNext = 0;
-        if (!txdb.WriteBlockIndex(blockindexPrev))
-            return error("DisconnectBlock() : WriteBlockIndex failed");
-    }
+        if (!txdb.WriteHashConnectedTip(pindex->pprev->GetBlockHash()))
+            return error("DisconnectBlock() : WriteHashConnectedTip failed");
 
     return true;
 }
@@ -2023,6 +2424,8 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
     else
         nTxPos = pindex->nBlockPos + ::GetSerializeSize(CBlock(), SER_DISK, CLIENT_VERSION) - 1 + GetSizeOfCompactSize(vtx.size());
 
+    CCheckQueueControl<CScriptCheck> control(nScriptCheckThreads ? &scriptcheckqueue : NULL);
+
     map<uint256, CTxIndex> mapQueuedChanges;
     mpq nFees = 0;
     unsigned int nSigOps = 0;
@@ -2070,8 +2473,10 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
             mpq qNet = tx.GetValueIn(mapInputs) - tx.GetValueOut();
             nFees += GetTimeAdjustedValue(qNet, pindex->nHeight - tx.nRefHeight);
 
-            if (!tx.ConnectInputs(mapInputs, mapQueuedChanges, posThisTx, pindex, true, false, fStrictPayToScriptHash))
+            std::vector<CScriptCheck> vChecks;
+            if (!tx.ConnectInputs(mapInputs, mapQueuedChanges, posThisTx, pindex, true, false, fStrictPayToScriptHash, nScriptCheckThreads ? &vChecks : NULL))
                 return error("ConnectBlock() : unable to connect inputs");
+            control.Add(vChecks);
         }
 
         mapQueuedChanges[hashTx] = CTxIndex(posThisTx, tx.vout.size());
@@ -2101,6 +2506,9 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
     if (!VerifyBudget(mapBudget, vtx, pindex->nHeight))
         return error("ConnectBlock() : block does not meet budget requirements");
 
+    if (!control.Wait())
+        return DoS(100, error("ConnectBlock() : script verification failed"));
+
     if (fJustCheck)
         return true;
 
@@ -2111,15 +2519,14 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
             return error("ConnectBlock() : UpdateTxIndex failed");
     }
 
-    // Update block index on disk without changing it in memory.
+    // New outputs are likely to be spent soon; keep them at hand
+    BOOST_FOREACH(CTransaction& tx, vtx)
+        txdb.CacheTx(tx.GetHash(), tx);
+
+    // Record the new end of the connected chain without changing memory.
     // The memory index structure will be changed after the db commits.
-    if (pindex->pprev)
-    {
-        CDiskBlockIndex blockindexPrev(pindex->pprev);
-        blockindexPrev.hashNext = pindex->GetBlockHash();
-        if (!txdb.WriteBlockIndex(blockindexPrev))
-            return error("ConnectBlock() : WriteBlockIndex failed");
-    }
+    if (!txdb.WriteHashConnectedTip(pindex->GetBlockHash()))
+        return error("ConnectBlock() : WriteHashConnectedTip failed");
 
     // Watch for transactions paying to me
     BOOST_FOREACH(CTransaction& tx, vtx)
@@ -2197,6 +2604,9 @@ bool static Reorganize(CTxDB& txdb, CBlockIndex* pindexNew)
     if (!txdb.WriteHashBestChain(pindexNew->GetBlockHash()))
         return error("Reorganize() : WriteHashBestChain failed");
 
+    // Block index links were rewritten above, so the tx index must follow
+    txdb.FlushCoinsOnCommit();
+
     // Make sure it's successfully written to disk before changing memory structure
     if (!txdb.TxnCommit())
         return error("Reorganize() : TxnCommit failed");
@@ -2210,6 +2620,7 @@ bool static Reorganize(CTxDB& txdb, CBlockIndex* pindexNew)
     BOOST_FOREACH(CBlockIndex* pindex, vConnect)
         if (pindex->pprev)
             pindex->pprev->pnext = pindex;
+    SetMainChainTip(pindexNew);
 
     // Resurrect memory transactions that were in the disconnected branch
     BOOST_FOREACH(CTransaction& tx, vResurrect)
@@ -2219,6 +2630,11 @@ bool static Reorganize(CTxDB& txdb, CBlockIndex* pindexNew)
     BOOST_FOREACH(CTransaction& tx, vDelete)
         mempool.remove(tx);
 
+    // Transactions of the disconnected branch are no longer confirmed
+    filterRecentConfirmed.reset();
+    BOOST_FOREACH(CTransaction& tx, vDelete)
+        filterRecentConfirmed.insert(tx.GetHash());
+
     printf("REORGANIZE: done\n");
 
     return true;
@@ -2237,15 +2653,23 @@ bool CBlock::SetBestChainInner(CTxDB& txdb, CBlockIndex *pindexNew)
         InvalidChainFound(pindexNew);
         return false;
     }
+    // During initial download the tx index is only written back once the
+    // coins cache fills up; afterwards every block goes straight to disk.
+    if (!IsInitialBlockDownload())
+        txdb.FlushCoinsOnCommit();
     if (!txdb.TxnCommit())
         return error("SetBestChain() : TxnCommit failed");
 
     // Add to current best branch
     pindexNew->pprev->pnext = pindexNew;
+    SetMainChainTip(pindexNew);
 
     // Delete redundant memory transactions
     BOOST_FOREACH(CTransaction& tx, vtx)
+    {
         mempool.remove(tx);
+        filterRecentConfirmed.insert(tx.GetHash());
+    }
 
     return true;
 }
@@ -2260,9 +2684,11 @@ bool CBlock::SetBestChain(CTxDB& txdb, CBlockIndex* pindexNew)
     if (pindexGenesisBlock == NULL && hash == hashGenesisBlock)
     {
         txdb.WriteHashBestChain(hash);
+        txdb.FlushCoinsOnCommit();
         if (!txdb.TxnCommit())
             return error("SetBestChain() : TxnCommit failed");
         pindexGenesisBlock = pindexNew;
+        SetMainChainTip(pindexNew);
     }
     else if (hashPrevBlock == hashBestChain)
     {
@@ -2326,7 +2752,6 @@ bool CBlock::SetBestChain(CTxDB& txdb, CBlockIndex* pindexNew)
     // New best block
     hashBestChain = hash;
     pindexBest = pindexNew;
-    pblockindexFBBHLast = NULL;
     nBestHeight = pindexBest->nHeight;
     bnBestChainWork = pindexNew->bnChainWork;
     nTimeBestReceived = GetTime();
@@ -2364,6 +2789,16 @@ bool CBlock::SetBestChain(CTxDB& txdb, CBlockIndex* pindexNew)
     return true;
 }
 
+bool WaitForBlockChange(const uint256& hashWatched, int64 nMilliseconds)
+{
+    boost::system_time timeout = boost::get_system_time() + boost::posix_time::milliseconds(nMilliseconds);
+    boost::unique_lock<boost::mutex> lock(csBlockChange);
+    while (hashBlockChange == hashWatched && !fShutdown)
+        if (!condBlockChange.timed_wait(lock, timeout))
+            break;
+    return (hashBlockChange != hashWatched);
+}
+
 
 bool CBlock::AddToBlockIndex(unsigned int nFile, unsigned int nBlockPos)
 {
@@ -2373,27 +2808,24 @@ bool CBlock::AddToBlockIndex(unsigned int nFile, unsigned int nBlockPos)
         return error("AddToBlockIndex() : %s already exists", hash.ToString().substr(0,20).c_str());
 
     // Construct new block index object
-    CBlockIndex* pindexNew = new CBlockIndex(nFile, nBlockPos, *this);
-    if (!pindexNew)
-        return error("AddToBlockIndex() : new CBlockIndex failed");
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
+    CBlockIndex* pindexNew = NewBlockIndex();
+    *pindexNew = CBlockIndex(nFile, nBlockPos, *this);
+    BlockMap::iterator mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
     pindexNew->phashBlock = &((*mi).first);
-    map<uint256, CBlockIndex*>::iterator miPrev = mapBlockIndex.find(hashPrevBlock);
+    BlockMap::iterator miPrev = mapBlockIndex.find(hashPrevBlock);
     if (miPrev != mapBlockIndex.end())
     {
         pindexNew->pprev = (*miPrev).second;
         pindexNew->nHeight = pindexNew->pprev->nHeight + 1;
+        pindexNew->BuildSkip();
     }
     pindexNew->bnChainWork = (pindexNew->pprev ? pindexNew->pprev->bnChainWork : 0) + pindexNew->GetBlockWork();
 
-    CTxDB txdb;
-    if (!txdb.TxnBegin())
-        return false;
-    txdb.WriteBlockIndex(CDiskBlockIndex(pindexNew));
-    if (!txdb.TxnCommit())
-        return false;
+    if (!blockindexdb.Append(pindexNew, !IsInitialBlockDownload() || (nBestHeight+1) % 500 == 0))
+        return error("AddToBlockIndex() : writing block index failed");
 
     // New best
+    CTxDB txdb;
     if (pindexNew->bnChainWork > bnBestChainWork)
         if (!SetBestChain(txdb, pindexNew))
             return false;
@@ -2477,7 +2909,7 @@ bool CBlock::AcceptBlock()
         return error("AcceptBlock() : block already in mapBlockIndex");
 
     // Get prev block index
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashPrevBlock);
+    BlockMap::iterator mi = mapBlockIndex.find(hashPrevBlock);
     if (mi == mapBlockIndex.end())
         return DoS(10, error("AcceptBlock() : prev block not found"));
     CBlockIndex* pindexPrev = (*mi).second;
@@ -2540,6 +2972,7 @@ bool CBlock::AcceptBlock()
         BOOST_FOREACH(CNode* pnode, vNodes)
             if (nBestHeight > (pnode->nStartingHeight != -1 ? pnode->nStartingHeight - 2000 : nBlockEstimate))
                 pnode->PushInventory(CInv(MSG_BLOCK, hash));
+        WakeMessageHandler();
     }
 
     return true;
@@ -2557,7 +2990,232 @@ bool CBlockIndex::IsSuperMajority(int minVersion, const CBlockIndex* pstart, uns
     return (nFound >= nRequired);
 }
 
-bool ProcessBlock(CNode* pfrom, CBlock* pblock)
+//
+// Headers-first download
+//
+// Peers are asked for headers first.  Headers are checked (proof of work,
+// GetNextWorkRequired, timestamps, checkpoints) and kept as header-only
+// CBlockIndex entries in mapHeaderIndex, outside of mapBlockIndex.  Block
+// bodies along the best header chain are then requested from all peers at
+// once, MAX_BLOCKS_IN_FLIGHT at a time each, within BLOCK_DOWNLOAD_WINDOW
+// blocks of the last one we have.  Bodies that arrive ahead of their
+// parent wait in mapDownloadedBlocks instead of with the orphans.
+// Everything here is protected by cs_main.
+//
+
+CBlockIndex* GetBestHeader()
+{
+    if (vHeaderChain.empty() || vHeaderChain.back()->bnChainWork <= bnBestChainWork)
+        return pindexBest;
+    return vHeaderChain.back();
+}
+
+// Make pindex the tip of vHeaderChain
+void SetBestHeader(CBlockIndex* pindex)
+{
+    vHeaderChain.resize(pindex->nHeight + 1, NULL);
+    nHeaderChainHave = min(nHeaderChainHave, pindex->nHeight);
+    for (; pindex; pindex = pindex->pprev)
+    {
+        CBlockIndex*& pentry = vHeaderChain[pindex->nHeight];
+        if (pentry && pentry->GetBlockHash() == pindex->GetBlockHash())
+            break;
+        pentry = pindex;
+        nHeaderChainHave = min(nHeaderChainHave, pindex->nHeight - 1);
+    }
+}
+
+// Mark a block of the header chain invalid along with everything built on
+// it.  If it was on the best header chain, fall back to the best one that
+// is still valid and ask for headers again, as the peer that sent it may
+// have nothing better.
+void InvalidateHeader(const uint256& hash)
+{
+    setHeadersInvalid.insert(hash);
+    BlockMap::iterator mi = mapHeaderIndex.find(hash);
+    if (mi == mapHeaderIndex.end())
+        return;
+    CBlockIndex* pindexInvalid = (*mi).second;
+    bool fOnBestChain = (pindexInvalid->nHeight < (int)vHeaderChain.size() && vHeaderChain[pindexInvalid->nHeight] == pindexInvalid);
+
+    CBlockIndex* pindexBestValid = NULL;
+    BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapHeaderIndex)
+    {
+        CBlockIndex* pindex = item.second;
+        if (pindex->nHeight >= pindexInvalid->nHeight && pindex->GetAncestor(pindexInvalid->nHeight)->GetBlockHash() == hash)
+            setHeadersInvalid.insert(item.first);
+        else if (!setHeadersInvalid.count(item.first) && (!pindexBestValid || pindex->bnChainWork > pindexBestValid->bnChainWork))
+            pindexBestValid = pindex;
+    }
+    if (!fOnBestChain)
+        return;
+
+    if (pindexBestValid && pindexBestValid->bnChainWork > bnBestChainWork)
+        SetBestHeader(pindexBestValid);
+    else
+    {
+        vHeaderChain.clear();
+        nHeaderChainHave = 0;
+    }
+    nLastHeadersTime = 0;
+}
+
+static bool AcceptBlockHeader(CBlock& header, CBlockIndex*& pindexRet)
+{
+    // Check for duplicate
+    uint256 hash = header.GetHash();
+    BlockMap::iterator mi = mapBlockIndex.find(hash);
+    if (mi != mapBlockIndex.end() || (mi = mapHeaderIndex.find(hash)) != mapHeaderIndex.end())
+    {
+        pindexRet = (*mi).second;
+        return true;
+    }
+
+    // Header-only entries are cheap to send, so their number is bounded
+    if (mapHeaderIndex.size() >= MAX_HEADER_INDEX)
+        return error("AcceptBlockHeader() : too many headers");
+
+    // Context-free checks, as in CheckBlock
+    if (!CheckProofOfWork(hash, header.nBits))
+        return header.DoS(50, error("AcceptBlockHeader() : proof of work failed"));
+    if (header.GetBlockTime() > GetAdjustedTime() + 2 * 60 * 60)
+        return error("AcceptBlockHeader() : block timestamp too far in the future");
+
+    // Extra checks to prevent "fill up memory by spamming with bogus
+    // headers", as in ProcessBlock
+    CBlockIndex* pcheckpoint = Checkpoints::GetLastCheckpoint();
+    if (pcheckpoint && header.hashPrevBlock != hashBestChain && header.GetBlockTime() < pcheckpoint->nTime)
+        return header.DoS(100, error("AcceptBlockHeader() : block with timestamp before last checkpoint"));
+
+    // Get prev block index
+    mi = mapBlockIndex.find(header.hashPrevBlock);
+    if (mi == mapBlockIndex.end() && (mi = mapHeaderIndex.find(header.hashPrevBlock)) == mapHeaderIndex.end())
+        return header.DoS(10, error("AcceptBlockHeader() : prev block not found"));
+    CBlockIndex* pindexPrev = (*mi).second;
+    int nHeight = pindexPrev->nHeight+1;
+    if (setHeadersInvalid.count(header.hashPrevBlock))
+    {
+        setHeadersInvalid.insert(hash);
+        return error("AcceptBlockHeader() : prev block invalid");
+    }
+
+    // Header checks from AcceptBlock
+    if (header.nBits != GetNextWorkRequired(pindexPrev, &header))
+        return header.DoS(100, error("AcceptBlockHeader() : incorrect proof of work"));
+    if (header.GetBlockTime() <= pindexPrev->GetMedianTimePast())
+        return error("AcceptBlockHeader() : block's timestamp is too early");
+    if (!Checkpoints::CheckBlock(nHeight, hash))
+        return header.DoS(100, error("AcceptBlockHeader() : rejected by checkpoint lock-in at %d", nHeight));
+    if (pcheckpoint && (nHeight <= pcheckpoint->nHeight || pindexPrev->GetAncestor(pcheckpoint->nHeight)->GetBlockHash() != pcheckpoint->GetBlockHash()))
+        return header.DoS(100, error("AcceptBlockHeader() : forks the chain before the last checkpoint"));
+
+    CBlockIndex* pindexNew = new CBlockIndex(0, 0, header);
+    pindexNew->phashBlock = &((*mapHeaderIndex.insert(make_pair(hash, pindexNew)).first).first);
+    pindexNew->pprev = pindexPrev;
+    pindexNew->nHeight = nHeight;
+    pindexNew->BuildSkip();
+    pindexNew->bnChainWork = pindexPrev->bnChainWork + pindexNew->GetBlockWork();
+    if (pindexNew->bnChainWork > GetBestHeader()->bnChainWork)
+        SetBestHeader(pindexNew);
+
+    pindexRet = pindexNew;
+    return true;
+}
+
+static void MarkBlockReceived(CNode* pfrom, const uint256& hash)
+{
+    map<uint256, CNode*>::iterator mi = mapBlocksInFlight.find(hash);
+    if (mi == mapBlocksInFlight.end())
+        return;
+    (*mi).second->setBlocksRequested.erase(hash);
+    if ((*mi).second == pfrom)
+        pfrom->nBlocksRequestedTime = GetTime();
+    mapBlocksInFlight.erase(mi);
+}
+
+// Called before a node is deleted
+void FinalizeNode(CNode* pnode)
+{
+    BOOST_FOREACH(const uint256& hash, pnode->setBlocksRequested)
+    {
+        map<uint256, CNode*>::iterator mi = mapBlocksInFlight.find(hash);
+        if (mi != mapBlocksInFlight.end() && (*mi).second == pnode)
+            mapBlocksInFlight.erase(mi);
+    }
+    pnode->setBlocksRequested.clear();
+}
+
+// Ask pto for headers and for the next blocks along the header chain
+void ScheduleBlockDownloads(CNode* pto, vector<CInv>& vGetData)
+{
+    int64 nNow = GetTime();
+
+    // A peer that stops delivering is dropped; what it was asked for goes
+    // to the others once it is marked to disconnect
+    if (!pto->setBlocksRequested.empty() && nNow - pto->nBlocksRequestedTime > BLOCK_DOWNLOAD_TIMEOUT)
+    {
+        printf("peer %s stalled block download, disconnecting\n", pto->addr.ToString().c_str());
+        pto->fDisconnect = true;
+        return;
+    }
+
+    // One peer at a time is asked for headers, unless it goes quiet
+    CBlockIndex* pindexBestHeader = GetBestHeader();
+    if (pto->nStartingHeight > pindexBestHeader->nHeight && nNow - nLastHeadersTime > BLOCK_DOWNLOAD_TIMEOUT)
+    {
+        nLastHeadersTime = nNow;
+        pto->PushMessage("getheaders", CBlockLocator(pindexBestHeader), uint256(0));
+    }
+
+    if (pindexBestHeader == pindexBest)
+    {
+        // Caught up; free the header chain
+        if (!mapHeaderIndex.empty() && mapBlocksInFlight.empty())
+        {
+            BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapHeaderIndex)
+                delete item.second;
+            mapHeaderIndex.clear();
+            for (map<uint256, CBlock*>::iterator mi = mapDownloadedBlocks.begin(); mi != mapDownloadedBlocks.end(); ++mi)
+                delete (*mi).second;
+            mapDownloadedBlocks.clear();
+            mapDownloadedBlocksByPrev.clear();
+            vHeaderChain.clear();
+            nHeaderChainHave = 0;
+        }
+        return;
+    }
+
+    // Skip past the blocks we have
+    while (nHeaderChainHave + 1 < (int)vHeaderChain.size() && mapBlockIndex.count(vHeaderChain[nHeaderChainHave + 1]->GetBlockHash()))
+        nHeaderChainHave++;
+
+    int nWindowEnd = min(nHeaderChainHave + BLOCK_DOWNLOAD_WINDOW, min((int)vHeaderChain.size() - 1, pto->nStartingHeight));
+    for (int nHeight = nHeaderChainHave + 1; nHeight <= nWindowEnd && pto->setBlocksRequested.size() < MAX_BLOCKS_IN_FLIGHT; nHeight++)
+    {
+        uint256 hash = vHeaderChain[nHeight]->GetBlockHash();
+        if (setHeadersInvalid.count(hash))
+            break;
+        if (mapBlockIndex.count(hash) || mapDownloadedBlocks.count(hash))
+            continue;
+
+        map<uint256, CNode*>::iterator mi = mapBlocksInFlight.find(hash);
+        if (mi != mapBlocksInFlight.end())
+        {
+            if (!(*mi).second->fDisconnect)
+                continue;
+            (*mi).second->setBlocksRequested.erase(hash);
+        }
+
+        if (pto->setBlocksRequested.empty())
+            pto->nBlocksRequestedTime = nNow;
+        pto->setBlocksRequested.insert(hash);
+        mapBlocksInFlight[hash] = pto;
+        vGetData.push_back(CInv(MSG_BLOCK, hash));
+    }
+}
+
+// fChecked: the caller already ran CheckBlock
+bool ProcessBlock(CNode* pfrom, CBlock* pblock, bool fChecked)
 {
     // Check for duplicate
     uint256 hash = pblock->GetHash();
@@ -2565,12 +3223,14 @@ bool ProcessBlock(CNode* pfrom, CBlock* pblock)
         return error("ProcessBlock() : already have block %d %s", mapBlockIndex[hash]->nHeight, hash.ToString().substr(0,20).c_str());
     if (mapOrphanBlocks.count(hash))
         return error("ProcessBlock() : already have block (orphan) %s", hash.ToString().substr(0,20).c_str());
+    if (mapDownloadedBlocks.count(hash))
+        return error("ProcessBlock() : already have block (downloaded) %s", hash.ToString().substr(0,20).c_str());
 
     // Preliminary checks
-    if (!pblock->CheckBlock())
+    if (!fChecked && !pblock->CheckBlock())
         return error("ProcessBlock() : CheckBlock FAILED");
 
-    CBlockIndex* pcheckpoint = Checkpoints::GetLastCheckpoint(mapBlockIndex);
+    CBlockIndex* pcheckpoint = Checkpoints::GetLastCheckpoint();
     if (pcheckpoint && pblock->hashPrevBlock != hashBestChain)
     {
         // Extra checks to prevent "fill up memory by spamming with bogus blocks"
@@ -2601,6 +3261,15 @@ bool ProcessBlock(CNode* pfrom, CBlock* pblock)
     // If we don't already have its previous block, shunt it off to holding area until we get it
     if (!mapBlockIndex.count(pblock->hashPrevBlock))
     {
+        // Blocks downloaded along the header chain wait for their parent
+        if (mapHeaderIndex.count(hash))
+        {
+            CBlock* pblock2 = new CBlock(*pblock);
+            mapDownloadedBlocks.insert(make_pair(hash, pblock2));
+            mapDownloadedBlocksByPrev.insert(make_pair(pblock2->hashPrevBlock, pblock2));
+            return true;
+        }
+
         printf("ProcessBlock: ORPHAN BLOCK, prev=%s\n", pblock->hashPrevBlock.ToString().substr(0,20).c_str());
 
         // Accept orphans as long as there is a node to request its parents from
@@ -2610,14 +3279,21 @@ bool ProcessBlock(CNode* pfrom, CBlock* pblock)
             mapOrphanBlocksByPrev.insert(make_pair(pblock2->hashPrevBlock, pblock2));
 
             // Ask this guy to fill in what we're missing
-            pfrom->PushGetBlocks(pindexBest, GetOrphanRoot(pblock2));
+            if (fHeadersFirst)
+                pfrom->PushMessage("getheaders", CBlockLocator(GetBestHeader()), uint256(0));
+            else
+                pfrom->PushGetBlocks(pindexBest, GetOrphanRoot(pblock2));
         }
         return true;
     }
 
     // Store to disk
     if (!pblock->AcceptBlock())
+    {
+        if (mapHeaderIndex.count(hash))
+            InvalidateHeader(hash);
         return error("ProcessBlock() : AcceptBlock FAILED");
+    }
 
     // Recursively process any orphan blocks that depended on this one
     vector<uint256> vWorkQueue;
@@ -2636,6 +3312,20 @@ bool ProcessBlock(CNode* pfrom, CBlock* pblock)
             delete pblockOrphan;
         }
         mapOrphanBlocksByPrev.erase(hashPrev);
+
+        for (multimap<uint256, CBlock*>::iterator mi = mapDownloadedBlocksByPrev.lower_bound(hashPrev);
+             mi != mapDownloadedBlocksByPrev.upper_bound(hashPrev);
+             ++mi)
+        {
+            CBlock* pblockDownloaded = (*mi).second;
+            if (pblockDownloaded->AcceptBlock())
+                vWorkQueue.push_back(pblockDownloaded->GetHash());
+            else
+                InvalidateHeader(pblockDownloaded->GetHash());
+            mapDownloadedBlocks.erase(pblockDownloaded->GetHash());
+            delete pblockDownloaded;
+        }
+        mapDownloadedBlocksByPrev.erase(hashPrev);
     }
 
     printf("ProcessBlock: ACCEPTED\n");
@@ -2728,7 +3418,7 @@ bool LoadBlockIndex(bool fAllowNew)
     //
     // Load block index
     //
-    CTxDB txdb("cr");
+    CTxDB txdb("cr+");
     if (!txdb.LoadBlockIndex())
         return false;
     txdb.Close();
@@ -2898,7 +3588,7 @@ void PrintBlockTree()
 {
     // pre-compute tree structure
     map<CBlockIndex*, vector<CBlockIndex*> > mapNext;
-    for (map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
+    for (BlockMap::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
     {
         CBlockIndex* pindex = (*mi).second;
         mapNext[pindex->pprev].push_back(pindex);
@@ -2966,61 +3656,233 @@ void PrintBlockTree()
     }
 }
 
-bool LoadExternalBlockFile(FILE* fileIn)
+// Importing a block file is pipelined: one thread frames blocks out of the
+// file, a pool deserializes them and runs CheckBlock, and the calling thread
+// connects them in file order, taking cs_main one block at a time.  Blocks
+// whose parent hasn't been seen yet wait in the importer, not in
+// mapOrphanBlocks.
+class CBlockImporter
 {
-    int64 nStart = GetTimeMillis();
+private:
+    boost::mutex mutex;
+    boost::condition_variable cond;
+
+    // Framed blocks waiting to be checked, by position in the file
+    std::deque<std::pair<unsigned int, std::vector<char> > > queueFramed;
+    // Checked blocks waiting to be connected; NULL if the check failed
+    std::map<unsigned int, CBlock*> mapChecked;
+    unsigned int nFramed;
+    unsigned int nConnected;
+    bool fReadDone;
+    bool fAbort;
+
+    // Blocks read from disk but not yet connected are limited to this
+    static const unsigned int MAX_IN_FLIGHT = 64;
+    // Out of order blocks held back waiting for their parent
+    static const unsigned int MAX_PENDING = 1000;
+
+    // Make sure at least nNeed unread bytes are in vchBuf[nBegin..]
+    static bool Fill(FILE* file, std::vector<char>& vchBuf, unsigned int& nBegin, unsigned int nNeed)
+    {
+        if (vchBuf.size() - nBegin >= nNeed)
+            return true;
+        vchBuf.erase(vchBuf.begin(), vchBuf.begin() + nBegin);
+        nBegin = 0;
+        while (vchBuf.size() < nNeed)
+        {
+            unsigned int nPos = vchBuf.size();
+            vchBuf.resize(nPos + std::max(nNeed - nPos, (unsigned int)(1 << 20)));
+            size_t nRead = fread(&vchBuf[nPos], 1, vchBuf.size() - nPos, file);
+            vchBuf.resize(nPos + nRead);
+            if (nRead == 0)
+                return false;
+        }
+        return true;
+    }
 
-    int nLoaded = 0;
+    void ThreadRead(FILE* file)
     {
-        LOCK(cs_main);
-        try {
-            CAutoFile blkdat(fileIn, SER_DISK, CLIENT_VERSION);
-            unsigned int nPos = 0;
-            while (nPos != (unsigned int)-1 && blkdat.good() && !fRequestShutdown)
+        std::vector<char> vchBuf;
+        unsigned int nBegin = 0;
+        while (!fAbort && Fill(file, vchBuf, nBegin, sizeof(pchMessageStart) + sizeof(unsigned int)))
+        {
+            // Scan for message start
+            std::vector<char>::iterator pstart = search(vchBuf.begin() + nBegin, vchBuf.end(), BEGIN(pchMessageStart), END(pchMessageStart));
+            if (vchBuf.end() - pstart < (int)(sizeof(pchMessageStart) + sizeof(unsigned int)))
             {
-                unsigned char pchData[65536];
-                do {
-                    fseek(blkdat, nPos, SEEK_SET);
-                    int nRead = fread(pchData, 1, sizeof(pchData), blkdat);
-                    if (nRead <= 8)
-                    {
-                        nPos = (unsigned int)-1;
-                        break;
-                    }
-                    void* nFind = memchr(pchData, pchMessageStart[0], nRead+1-sizeof(pchMessageStart));
-                    if (nFind)
-                    {
-                        if (memcmp(nFind, pchMessageStart, sizeof(pchMessageStart))==0)
-                        {
-                            nPos += ((unsigned char*)nFind - pchData) + sizeof(pchMessageStart);
-                            break;
-                        }
-                        nPos += ((unsigned char*)nFind - pchData) + 1;
-                    }
-                    else
-                        nPos += sizeof(pchData) - sizeof(pchMessageStart) + 1;
-                } while(!fRequestShutdown);
-                if (nPos == (unsigned int)-1)
+                // Keep the partial header, or what could be the start of one
+                if (pstart == vchBuf.end())
+                    nBegin = vchBuf.size() - (sizeof(pchMessageStart) - 1);
+                else
+                    nBegin = pstart - vchBuf.begin();
+                if (!Fill(file, vchBuf, nBegin, vchBuf.size() - nBegin + 1))
+                    break;
+                continue;
+            }
+            nBegin = pstart - vchBuf.begin() + sizeof(pchMessageStart);
+
+            unsigned int nSize;
+            memcpy(&nSize, &vchBuf[nBegin], sizeof(nSize));
+            if (nSize == 0 || nSize > MAX_BLOCK_SIZE)
+                continue;
+            if (!Fill(file, vchBuf, nBegin, sizeof(nSize) + nSize))
+                break;
+            nBegin += sizeof(nSize);
+
+            boost::unique_lock<boost::mutex> lock(mutex);
+            while (nFramed - nConnected >= MAX_IN_FLIGHT && !fAbort)
+                cond.wait(lock);
+            queueFramed.push_back(make_pair(nFramed++, std::vector<char>(vchBuf.begin() + nBegin, vchBuf.begin() + nBegin + nSize)));
+            nBegin += nSize;
+            cond.notify_all();
+        }
+
+        boost::unique_lock<boost::mutex> lock(mutex);
+        fReadDone = true;
+        cond.notify_all();
+    }
+
+    void ThreadCheck()
+    {
+        loop
+        {
+            std::pair<unsigned int, std::vector<char> > item;
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                while (queueFramed.empty() && !fReadDone && !fAbort)
+                    cond.wait(lock);
+                if (queueFramed.empty() || fAbort)
+                    return;
+                item.first = queueFramed.front().first;
+                item.second.swap(queueFramed.front().second);
+                queueFramed.pop_front();
+            }
+
+            CBlock* pblock = new CBlock();
+            try {
+                CMemoryReader(&item.second[0], &item.second[0] + item.second.size(), SER_DISK, CLIENT_VERSION) >> *pblock;
+                if (!pblock->CheckBlock())
+                {
+                    printf("LoadExternalBlockFile() : CheckBlock FAILED\n");
+                    delete pblock;
+                    pblock = NULL;
+                }
+            }
+            catch (std::exception &e) {
+                printf("LoadExternalBlockFile() : deserialize error caught during load\n");
+                delete pblock;
+                pblock = NULL;
+            }
+
+            boost::unique_lock<boost::mutex> lock(mutex);
+            mapChecked[item.first] = pblock;
+            cond.notify_all();
+        }
+    }
+
+    // Caller must hold cs_main
+    bool Connect(CBlock* pblock, std::multimap<uint256, CBlock*>& mapPending)
+    {
+        uint256 hash = pblock->GetHash();
+        if (mapBlockIndex.count(hash) || mapDownloadedBlocks.count(hash))
+            return false;
+        if (!mapBlockIndex.count(pblock->hashPrevBlock) && !mapHeaderIndex.count(hash))
+        {
+            if (mapPending.size() >= MAX_PENDING)
+                return false;
+            mapPending.insert(make_pair(pblock->hashPrevBlock, new CBlock(*pblock)));
+            return false;
+        }
+        // The workers ran CheckBlock; ProcessBlock does the rest, including
+        // the checkpoint guard and blocks waiting on this one
+        return ProcessBlock(NULL, pblock, true);
+    }
+
+public:
+    CBlockImporter() : nFramed(0), nConnected(0), fReadDone(false), fAbort(false) {}
+
+    int Import(FILE* file)
+    {
+        int nLoaded = 0;
+        std::multimap<uint256, CBlock*> mapPending;
+
+        boost::thread_group threads;
+        threads.create_thread(boost::bind(&CBlockImporter::ThreadRead, this, file));
+        for (int i = 0; i < std::max(nScriptCheckThreads, 1); i++)
+            threads.create_thread(boost::bind(&CBlockImporter::ThreadCheck, this));
+
+        loop
+        {
+            CBlock* pblock;
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                while (!mapChecked.count(nConnected) && !(fReadDone && nConnected == nFramed) && !fRequestShutdown)
+                    cond.timed_wait(lock, boost::posix_time::milliseconds(100));
+                if (!mapChecked.count(nConnected))
                     break;
-                fseek(blkdat, nPos, SEEK_SET);
-                unsigned int nSize;
-                blkdat >> nSize;
-                if (nSize > 0 && nSize <= MAX_BLOCK_SIZE)
+                pblock = mapChecked[nConnected];
+                mapChecked.erase(nConnected);
+                nConnected++;
+                cond.notify_all();
+            }
+            if (!pblock)
+                continue;
+
+            LOCK(cs_main);
+            if (Connect(pblock, mapPending))
+            {
+                nLoaded++;
+
+                // Connect any blocks that were waiting for this one
+                vector<uint256> vWorkQueue;
+                vWorkQueue.push_back(pblock->GetHash());
+                for (unsigned int i = 0; i < vWorkQueue.size(); i++)
                 {
-                    CBlock block;
-                    blkdat >> block;
-                    if (ProcessBlock(NULL,&block))
+                    uint256 hashPrev = vWorkQueue[i];
+                    for (multimap<uint256, CBlock*>::iterator mi = mapPending.lower_bound(hashPrev);
+                         mi != mapPending.upper_bound(hashPrev);
+                         ++mi)
                     {
-                        nLoaded++;
-                        nPos += 4 + nSize;
+                        CBlock* pblockPending = (*mi).second;
+                        if (Connect(pblockPending, mapPending))
+                        {
+                            nLoaded++;
+                            vWorkQueue.push_back(pblockPending->GetHash());
+                        }
+                        delete pblockPending;
                     }
+                    mapPending.erase(hashPrev);
                 }
             }
+            delete pblock;
         }
-        catch (std::exception &e) {
-            printf("%s() : Deserialize or I/O error caught during load\n",
-                   __PRETTY_FUNCTION__);
+
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            fAbort = true;
+            cond.notify_all();
         }
+        threads.join_all();
+
+        for (map<unsigned int, CBlock*>::iterator mi = mapChecked.begin(); mi != mapChecked.end(); ++mi)
+            delete (*mi).second;
+        for (multimap<uint256, CBlock*>::iterator mi = mapPending.begin(); mi != mapPending.end(); ++mi)
+            delete (*mi).second;
+        if (!mapPending.empty())
+            printf("LoadExternalBlockFile() : %"PRIszu" blocks without a parent were skipped\n", mapPending.size());
+        return nLoaded;
+    }
+};
+
+bool LoadExternalBlockFile(FILE* fileIn)
+{
+    int64 nStart = GetTimeMillis();
+
+    int nLoaded = 0;
+    {
+        CAutoFile blkdat(fileIn, SER_DISK, CLIENT_VERSION);
+        CBlockImporter importer;
+        nLoaded = importer.Import(blkdat);
     }
     printf("Loaded %i blocks from external file in %"PRI64d"ms\n", nLoaded, GetTimeMillis() - nStart);
     return nLoaded > 0;
@@ -3033,7 +3895,6 @@ bool LoadExternalBlockFile(FILE* fileIn)
 
 
 
-
 //////////////////////////////////////////////////////////////////////////////
 //
 // CAlert
@@ -3099,25 +3960,36 @@ string GetWarnings(string strFor)
 //
 
 
-bool static AlreadyHave(CTxDB& txdb, const CInv& inv)
+bool static AlreadyHave(const CInv& inv)
 {
     switch (inv.type)
     {
     case MSG_TX:
         {
+        if (hashBestChain != hashRecentRejectsChainTip)
+        {
+            // Transactions rejected against an older tip may be valid now
+            hashRecentRejectsChainTip = hashBestChain;
+            filterRecentRejects.reset();
+        }
         bool txInMap = false;
             {
             LOCK(mempool.cs);
             txInMap = (mempool.exists(inv.hash));
             }
+        // Transactions confirmed before the recent blocks are not looked up
+        // in the txdb; if one is announced it is fetched once, rejected and
+        // remembered as such.
         return txInMap ||
                mapOrphanTransactions.count(inv.hash) ||
-               txdb.ContainsTx(inv.hash);
+               filterRecentConfirmed.contains(inv.hash) ||
+               filterRecentRejects.contains(inv.hash);
         }
 
     case MSG_BLOCK:
         return mapBlockIndex.count(inv.hash) ||
-               mapOrphanBlocks.count(inv.hash);
+               mapOrphanBlocks.count(inv.hash) ||
+               mapDownloadedBlocks.count(inv.hash);
     }
     // Don't know what it is, just say we already got one
     return true;
@@ -3231,9 +4103,10 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
             }
         }
 
-        // Ask the first connected node for block updates
+        // Ask the first connected node for block updates; with headers
+        // first, SendMessages does the asking
         static int nAskedForBlocks = 0;
-        if (!pfrom->fClient && !pfrom->fOneShot &&
+        if (!fHeadersFirst && !pfrom->fClient && !pfrom->fOneShot &&
             (pfrom->nStartingHeight > (nBestHeight - 144)) &&
             (pfrom->nVersion < NOBLKS_VERSION_START ||
              pfrom->nVersion >= NOBLKS_VERSION_END) &&
@@ -3268,7 +4141,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
 
     else if (strCommand == "verack")
     {
-        pfrom->vRecv.SetVersion(min(pfrom->nVersion, PROTOCOL_VERSION));
+        pfrom->SetRecvVersion(min(pfrom->nVersion, PROTOCOL_VERSION));
     }
 
 
@@ -3357,7 +4230,6 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
                 break;
             }
         }
-        CTxDB txdb("r");
         for (unsigned int nInv = 0; nInv < vInv.size(); nInv++)
         {
             const CInv &inv = vInv[nInv];
@@ -3366,15 +4238,19 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
                 return true;
             pfrom->AddInventoryKnown(inv);
 
-            bool fAlreadyHave = AlreadyHave(txdb, inv);
+            bool fAlreadyHave = AlreadyHave(inv);
             if (fDebug)
                 printf("  got inventory: %s  %s\n", inv.ToString().c_str(), fAlreadyHave ? "have" : "new");
 
             if (!fAlreadyHave)
-                pfrom->AskFor(inv);
+            {
+                // Blocks already requested by the download scheduler
+                if (!(inv.type == MSG_BLOCK && mapBlocksInFlight.count(inv.hash)))
+                    pfrom->AskFor(inv);
+            }
             else if (inv.type == MSG_BLOCK && mapOrphanBlocks.count(inv.hash)) {
                 pfrom->PushGetBlocks(pindexBest, GetOrphanRoot(mapOrphanBlocks[inv.hash]));
-            } else if (nInv == nLastBlock) {
+            } else if (nInv == nLastBlock && mapBlockIndex.count(inv.hash)) {
                 // In case we are on a very long side-chain, it is possible that we already have
                 // the last block in an inv bundle sent in response to getblocks. Try to detect
                 // this situation and push another getblocks to continue.
@@ -3412,7 +4288,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
             if (inv.type == MSG_BLOCK)
             {
                 // Send block from disk
-                map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(inv.hash);
+                BlockMap::iterator mi = mapBlockIndex.find(inv.hash);
                 if (mi != mapBlockIndex.end())
                 {
                     CBlock block;
@@ -3506,7 +4382,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
         if (locator.IsNull())
         {
             // If locator is null, return the hashStop block
-            map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashStop);
+            BlockMap::iterator mi = mapBlockIndex.find(hashStop);
             if (mi == mapBlockIndex.end())
                 return true;
             pindex = (*mi).second;
@@ -3520,7 +4396,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
         }
 
         vector<CBlock> vHeaders;
-        int nLimit = 2000;
+        int nLimit = MAX_HEADERS_RESULTS;
         printf("getheaders %d to %s\n", (pindex ? pindex->nHeight : -1), hashStop.ToString().substr(0,20).c_str());
         for (; pindex; pindex = pindex->pnext)
         {
@@ -3532,6 +4408,33 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
     }
 
 
+    else if (strCommand == "headers")
+    {
+        vector<CBlock> vHeaders;
+        vRecv >> vHeaders;
+        if (vHeaders.size() > MAX_HEADERS_RESULTS)
+        {
+            pfrom->Misbehaving(20);
+            return error("message headers size() = %"PRIszu"", vHeaders.size());
+        }
+
+        CBlockIndex* pindexLast = NULL;
+        BOOST_FOREACH(CBlock& header, vHeaders)
+        {
+            if (!AcceptBlockHeader(header, pindexLast))
+            {
+                if (header.nDoS) pfrom->Misbehaving(header.nDoS);
+                return error("ProcessMessage() : invalid header %s", header.GetHash().ToString().substr(0,20).c_str());
+            }
+        }
+        nLastHeadersTime = GetTime();
+
+        // A full batch means the peer has more
+        if (pindexLast && vHeaders.size() == MAX_HEADERS_RESULTS)
+            pfrom->PushMessage("getheaders", CBlockLocator(pindexLast), uint256(0));
+    }
+
+
     else if (strCommand == "tx")
     {
         vector<uint256> vWorkQueue;
@@ -3580,6 +4483,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
                     {
                         // invalid orphan
                         vEraseQueue.push_back(inv.hash);
+                        filterRecentRejects.insert(inv.hash);
                         printf("   removed invalid orphan tx %s\n", inv.hash.ToString().substr(0,10).c_str());
                     }
                 }
@@ -3597,6 +4501,8 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
             if (nEvicted > 0)
                 printf("mapOrphan overflow, removed %u tx\n", nEvicted);
         }
+        else
+            filterRecentRejects.insert(inv.hash);
         if (tx.nDoS) pfrom->Misbehaving(tx.nDoS);
     }
 
@@ -3611,6 +4517,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
 
         CInv inv(MSG_BLOCK, block.GetHash());
         pfrom->AddInventoryKnown(inv);
+        MarkBlockReceived(pfrom, inv.hash);
 
         if (ProcessBlock(pfrom, &block))
             mapAlreadyAskedFor.erase(inv);
@@ -3760,11 +4667,8 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
 
 bool ProcessMessages(CNode* pfrom)
 {
-    CDataStream& vRecv = pfrom->vRecv;
-    if (vRecv.empty())
-        return true;
     //if (fDebug)
-    //    printf("ProcessMessages(%u bytes)\n", vRecv.size());
+    //    printf("ProcessMessages(%"PRIszu" messages)\n", pfrom->vRecvMsg.size());
 
     //
     // Message format
@@ -3781,26 +4685,19 @@ bool ProcessMessages(CNode* pfrom)
         if (pfrom->vSend.size() >= SendBufferSize())
             break;
 
-        // Scan for message start
-        CDataStream::iterator pstart = search(vRecv.begin(), vRecv.end(), BEGIN(pchMessageStart), END(pchMessageStart));
-        int nHeaderSize = vRecv.GetSerializeSize(CMessageHeader());
-        if (vRecv.end() - pstart < nHeaderSize)
+        // Take the next complete message off the queue; the socket thread
+        // can keep receiving while it is processed
+        CNetMessage msg(SER_NETWORK, PROTOCOL_VERSION);
         {
-            if ((int)vRecv.size() > nHeaderSize)
-            {
-                printf("\n\nPROCESSMESSAGE MESSAGESTART NOT FOUND\n\n");
-                vRecv.erase(vRecv.begin(), vRecv.end() - nHeaderSize);
-            }
-            break;
+            LOCK(pfrom->cs_vRecv);
+            if (pfrom->fDisconnect || !pfrom->HasMessageReady())
+                break;
+            msg.swap(pfrom->vRecvMsg.front());
+            pfrom->vRecvMsg.pop_front();
         }
-        if (pstart - vRecv.begin() > 0)
-            printf("\n\nPROCESSMESSAGE SKIPPED %"PRIpdd" BYTES\n\n", pstart - vRecv.begin());
-        vRecv.erase(vRecv.begin(), pstart);
 
         // Read header
-        vector<char> vHeaderSave(vRecv.begin(), vRecv.begin() + nHeaderSize);
-        CMessageHeader hdr;
-        vRecv >> hdr;
+        CMessageHeader& hdr = msg.hdr;
         if (!hdr.IsValid())
         {
             printf("\n\nPROCESSMESSAGE: ERRORS IN HEADER %s\n\n\n", hdr.GetCommand().c_str());
@@ -3810,19 +4707,9 @@ bool ProcessMessages(CNode* pfrom)
 
         // Message size
         unsigned int nMessageSize = hdr.nMessageSize;
-        if (nMessageSize > MAX_SIZE)
-        {
-            printf("ProcessMessages(%s, %u bytes) : nMessageSize > MAX_SIZE\n", strCommand.c_str(), nMessageSize);
-            continue;
-        }
-        if (nMessageSize > vRecv.size())
-        {
-            // Rewind and wait for rest of message
-            vRecv.insert(vRecv.begin(), vHeaderSave.begin(), vHeaderSave.end());
-            break;
-        }
 
         // Checksum
+        CDataStream& vRecv = msg.vRecv;
         uint256 hash = Hash(vRecv.begin(), vRecv.begin() + nMessageSize);
         unsigned int nChecksum = 0;
         memcpy(&nChecksum, &hash, sizeof(nChecksum));
@@ -3833,17 +4720,13 @@ bool ProcessMessages(CNode* pfrom)
             continue;
         }
 
-        // Copy message to its own buffer
-        CDataStream vMsg(vRecv.begin(), vRecv.begin() + nMessageSize, vRecv.nType, vRecv.nVersion);
-        vRecv.ignore(nMessageSize);
-
         // Process message
         bool fRet = false;
         try
         {
             {
                 LOCK(cs_main);
-                fRet = ProcessMessage(pfrom, strCommand, vMsg);
+                fRet = ProcessMessage(pfrom, strCommand, vRecv);
             }
             if (fShutdown)
                 return true;
@@ -3875,7 +4758,6 @@ bool ProcessMessages(CNode* pfrom)
             printf("ProcessMessage(%s, %u bytes) FAILED\n", strCommand.c_str(), nMessageSize);
     }
 
-    vRecv.Compact();
     return true;
 }
 
@@ -4005,6 +4887,7 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
                 }
             }
             pto->vInventoryToSend = vInvWait;
+            pto->fInventoryNow = false;
         }
         if (!vInv.empty())
             pto->PushMessage("inv", vInv);
@@ -4015,11 +4898,10 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         //
         vector<CInv> vGetData;
         int64 nNow = GetTime() * 1000000;
-        CTxDB txdb("r");
         while (!pto->mapAskFor.empty() && (*pto->mapAskFor.begin()).first <= nNow)
         {
             const CInv& inv = (*pto->mapAskFor.begin()).second;
-            if (!AlreadyHave(txdb, inv))
+            if (!AlreadyHave(inv))
             {
                 if (fDebugNet)
                     printf("sending getdata: %s\n", inv.ToString().c_str());
@@ -4033,6 +4915,8 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
             }
             pto->mapAskFor.erase(pto->mapAskFor.begin());
         }
+        if (fHeadersFirst && !pto->fClient && !pto->fDisconnect)
+            ScheduleBlockDownloads(pto, vGetData);
         if (!vGetData.empty())
             pto->PushMessage("getdata", vGetData);
 
@@ -4127,58 +5011,138 @@ unsigned int static ScanHash_CryptoPP(char* pmidstate, char* pdata, char* phash1
     }
 }
 
-// Some explaining would be appreciated
-class COrphan
+uint64 nLastBlockTx = 0;
+uint64 nLastBlockSize = 0;
+
+// The block CreateNewBlock is filling with memory pool transactions
+class CBlockAssembler
 {
 public:
-    CTransaction* ptx;
-    set<uint256> setDependsOn;
-    double dPriority;
-    double dFeePerKb;
-
-    COrphan(CTransaction* ptxIn)
+    CBlock* pblock;
+    CTxDB& txdb;
+    CBlockIndex* pindexPrev;
+    int nHeight;
+    unsigned int nBlockMaxSize;
+
+    map<uint256, CTxIndex> mapTestPool;
+    set<uint256> setInBlock;
+    uint64 nBlockSize;
+    uint64 nBlockTx;
+    int nBlockSigOps;
+    mpq nFees;
+
+    CBlockAssembler(CBlock* pblockIn, CTxDB& txdbIn, CBlockIndex* pindexPrevIn, unsigned int nBlockMaxSizeIn) :
+        pblock(pblockIn), txdb(txdbIn), pindexPrev(pindexPrevIn), nHeight(pindexPrevIn->nHeight + 1),
+        nBlockMaxSize(nBlockMaxSizeIn), nBlockSize(1000), nBlockTx(0), nBlockSigOps(100), nFees(0) { }
+
+    // Adds tx if it fits and connects on top of the block so far
+    bool Add(const uint256& hash, const CTxMemPoolEntry& entry, double dPriority, double dFeePerKb)
     {
-        ptx = ptxIn;
-        dPriority = dFeePerKb = 0;
-    }
+        CTransaction& tx = mempool.mapTx[hash];
+        if (tx.IsCoinBase() || !tx.IsFinal())
+            return false;
 
-    void print() const
-    {
-        printf("COrphan(hash=%s, dPriority=%.1f, dFeePerKb=%.1f)\n",
-               ptx->GetHash().ToString().substr(0,10).c_str(), dPriority, dFeePerKb);
-        BOOST_FOREACH(uint256 hash, setDependsOn)
-            printf("   setDependsOn %s\n", hash.ToString().substr(0,10).c_str());
-    }
-};
+        // Invalid height
+        if ( tx.nRefHeight > nHeight )
+            return false;
 
+        // Size limits
+        if (nBlockSize + entry.nTxSize >= nBlockMaxSize)
+            return false;
 
-uint64 nLastBlockTx = 0;
-uint64 nLastBlockSize = 0;
+        // Legacy limits on sigOps:
+        unsigned int nTxSigOps = tx.GetLegacySigOpCount();
+        if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
+            return false;
 
-// We want to sort transactions by priority and fee, so:
-typedef boost::tuple<double, double, CTransaction*> TxPriority;
-class TxPriorityCompare
-{
-    bool byFee;
-public:
-    TxPriorityCompare(bool _byFee) : byFee(_byFee) { }
-    bool operator()(const TxPriority& a, const TxPriority& b)
+        // Connecting shouldn't fail due to dependency on other memory pool transactions
+        // because we're already processing them in order of dependency
+        map<uint256, CTxIndex> mapTestPoolTmp(mapTestPool);
+        MapPrevTx mapInputs;
+        bool fInvalid;
+        if (!tx.FetchInputs(txdb, mapTestPoolTmp, false, true, mapInputs, fInvalid))
+            return false;
+
+        mpq nNet = tx.GetValueIn(mapInputs) - tx.GetValueOut();
+        mpq nTxFees = GetTimeAdjustedValue(nNet, nHeight-tx.nRefHeight);
+
+        nTxSigOps += tx.GetP2SHSigOpCount(mapInputs);
+        if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
+            return false;
+
+        if (!tx.ConnectInputs(mapInputs, mapTestPoolTmp, CDiskTxPos(1,1,1), pindexPrev, false, true))
+            return false;
+        mapTestPoolTmp[hash] = CTxIndex(CDiskTxPos(1,1,1), tx.vout.size());
+        swap(mapTestPool, mapTestPoolTmp);
+
+        // Added
+        pblock->vtx.push_back(tx);
+        setInBlock.insert(hash);
+        nBlockSize += entry.nTxSize;
+        ++nBlockTx;
+        nBlockSigOps += nTxSigOps;
+        nFees += nTxFees;
+
+        if (fDebug && GetBoolArg("-printpriority"))
+        {
+            printf("priority %.1f feeperkb %.1f txid %s\n",
+                   dPriority, dFeePerKb, hash.ToString().c_str());
+        }
+        return true;
+    }
+
+    // Adds a package from CTxMemPool::GetPackage, parents first, all or
+    // nothing: parents without the child that pays for them would only
+    // take up space
+    bool AddPackage(const vector<uint256>& vPackage, double dFeePerKb)
     {
-        if (byFee)
+        if (vPackage.size() == 1)
         {
-            if (a.get<1>() == b.get<1>())
-                return a.get<0>() < b.get<0>();
-            return a.get<1>() < b.get<1>();
+            const CTxMemPoolEntry& entry = mempool.mapEntry[vPackage[0]];
+            return Add(vPackage[0], entry, entry.GetPriority(nHeight - 1), dFeePerKb);
         }
-        else
+
+        // Size and legacy sigops are known up front
+        uint64 nPackageSize = 0;
+        int nPackageSigOps = 0;
+        BOOST_FOREACH(const uint256& hashTx, vPackage)
         {
-            if (a.get<0>() == b.get<0>())
-                return a.get<1>() < b.get<1>();
-            return a.get<0>() < b.get<0>();
+            nPackageSize += mempool.mapEntry[hashTx].nTxSize;
+            nPackageSigOps += mempool.mapTx[hashTx].GetLegacySigOpCount();
         }
+        if (nBlockSize + nPackageSize >= nBlockMaxSize || nBlockSigOps + nPackageSigOps >= MAX_BLOCK_SIGOPS)
+            return false;
+
+        // P2SH sigops and inputs only as each is added; undo the ones
+        // already in if a later one fails
+        unsigned int nTxBefore = pblock->vtx.size();
+        map<uint256, CTxIndex> mapTestPoolBefore(mapTestPool);
+        uint64 nBlockSizeBefore = nBlockSize;
+        uint64 nBlockTxBefore = nBlockTx;
+        int nBlockSigOpsBefore = nBlockSigOps;
+        mpq nFeesBefore = nFees;
+        BOOST_FOREACH(const uint256& hashTx, vPackage)
+        {
+            const CTxMemPoolEntry& entry = mempool.mapEntry[hashTx];
+            if (!Add(hashTx, entry, entry.GetPriority(nHeight - 1), dFeePerKb))
+            {
+                for (unsigned int i = nTxBefore; i < pblock->vtx.size(); i++)
+                    setInBlock.erase(pblock->vtx[i].GetHash());
+                pblock->vtx.resize(nTxBefore);
+                swap(mapTestPool, mapTestPoolBefore);
+                nBlockSize = nBlockSizeBefore;
+                nBlockTx = nBlockTxBefore;
+                nBlockSigOps = nBlockSigOpsBefore;
+                nFees = nFeesBefore;
+                return false;
+            }
+        }
+        return true;
     }
 };
 
+typedef std::pair<double, uint256> TxPriority;
+
 CBlock* CreateNewBlock(CReserveKey& reservekey)
 {
     // Create new block
@@ -4253,189 +5217,95 @@ CBlock* CreateNewBlock(CReserveKey& reservekey)
             ParseMoney(mapArgs["-mintxfee"], nMinTxFee);
 
         // Collect memory pool transactions into the block
-        mpq nFees = 0;
-
         CTxDB txdb("r");
 
-        // Priority order to process transactions
-        list<COrphan> vOrphan; // list memory doesn't move
-        map<uint256, vector<COrphan*> > mapDependers;
+        // Only transactions that came or whose ancestors changed since the
+        // last call need their inputs looked at
+        mempool.Refresh(txdb);
 
-        // This vector will be sorted into a priority queue:
-        vector<TxPriority> vecPriority;
-        vecPriority.reserve(mempool.mapTx.size());
-        for (map<uint256, CTransaction>::iterator mi = mempool.mapTx.begin(); mi != mempool.mapTx.end(); ++mi)
+        CBlockAssembler assembler(pblock.get(), txdb, pindexPrev, nBlockMaxSize);
+
+        // First the highest priority transactions, regardless of fee, with
+        // those waiting on other memory pool transactions joining once
+        // their inputs are in
+        if (nBlockPrioritySize > 0)
         {
-            CTransaction& tx = (*mi).second;
-            if (tx.IsCoinBase() || !tx.IsFinal())
-                continue;
+            vector<TxPriority> vecPriority;
+            vecPriority.reserve(mempool.mapEntry.size());
+            for (map<uint256, CTxMemPoolEntry>::iterator mi = mempool.mapEntry.begin(); mi != mempool.mapEntry.end(); ++mi)
+            {
+                const CTxMemPoolEntry& entry = (*mi).second;
+                if (!entry.fMissingInputs && entry.setDependsOn.empty())
+                    vecPriority.push_back(TxPriority(entry.GetPriority(nHeight - 1), (*mi).first));
+            }
+            std::make_heap(vecPriority.begin(), vecPriority.end());
 
-            COrphan* porphan = NULL;
-            double dPriority = 0;
-            mpq nTotalIn = 0;
-            bool fMissingInputs = false;
-            BOOST_FOREACH(const CTxIn& txin, tx.vin)
+            while (!vecPriority.empty())
             {
-                // Read prev transaction
-                CTransaction txPrev;
-                CTxIndex txindex;
-                if (!txPrev.ReadFromDisk(txdb, txin.prevout, txindex))
-                {
-                    // This should never happen; all transactions in the memory
-                    // pool should connect to either transactions in the chain
-                    // or other transactions in the memory pool.
-                    if (!mempool.mapTx.count(txin.prevout.hash))
-                    {
-                        printf("ERROR: mempool transaction missing input\n");
-                        if (fDebug) assert("mempool transaction missing input" == 0);
-                        fMissingInputs = true;
-                        if (porphan)
-                            vOrphan.pop_back();
-                        break;
-                    }
+                // Take highest priority transaction off the priority queue:
+                double dPriority = vecPriority.front().first;
+                uint256 hash = vecPriority.front().second;
+                std::pop_heap(vecPriority.begin(), vecPriority.end());
+                vecPriority.pop_back();
+
+                // The rest of the block goes by fee once past the priority
+                // size or out of high-priority transactions
+                const CTxMemPoolEntry& entry = mempool.mapEntry[hash];
+                if ((assembler.nBlockSize + entry.nTxSize >= nBlockPrioritySize) || (dPriority < COIN * 144 / 250))
+                    break;
+
+                if (!assembler.Add(hash, entry, dPriority, entry.GetFeeRateWithAncestors(nHeight)))
+                    continue;
 
-                    // Has to wait for dependencies
-                    if (!porphan)
+                // Add transactions that depend on this one to the priority queue
+                const CTransaction& tx = mempool.mapTx[hash];
+                for (unsigned int i = 0; i < tx.vout.size(); i++)
+                {
+                    map<COutPoint, CInPoint>::iterator mi = mempool.mapNextTx.find(COutPoint(hash, i));
+                    if (mi == mempool.mapNextTx.end())
+                        continue;
+                    uint256 hashChild = (*mi).second.ptx->GetHash();
+                    const CTxMemPoolEntry& entryChild = mempool.mapEntry[hashChild];
+                    if (entryChild.fMissingInputs || assembler.setInBlock.count(hashChild))
+                        continue;
+                    bool fReady = true;
+                    BOOST_FOREACH(const uint256& hashParent, entryChild.setDependsOn)
+                        if (!assembler.setInBlock.count(hashParent))
+                            fReady = false;
+                    if (fReady)
                     {
-                        // Use list for automatic deletion
-                        vOrphan.push_back(COrphan(&tx));
-                        porphan = &vOrphan.back();
+                        vecPriority.push_back(TxPriority(entryChild.GetPriority(nHeight - 1), hashChild));
+                        std::push_heap(vecPriority.begin(), vecPriority.end());
                     }
-                    mapDependers[txin.prevout.hash].push_back(porphan);
-                    porphan->setDependsOn.insert(txin.prevout.hash);
-                    const CTransaction &txPrevIn = mempool.mapTx[txin.prevout.hash];
-                    nTotalIn += GetPresentValue(txPrevIn, txPrevIn.vout[txin.prevout.n], tx.nRefHeight);
-                    continue;
                 }
-
-                int nConf = txindex.GetDepthInMainChain();
-
-                mpq nValueIn = GetPresentValue(txPrev, txPrev.vout[txin.prevout.n], tx.nRefHeight);
-                nTotalIn += nValueIn;
-
-                dPriority += nTotalIn.get_d() * nConf;
             }
-            if (fMissingInputs) continue;
-
-            // Priority is sum(valuein * age) / txsize
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-            dPriority /= nTxSize;
-
-            // This is a more accurate fee-per-kilobyte than is used by the client code, because the
-            // client code rounds up the size to the nearest 1K. That's good, because it gives an
-            // incentive to create smaller transactions.
-            mpq txValueOut = nTotalIn - tx.GetValueOut();
-            double dFeePerKb = txValueOut.get_d() / (double(nTxSize)/1000.0);
-
-            if (porphan)
-            {
-                porphan->dPriority = dPriority;
-                porphan->dFeePerKb = dFeePerKb;
-            }
-            else
-                vecPriority.push_back(TxPriority(dPriority, dFeePerKb, &(*mi).second));
         }
 
-        // Collect transactions into block
-        map<uint256, CTxIndex> mapTestPool;
-        uint64 nBlockSize = 1000;
-        uint64 nBlockTx = 0;
-        int nBlockSigOps = 100;
-        bool fSortedByFee = (nBlockPrioritySize <= 0);
-
-        TxPriorityCompare comparer(fSortedByFee);
-        std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
-
-        while (!vecPriority.empty())
+        // Then by fee rate, each transaction together with the ancestors it
+        // needs, so that paying for a parent from a child works
+        for (set<pair<double, uint256> >::reverse_iterator it = mempool.setByFeeRate.rbegin(); it != mempool.setByFeeRate.rend(); ++it)
         {
-            // Take highest priority transaction off the priority queue:
-            double dPriority = vecPriority.front().get<0>();
-            double dFeePerKb = vecPriority.front().get<1>();
-            CTransaction& tx = *(vecPriority.front().get<2>());
-
-            std::pop_heap(vecPriority.begin(), vecPriority.end(), comparer);
-            vecPriority.pop_back();
-
-            // Invalid height
-            if ( tx.nRefHeight > nHeight )
-                continue;
-
-            // Size limits
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-            if (nBlockSize + nTxSize >= nBlockMaxSize)
+            const uint256& hash = (*it).second;
+            if (assembler.setInBlock.count(hash))
                 continue;
 
-            // Legacy limits on sigOps:
-            unsigned int nTxSigOps = tx.GetLegacySigOpCount();
-            if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
-                continue;
+            const CTxMemPoolEntry& entry = mempool.mapEntry[hash];
+            double dFeePerKb = entry.GetFeeRateWithAncestors(nHeight);
 
             // Skip free transactions if we're past the minimum block size:
-            if (fSortedByFee && (dFeePerKb < nMinTxFee) && (nBlockSize + nTxSize >= nBlockMinSize))
+            if ((dFeePerKb < nMinTxFee) && (assembler.nBlockSize + entry.nTxSize >= nBlockMinSize))
                 continue;
 
-            // Prioritize by fee once past the priority size or we run out of high-priority
-            // transactions:
-            if (!fSortedByFee &&
-                ((nBlockSize + nTxSize >= nBlockPrioritySize) || (dPriority < COIN * 144 / 250)))
-            {
-                fSortedByFee = true;
-                comparer = TxPriorityCompare(fSortedByFee);
-                std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
-            }
-
-            // Connecting shouldn't fail due to dependency on other memory pool transactions
-            // because we're already processing them in order of dependency
-            map<uint256, CTxIndex> mapTestPoolTmp(mapTestPool);
-            MapPrevTx mapInputs;
-            bool fInvalid;
-            if (!tx.FetchInputs(txdb, mapTestPoolTmp, false, true, mapInputs, fInvalid))
+            vector<uint256> vPackage;
+            if (!mempool.GetPackage(hash, assembler.setInBlock, vPackage))
                 continue;
-
-            mpq nNet = tx.GetValueIn(mapInputs) - tx.GetValueOut();
-            mpq nTxFees = GetTimeAdjustedValue(nNet, nHeight-tx.nRefHeight);
-
-            nTxSigOps += tx.GetP2SHSigOpCount(mapInputs);
-            if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
-                continue;
-
-            if (!tx.ConnectInputs(mapInputs, mapTestPoolTmp, CDiskTxPos(1,1,1), pindexPrev, false, true))
-                continue;
-            mapTestPoolTmp[tx.GetHash()] = CTxIndex(CDiskTxPos(1,1,1), tx.vout.size());
-            swap(mapTestPool, mapTestPoolTmp);
-
-            // Added
-            pblock->vtx.push_back(tx);
-            nBlockSize += nTxSize;
-            ++nBlockTx;
-            nBlockSigOps += nTxSigOps;
-            nFees += nTxFees;
-
-            if (fDebug && GetBoolArg("-printpriority"))
-            {
-                printf("priority %.1f feeperkb %.1f txid %s\n",
-                       dPriority, dFeePerKb, tx.GetHash().ToString().c_str());
-            }
-
-            // Add transactions that depend on this one to the priority queue
-            uint256 hash = tx.GetHash();
-            if (mapDependers.count(hash))
-            {
-                BOOST_FOREACH(COrphan* porphan, mapDependers[hash])
-                {
-                    if (!porphan->setDependsOn.empty())
-                    {
-                        porphan->setDependsOn.erase(hash);
-                        if (porphan->setDependsOn.empty())
-                        {
-                            vecPriority.push_back(TxPriority(porphan->dPriority, porphan->dFeePerKb, porphan->ptx));
-                            std::push_heap(vecPriority.begin(), vecPriority.end(), comparer);
-                        }
-                    }
-                }
-            }
+            assembler.AddPackage(vPackage, dFeePerKb);
         }
 
+        mpq nFees = assembler.nFees;
+        uint64 nBlockSize = assembler.nBlockSize;
+        uint64 nBlockTx = assembler.nBlockTx;
+
         mapBudget.clear();
         ApplyBudget(nIDAmount, budgetID, mapBudget);
         ApplyBudget(nPSAmount, budgetPS, mapBudget);
@@ -4477,6 +5347,14 @@ CBlock* CreateNewBlock(CReserveKey& reservekey)
 }
 
 
+CScript GetCoinbaseScriptSig(int nHeight, unsigned int nExtraNonce)
+{
+    // Height first in coinbase required for block.version=2
+    CScript scriptSig = (CScript() << nHeight << CBigNum(nExtraNonce)) + COINBASE_FLAGS;
+    assert(scriptSig.size() <= 100);
+    return scriptSig;
+}
+
 void IncrementExtraNonce(CBlock* pblock, CBlockIndex* pindexPrev, unsigned int& nExtraNonce)
 {
     // Update nExtraNonce
@@ -4487,9 +5365,7 @@ void IncrementExtraNonce(CBlock* pblock, CBlockIndex* pindexPrev, unsigned int&
         hashPrevBlock = pblock->hashPrevBlock;
     }
     ++nExtraNonce;
-    unsigned int nHeight = pindexPrev->nHeight+1; // Height first in coinbase required for block.version=2
-    pblock->vtx[0].vin[0].scriptSig = (CScript() << nHeight << CBigNum(nExtraNonce)) + COINBASE_FLAGS;
-    assert(pblock->vtx[0].vin[0].scriptSig.size() <= 100);
+    pblock->vtx[0].vin[0].scriptSig = GetCoinbaseScriptSig(pindexPrev->nHeight+1, nExtraNonce);
 
     pblock->hashMerkleRoot = pblock->BuildMerkleTree();
 }
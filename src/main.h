@@ -9,9 +9,13 @@
 #include "sync.h"
 #include "net.h"
 #include "script.h"
+#include "blockstore.h"
 
 #include <list>
 
+#include <boost/shared_ptr.hpp>
+#include <boost/unordered_map.hpp>
+
 class CWallet;
 class CBlock;
 class CBlockIndex;
@@ -27,7 +31,21 @@ static const unsigned int MAX_BLOCK_SIZE = 1000000;
 static const unsigned int MAX_BLOCK_SIZE_GEN = MAX_BLOCK_SIZE/2;
 static const unsigned int MAX_BLOCK_SIGOPS = MAX_BLOCK_SIZE/50;
 static const unsigned int MAX_ORPHAN_TRANSACTIONS = MAX_BLOCK_SIZE/100;
+/** The most unconfirmed ancestors, and their size in bytes with the
+ * transaction itself, a memory pool transaction may have */
+static const unsigned int MAX_MEMPOOL_ANCESTORS = 25;
+static const unsigned int MAX_MEMPOOL_ANCESTOR_SIZE = 101000;
 static const unsigned int MAX_INV_SZ = 50000;
+/** The maximum number of headers in a "headers" message */
+static const unsigned int MAX_HEADERS_RESULTS = 2000;
+/** Header-only block index entries kept during headers-first download */
+static const unsigned int MAX_HEADER_INDEX = 500000;
+/** How far past the last block we have bodies are downloaded during headers-first sync */
+static const int BLOCK_DOWNLOAD_WINDOW = 1024;
+/** The number of blocks requested from one peer at a time */
+static const unsigned int MAX_BLOCKS_IN_FLIGHT = 16;
+/** Seconds a peer may go without delivering a requested block before it is dropped */
+static const int64 BLOCK_DOWNLOAD_TIMEOUT = 60;
 static const mpq MIN_TX_FEE = mpq("50000/1");
 static const mpq MIN_RELAY_TX_FEE = mpq("10000/1");
 static const int64 I64_MAX_MONEY = 9999999999999999LL;
@@ -38,10 +56,13 @@ static const mpq TITHE_RATIO = mpq("4/5");
 static const mpq TITHE_AMOUNT = MPQ_MAX_MONEY * TITHE_RATIO / EQ_HEIGHT;
 static const mpq INITIAL_SUBSIDY = mpq("15916928404");
 static const int DEMURRAGE_RATE = 1048576;
+static const unsigned int MAX_DEMURRAGE_FACTOR_CACHE = 16384;
 inline bool MoneyRange(int64 nValue) { return (nValue >= 0 && nValue <= I64_MAX_MONEY); }
 inline bool MoneyRange(mpz zValue) { return (zValue >= 0 && zValue <= MPZ_MAX_MONEY); }
 inline bool MoneyRange(mpq qValue) { return (qValue >= 0 && qValue <= MPQ_MAX_MONEY); }
 static const int COINBASE_MATURITY = 100;
+/** Maximum number of script-checking threads allowed */
+static const int MAX_SCRIPTCHECK_THREADS = 16;
 // Threshold for nLockTime: below this value it is interpreted as block number, otherwise as UNIX timestamp.
 static const unsigned int LOCKTIME_THRESHOLD = 500000000; // Tue Nov  5 00:53:20 1985 UTC
 static const int DIFF_FILTER_THRESHOLD_TESTNET =  2016;
@@ -61,7 +82,8 @@ extern CScript COINBASE_FLAGS;
 
 
 extern CCriticalSection cs_main;
-extern std::map<uint256, CBlockIndex*> mapBlockIndex;
+typedef boost::unordered_map<uint256, CBlockIndex*, uint256Hasher> BlockMap;
+extern BlockMap mapBlockIndex;
 extern uint256 hashGenesisBlock;
 extern CBlockIndex* pindexGenesisBlock;
 extern int nBestHeight;
@@ -82,6 +104,8 @@ extern unsigned char pchMessageStart[4];
 
 // Settings
 extern mpq nTransactionFee;
+extern int nScriptCheckThreads;
+extern bool fHeadersFirst;
 
 // Minimum disk space required - used in CheckDiskSpace()
 static const uint64 nMinDiskSpace = 52428800;
@@ -90,24 +114,31 @@ static const uint64 nMinDiskSpace = 52428800;
 class CReserveKey;
 class CTxDB;
 class CTxIndex;
+class CScriptCheck;
 
 class CTxOut;
 
 void RegisterWallet(CWallet* pwalletIn);
 void UnregisterWallet(CWallet* pwalletIn);
 void SyncWithWallets(const CTransaction& tx, const CBlock* pblock = NULL, bool fUpdate = false);
-bool ProcessBlock(CNode* pfrom, CBlock* pblock);
+bool ProcessBlock(CNode* pfrom, CBlock* pblock, bool fChecked=false);
 bool CheckDiskSpace(uint64 nAdditionalBytes=0);
 FILE* OpenBlockFile(unsigned int nFile, unsigned int nBlockPos, const char* pszMode="rb");
 FILE* AppendBlockFile(unsigned int& nFileRet);
 bool LoadBlockIndex(bool fAllowNew=true);
 void PrintBlockTree();
 CBlockIndex* FindBlockByHeight(int nHeight);
+CBlockIndex* NewBlockIndex();
+void SetMainChainTip(CBlockIndex* pindexTip);
 bool ProcessMessages(CNode* pfrom);
 bool SendMessages(CNode* pto, bool fSendTrickle);
+void FinalizeNode(CNode* pnode);
+/** Waits up to nMilliseconds for the best chain to move away from hashWatched; true if it did */
+bool WaitForBlockChange(const uint256& hashWatched, int64 nMilliseconds);
 bool LoadExternalBlockFile(FILE* fileIn);
 void GenerateXcoins(bool fGenerate, CWallet* pwallet);
 CBlock* CreateNewBlock(CReserveKey& reservekey);
+CScript GetCoinbaseScriptSig(int nHeight, unsigned int nExtraNonce);
 void IncrementExtraNonce(CBlock* pblock, CBlockIndex* pindexPrev, unsigned int& nExtraNonce);
 void FormatHashBuffers(CBlock* pblock, char* pmidstate, char* pdata, char* phash1);
 bool CheckWork(CBlock* pblock, CWallet& wallet, CReserveKey& reservekey);
@@ -116,7 +147,15 @@ unsigned int ComputeMinWork(unsigned int nBase, int64 nTime);
 int GetNumBlocksOfPeers();
 bool IsInitialBlockDownload();
 std::string GetWarnings(std::string strFor);
+/** Run an instance of the script checking thread */
+void ThreadScriptCheck(void* parg);
+/** Let the script checking threads exit */
+void ThreadScriptCheckQuit();
 bool GetTransaction(const uint256 &hash, CTransaction &tx, uint256 &hashBlock);
+/** Exact ((DEMURRAGE_RATE-1)/DEMURRAGE_RATE)^n as rounded to 113 bits by MPFR */
+mpq ComputeDemurrageFactor(int nRelativeDepth);
+/** Same as ComputeDemurrageFactor, but served from a bounded cache */
+mpq GetDemurrageFactor(int nRelativeDepth);
 mpq GetTimeAdjustedValue(int64 nInitialValue, int nRelativeDepth);
 mpq GetTimeAdjustedValue(const mpz &zInitialValue, int nRelativeDepth);
 mpq GetTimeAdjustedValue(const mpq &qInitialValue, int nRelativeDepth);
@@ -434,6 +473,15 @@ public:
     mutable int nDoS;
     bool DoS(int nDoSIn, bool fIn) const { nDoS += nDoSIn; return fIn; }
 
+protected:
+    // Transactions that were unserialized, which are not modified in place,
+    // get their hash computed once as they are read.  Code that does modify
+    // one must call InvalidateHash().  GetHash() never writes the memo, so
+    // threads can share a transaction without locking.
+    bool fHashCached;
+    uint256 hashCached;
+
+public:
     CTransaction()
     {
         SetNull();
@@ -441,6 +489,8 @@ public:
 
     IMPLEMENT_SERIALIZE
     (
+        if (fRead)
+            const_cast<CTransaction*>(this)->fHashCached = false;
         READWRITE(this->nVersion);
         nVersion = this->nVersion;
         READWRITE(vin);
@@ -448,6 +498,12 @@ public:
         READWRITE(nLockTime);
         if ( nVersion == 2 )
             READWRITE(nRefHeight);
+        if (fRead)
+        {
+            CTransaction* pthis = const_cast<CTransaction*>(this);
+            pthis->hashCached = SerializeHash(*this);
+            pthis->fHashCached = true;
+        }
     )
 
     void SetNull()
@@ -458,6 +514,7 @@ public:
         nLockTime = 0;
         nDoS = 0;  // Denial-of-service prevention
         nRefHeight = 0;
+        fHashCached = false;
     }
 
     bool IsNull() const
@@ -467,9 +524,16 @@ public:
 
     uint256 GetHash() const
     {
+        if (fHashCached)
+            return hashCached;
         return SerializeHash(*this);
     }
 
+    void InvalidateHash()
+    {
+        fHashCached = false;
+    }
+
     bool IsFinal(int nBlockHeight=0, int64 nBlockTime=0) const
     {
         // Time based nLockTime implemented in 0.1.6
@@ -583,7 +647,19 @@ public:
 
     bool ReadFromDisk(CDiskTxPos pos, FILE** pfileRet=NULL)
     {
-        CAutoFile filein = CAutoFile(OpenBlockFile(pos.nFile, 0, pfileRet ? "rb+" : "rb"), SER_DISK, CLIENT_VERSION);
+        if (!pfileRet)
+        {
+            try {
+                if (!blockstore.Read(pos.nFile, pos.nTxPos, *this, SER_DISK))
+                    return error("CTransaction::ReadFromDisk() : OpenBlockFile failed");
+            }
+            catch (std::exception &e) {
+                return error("%s() : deserialize or I/O error", __PRETTY_FUNCTION__);
+            }
+            return true;
+        }
+
+        CAutoFile filein = CAutoFile(OpenBlockFile(pos.nFile, 0, "rb+"), SER_DISK, CLIENT_VERSION);
         if (!filein)
             return error("CTransaction::ReadFromDisk() : OpenBlockFile failed");
 
@@ -599,12 +675,9 @@ public:
         }
 
         // Return file pointer
-        if (pfileRet)
-        {
-            if (fseek(filein, pos.nTxPos, SEEK_SET) != 0)
-                return error("CTransaction::ReadFromDisk() : second fseek failed");
-            *pfileRet = filein.release();
-        }
+        if (fseek(filein, pos.nTxPos, SEEK_SET) != 0)
+            return error("CTransaction::ReadFromDisk() : second fseek failed");
+        *pfileRet = filein.release();
         return true;
     }
 
@@ -674,11 +747,13 @@ public:
         @param[in] fBlock	true if called from ConnectBlock
         @param[in] fMiner	true if called from CreateNewBlock
         @param[in] fStrictPayToScriptHash	true if fully validating p2sh transactions
+        @param[out] pvChecks	if not NULL, script checks are pushed onto it instead of being performed inline
         @return Returns true if all checks succeed
      */
     bool ConnectInputs(MapPrevTx inputs,
                        std::map<uint256, CTxIndex>& mapTestPool, const CDiskTxPos& posThisTx,
-                       const CBlockIndex* pindexBlock, bool fBlock, bool fMiner, bool fStrictPayToScriptHash=true);
+                       const CBlockIndex* pindexBlock, bool fBlock, bool fMiner, bool fStrictPayToScriptHash=true,
+                       std::vector<CScriptCheck> *pvChecks = NULL);
     bool ClientConnectInputs(CTxDB& txdb);
     bool CheckTransaction() const;
     bool AcceptToMemoryPool(CTxDB& txdb, bool fCheckInputs=true, bool* pfMissingInputs=NULL);
@@ -691,6 +766,42 @@ protected:
 
 
 
+/** Closure representing one script verification.
+ *  Note that this stores a reference to the spending transaction. */
+class CScriptCheck
+{
+private:
+    CScript scriptPubKey;
+    const CTransaction *ptxTo;
+    unsigned int nIn;
+    bool fStrictPayToScriptHash;
+    int nHashType;
+    boost::shared_ptr<const CSignatureHashContext> psighashctx;
+
+public:
+    CScriptCheck() : ptxTo(NULL), nIn(0), fStrictPayToScriptHash(false), nHashType(0) { }
+    CScriptCheck(const CTransaction& txFromIn, const CTransaction& txToIn, unsigned int nInIn, bool fStrictPayToScriptHashIn, int nHashTypeIn,
+                 const boost::shared_ptr<const CSignatureHashContext>& psighashctxIn) :
+        scriptPubKey(txFromIn.vout[txToIn.vin[nInIn].prevout.n].scriptPubKey),
+        ptxTo(&txToIn), nIn(nInIn), fStrictPayToScriptHash(fStrictPayToScriptHashIn), nHashType(nHashTypeIn),
+        psighashctx(psighashctxIn) { }
+
+    bool operator()() const;
+
+    void swap(CScriptCheck &check)
+    {
+        scriptPubKey.swap(check.scriptPubKey);
+        std::swap(ptxTo, check.ptxTo);
+        std::swap(nIn, check.nIn);
+        std::swap(fStrictPayToScriptHash, check.fStrictPayToScriptHash);
+        std::swap(nHashType, check.nHashType);
+        psighashctx.swap(check.psighashctx);
+    }
+};
+
+
+
+
 /** A transaction with a merkle branch linking it to the block chain. */
 class CMerkleTx : public CTransaction
 {
@@ -778,7 +889,7 @@ public:
         vSpent.clear();
     }
 
-    bool IsNull()
+    bool IsNull() const
     {
         return pos.IsNull();
     }
@@ -833,6 +944,15 @@ public:
     mutable int nDoS;
     bool DoS(int nDoSIn, bool fIn) const { nDoS += nDoSIn; return fIn; }
 
+private:
+    // Hash computed as the block is read, valid for as long as the header
+    // matches the copy it was computed from; miners and getwork modify
+    // headers in place.  Like CTransaction, GetHash() never writes it.
+    bool fHashCached;
+    uint256 hashCached;
+    char pchHeaderCached[80];
+
+public:
     CBlock()
     {
         SetNull();
@@ -847,6 +967,13 @@ public:
         READWRITE(nTime);
         READWRITE(nBits);
         READWRITE(nNonce);
+        if (fRead)
+        {
+            CBlock* pthis = const_cast<CBlock*>(this);
+            pthis->hashCached = Hash(BEGIN(this->nVersion), END(this->nNonce));
+            memcpy(pthis->pchHeaderCached, BEGIN(this->nVersion), sizeof(pchHeaderCached));
+            pthis->fHashCached = true;
+        }
 
         // ConnectBlock depends on vtx being last so it can calculate offset
         if (!(nType & (SER_GETHASH|SER_BLOCKHEADERONLY)))
@@ -866,6 +993,7 @@ public:
         vtx.clear();
         vMerkleTree.clear();
         nDoS = 0;
+        fHashCached = false;
     }
 
     bool IsNull() const
@@ -875,6 +1003,9 @@ public:
 
     uint256 GetHash() const
     {
+        assert(END(nNonce) - BEGIN(nVersion) == sizeof(pchHeaderCached));
+        if (fHashCached && memcmp(pchHeaderCached, BEGIN(nVersion), sizeof(pchHeaderCached)) == 0)
+            return hashCached;
         return Hash(BEGIN(nVersion), END(nNonce));
     }
 
@@ -967,16 +1098,10 @@ public:
     {
         SetNull();
 
-        // Open history file to read
-        CAutoFile filein = CAutoFile(OpenBlockFile(nFile, nBlockPos, "rb"), SER_DISK, CLIENT_VERSION);
-        if (!filein)
-            return error("CBlock::ReadFromDisk() : OpenBlockFile failed");
-        if (!fReadTransactions)
-            filein.nType |= SER_BLOCKHEADERONLY;
-
         // Read block
         try {
-            filein >> *this;
+            if (!blockstore.Read(nFile, nBlockPos, *this, SER_DISK | (fReadTransactions ? 0 : SER_BLOCKHEADERONLY)))
+                return error("CBlock::ReadFromDisk() : OpenBlockFile failed");
         }
         catch (std::exception &e) {
             return error("%s() : deserialize or I/O error", __PRETTY_FUNCTION__);
@@ -1042,6 +1167,7 @@ public:
     const uint256* phashBlock;
     CBlockIndex* pprev;
     CBlockIndex* pnext;
+    CBlockIndex* pskip;
     unsigned int nFile;
     unsigned int nBlockPos;
     int nHeight;
@@ -1060,6 +1186,7 @@ public:
         phashBlock = NULL;
         pprev = NULL;
         pnext = NULL;
+        pskip = NULL;
         nFile = 0;
         nBlockPos = 0;
         nHeight = 0;
@@ -1077,6 +1204,7 @@ public:
         phashBlock = NULL;
         pprev = NULL;
         pnext = NULL;
+        pskip = NULL;
         nFile = nFileIn;
         nBlockPos = nBlockPosIn;
         nHeight = 0;
@@ -1159,6 +1287,13 @@ public:
         return pindex->GetMedianTimePast();
     }
 
+    // Build the skip pointer; pprev and its skip pointers must be set
+    void BuildSkip();
+
+    // Efficiently find the ancestor of this block at height nHeightIn
+    CBlockIndex* GetAncestor(int nHeightIn);
+    const CBlockIndex* GetAncestor(int nHeightIn) const;
+
     /**
      * Returns true if there are nRequired or more blocks of minVersion or above
      * in the last nToCheck blocks, starting at pstart and going backwards.
@@ -1279,7 +1414,7 @@ public:
 
     explicit CBlockLocator(uint256 hashBlock)
     {
-        std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+        BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
         if (mi != mapBlockIndex.end())
             Set((*mi).second);
     }
@@ -1315,8 +1450,7 @@ public:
             vHave.push_back(pindex->GetBlockHash());
 
             // Exponentially larger steps back
-            for (int i = 0; pindex && i < nStep; i++)
-                pindex = pindex->pprev;
+            pindex = pindex->GetAncestor(pindex->nHeight - nStep);
             if (vHave.size() > 10)
                 nStep *= 2;
         }
@@ -1330,7 +1464,7 @@ public:
         int nStep = 1;
         BOOST_FOREACH(const uint256& hash, vHave)
         {
-            std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+            BlockMap::iterator mi = mapBlockIndex.find(hash);
             if (mi != mapBlockIndex.end())
             {
                 CBlockIndex* pindex = (*mi).second;
@@ -1349,7 +1483,7 @@ public:
         // Find the first block the caller has in the main chain
         BOOST_FOREACH(const uint256& hash, vHave)
         {
-            std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+            BlockMap::iterator mi = mapBlockIndex.find(hash);
             if (mi != mapBlockIndex.end())
             {
                 CBlockIndex* pindex = (*mi).second;
@@ -1365,7 +1499,7 @@ public:
         // Find the first block the caller has in the main chain
         BOOST_FOREACH(const uint256& hash, vHave)
         {
-            std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+            BlockMap::iterator mi = mapBlockIndex.find(hash);
             if (mi != mapBlockIndex.end())
             {
                 CBlockIndex* pindex = (*mi).second;
@@ -1392,6 +1526,52 @@ public:
 
 
 
+/** What block assembly needs to know about a memory pool transaction,
+ * worked out once by CTxMemPool::Refresh instead of on every new block */
+class CTxMemPoolEntry
+{
+public:
+    bool fMissingInputs;
+    unsigned int nTxSize;
+
+    // Inputs less outputs, valued at tx.nRefHeight
+    mpq nFee;
+
+    // Priority at height h is (dValueIn * (h+1) - dValueInHeight) / nTxSize,
+    // counting only inputs in the chain
+    double dValueIn;
+    double dValueInHeight;
+
+    // Inputs spending other memory pool transactions
+    std::set<uint256> setDependsOn;
+
+    // The transaction together with all its ancestors in the pool; the fee
+    // is scaled by GetFeeScale so fees of different nRefHeight compare
+    unsigned int nSizeWithAncestors;
+    double dScaledFeeWithAncestors;
+
+    // Key in CTxMemPool::setByFeeRate
+    double dFeeRateKey;
+
+    CTxMemPoolEntry()
+    {
+        fMissingInputs = false;
+        nTxSize = 0;
+        nFee = 0;
+        dValueIn = dValueInHeight = 0;
+        nSizeWithAncestors = 0;
+        dScaledFeeWithAncestors = dFeeRateKey = 0;
+    }
+
+    double GetPriority(int nHeight) const
+    {
+        return (dValueIn * (nHeight + 1) - dValueInHeight) / nTxSize;
+    }
+
+    /** Fee per kB of the transaction and its ancestors, at nHeight */
+    double GetFeeRateWithAncestors(int nHeight) const;
+};
+
 class CTxMemPool
 {
 public:
@@ -1399,6 +1579,23 @@ public:
     std::map<uint256, CTransaction> mapTx;
     std::map<COutPoint, CInPoint> mapNextTx;
 
+    // Entries of mapTx that Refresh has brought up to date; the rest are
+    // in setStale.  Entries go stale when added or when an ancestor comes
+    // or goes.
+    std::map<uint256, CTxMemPoolEntry> mapEntry;
+    std::set<uint256> setStale;
+
+    // Up to date entries without missing inputs, by ancestor package fee
+    // rate.  Demurrage shrinks all fees by the same factor each block, so
+    // the order holds from one height to the next.
+    std::set<std::pair<double, uint256> > setByFeeRate;
+
+private:
+    void MarkStale(const uint256& hash);
+    void MarkDependentsStale(const CTransaction& tx);
+    void RefreshEntry(CTxDB& txdb, const uint256& hash, CTxMemPoolEntry& entry);
+
+public:
     bool accept(CTxDB& txdb, CTransaction &tx,
                 bool fCheckInputs, bool* pfMissingInputs);
     bool addUnchecked(const uint256& hash, CTransaction &tx);
@@ -1406,6 +1603,18 @@ public:
     void clear();
     void queryHashes(std::vector<uint256>& vtxid);
 
+    /** Bring the stale entries up to date; caller must hold cs_main and cs */
+    void Refresh(CTxDB& txdb);
+
+    /** Appends the ancestors of hash that aren't in setExclude, parents
+     * before children, followed by hash itself; false if one of them has
+     * missing inputs */
+    bool GetPackage(const uint256& hash, const std::set<uint256>& setExclude, std::vector<uint256>& vPackage);
+
+    /** Whether tx, of nSize bytes, stays within MAX_MEMPOOL_ANCESTORS and
+     * MAX_MEMPOOL_ANCESTOR_SIZE with its ancestors in the pool */
+    bool CheckAncestorLimits(const CTransaction& tx, unsigned int nSize);
+
     unsigned long size()
     {
         LOCK(cs);
@@ -14,6 +14,11 @@
 #include <string.h>
 #endif
 
+#ifdef __linux__
+#define USE_EPOLL 1
+#include <sys/epoll.h>
+#endif
+
 #ifdef USE_UPNP
 #include <miniupnpc/miniwget.h>
 #include <miniupnpc/miniupnpc.h>
@@ -26,6 +31,15 @@ using namespace boost;
 
 static const int MAX_OUTBOUND_CONNECTIONS = 8;
 
+// epoll instance holding the listen sockets and every node's socket,
+// or -1 when the select() loop is used
+static int hEpoll = -1;
+
+// Signals the message handler that there is work before its next round
+static CWaitableCriticalSection csMessageHandler;
+static boost::condition_variable condMessageHandler;
+static bool fMessageHandlerWake = false;
+
 void ThreadMessageHandler2(void* parg);
 void ThreadSocketHandler2(void* parg);
 void ThreadOpenConnections2(void* parg);
@@ -508,6 +522,10 @@ CNode* ConnectNode(CAddress addrConnect, const char *pszDest, int64 nTimeout)
 
         // Add node
         CNode* pnode = new CNode(hSocket, addrConnect, pszDest ? pszDest : "", false);
+        {
+            LOCK(pnode->cs_vSend);
+            pnode->UpdatePollInterest();
+        }
         if (nTimeout != 0)
             pnode->AddRef(nTimeout);
         else
@@ -527,16 +545,139 @@ CNode* ConnectNode(CAddress addrConnect, const char *pszDest, int64 nTimeout)
     }
 }
 
+void CNode::CloseSocket()
+{
+    if (hSocket == INVALID_SOCKET)
+        return;
+#ifdef USE_EPOLL
+    // Child processes may still hold the descriptor, so closing it
+    // does not necessarily take it out of the epoll set
+    if (fPollRegistered)
+    {
+        struct epoll_event event;
+        epoll_ctl(hEpoll, EPOLL_CTL_DEL, hSocket, &event);
+        fPollRegistered = false;
+    }
+#endif
+    closesocket(hSocket);
+    hSocket = INVALID_SOCKET;
+}
+
 void CNode::CloseSocketDisconnect()
 {
     fDisconnect = true;
+    LOCK(cs_vSend);
     if (hSocket != INVALID_SOCKET)
     {
         printf("disconnecting node %s\n", addrName.c_str());
-        closesocket(hSocket);
-        hSocket = INVALID_SOCKET;
-        vRecv.clear();
+        CloseSocket();
+        // in case this fails, the messages go when the CNode is deleted
+        TRY_LOCK(cs_vRecv, lockRecv);
+        if (lockRecv)
+            vRecvMsg.clear();
+    }
+}
+
+// Register the socket with epoll, asking for write readiness only while
+// there is something to send.  Caller must hold cs_vSend.
+void CNode::UpdatePollInterest()
+{
+#ifdef USE_EPOLL
+    if (hEpoll == -1 || hSocket == INVALID_SOCKET)
+        return;
+    bool fWantSend = !vSend.empty();
+    if (fPollRegistered && fPollSend == fWantSend)
+        return;
+
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLET | (fWantSend ? EPOLLOUT : 0);
+    event.data.ptr = this;
+    if (epoll_ctl(hEpoll, fPollRegistered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, hSocket, &event) == 0)
+    {
+        fPollRegistered = true;
+        fPollSend = fWantSend;
+    }
+    else
+        printf("epoll_ctl failed for %s: %d\n", addrName.c_str(), errno);
+#endif
+}
+
+int CNetMessage::readHeader(const char* pch, unsigned int nBytes)
+{
+    // copy data to temporary parsing buffer
+    unsigned int nRemaining = hdrbuf.size() - nHdrPos;
+    unsigned int nCopy = std::min(nRemaining, nBytes);
+    memcpy(&hdrbuf[nHdrPos], pch, nCopy);
+    nHdrPos += nCopy;
+
+    // if header incomplete, exit
+    if (nHdrPos < hdrbuf.size())
+        return nCopy;
+
+    try {
+        hdrbuf >> hdr;
+    }
+    catch (std::exception &e) {
+        return -1;
+    }
+
+    // without the message start there is no telling where messages begin
+    if (memcmp(hdr.pchMessageStart, pchMessageStart, sizeof(pchMessageStart)) != 0)
+    {
+        printf("CNetMessage::readHeader() : message start not found\n");
+        return -1;
+    }
+    if (hdr.nMessageSize > MAX_SIZE)
+    {
+        printf("CNetMessage::readHeader() : (%s, %u bytes) nMessageSize > MAX_SIZE\n", hdr.GetCommand().c_str(), hdr.nMessageSize);
+        return -1;
+    }
+
+    fInData = true;
+    return nCopy;
+}
+
+int CNetMessage::readData(const char* pch, unsigned int nBytes)
+{
+    unsigned int nRemaining = hdr.nMessageSize - nDataPos;
+    unsigned int nCopy = std::min(nRemaining, nBytes);
+
+    // Grow the payload as it arrives rather than trusting the header's size
+    if (vRecv.size() < nDataPos + nCopy)
+        vRecv.resize(std::min(hdr.nMessageSize, nDataPos + nCopy + 256 * 1024));
+
+    memcpy(&vRecv[nDataPos], pch, nCopy);
+    nDataPos += nCopy;
+    return nCopy;
+}
+
+// Split received bytes into messages.  Returns false if the peer is not
+// speaking the protocol.
+bool CNode::ReceiveMsgBytes(const char* pch, unsigned int nBytes)
+{
+    while (nBytes > 0)
+    {
+        // get current incomplete message, or create a new one
+        if (vRecvMsg.empty() || vRecvMsg.back().complete())
+            vRecvMsg.push_back(CNetMessage(SER_NETWORK, nRecvVersion));
+
+        CNetMessage& msg = vRecvMsg.back();
+        int nHandled = msg.fInData ? msg.readData(pch, nBytes) : msg.readHeader(pch, nBytes);
+        if (nHandled < 0)
+            return false;
+
+        pch += nHandled;
+        nBytes -= nHandled;
     }
+    return true;
+}
+
+void CNode::SetRecvVersion(int nVersionIn)
+{
+    LOCK(cs_vRecv);
+    nRecvVersion = nVersionIn;
+    BOOST_FOREACH(CNetMessage& msg, vRecvMsg)
+        msg.SetVersion(nVersionIn);
 }
 
 void CNode::Cleanup()
@@ -657,332 +798,516 @@ void ThreadSocketHandler(void* parg)
     printf("ThreadSocketHandler exited\n");
 }
 
-void ThreadSocketHandler2(void* parg)
+static void DisconnectNodes(list<CNode*>& vNodesDisconnected)
 {
-    printf("ThreadSocketHandler started\n");
-    list<CNode*> vNodesDisconnected;
-    unsigned int nPrevNodeCount = 0;
-
-    loop
+    vector<CNode*> vNodesToClose;
     {
-        //
-        // Disconnect nodes
-        //
+        LOCK(cs_vNodes);
+        // Disconnect unused nodes
+        vector<CNode*> vNodesCopy = vNodes;
+        BOOST_FOREACH(CNode* pnode, vNodesCopy)
         {
-            LOCK(cs_vNodes);
-            // Disconnect unused nodes
-            vector<CNode*> vNodesCopy = vNodes;
-            BOOST_FOREACH(CNode* pnode, vNodesCopy)
+            if (pnode->fDisconnect ||
+                (pnode->GetRefCount() <= 0 && pnode->vRecvMsg.empty() && pnode->vSend.empty()))
             {
-                if (pnode->fDisconnect ||
-                    (pnode->GetRefCount() <= 0 && pnode->vRecv.empty() && pnode->vSend.empty()))
-                {
-                    // remove from vNodes
-                    vNodes.erase(remove(vNodes.begin(), vNodes.end(), pnode), vNodes.end());
-
-                    // release outbound grant (if any)
-                    pnode->grantOutbound.Release();
-
-                    // close socket and cleanup
-                    pnode->CloseSocketDisconnect();
-                    pnode->Cleanup();
-
-                    // hold in disconnected pool until all refs are released
-                    pnode->nReleaseTime = max(pnode->nReleaseTime, GetTime() + 15 * 60);
-                    if (pnode->fNetworkNode || pnode->fInbound)
-                        pnode->Release();
-                    vNodesDisconnected.push_back(pnode);
-                }
+                // remove from vNodes
+                vNodes.erase(remove(vNodes.begin(), vNodes.end(), pnode), vNodes.end());
+
+                // release outbound grant (if any)
+                pnode->grantOutbound.Release();
+
+                // hold in disconnected pool until all refs are released
+                pnode->nReleaseTime = max(pnode->nReleaseTime, GetTime() + 15 * 60);
+                if (pnode->fNetworkNode || pnode->fInbound)
+                    pnode->Release();
+                vNodesDisconnected.push_back(pnode);
+                vNodesToClose.push_back(pnode);
             }
+        }
+    }
 
-            // Delete disconnected nodes
-            list<CNode*> vNodesDisconnectedCopy = vNodesDisconnected;
-            BOOST_FOREACH(CNode* pnode, vNodesDisconnectedCopy)
+    // close socket and cleanup; outside cs_vNodes, since closing takes
+    // cs_vSend and SendMessages takes cs_vNodes while holding that
+    BOOST_FOREACH(CNode* pnode, vNodesToClose)
+    {
+        pnode->CloseSocketDisconnect();
+        pnode->Cleanup();
+    }
+
+    LOCK(cs_vNodes);
+    // Delete disconnected nodes
+    list<CNode*> vNodesDisconnectedCopy = vNodesDisconnected;
+    BOOST_FOREACH(CNode* pnode, vNodesDisconnectedCopy)
+    {
+        // wait until threads are done using it
+        if (pnode->GetRefCount() <= 0)
+        {
+            bool fDelete = false;
             {
-                // wait until threads are done using it
-                if (pnode->GetRefCount() <= 0)
+                TRY_LOCK(pnode->cs_vSend, lockSend);
+                if (lockSend)
                 {
-                    bool fDelete = false;
+                    TRY_LOCK(pnode->cs_vRecv, lockRecv);
+                    if (lockRecv)
                     {
-                        TRY_LOCK(pnode->cs_vSend, lockSend);
-                        if (lockSend)
+                        TRY_LOCK(pnode->cs_mapRequests, lockReq);
+                        if (lockReq)
                         {
-                            TRY_LOCK(pnode->cs_vRecv, lockRecv);
-                            if (lockRecv)
+                            TRY_LOCK(pnode->cs_inventory, lockInv);
+                            if (lockInv)
                             {
-                                TRY_LOCK(pnode->cs_mapRequests, lockReq);
-                                if (lockReq)
+                                TRY_LOCK(cs_main, lockMain);
+                                if (lockMain)
                                 {
-                                    TRY_LOCK(pnode->cs_inventory, lockInv);
-                                    if (lockInv)
-                                        fDelete = true;
+                                    FinalizeNode(pnode);
+                                    fDelete = true;
                                 }
                             }
                         }
                     }
-                    if (fDelete)
-                    {
-                        vNodesDisconnected.remove(pnode);
-                        delete pnode;
-                    }
                 }
             }
+            if (fDelete)
+            {
+                vNodesDisconnected.remove(pnode);
+                delete pnode;
+            }
         }
-        if (vNodes.size() != nPrevNodeCount)
-        {
-            nPrevNodeCount = vNodes.size();
-            uiInterface.NotifyNumConnectionsChanged(vNodes.size());
-        }
+    }
+}
+
+static void AcceptConnection(SOCKET hListenSocket)
+{
+#ifdef USE_IPV6
+    struct sockaddr_storage sockaddr;
+#else
+    struct sockaddr sockaddr;
+#endif
+    socklen_t len = sizeof(sockaddr);
+    SOCKET hSocket = accept(hListenSocket, (struct sockaddr*)&sockaddr, &len);
+    CAddress addr;
+    int nInbound = 0;
 
+    if (hSocket != INVALID_SOCKET)
+        if (!addr.SetSockAddr((const struct sockaddr*)&sockaddr))
+            printf("Warning: Unknown socket family\n");
 
-        //
-        // Find which sockets have data to receive
-        //
-        struct timeval timeout;
-        timeout.tv_sec  = 0;
-        timeout.tv_usec = 50000; // frequency to poll pnode->vSend
-
-        fd_set fdsetRecv;
-        fd_set fdsetSend;
-        fd_set fdsetError;
-        FD_ZERO(&fdsetRecv);
-        FD_ZERO(&fdsetSend);
-        FD_ZERO(&fdsetError);
-        SOCKET hSocketMax = 0;
-        bool have_fds = false;
+    {
+        LOCK(cs_vNodes);
+        BOOST_FOREACH(CNode* pnode, vNodes)
+            if (pnode->fInbound)
+                nInbound++;
+    }
 
-        BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket) {
-            FD_SET(hListenSocket, &fdsetRecv);
-            hSocketMax = max(hSocketMax, hListenSocket);
-            have_fds = true;
+    if (hSocket == INVALID_SOCKET)
+    {
+        int nErr = WSAGetLastError();
+        if (nErr != WSAEWOULDBLOCK)
+            printf("socket error accept failed: %d\n", nErr);
+    }
+#ifndef WIN32
+    else if (hEpoll == -1 && hSocket >= FD_SETSIZE)
+    {
+        printf("connection from %s dropped (too many sockets for select)\n", addr.ToString().c_str());
+        closesocket(hSocket);
+    }
+#endif
+    else if (nInbound >= GetArg("-maxconnections", 125) - MAX_OUTBOUND_CONNECTIONS)
+    {
+        {
+            LOCK(cs_setservAddNodeAddresses);
+            if (!setservAddNodeAddresses.count(addr))
+                closesocket(hSocket);
+        }
+    }
+    else if (CNode::IsBanned(addr))
+    {
+        printf("connection from %s dropped (banned)\n", addr.ToString().c_str());
+        closesocket(hSocket);
+    }
+    else
+    {
+        printf("accepted connection %s\n", addr.ToString().c_str());
+        CNode* pnode = new CNode(hSocket, addr, "", true);
+        pnode->AddRef();
+        {
+            LOCK(pnode->cs_vSend);
+            pnode->UpdatePollInterest();
         }
         {
             LOCK(cs_vNodes);
-            BOOST_FOREACH(CNode* pnode, vNodes)
-            {
-                if (pnode->hSocket == INVALID_SOCKET)
-                    continue;
-                FD_SET(pnode->hSocket, &fdsetRecv);
-                FD_SET(pnode->hSocket, &fdsetError);
-                hSocketMax = max(hSocketMax, pnode->hSocket);
-                have_fds = true;
-                {
-                    TRY_LOCK(pnode->cs_vSend, lockSend);
-                    if (lockSend && !pnode->vSend.empty())
-                        FD_SET(pnode->hSocket, &fdsetSend);
-                }
-            }
+            vNodes.push_back(pnode);
         }
+    }
+}
 
-        vnThreadsRunning[THREAD_SOCKETHANDLER]--;
-        int nSelect = select(have_fds ? hSocketMax + 1 : 0,
-                             &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
-        vnThreadsRunning[THREAD_SOCKETHANDLER]++;
-        if (fShutdown)
-            return;
-        if (nSelect == SOCKET_ERROR)
+// Read what the socket has into the node's message queue; with fAll, keep
+// reading until it is drained.  Returns false if another thread held the
+// queue, in which case nothing was read.
+static bool SocketRecvData(CNode* pnode, bool fAll)
+{
+    TRY_LOCK(pnode->cs_vRecv, lockRecv);
+    if (!lockRecv)
+        return false;
+
+    bool fReceived = false;
+    while (pnode->hSocket != INVALID_SOCKET)
+    {
+        unsigned int nRecvSize = pnode->GetTotalRecvSize();
+        if (nRecvSize > ReceiveBufferSize()) {
+            if (!pnode->fDisconnect)
+                printf("socket recv flood control disconnect (%u bytes)\n", nRecvSize);
+            pnode->CloseSocketDisconnect();
+            break;
+        }
+
+        // typical socket buffer is 8K-64K
+        char pchBuf[0x10000];
+        int nBytes = recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
+        if (nBytes > 0)
         {
-            if (have_fds)
+            if (!pnode->ReceiveMsgBytes(pchBuf, nBytes))
             {
-                int nErr = WSAGetLastError();
-                printf("socket select error %d\n", nErr);
-                for (unsigned int i = 0; i <= hSocketMax; i++)
-                    FD_SET(i, &fdsetRecv);
+                pnode->CloseSocketDisconnect();
+                break;
             }
-            FD_ZERO(&fdsetSend);
-            FD_ZERO(&fdsetError);
-            Sleep(timeout.tv_usec/1000);
+            pnode->nLastRecv = GetTime();
+            fReceived = true;
+            // A short read means the socket buffer is empty
+            if (!fAll || nBytes < (int)sizeof(pchBuf))
+                break;
         }
-
-
-        //
-        // Accept new connections
-        //
-        BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket)
-        if (hListenSocket != INVALID_SOCKET && FD_ISSET(hListenSocket, &fdsetRecv))
+        else if (nBytes == 0)
         {
-#ifdef USE_IPV6
-            struct sockaddr_storage sockaddr;
-#else
-            struct sockaddr sockaddr;
-#endif
-            socklen_t len = sizeof(sockaddr);
-            SOCKET hSocket = accept(hListenSocket, (struct sockaddr*)&sockaddr, &len);
-            CAddress addr;
-            int nInbound = 0;
-
-            if (hSocket != INVALID_SOCKET)
-                if (!addr.SetSockAddr((const struct sockaddr*)&sockaddr))
-                    printf("Warning: Unknown socket family\n");
-
+            // socket closed gracefully
+            if (!pnode->fDisconnect)
+                printf("socket closed\n");
+            pnode->CloseSocketDisconnect();
+            break;
+        }
+        else
+        {
+            // error
+            int nErr = WSAGetLastError();
+            if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
             {
-                LOCK(cs_vNodes);
-                BOOST_FOREACH(CNode* pnode, vNodes)
-                    if (pnode->fInbound)
-                        nInbound++;
+                if (!pnode->fDisconnect)
+                    printf("socket recv error %d\n", nErr);
+                pnode->CloseSocketDisconnect();
             }
+            break;
+        }
+    }
+    if (fReceived && pnode->HasMessageReady())
+        WakeMessageHandler();
+    return true;
+}
+
+// Write as much of vSend as the socket takes.  Returns false if another
+// thread held vSend, in which case nothing was sent.
+static bool SocketSendData(CNode* pnode)
+{
+    TRY_LOCK(pnode->cs_vSend, lockSend);
+    if (!lockSend)
+        return false;
 
-            if (hSocket == INVALID_SOCKET)
+    CDataStream& vSend = pnode->vSend;
+    while (!vSend.empty() && pnode->hSocket != INVALID_SOCKET)
+    {
+        int nBytes = send(pnode->hSocket, &vSend[0], vSend.size(), MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (nBytes > 0)
+        {
+            vSend.erase(vSend.begin(), vSend.begin() + nBytes);
+            pnode->nLastSend = GetTime();
+        }
+        else
+        {
+            if (nBytes < 0)
             {
+                // error
                 int nErr = WSAGetLastError();
-                if (nErr != WSAEWOULDBLOCK)
-                    printf("socket error accept failed: %d\n", nErr);
-            }
-            else if (nInbound >= GetArg("-maxconnections", 125) - MAX_OUTBOUND_CONNECTIONS)
-            {
-                {
-                    LOCK(cs_setservAddNodeAddresses);
-                    if (!setservAddNodeAddresses.count(addr))
-                        closesocket(hSocket);
-                }
-            }
-            else if (CNode::IsBanned(addr))
-            {
-                printf("connection from %s dropped (banned)\n", addr.ToString().c_str());
-                closesocket(hSocket);
-            }
-            else
-            {
-                printf("accepted connection %s\n", addr.ToString().c_str());
-                CNode* pnode = new CNode(hSocket, addr, "", true);
-                pnode->AddRef();
+                if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
                 {
-                    LOCK(cs_vNodes);
-                    vNodes.push_back(pnode);
+                    printf("socket send error %d\n", nErr);
+                    pnode->CloseSocketDisconnect();
                 }
             }
+            break;
         }
+    }
+    if (vSend.empty())
+        pnode->nLastSendEmpty = GetTime();
+    pnode->UpdatePollInterest();
+    return true;
+}
 
-
-        //
-        // Service each socket
-        //
-        vector<CNode*> vNodesCopy;
+static void InactivityCheck(CNode* pnode)
+{
+    if (pnode->vSend.empty())
+        pnode->nLastSendEmpty = GetTime();
+    if (GetTime() - pnode->nTimeConnected > 60)
+    {
+        if (pnode->nLastRecv == 0 || pnode->nLastSend == 0)
         {
-            LOCK(cs_vNodes);
-            vNodesCopy = vNodes;
-            BOOST_FOREACH(CNode* pnode, vNodesCopy)
-                pnode->AddRef();
+            printf("socket no message in first 60 seconds, %d %d\n", pnode->nLastRecv != 0, pnode->nLastSend != 0);
+            pnode->fDisconnect = true;
         }
-        BOOST_FOREACH(CNode* pnode, vNodesCopy)
+        else if (GetTime() - pnode->nLastSend > 90*60 && GetTime() - pnode->nLastSendEmpty > 90*60)
         {
-            if (fShutdown)
-                return;
-
-            //
-            // Receive
-            //
-            if (pnode->hSocket == INVALID_SOCKET)
-                continue;
-            if (FD_ISSET(pnode->hSocket, &fdsetRecv) || FD_ISSET(pnode->hSocket, &fdsetError))
-            {
-                TRY_LOCK(pnode->cs_vRecv, lockRecv);
-                if (lockRecv)
-                {
-                    CDataStream& vRecv = pnode->vRecv;
-                    unsigned int nPos = vRecv.size();
-
-                    if (nPos > ReceiveBufferSize()) {
-                        if (!pnode->fDisconnect)
-                            printf("socket recv flood control disconnect (%"PRIszu" bytes)\n", vRecv.size());
-                        pnode->CloseSocketDisconnect();
-                    }
-                    else {
-                        // typical socket buffer is 8K-64K
-                        char pchBuf[0x10000];
-                        int nBytes = recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
-                        if (nBytes > 0)
-                        {
-                            vRecv.resize(nPos + nBytes);
-                            memcpy(&vRecv[nPos], pchBuf, nBytes);
-                            pnode->nLastRecv = GetTime();
-                        }
-                        else if (nBytes == 0)
-                        {
-                            // socket closed gracefully
-                            if (!pnode->fDisconnect)
-                                printf("socket closed\n");
-                            pnode->CloseSocketDisconnect();
-                        }
-                        else if (nBytes < 0)
-                        {
-                            // error
-                            int nErr = WSAGetLastError();
-                            if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
-                            {
-                                if (!pnode->fDisconnect)
-                                    printf("socket recv error %d\n", nErr);
-                                pnode->CloseSocketDisconnect();
-                            }
-                        }
-                    }
-                }
-            }
+            printf("socket not sending\n");
+            pnode->fDisconnect = true;
+        }
+        else if (GetTime() - pnode->nLastRecv > 90*60)
+        {
+            printf("socket inactivity timeout\n");
+            pnode->fDisconnect = true;
+        }
+    }
+}
 
-            //
-            // Send
-            //
+// One round of the select() loop: poll every socket, then service them all
+static bool SocketHandlerSelect()
+{
+    //
+    // Find which sockets have data to receive
+    //
+    struct timeval timeout;
+    timeout.tv_sec  = 0;
+    timeout.tv_usec = 50000; // frequency to poll pnode->vSend
+
+    fd_set fdsetRecv;
+    fd_set fdsetSend;
+    fd_set fdsetError;
+    FD_ZERO(&fdsetRecv);
+    FD_ZERO(&fdsetSend);
+    FD_ZERO(&fdsetError);
+    SOCKET hSocketMax = 0;
+    bool have_fds = false;
+
+    BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket) {
+        FD_SET(hListenSocket, &fdsetRecv);
+        hSocketMax = max(hSocketMax, hListenSocket);
+        have_fds = true;
+    }
+    {
+        LOCK(cs_vNodes);
+        BOOST_FOREACH(CNode* pnode, vNodes)
+        {
             if (pnode->hSocket == INVALID_SOCKET)
                 continue;
-            if (FD_ISSET(pnode->hSocket, &fdsetSend))
+            FD_SET(pnode->hSocket, &fdsetRecv);
+            FD_SET(pnode->hSocket, &fdsetError);
+            hSocketMax = max(hSocketMax, pnode->hSocket);
+            have_fds = true;
             {
                 TRY_LOCK(pnode->cs_vSend, lockSend);
-                if (lockSend)
-                {
-                    CDataStream& vSend = pnode->vSend;
-                    if (!vSend.empty())
-                    {
-                        int nBytes = send(pnode->hSocket, &vSend[0], vSend.size(), MSG_NOSIGNAL | MSG_DONTWAIT);
-                        if (nBytes > 0)
-                        {
-                            vSend.erase(vSend.begin(), vSend.begin() + nBytes);
-                            pnode->nLastSend = GetTime();
-                        }
-                        else if (nBytes < 0)
-                        {
-                            // error
-                            int nErr = WSAGetLastError();
-                            if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
-                            {
-                                printf("socket send error %d\n", nErr);
-                                pnode->CloseSocketDisconnect();
-                            }
-                        }
-                    }
-                }
+                if (lockSend && !pnode->vSend.empty())
+                    FD_SET(pnode->hSocket, &fdsetSend);
             }
+        }
+    }
+
+    vnThreadsRunning[THREAD_SOCKETHANDLER]--;
+    int nSelect = select(have_fds ? hSocketMax + 1 : 0,
+                         &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
+    vnThreadsRunning[THREAD_SOCKETHANDLER]++;
+    if (fShutdown)
+        return false;
+    if (nSelect == SOCKET_ERROR)
+    {
+        if (have_fds)
+        {
+            int nErr = WSAGetLastError();
+            printf("socket select error %d\n", nErr);
+            for (unsigned int i = 0; i <= hSocketMax; i++)
+                FD_SET(i, &fdsetRecv);
+        }
+        FD_ZERO(&fdsetSend);
+        FD_ZERO(&fdsetError);
+        Sleep(timeout.tv_usec/1000);
+    }
+
+
+    //
+    // Accept new connections
+    //
+    BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket)
+        if (hListenSocket != INVALID_SOCKET && FD_ISSET(hListenSocket, &fdsetRecv))
+            AcceptConnection(hListenSocket);
+
+
+    //
+    // Service each socket
+    //
+    vector<CNode*> vNodesCopy;
+    {
+        LOCK(cs_vNodes);
+        vNodesCopy = vNodes;
+        BOOST_FOREACH(CNode* pnode, vNodesCopy)
+            pnode->AddRef();
+    }
+    BOOST_FOREACH(CNode* pnode, vNodesCopy)
+    {
+        if (fShutdown)
+            return false;
+
+        //
+        // Receive
+        //
+        if (pnode->hSocket == INVALID_SOCKET)
+            continue;
+        if (FD_ISSET(pnode->hSocket, &fdsetRecv) || FD_ISSET(pnode->hSocket, &fdsetError))
+            SocketRecvData(pnode, false);
+
+        //
+        // Send
+        //
+        if (pnode->hSocket == INVALID_SOCKET)
+            continue;
+        if (FD_ISSET(pnode->hSocket, &fdsetSend))
+            SocketSendData(pnode);
+
+        //
+        // Inactivity checking
+        //
+        InactivityCheck(pnode);
+    }
+    {
+        LOCK(cs_vNodes);
+        BOOST_FOREACH(CNode* pnode, vNodesCopy)
+            pnode->Release();
+    }
 
-            //
-            // Inactivity checking
-            //
-            if (pnode->vSend.empty())
-                pnode->nLastSendEmpty = GetTime();
-            if (GetTime() - pnode->nTimeConnected > 60)
+    Sleep(10);
+    return true;
+}
+
+#ifdef USE_EPOLL
+// One round of the epoll loop: wait for readiness and service only the
+// sockets that reported it.  Reads are edge-triggered, so a socket whose
+// buffer lock was busy is remembered in mapPending (holding a reference)
+// and retried on the next round.
+static bool SocketHandlerEpoll(map<CNode*, unsigned int>& mapPending)
+{
+    static int64 nLastInactivityCheck;
+    struct epoll_event events[256];
+
+    vnThreadsRunning[THREAD_SOCKETHANDLER]--;
+    int nEvents = epoll_wait(hEpoll, events, 256, mapPending.empty() ? 50 : 10);
+    vnThreadsRunning[THREAD_SOCKETHANDLER]++;
+    if (fShutdown)
+        return false;
+    if (nEvents < 0)
+    {
+        if (errno != EINTR)
+            printf("socket epoll_wait error %d\n", errno);
+        nEvents = 0;
+    }
+
+    map<CNode*, unsigned int> mapReady;
+    mapReady.swap(mapPending);
+    bool fAccept = false;
+    {
+        LOCK(cs_vNodes);
+        for (int i = 0; i < nEvents; i++)
+        {
+            CNode* pnode = (CNode*)events[i].data.ptr;
+            if (pnode == NULL)
             {
-                if (pnode->nLastRecv == 0 || pnode->nLastSend == 0)
-                {
-                    printf("socket no message in first 60 seconds, %d %d\n", pnode->nLastRecv != 0, pnode->nLastSend != 0);
-                    pnode->fDisconnect = true;
-                }
-                else if (GetTime() - pnode->nLastSend > 90*60 && GetTime() - pnode->nLastSendEmpty > 90*60)
-                {
-                    printf("socket not sending\n");
-                    pnode->fDisconnect = true;
-                }
-                else if (GetTime() - pnode->nLastRecv > 90*60)
-                {
-                    printf("socket inactivity timeout\n");
-                    pnode->fDisconnect = true;
-                }
+                fAccept = true;
+                continue;
             }
+            if (!mapReady.count(pnode))
+                pnode->AddRef();
+            mapReady[pnode] |= events[i].events;
         }
+    }
+
+    //
+    // Accept new connections
+    //
+    if (fAccept)
+        BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket)
+            if (hListenSocket != INVALID_SOCKET)
+                AcceptConnection(hListenSocket);
+
+    //
+    // Service ready sockets
+    //
+    vector<CNode*> vNodesDone;
+    for (map<CNode*, unsigned int>::iterator mi = mapReady.begin(); mi != mapReady.end(); ++mi)
+    {
+        CNode* pnode = (*mi).first;
+        unsigned int nPending = 0;
+        if (pnode->hSocket != INVALID_SOCKET && ((*mi).second & (EPOLLIN | EPOLLERR | EPOLLHUP)))
+            if (!SocketRecvData(pnode, true))
+                nPending |= EPOLLIN;
+        if (pnode->hSocket != INVALID_SOCKET && ((*mi).second & EPOLLOUT))
+            if (!SocketSendData(pnode))
+                nPending |= EPOLLOUT;
+        if (nPending && pnode->hSocket != INVALID_SOCKET && !fShutdown)
+            mapPending[pnode] = nPending;
+        else
+            vNodesDone.push_back(pnode);
+    }
+
+    //
+    // Inactivity checking
+    //
+    vector<CNode*> vNodesCopy;
+    if (GetTime() != nLastInactivityCheck)
+    {
+        nLastInactivityCheck = GetTime();
+        LOCK(cs_vNodes);
+        vNodesCopy = vNodes;
+        BOOST_FOREACH(CNode* pnode, vNodesCopy)
+            pnode->AddRef();
+    }
+    BOOST_FOREACH(CNode* pnode, vNodesCopy)
+        InactivityCheck(pnode);
+
+    {
+        LOCK(cs_vNodes);
+        BOOST_FOREACH(CNode* pnode, vNodesDone)
+            pnode->Release();
+        BOOST_FOREACH(CNode* pnode, vNodesCopy)
+            pnode->Release();
+    }
+    return !fShutdown;
+}
+#endif
+
+void ThreadSocketHandler2(void* parg)
+{
+    printf("ThreadSocketHandler started\n");
+    list<CNode*> vNodesDisconnected;
+    unsigned int nPrevNodeCount = 0;
+#ifdef USE_EPOLL
+    map<CNode*, unsigned int> mapPending;
+#endif
+
+    loop
+    {
+        //
+        // Disconnect nodes
+        //
+        DisconnectNodes(vNodesDisconnected);
+        if (vNodes.size() != nPrevNodeCount)
         {
-            LOCK(cs_vNodes);
-            BOOST_FOREACH(CNode* pnode, vNodesCopy)
-                pnode->Release();
+            nPrevNodeCount = vNodes.size();
+            uiInterface.NotifyNumConnectionsChanged(vNodes.size());
         }
 
-        Sleep(10);
+#ifdef USE_EPOLL
+        if (hEpoll != -1)
+        {
+            if (!SocketHandlerEpoll(mapPending))
+                return;
+            continue;
+        }
+#endif
+        if (!SocketHandlerSelect())
+            return;
     }
 }
 
@@ -1574,12 +1899,29 @@ void ThreadMessageHandler(void* parg)
     printf("ThreadMessageHandler exited\n");
 }
 
+void WakeMessageHandler()
+{
+    {
+        boost::unique_lock<CWaitableCriticalSection> lock(csMessageHandler);
+        fMessageHandlerWake = true;
+    }
+    condMessageHandler.notify_one();
+}
+
 void ThreadMessageHandler2(void* parg)
 {
     printf("ThreadMessageHandler started\n");
     SetThreadPriority(THREAD_PRIORITY_BELOW_NORMAL);
+    int64 nLastPollAll = 0;
     while (!fShutdown)
     {
+        // Every 100ms all nodes are polled for messages and trickled inventory;
+        // in between, only nodes with a complete message or block inventory are
+        int64 nNow = GetTimeMillis();
+        bool fPollAll = (nNow - nLastPollAll >= 100);
+        if (fPollAll)
+            nLastPollAll = nNow;
+
         vector<CNode*> vNodesCopy;
         {
             LOCK(cs_vNodes);
@@ -1588,22 +1930,24 @@ void ThreadMessageHandler2(void* parg)
                 pnode->AddRef();
         }
 
-        // Poll the connected nodes for messages
         CNode* pnodeTrickle = NULL;
-        if (!vNodesCopy.empty())
+        if (fPollAll && !vNodesCopy.empty())
             pnodeTrickle = vNodesCopy[GetRand(vNodesCopy.size())];
         BOOST_FOREACH(CNode* pnode, vNodesCopy)
         {
             // Receive messages
+            bool fProcessed = false;
             {
                 TRY_LOCK(pnode->cs_vRecv, lockRecv);
-                if (lockRecv)
-                    ProcessMessages(pnode);
+                fProcessed = lockRecv && pnode->HasMessageReady();
             }
+            if (fProcessed)
+                ProcessMessages(pnode);
             if (fShutdown)
                 return;
 
             // Send messages
+            if (fPollAll || fProcessed || pnode->fInventoryNow)
             {
                 TRY_LOCK(pnode->cs_vSend, lockSend);
                 if (lockSend)
@@ -1619,11 +1963,18 @@ void ThreadMessageHandler2(void* parg)
                 pnode->Release();
         }
 
-        // Wait and allow messages to bunch up.
+        // Wait for the socket thread to signal a complete message, or for
+        // the next poll.
         // Reduce vnThreadsRunning so StopNode has permission to exit while
-        // we're sleeping, but we must always check fShutdown after doing this.
+        // we're waiting, but we must always check fShutdown after doing this.
         vnThreadsRunning[THREAD_MESSAGEHANDLER]--;
-        Sleep(100);
+        {
+            boost::unique_lock<CWaitableCriticalSection> lock(csMessageHandler);
+            int64 nWait = nLastPollAll + 100 - GetTimeMillis();
+            if (!fMessageHandlerWake && nWait > 0)
+                condMessageHandler.timed_wait(lock, boost::posix_time::milliseconds(nWait));
+            fMessageHandlerWake = false;
+        }
         if (fRequestShutdown)
             StartShutdown();
         vnThreadsRunning[THREAD_MESSAGEHANDLER]++;
@@ -1834,6 +2185,32 @@ void StartNode(void* parg)
     if (!NewThread(ThreadIRCSeed, NULL))
         printf("Error: NewThread(ThreadIRCSeed) failed\n");
 
+#ifdef USE_EPOLL
+    // Set up the epoll loop, falling back to select() if that fails
+    if (GetBoolArg("-epoll", true))
+    {
+        hEpoll = epoll_create(1024);
+        if (hEpoll == -1)
+            printf("epoll_create failed (%d), using select\n", errno);
+        BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket)
+        {
+            if (hEpoll == -1)
+                break;
+            struct epoll_event event;
+            event.events = EPOLLIN;
+            event.data.ptr = NULL;
+            if (epoll_ctl(hEpoll, EPOLL_CTL_ADD, hListenSocket, &event) != 0)
+            {
+                printf("epoll_ctl failed for listen socket (%d), using select\n", errno);
+                close(hEpoll);
+                hEpoll = -1;
+            }
+        }
+        if (hEpoll != -1)
+            printf("Using epoll for network sockets\n");
+    }
+#endif
+
     // Send and receive from sockets, accept connections
     if (!NewThread(ThreadSocketHandler, NULL))
         printf("Error: NewThread(ThreadSocketHandler) failed\n");
@@ -1867,6 +2244,8 @@ bool StopNode()
     if (semOutbound)
         for (int i=0; i<MAX_OUTBOUND_CONNECTIONS; i++)
             semOutbound->post();
+    ThreadScriptCheckQuit();
+    WakeMessageHandler();
     do
     {
         int nThreadsRunning = 0;
@@ -1890,6 +2269,7 @@ bool StopNode()
     if (vnThreadsRunning[THREAD_DNSSEED] > 0) printf("ThreadDNSAddressSeed still running\n");
     if (vnThreadsRunning[THREAD_ADDEDCONNECTIONS] > 0) printf("ThreadOpenAddedConnections still running\n");
     if (vnThreadsRunning[THREAD_DUMPADDRESS] > 0) printf("ThreadDumpAddresses still running\n");
+    if (vnThreadsRunning[THREAD_SCRIPTCHECK] > 0) printf("ThreadScriptCheck still running\n");
     while (vnThreadsRunning[THREAD_MESSAGEHANDLER] > 0 || vnThreadsRunning[THREAD_RPCHANDLER] > 0)
         Sleep(20);
     Sleep(50);
@@ -1913,6 +2293,10 @@ public:
             if (hListenSocket != INVALID_SOCKET)
                 if (closesocket(hListenSocket) == SOCKET_ERROR)
                     printf("closesocket(hListenSocket) failed with error %d\n", WSAGetLastError());
+#ifdef USE_EPOLL
+        if (hEpoll != -1)
+            close(hEpoll);
+#endif
 
 #ifdef WIN32
         // Shutdown Windows Sockets
@@ -41,6 +41,8 @@ unsigned short GetListenPort();
 bool BindListenPort(const CService &bindAddr, std::string& strError=REF(std::string()));
 void StartNode(void* parg);
 bool StopNode();
+/** Have the message handler thread run a round now instead of after its timeout */
+void WakeMessageHandler();
 
 enum
 {
@@ -106,6 +108,7 @@ enum threadId
     THREAD_ADDEDCONNECTIONS,
     THREAD_DUMPADDRESS,
     THREAD_RPCHANDLER,
+    THREAD_SCRIPTCHECK,
 
     THREAD_MAX
 };
@@ -148,6 +151,60 @@ public:
 
 
 
+/** A message being received from a peer.  The header is parsed as soon as
+ * its bytes are in, after which the payload is collected in its own stream.
+ */
+class CNetMessage
+{
+public:
+    bool fInData;
+
+    // header
+    CDataStream hdrbuf;
+    CMessageHeader hdr;
+    unsigned int nHdrPos;
+
+    // payload
+    CDataStream vRecv;
+    unsigned int nDataPos;
+
+    CNetMessage(int nTypeIn, int nVersionIn) : hdrbuf(nTypeIn, nVersionIn), vRecv(nTypeIn, nVersionIn)
+    {
+        hdrbuf.resize(hdrbuf.GetSerializeSize(CMessageHeader()));
+        fInData = false;
+        nHdrPos = 0;
+        nDataPos = 0;
+    }
+
+    bool complete() const
+    {
+        return fInData && hdr.nMessageSize == nDataPos;
+    }
+
+    void SetVersion(int nVersionIn)
+    {
+        hdrbuf.SetVersion(nVersionIn);
+        vRecv.SetVersion(nVersionIn);
+    }
+
+    void swap(CNetMessage& msg)
+    {
+        std::swap(fInData, msg.fInData);
+        hdrbuf.swap(msg.hdrbuf);
+        std::swap(hdr, msg.hdr);
+        std::swap(nHdrPos, msg.nHdrPos);
+        vRecv.swap(msg.vRecv);
+        std::swap(nDataPos, msg.nDataPos);
+    }
+
+    int readHeader(const char* pch, unsigned int nBytes);
+    int readData(const char* pch, unsigned int nBytes);
+};
+
+
+
+
+
 /** Information about a peer */
 class CNode
 {
@@ -156,7 +213,8 @@ public:
     uint64 nServices;
     SOCKET hSocket;
     CDataStream vSend;
-    CDataStream vRecv;
+    std::deque<CNetMessage> vRecvMsg;
+    int nRecvVersion;
     CCriticalSection cs_vSend;
     CCriticalSection cs_vRecv;
     int64 nLastSend;
@@ -177,6 +235,11 @@ public:
     bool fSuccessfullyConnected;
     bool fDisconnect;
     CSemaphoreGrant grantOutbound;
+    // whether hSocket is in the epoll set, and with write interest; protected by cs_vSend
+    bool fPollRegistered;
+    bool fPollSend;
+    // block inventory is waiting that should go out before the next trickle
+    bool fInventoryNow;
 protected:
     int nRefCount;
 
@@ -195,6 +258,10 @@ public:
     uint256 hashLastGetBlocksEnd;
     int nStartingHeight;
 
+    // headers-first block download; protected by cs_main
+    std::set<uint256> setBlocksRequested;
+    int64 nBlocksRequestedTime;
+
     // flood relay
     std::vector<CAddress> vAddrToSend;
     std::set<CAddress> setAddrKnown;
@@ -207,10 +274,11 @@ public:
     CCriticalSection cs_inventory;
     std::multimap<int64, CInv> mapAskFor;
 
-    CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn = "", bool fInboundIn=false) : vSend(SER_NETWORK, MIN_PROTO_VERSION), vRecv(SER_NETWORK, MIN_PROTO_VERSION)
+    CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn = "", bool fInboundIn=false) : vSend(SER_NETWORK, MIN_PROTO_VERSION)
     {
         nServices = 0;
         hSocket = hSocketIn;
+        nRecvVersion = MIN_PROTO_VERSION;
         nLastSend = 0;
         nLastRecv = 0;
         nLastSendEmpty = GetTime();
@@ -227,12 +295,16 @@ public:
         fNetworkNode = false;
         fSuccessfullyConnected = false;
         fDisconnect = false;
+        fPollRegistered = false;
+        fPollSend = false;
+        fInventoryNow = false;
         nRefCount = 0;
         nReleaseTime = 0;
         hashContinue = 0;
         pindexLastGetBlocksBegin = 0;
         hashLastGetBlocksEnd = 0;
         nStartingHeight = -1;
+        nBlocksRequestedTime = 0;
         fGetAddr = false;
         nMisbehavior = 0;
         setInventoryKnown.max_size(SendBufferSize() / 1000);
@@ -244,11 +316,7 @@ public:
 
     ~CNode()
     {
-        if (hSocket != INVALID_SOCKET)
-        {
-            closesocket(hSocket);
-            hSocket = INVALID_SOCKET;
-        }
+        CloseSocket();
     }
 
 private:
@@ -306,7 +374,11 @@ public:
         {
             LOCK(cs_inventory);
             if (!setInventoryKnown.count(inv))
+            {
                 vInventoryToSend.push_back(inv);
+                if (inv.type == MSG_BLOCK)
+                    fInventoryNow = true;
+            }
         }
     }
 
@@ -386,6 +458,7 @@ public:
 
         nHeaderStart = -1;
         nMessageStart = -1;
+        UpdatePollInterest();
         LEAVE_CRITICAL_SECTION(cs_vSend);
     }
 
@@ -614,7 +687,25 @@ public:
     bool IsSubscribed(unsigned int nChannel);
     void Subscribe(unsigned int nChannel, unsigned int nHops=0);
     void CancelSubscribe(unsigned int nChannel);
+    void CloseSocket();
     void CloseSocketDisconnect();
+    void UpdatePollInterest();
+
+    // Receive buffer; the caller must hold cs_vRecv for these
+    bool ReceiveMsgBytes(const char* pch, unsigned int nBytes);
+    bool HasMessageReady() const
+    {
+        return !vRecvMsg.empty() && vRecvMsg.front().complete();
+    }
+    unsigned int GetTotalRecvSize() const
+    {
+        unsigned int nTotal = 0;
+        BOOST_FOREACH(const CNetMessage& msg, vRecvMsg)
+            nTotal += msg.nHdrPos + msg.nDataPos;
+        return nTotal;
+    }
+
+    void SetRecvVersion(int nVersionIn);
     void Cleanup();
 
 
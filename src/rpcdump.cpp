@@ -61,9 +61,17 @@ Value importprivkey(const Array& params, bool fHelp)
 
         if (!pwalletMain->AddKey(key))
             throw JSONRPCError(RPC_WALLET_ERROR, "Error adding key to wallet");
+    }
 
+    // The wallet stays usable while the chain is searched for the key.
+    // Imports running at the same time take turns.
+    {
+        LOCK(pwalletMain->cs_rescan);
         pwalletMain->ScanForWalletTransactions(pindexGenesisBlock, true);
-        pwalletMain->ReacceptWalletTransactions();
+        {
+            LOCK(cs_main);
+            pwalletMain->ReacceptWalletTransactions();
+        }
     }
 
     return Value::null;
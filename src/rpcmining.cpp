@@ -85,6 +85,25 @@ Value getmininginfo(const Array& params, bool fHelp)
 }
 
 
+// Work handed out by getwork, by merkle root.  Units of the current block
+// template share it and only carry their own coinbase scriptSig.
+class CGetWorkUnit
+{
+public:
+    boost::shared_ptr<CBlock> pblock;
+    CScript scriptSig;
+};
+
+// Oldest units are dropped beyond this; miners submit within seconds
+static const unsigned int MAX_GETWORK_UNITS = 10000;
+
+static CCriticalSection cs_getwork;
+static map<uint256, CGetWorkUnit> mapGetWork;
+static deque<uint256> queueGetWork;
+static boost::shared_ptr<CBlock> pGetWorkBlock;
+static vector<uint256> vGetWorkBranch;
+static unsigned int nGetWorkExtraNonce = 0;
+
 Value getwork(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() > 1)
@@ -97,34 +116,37 @@ Value getwork(const Array& params, bool fHelp)
             "  \"target\" : little endian hash target\n"
             "If [data] is specified, tries to solve the block and returns true if it was successful.");
 
-    if (vNodes.empty())
-        throw JSONRPCError(RPC_CLIENT_NOT_CONNECTED, "Xcoin is not connected!");
+    // Runs unlocked, so that handing out work for the current template
+    // doesn't wait on block processing
+    {
+        LOCK(cs_main);
+        if (vNodes.empty())
+            throw JSONRPCError(RPC_CLIENT_NOT_CONNECTED, "Xcoin is not connected!");
 
-    if (IsInitialBlockDownload())
-        throw JSONRPCError(RPC_CLIENT_IN_INITIAL_DOWNLOAD, "Xcoin is downloading blocks...");
+        if (IsInitialBlockDownload())
+            throw JSONRPCError(RPC_CLIENT_IN_INITIAL_DOWNLOAD, "Xcoin is downloading blocks...");
+    }
 
-    typedef map<uint256, pair<CBlock*, CScript> > mapNewBlock_t;
-    static mapNewBlock_t mapNewBlock;    // FIXME: thread safety
-    static vector<CBlock*> vNewBlock;
     static CReserveKey reservekey(pwalletMain);
 
     if (params.size() == 0)
     {
+        LOCK(cs_getwork);
+
         // Update block
         static unsigned int nTransactionsUpdatedLast;
         static CBlockIndex* pindexPrev;
         static int64 nStart;
-        static CBlock* pblock;
         if (pindexPrev != pindexBest ||
             (nTransactionsUpdated != nTransactionsUpdatedLast && GetTime() - nStart > 60))
         {
+            LOCK2(cs_main, pwalletMain->cs_wallet);
             if (pindexPrev != pindexBest)
             {
-                // Deallocate old blocks since they're obsolete now
-                mapNewBlock.clear();
-                BOOST_FOREACH(CBlock* pblock, vNewBlock)
-                    delete pblock;
-                vNewBlock.clear();
+                // Work on the old tip is obsolete now
+                mapGetWork.clear();
+                queueGetWork.clear();
+                nGetWorkExtraNonce = 0;
             }
 
             // Clear pindexPrev so future getworks make a new block, despite any failures from here on
@@ -136,33 +158,50 @@ Value getwork(const Array& params, bool fHelp)
             nStart = GetTime();
 
             // Create new block
-            pblock = CreateNewBlock(reservekey);
+            CBlock* pblock = CreateNewBlock(reservekey);
             if (!pblock)
                 throw JSONRPCError(RPC_OUT_OF_MEMORY, "Out of memory");
-            vNewBlock.push_back(pblock);
+            pGetWorkBlock.reset(pblock);
+            vGetWorkBranch = pblock->GetMerkleBranch(0);
 
             // Need to update only after we know CreateNewBlock succeeded
             pindexPrev = pindexPrevNew;
         }
 
-        // Update nTime
-        pblock->UpdateTime(pindexPrev);
-        pblock->nNonce = 0;
+        // New work only differs from the template in the coinbase, so the
+        // merkle root follows from the coinbase hash and its branch
+        CTransaction txCoinbase = pGetWorkBlock->vtx[0];
+        txCoinbase.vin[0].scriptSig = GetCoinbaseScriptSig(pindexPrev->nHeight+1, ++nGetWorkExtraNonce);
+
+        CBlock block;
+        block.nVersion       = pGetWorkBlock->nVersion;
+        block.hashPrevBlock  = pGetWorkBlock->hashPrevBlock;
+        block.hashMerkleRoot = CBlock::CheckMerkleBranch(txCoinbase.GetHash(), vGetWorkBranch, 0);
+        block.nTime          = pGetWorkBlock->nTime;
+        block.nBits          = pGetWorkBlock->nBits;
+        block.nNonce         = 0;
 
-        // Update nExtraNonce
-        static unsigned int nExtraNonce = 0;
-        IncrementExtraNonce(pblock, pindexPrev, nExtraNonce);
+        // Update nTime
+        block.UpdateTime(pindexPrev);
 
         // Save
-        mapNewBlock[pblock->hashMerkleRoot] = make_pair(pblock, pblock->vtx[0].vin[0].scriptSig);
+        CGetWorkUnit& work = mapGetWork[block.hashMerkleRoot];
+        work.pblock = pGetWorkBlock;
+        work.scriptSig = txCoinbase.vin[0].scriptSig;
+        queueGetWork.push_back(block.hashMerkleRoot);
+        while (queueGetWork.size() > MAX_GETWORK_UNITS)
+        {
+            mapGetWork.erase(queueGetWork.front());
+            queueGetWork.pop_front();
+        }
 
         // Pre-build hash buffers
         char pmidstate[32];
         char pdata[128];
         char phash1[64];
-        FormatHashBuffers(pblock, pmidstate, pdata, phash1);
+        FormatHashBuffers(&block, pmidstate, pdata, phash1);
 
-        uint256 hashTarget = CBigNum().SetCompact(pblock->nBits).getuint256();
+        uint256 hashTarget = CBigNum().SetCompact(block.nBits).getuint256();
 
         Object result;
         result.push_back(Pair("midstate", HexStr(BEGIN(pmidstate), END(pmidstate)))); // deprecated
@@ -184,20 +223,50 @@ Value getwork(const Array& params, bool fHelp)
             ((unsigned int*)pdata)[i] = ByteReverse(((unsigned int*)pdata)[i]);
 
         // Get saved block
-        if (!mapNewBlock.count(pdata->hashMerkleRoot))
-            return false;
-        CBlock* pblock = mapNewBlock[pdata->hashMerkleRoot].first;
+        CBlock block;
+        {
+            LOCK(cs_getwork);
+            map<uint256, CGetWorkUnit>::iterator mi = mapGetWork.find(pdata->hashMerkleRoot);
+            if (mi == mapGetWork.end())
+                return false;
+            block = *(*mi).second.pblock;
+            block.vtx[0].vin[0].scriptSig = (*mi).second.scriptSig;
+        }
 
-        pblock->nTime = pdata->nTime;
-        pblock->nNonce = pdata->nNonce;
-        pblock->vtx[0].vin[0].scriptSig = mapNewBlock[pdata->hashMerkleRoot].second;
-        pblock->hashMerkleRoot = pblock->BuildMerkleTree();
+        block.nTime = pdata->nTime;
+        block.nBits = pdata->nBits;
+        block.nNonce = pdata->nNonce;
+        block.hashMerkleRoot = block.BuildMerkleTree();
 
-        return CheckWork(pblock, *pwalletMain, reservekey);
+        return CheckWork(&block, *pwalletMain, reservekey);
     }
 }
 
 
+// Long polls hold an RPC worker for as long as they wait, so at least one
+// worker is always left free for other calls
+static CCriticalSection cs_nLongPolls;
+static int nLongPolls = 0;
+
+class CLongPollSlot
+{
+public:
+    CLongPollSlot()
+    {
+        int nMaxLongPolls = max((int)GetArg("-rpcthreads", 4), 1) - 1;
+        LOCK(cs_nLongPolls);
+        if (nLongPolls >= nMaxLongPolls)
+            throw JSONRPCError(RPC_MISC_ERROR, "Too many long polls in progress, try again later");
+        nLongPolls++;
+    }
+
+    ~CLongPollSlot()
+    {
+        LOCK(cs_nLongPolls);
+        nLongPolls--;
+    }
+};
+
 Value getblocktemplate(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() > 1)
@@ -219,9 +288,11 @@ Value getblocktemplate(const Array& params, bool fHelp)
             "  \"sizelimit\" : limit of block size\n"
             "  \"bits\" : compressed target of next block\n"
             "  \"height\" : height of the next block\n"
+            "  \"longpollid\" : pass this in [params] to wait until the template would change\n"
             "See https://en.bitcoin.it/wiki/BIP_0022 for full specification.");
 
     std::string strMode = "template";
+    Value lpval = Value::null;
     if (params.size() > 0)
     {
         const Object& oparam = params[0].get_obj();
@@ -234,11 +305,34 @@ Value getblocktemplate(const Array& params, bool fHelp)
         }
         else
             throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid mode");
+        lpval = find_value(oparam, "longpollid");
     }
 
     if (strMode != "template")
         throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid mode");
 
+    // Long polling: hold the reply, without any locks, until the best
+    // block changes, or until the memory pool has changed and a minute
+    // has passed
+    if (lpval.type() != null_type)
+    {
+        if (lpval.type() != str_type || lpval.get_str().size() < 64)
+            throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid longpollid");
+        uint256 hashWatched;
+        hashWatched.SetHex(lpval.get_str().substr(0, 64));
+        unsigned int nTransactionsUpdatedWatched = atoi64(lpval.get_str().substr(64));
+
+        CLongPollSlot slot;
+        int64 nStart = GetTime();
+        while (!WaitForBlockChange(hashWatched, 10000) && !fShutdown)
+            if (nTransactionsUpdated != nTransactionsUpdatedWatched && GetTime() - nStart >= 60)
+                break;
+        if (fShutdown)
+            throw JSONRPCError(RPC_CLIENT_NOT_CONNECTED, "Shutting down");
+    }
+
+    LOCK2(cs_main, pwalletMain->cs_wallet);
+
     if (vNodes.empty())
         throw JSONRPCError(RPC_CLIENT_NOT_CONNECTED, "Xcoin is not connected!");
 
@@ -247,11 +341,15 @@ Value getblocktemplate(const Array& params, bool fHelp)
 
     static CReserveKey reservekey(pwalletMain);
 
-    // Update block
+    // Update block.  The parts of the reply that only change with the
+    // block are built once and shared by every caller until then.
     static unsigned int nTransactionsUpdatedLast;
     static CBlockIndex* pindexPrev;
     static int64 nStart;
     static CBlock* pblock;
+    static Array transactions;
+    static Array aBudget;
+    static string strLongPollId;
     if (pindexPrev != pindexBest ||
         (nTransactionsUpdated != nTransactionsUpdatedLast && GetTime() - nStart > 5))
     {
@@ -273,58 +371,71 @@ Value getblocktemplate(const Array& params, bool fHelp)
         if (!pblock)
             throw JSONRPCError(RPC_OUT_OF_MEMORY, "Out of memory");
 
-        // Need to update only after we know CreateNewBlock succeeded
-        pindexPrev = pindexPrevNew;
-    }
-
-    // Update nTime
-    pblock->UpdateTime(pindexPrev);
-    pblock->nNonce = 0;
-
-    Array transactions;
-    map<uint256, int64_t> setTxIndex;
-    int i = 0;
-    CTxDB txdb("r");
-    BOOST_FOREACH (CTransaction& tx, pblock->vtx)
-    {
-        uint256 txHash = tx.GetHash();
-        setTxIndex[txHash] = i++;
+        transactions.clear();
+        map<uint256, int64_t> setTxIndex;
+        int i = 0;
+        CTxDB txdb("r");
+        BOOST_FOREACH (CTransaction& tx, pblock->vtx)
+        {
+            uint256 txHash = tx.GetHash();
+            setTxIndex[txHash] = i++;
 
-        if (tx.IsCoinBase())
-            continue;
+            if (tx.IsCoinBase())
+                continue;
 
-        Object entry;
+            Object entry;
 
-        CDataStream ssTx(SER_NETWORK, PROTOCOL_VERSION);
-        ssTx << tx;
-        entry.push_back(Pair("data", HexStr(ssTx.begin(), ssTx.end())));
+            CDataStream ssTx(SER_NETWORK, PROTOCOL_VERSION);
+            ssTx << tx;
+            entry.push_back(Pair("data", HexStr(ssTx.begin(), ssTx.end())));
 
-        entry.push_back(Pair("hash", txHash.GetHex()));
+            entry.push_back(Pair("hash", txHash.GetHex()));
 
-        MapPrevTx mapInputs;
-        map<uint256, CTxIndex> mapUnused;
-        bool fInvalid = false;
-        if (tx.FetchInputs(txdb, mapUnused, false, false, mapInputs, fInvalid))
-        {
-            mpq nFee = tx.GetValueIn(mapInputs) - tx.GetValueOut();
-            entry.push_back(Pair("fee", FormatMoney(nFee)));
-
-            Array deps;
-            BOOST_FOREACH (MapPrevTx::value_type& inp, mapInputs)
+            MapPrevTx mapInputs;
+            map<uint256, CTxIndex> mapUnused;
+            bool fInvalid = false;
+            if (tx.FetchInputs(txdb, mapUnused, false, false, mapInputs, fInvalid))
             {
-                if (setTxIndex.count(inp.first))
-                    deps.push_back(setTxIndex[inp.first]);
+                mpq nFee = tx.GetValueIn(mapInputs) - tx.GetValueOut();
+                entry.push_back(Pair("fee", FormatMoney(nFee)));
+
+                Array deps;
+                BOOST_FOREACH (MapPrevTx::value_type& inp, mapInputs)
+                {
+                    if (setTxIndex.count(inp.first))
+                        deps.push_back(setTxIndex[inp.first]);
+                }
+                entry.push_back(Pair("depends", deps));
+
+                int64_t nSigOps = tx.GetLegacySigOpCount();
+                nSigOps += tx.GetP2SHSigOpCount(mapInputs);
+                entry.push_back(Pair("sigops", nSigOps));
             }
-            entry.push_back(Pair("depends", deps));
 
-            int64_t nSigOps = tx.GetLegacySigOpCount();
-            nSigOps += tx.GetP2SHSigOpCount(mapInputs);
-            entry.push_back(Pair("sigops", nSigOps));
+            transactions.push_back(entry);
+        }
+
+        aBudget.clear();
+        BOOST_FOREACH(const CTxOut& txout, pblock->vtx[0].vout) {
+            if ( txout != pblock->vtx[0].vout[0] ) {
+                Object entry, script;
+                ScriptPubKeyToJSON(txout.scriptPubKey, script);
+                entry.push_back(Pair("scriptPubKey", script));
+                entry.push_back(Pair("value", (int64_t)txout.nValue));
+                aBudget.push_back(entry);
+            }
         }
 
-        transactions.push_back(entry);
+        strLongPollId = pindexPrevNew->GetBlockHash().GetHex() + strprintf("%u", nTransactionsUpdatedLast);
+
+        // Need to update only after we know CreateNewBlock succeeded
+        pindexPrev = pindexPrevNew;
     }
 
+    // Update nTime
+    pblock->UpdateTime(pindexPrev);
+    pblock->nNonce = 0;
+
     Object aux;
     aux.push_back(Pair("flags", HexStr(COINBASE_FLAGS.begin(), COINBASE_FLAGS.end())));
 
@@ -343,18 +454,9 @@ Value getblocktemplate(const Array& params, bool fHelp)
     result.push_back(Pair("previousblockhash", pblock->hashPrevBlock.GetHex()));
     result.push_back(Pair("transactions", transactions));
     result.push_back(Pair("coinbaseaux", aux));
-    Array aBudget;
-    BOOST_FOREACH(const CTxOut& txout, pblock->vtx[0].vout) {
-        if ( txout != pblock->vtx[0].vout[0] ) {
-            Object entry, script;
-            ScriptPubKeyToJSON(txout.scriptPubKey, script);
-            entry.push_back(Pair("scriptPubKey", script));
-            entry.push_back(Pair("value", (int64_t)txout.nValue));
-            aBudget.push_back(entry);
-        }
-    }
     result.push_back(Pair("coinbasevalue", (int64_t)pblock->vtx[0].vout[0].nValue));
     result.push_back(Pair("budget", aBudget));
+    result.push_back(Pair("longpollid", strLongPollId));
     result.push_back(Pair("target", hashTarget.GetHex()));
     result.push_back(Pair("mintime", (int64_t)pindexPrev->GetMedianTimePast()+1));
     result.push_back(Pair("mutable", aMutable));
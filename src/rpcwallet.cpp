@@ -1154,11 +1154,7 @@ Value listsinceblock(const Array& params, bool fHelp)
     {
         int target_height = pindexBest->nHeight + 1 - target_confirms;
 
-        CBlockIndex *block;
-        for (block = pindexBest;
-             block && block->nHeight > target_height;
-             block = block->pprev)  { }
-
+        CBlockIndex *block = FindBlockByHeight(max(target_height, 0));
         lastblock = block ? block->GetBlockHash() : 0;
     }
 
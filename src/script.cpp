@@ -16,7 +16,8 @@ using namespace boost;
 #include "sync.h"
 #include "util.h"
 
-bool CheckSig(vector<unsigned char> vchSig, vector<unsigned char> vchPubKey, CScript scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType);
+bool CheckSig(vector<unsigned char> vchSig, vector<unsigned char> vchPubKey, CScript scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType,
+              const CSignatureHashContext* psighashctx);
 
 
 
@@ -253,7 +254,8 @@ const char* GetOpName(opcodetype opcode)
     }
 }
 
-bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, const CTransaction& txTo, unsigned int nIn, int nHashType)
+bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, const CTransaction& txTo, unsigned int nIn, int nHashType,
+                const CSignatureHashContext* psighashctx)
 {
     CAutoBN_CTX pctx;
     CScript::const_iterator pc = script.begin();
@@ -944,7 +946,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // Drop the signature, since there's no way for a signature to sign itself
                     scriptCode.FindAndDelete(CScript(vchSig));
 
-                    bool fSuccess = CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType);
+                    bool fSuccess = CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType, psighashctx);
 
                     popstack(stack);
                     popstack(stack);
@@ -1004,7 +1006,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                         valtype& vchPubKey = stacktop(-ikey);
 
                         // Check signature
-                        if (CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType))
+                        if (CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType, psighashctx))
                         {
                             isig++;
                             nSigsCount--;
@@ -1123,6 +1125,90 @@ uint256 SignatureHash(CScript scriptCode, const CTransaction& txTo, unsigned int
     return Hash(ss.begin(), ss.end());
 }
 
+// prevout, empty scriptSig and nSequence
+static const unsigned int BLANK_TXIN_SIZE = 36 + 1 + 4;
+
+CSignatureHashContext::CSignatureHashContext(const CTransaction& txToIn) : ptxTo(&txToIn)
+{
+    const CTransaction& txTo = *ptxTo;
+
+    CDataStream ss(SER_GETHASH, 0);
+    ss << txTo.nVersion;
+    SHA256_Init(&ctxVersion);
+    SHA256_Update(&ctxVersion, &ss[0], ss.size());
+
+    ss.clear();
+    WriteCompactSize(ss, txTo.vin.size());
+    SHA256_CTX ctx = ctxVersion;
+    SHA256_Update(&ctx, &ss[0], ss.size());
+
+    ss.clear();
+    ss.reserve(txTo.vin.size() * BLANK_TXIN_SIZE);
+    vMidstate.reserve(txTo.vin.size());
+    BOOST_FOREACH(const CTxIn& txin, txTo.vin)
+    {
+        vMidstate.push_back(ctx);
+        unsigned int nPos = ss.size();
+        ss << txin.prevout << CScript() << txin.nSequence;
+        SHA256_Update(&ctx, &ss[nPos], BLANK_TXIN_SIZE);
+    }
+    vchBlankInputs.assign(ss.begin(), ss.end());
+
+    ss.clear();
+    ss << txTo.vout << txTo.nLockTime;
+    if (txTo.nVersion == 2)
+        ss << txTo.nRefHeight;
+    vchSuffix.assign(ss.begin(), ss.end());
+}
+
+uint256 CSignatureHashContext::SignatureHash(CScript scriptCode, unsigned int nIn, int nHashType) const
+{
+    // SIGHASH_NONE and SIGHASH_SINGLE rewrite the other inputs and the outputs
+    if ((nHashType & 0x1f) == SIGHASH_NONE || (nHashType & 0x1f) == SIGHASH_SINGLE)
+        return ::SignatureHash(scriptCode, *ptxTo, nIn, nHashType);
+
+    if (nIn >= vMidstate.size())
+    {
+        printf("ERROR: SignatureHash() : nIn=%d out of range\n", nIn);
+        return 1;
+    }
+
+    scriptCode.FindAndDelete(CScript(OP_CODESEPARATOR));
+
+    const unsigned char* pblank = &vchBlankInputs[nIn * BLANK_TXIN_SIZE];
+    CDataStream ss(SER_GETHASH, 0);
+    ss.reserve(scriptCode.size() + 5);
+    ss << scriptCode;
+
+    SHA256_CTX ctx;
+    if (nHashType & SIGHASH_ANYONECANPAY)
+    {
+        // The signed input is the only one
+        const unsigned char nCount = 1;
+        ctx = ctxVersion;
+        SHA256_Update(&ctx, &nCount, 1);
+    }
+    else
+        ctx = vMidstate[nIn];
+    SHA256_Update(&ctx, pblank, 36);
+    SHA256_Update(&ctx, &ss[0], ss.size());
+    SHA256_Update(&ctx, pblank + 37, 4);
+    if (!(nHashType & SIGHASH_ANYONECANPAY) && nIn + 1 < vMidstate.size())
+        SHA256_Update(&ctx, pblank + BLANK_TXIN_SIZE, (vMidstate.size() - nIn - 1) * BLANK_TXIN_SIZE);
+    if (!vchSuffix.empty())
+        SHA256_Update(&ctx, &vchSuffix[0], vchSuffix.size());
+
+    ss.clear();
+    ss << nHashType;
+    SHA256_Update(&ctx, &ss[0], ss.size());
+
+    uint256 hash1;
+    SHA256_Final((unsigned char*)&hash1, &ctx);
+    uint256 hash2;
+    SHA256((unsigned char*)&hash1, sizeof(hash1), (unsigned char*)&hash2);
+    return hash2;
+}
+
 
 // Valid signature cache, to avoid doing expensive ECDSA signature checking
 // twice for every transaction (once when accepted into memory pool, and
@@ -1181,7 +1267,7 @@ public:
 };
 
 bool CheckSig(vector<unsigned char> vchSig, vector<unsigned char> vchPubKey, CScript scriptCode,
-              const CTransaction& txTo, unsigned int nIn, int nHashType)
+              const CTransaction& txTo, unsigned int nIn, int nHashType, const CSignatureHashContext* psighashctx)
 {
     static CSignatureCache signatureCache;
 
@@ -1194,7 +1280,8 @@ bool CheckSig(vector<unsigned char> vchSig, vector<unsigned char> vchPubKey, CSc
         return false;
     vchSig.pop_back();
 
-    uint256 sighash = SignatureHash(scriptCode, txTo, nIn, nHashType);
+    uint256 sighash = psighashctx ? psighashctx->SignatureHash(scriptCode, nIn, nHashType)
+                                  : SignatureHash(scriptCode, txTo, nIn, nHashType);
 
     if (signatureCache.Get(sighash, vchSig, vchPubKey))
         return true;
@@ -1572,14 +1659,14 @@ bool ExtractDestinations(const CScript& scriptPubKey, txnouttype& typeRet, vecto
 }
 
 bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const CTransaction& txTo, unsigned int nIn,
-                  bool fValidatePayToScriptHash, int nHashType)
+                  bool fValidatePayToScriptHash, int nHashType, const CSignatureHashContext* psighashctx)
 {
     vector<vector<unsigned char> > stack, stackCopy;
-    if (!EvalScript(stack, scriptSig, txTo, nIn, nHashType))
+    if (!EvalScript(stack, scriptSig, txTo, nIn, nHashType, psighashctx))
         return false;
     if (fValidatePayToScriptHash)
         stackCopy = stack;
-    if (!EvalScript(stack, scriptPubKey, txTo, nIn, nHashType))
+    if (!EvalScript(stack, scriptPubKey, txTo, nIn, nHashType, psighashctx))
         return false;
     if (stack.empty())
         return false;
@@ -1597,7 +1684,7 @@ bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const C
         CScript pubKey2(pubKeySerialized.begin(), pubKeySerialized.end());
         popstack(stackCopy);
 
-        if (!EvalScript(stackCopy, pubKey2, txTo, nIn, nHashType))
+        if (!EvalScript(stackCopy, pubKey2, txTo, nIn, nHashType, psighashctx))
             return false;
         if (stackCopy.empty())
             return false;
@@ -1608,14 +1695,17 @@ bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const C
 }
 
 
-bool SignSignature(const CKeyStore &keystore, const CScript& fromPubKey, CTransaction& txTo, unsigned int nIn, int nHashType)
+bool SignSignature(const CKeyStore &keystore, const CScript& fromPubKey, CTransaction& txTo, unsigned int nIn, int nHashType,
+                   const CSignatureHashContext* psighashctx)
 {
     assert(nIn < txTo.vin.size());
     CTxIn& txin = txTo.vin[nIn];
+    txTo.InvalidateHash();
 
     // Leave out the signature from the hash, since a signature can't sign itself.
     // The checksig op will also drop the signatures from its hash.
-    uint256 hash = SignatureHash(fromPubKey, txTo, nIn, nHashType);
+    uint256 hash = psighashctx ? psighashctx->SignatureHash(fromPubKey, nIn, nHashType)
+                               : SignatureHash(fromPubKey, txTo, nIn, nHashType);
 
     txnouttype whichType;
     if (!Solver(keystore, fromPubKey, hash, nHashType, txin.scriptSig, whichType))
@@ -1629,7 +1719,8 @@ bool SignSignature(const CKeyStore &keystore, const CScript& fromPubKey, CTransa
         CScript subscript = txin.scriptSig;
 
         // Recompute txn hash using subscript in place of scriptPubKey:
-        uint256 hash2 = SignatureHash(subscript, txTo, nIn, nHashType);
+        uint256 hash2 = psighashctx ? psighashctx->SignatureHash(subscript, nIn, nHashType)
+                                    : SignatureHash(subscript, txTo, nIn, nHashType);
 
         txnouttype subType;
         bool fSolved =
@@ -1640,20 +1731,22 @@ bool SignSignature(const CKeyStore &keystore, const CScript& fromPubKey, CTransa
     }
 
     // Test solution
-    return VerifyScript(txin.scriptSig, fromPubKey, txTo, nIn, true, 0);
+    return VerifyScript(txin.scriptSig, fromPubKey, txTo, nIn, true, 0, psighashctx);
 }
 
-bool SignSignature(const CKeyStore &keystore, const CTransaction& txFrom, CTransaction& txTo, unsigned int nIn, int nHashType)
+bool SignSignature(const CKeyStore &keystore, const CTransaction& txFrom, CTransaction& txTo, unsigned int nIn, int nHashType,
+                   const CSignatureHashContext* psighashctx)
 {
     assert(nIn < txTo.vin.size());
     CTxIn& txin = txTo.vin[nIn];
     assert(txin.prevout.n < txFrom.vout.size());
     const CTxOut& txout = txFrom.vout[txin.prevout.n];
 
-    return SignSignature(keystore, txout.scriptPubKey, txTo, nIn, nHashType);
+    return SignSignature(keystore, txout.scriptPubKey, txTo, nIn, nHashType, psighashctx);
 }
 
-bool VerifySignature(const CTransaction& txFrom, const CTransaction& txTo, unsigned int nIn, bool fValidatePayToScriptHash, int nHashType)
+bool VerifySignature(const CTransaction& txFrom, const CTransaction& txTo, unsigned int nIn, bool fValidatePayToScriptHash, int nHashType,
+                     const CSignatureHashContext* psighashctx)
 {
     assert(nIn < txTo.vin.size());
     const CTxIn& txin = txTo.vin[nIn];
@@ -1664,7 +1757,7 @@ bool VerifySignature(const CTransaction& txFrom, const CTransaction& txTo, unsig
     if (txin.prevout.hash != txFrom.GetHash())
         return false;
 
-    return VerifyScript(txin.scriptSig, txout.scriptPubKey, txTo, nIn, fValidatePayToScriptHash, nHashType);
+    return VerifyScript(txin.scriptSig, txout.scriptPubKey, txTo, nIn, fValidatePayToScriptHash, nHashType, psighashctx);
 }
 
 static CScript PushAll(const vector<valtype>& values)
@@ -1705,7 +1798,7 @@ static CScript CombineMultisig(CScript scriptPubKey, const CTransaction& txTo, u
             if (sigs.count(pubkey))
                 continue; // Already got a sig for this pubkey
 
-            if (CheckSig(sig, pubkey, scriptPubKey, txTo, nIn, 0))
+            if (CheckSig(sig, pubkey, scriptPubKey, txTo, nIn, 0, NULL))
             {
                 sigs[pubkey] = sig;
                 break;
@@ -9,6 +9,8 @@
 #include <vector>
 
 #include <boost/foreach.hpp>
+#include <boost/functional/hash.hpp>
+#include <boost/unordered_set.hpp>
 #include <boost/variant.hpp>
 
 #include "keystore.h"
@@ -579,11 +581,48 @@ public:
     }
 };
 
+/** Hash function for unordered containers keyed by CScript */
+struct CScriptHasher
+{
+    size_t operator()(const CScript& script) const { return boost::hash_range(script.begin(), script.end()); }
+};
+
+typedef boost::unordered_set<CScript, CScriptHasher> ScriptSet;
+
 
 
 
 
-bool EvalScript(std::vector<std::vector<unsigned char> >& stack, const CScript& script, const CTransaction& txTo, unsigned int nIn, int nHashType);
+/** Signature hashes of a single transaction, sharing work between its inputs.
+ * The SIGHASH_ALL digests of a transaction differ only in the scriptCode of
+ * the input being signed, so the blanked inputs and the outputs are
+ * serialized once and the SHA256 state ahead of every input is kept.  The
+ * prevouts, sequence numbers, outputs and lock time are captured on
+ * construction; only scriptSigs may change while the context is in use.
+ */
+class CSignatureHashContext
+{
+private:
+    const CTransaction* ptxTo;
+
+    // SHA256 state after nVersion, and after the blanked inputs ahead of each input
+    SHA256_CTX ctxVersion;
+    std::vector<SHA256_CTX> vMidstate;
+
+    // Serialized inputs with empty scriptSigs, and everything after the inputs
+    std::vector<unsigned char> vchBlankInputs;
+    std::vector<unsigned char> vchSuffix;
+
+public:
+    explicit CSignatureHashContext(const CTransaction& txToIn);
+
+    uint256 SignatureHash(CScript scriptCode, unsigned int nIn, int nHashType) const;
+};
+
+
+
+bool EvalScript(std::vector<std::vector<unsigned char> >& stack, const CScript& script, const CTransaction& txTo, unsigned int nIn, int nHashType,
+                const CSignatureHashContext* psighashctx=NULL);
 bool Solver(const CScript& scriptPubKey, txnouttype& typeRet, std::vector<std::vector<unsigned char> >& vSolutionsRet);
 int ScriptSigArgsExpected(txnouttype t, const std::vector<std::vector<unsigned char> >& vSolutions);
 bool IsStandard(const CScript& scriptPubKey);
@@ -591,11 +630,14 @@ bool IsMine(const CKeyStore& keystore, const CScript& scriptPubKey);
 bool IsMine(const CKeyStore& keystore, const CTxDestination &dest);
 bool ExtractDestination(const CScript& scriptPubKey, CTxDestination& addressRet);
 bool ExtractDestinations(const CScript& scriptPubKey, txnouttype& typeRet, std::vector<CTxDestination>& addressRet, int& nRequiredRet);
-bool SignSignature(const CKeyStore& keystore, const CScript& fromPubKey, CTransaction& txTo, unsigned int nIn, int nHashType=SIGHASH_ALL);
-bool SignSignature(const CKeyStore& keystore, const CTransaction& txFrom, CTransaction& txTo, unsigned int nIn, int nHashType=SIGHASH_ALL);
+bool SignSignature(const CKeyStore& keystore, const CScript& fromPubKey, CTransaction& txTo, unsigned int nIn, int nHashType=SIGHASH_ALL,
+                   const CSignatureHashContext* psighashctx=NULL);
+bool SignSignature(const CKeyStore& keystore, const CTransaction& txFrom, CTransaction& txTo, unsigned int nIn, int nHashType=SIGHASH_ALL,
+                   const CSignatureHashContext* psighashctx=NULL);
 bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const CTransaction& txTo, unsigned int nIn,
-                  bool fValidatePayToScriptHash, int nHashType);
-bool VerifySignature(const CTransaction& txFrom, const CTransaction& txTo, unsigned int nIn, bool fValidatePayToScriptHash, int nHashType);
+                  bool fValidatePayToScriptHash, int nHashType, const CSignatureHashContext* psighashctx=NULL);
+bool VerifySignature(const CTransaction& txFrom, const CTransaction& txTo, unsigned int nIn, bool fValidatePayToScriptHash, int nHashType,
+                     const CSignatureHashContext* psighashctx=NULL);
 
 // Given two sets of signatures for scriptPubKey, possibly with OP_0 placeholders,
 // combine them intelligently and return the result.
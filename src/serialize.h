@@ -795,6 +795,16 @@ public:
         return (ret);
     }
 
+    void swap(CDataStream& b)
+    {
+        vch.swap(b.vch);
+        std::swap(nReadPos, b.nReadPos);
+        std::swap(state, b.state);
+        std::swap(exceptmask, b.exceptmask);
+        std::swap(nType, b.nType);
+        std::swap(nVersion, b.nVersion);
+    }
+
     std::string str() const
     {
         return (std::string(begin(), end()));
@@ -1145,4 +1155,45 @@ public:
     }
 };
 
+/** Unserialize-only stream over memory owned by someone else, such as a
+ * mapped file.  Nothing is copied until an object is read out of it.
+ */
+class CMemoryReader
+{
+private:
+    const char* pcur;
+    const char* pend;
+public:
+    int nType;
+    int nVersion;
+
+    CMemoryReader(const char* pbeginIn, const char* pendIn, int nTypeIn, int nVersionIn) :
+        pcur(pbeginIn), pend(pendIn), nType(nTypeIn), nVersion(nVersionIn) {}
+
+    size_t size() const          { return pend - pcur; }
+    bool empty() const           { return pcur == pend; }
+
+    void SetType(int n)          { nType = n; }
+    int GetType()                { return nType; }
+    void SetVersion(int n)       { nVersion = n; }
+    int GetVersion()             { return nVersion; }
+
+    CMemoryReader& read(char* pch, size_t nSize)
+    {
+        if (nSize > size())
+            throw std::ios_base::failure("CMemoryReader::read() : end of data");
+        memcpy(pch, pcur, nSize);
+        pcur += nSize;
+        return (*this);
+    }
+
+    template<typename T>
+    CMemoryReader& operator>>(T& obj)
+    {
+        // Unserialize from this stream
+        ::Unserialize(*this, obj, nType, nVersion);
+        return (*this);
+    }
+};
+
 #endif
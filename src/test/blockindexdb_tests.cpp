@@ -0,0 +1,63 @@
+//
+// Unit tests for the flat block index file, blkindex.idx
+//
+#include <boost/test/unit_test.hpp>
+#include <boost/filesystem.hpp>
+
+#include "db.h"
+#include "main.h"
+#include "util.h"
+
+using namespace std;
+
+// Header and record sizes of the file format
+static const unsigned int nHeaderSize = 8;
+static const unsigned int nRecordSize = 124;
+
+BOOST_AUTO_TEST_SUITE(blockindexdb_tests)
+
+BOOST_AUTO_TEST_CASE(blockindexdb_load_rewrite)
+{
+    boost::filesystem::path pathIndex = GetDataDir() / "blkindex.idx";
+    unsigned int nEntries = mapBlockIndex.size();
+    BOOST_REQUIRE(pindexGenesisBlock != NULL);
+
+    // Rewriting leaves one record per entry
+    BOOST_CHECK(blockindexdb.Rewrite());
+    BOOST_CHECK_EQUAL(boost::filesystem::file_size(pathIndex), nHeaderSize + nRecordSize * nEntries);
+
+    // Loading gives back the same entries
+    CBlockIndex indexGenesis = *pindexGenesisBlock;
+    BOOST_CHECK(blockindexdb.Load());
+    BOOST_CHECK_EQUAL(mapBlockIndex.size(), nEntries);
+    BOOST_CHECK(pindexGenesisBlock->GetBlockHash() == hashGenesisBlock);
+    BOOST_CHECK(pindexGenesisBlock->pprev == NULL);
+    BOOST_CHECK_EQUAL(pindexGenesisBlock->nHeight, indexGenesis.nHeight);
+    BOOST_CHECK_EQUAL(pindexGenesisBlock->nFile, indexGenesis.nFile);
+    BOOST_CHECK_EQUAL(pindexGenesisBlock->nBlockPos, indexGenesis.nBlockPos);
+    BOOST_CHECK(pindexGenesisBlock->hashMerkleRoot == indexGenesis.hashMerkleRoot);
+    BOOST_CHECK_EQUAL(pindexGenesisBlock->nTime, indexGenesis.nTime);
+    BOOST_CHECK_EQUAL(pindexGenesisBlock->nBits, indexGenesis.nBits);
+    BOOST_CHECK_EQUAL(pindexGenesisBlock->nNonce, indexGenesis.nNonce);
+
+    // A record cut short by a crash is dropped on load
+    FILE* file = fopen(pathIndex.string().c_str(), "ab");
+    BOOST_REQUIRE(file);
+    vector<char> vchTorn(nRecordSize / 2, 0);
+    fwrite(&vchTorn[0], 1, vchTorn.size(), file);
+    fclose(file);
+    BOOST_CHECK(blockindexdb.Load());
+    BOOST_CHECK_EQUAL(mapBlockIndex.size(), nEntries);
+    BOOST_CHECK_EQUAL(boost::filesystem::file_size(pathIndex), nHeaderSize + nRecordSize * nEntries);
+
+    // so that appends line up with the records again
+    BOOST_CHECK(blockindexdb.Append(pindexGenesisBlock, true));
+    BOOST_CHECK_EQUAL(boost::filesystem::file_size(pathIndex), nHeaderSize + nRecordSize * (nEntries + 1));
+    BOOST_CHECK(blockindexdb.Load());
+    BOOST_CHECK_EQUAL(mapBlockIndex.size(), nEntries);
+
+    BOOST_CHECK(blockindexdb.Rewrite());
+    BOOST_CHECK_EQUAL(boost::filesystem::file_size(pathIndex), nHeaderSize + nRecordSize * nEntries);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
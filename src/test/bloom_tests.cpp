@@ -0,0 +1,43 @@
+#include <boost/test/unit_test.hpp>
+#include <boost/foreach.hpp>
+
+#include "bloom.h"
+#include "util.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(bloom_tests)
+
+BOOST_AUTO_TEST_CASE(rolling_bloom_filter)
+{
+    CRollingBloomFilter filter(100, 0.01);
+
+    // The last 100 insertions are always remembered
+    vector<uint256> vHashes;
+    for (int i = 0; i < 399; i++)
+    {
+        vHashes.push_back(GetRandHash());
+        filter.insert(vHashes.back());
+        for (int j = max(0, i - 99); j <= i; j++)
+            BOOST_CHECK(filter.contains(vHashes[j]));
+    }
+
+    // Older ones roll off, and random hashes mostly miss
+    int nFirstHits = 0;
+    for (int i = 0; i < 100; i++)
+        if (filter.contains(vHashes[i]))
+            nFirstHits++;
+    BOOST_CHECK(nFirstHits < 10);
+
+    int nRandomHits = 0;
+    for (int i = 0; i < 10000; i++)
+        if (filter.contains(GetRandHash()))
+            nRandomHits++;
+    BOOST_CHECK(nRandomHits < 200);
+
+    filter.reset();
+    BOOST_FOREACH(const uint256& hash, vHashes)
+        BOOST_CHECK(!filter.contains(hash));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,151 @@
+//
+// Unit tests for the coins cache in front of the tx index
+//
+#include <boost/test/unit_test.hpp>
+
+#include "db.h"
+#include "main.h"
+#include "util.h"
+
+using namespace std;
+
+static CTxIndex MakeTxIndex(unsigned int nFile, unsigned int nOutputs, unsigned int nSpent)
+{
+    CTxIndex txindex(CDiskTxPos(nFile, 100, 200), nOutputs);
+    for (unsigned int i = 0; i < nSpent; i++)
+        txindex.vSpent[i] = CDiskTxPos(nFile + 1, 300, 400 + i);
+    return txindex;
+}
+
+BOOST_AUTO_TEST_SUITE(coinscache_tests)
+
+BOOST_AUTO_TEST_CASE(coinscache_evict)
+{
+    CCoinsCache cache;
+    CTxIndex txindex;
+    bool fFound;
+
+    // Dirty entries, then clean ones filled from "disk"
+    for (unsigned int i = 1; i <= 50; i++)
+        cache.SetTxIndex(uint256(i), MakeTxIndex(i, 3, 1), true);
+    for (unsigned int i = 51; i <= 100; i++)
+        cache.FillTxIndex(uint256(i), MakeTxIndex(i, 3, 1));
+    BOOST_CHECK(cache.IsDirty());
+    BOOST_CHECK(!cache.IsFull());
+
+    // Over budget only the clean entries go
+    cache.SetMaxUsage(1);
+    BOOST_CHECK(cache.IsFull());
+    for (unsigned int i = 1; i <= 50; i++)
+    {
+        BOOST_CHECK(cache.GetTxIndex(uint256(i), txindex, fFound));
+        BOOST_CHECK(fFound && txindex == MakeTxIndex(i, 3, 1));
+    }
+    for (unsigned int i = 51; i <= 100; i++)
+        BOOST_CHECK(!cache.GetTxIndex(uint256(i), txindex, fFound));
+
+    // More dirty entries past the budget are kept as well
+    for (unsigned int i = 101; i <= 110; i++)
+        cache.SetTxIndex(uint256(i), MakeTxIndex(i, 2, 0), true);
+    vector<pair<uint256, CTxIndex> > vDirty;
+    uint256 hashBest;
+    cache.GetDirty(vDirty, hashBest);
+    BOOST_CHECK_EQUAL(vDirty.size(), 60U);
+
+    // Once written they may be evicted
+    cache.MarkClean();
+    BOOST_CHECK(!cache.IsDirty());
+    BOOST_CHECK_EQUAL(cache.GetUsage(), 0U);
+    BOOST_CHECK(!cache.GetTxIndex(uint256(1), txindex, fFound));
+}
+
+BOOST_AUTO_TEST_CASE(coinscache_evict_lru)
+{
+    CCoinsCache cache;
+    CTxIndex txindex;
+    bool fFound;
+
+    for (unsigned int i = 1; i <= 4; i++)
+        cache.FillTxIndex(uint256(i), MakeTxIndex(i, 1, 0));
+    size_t nEntryUsage = cache.GetUsage() / 4;
+
+    // Eviction goes down to half the budget, least recently used first;
+    // using the oldest entry keeps it
+    BOOST_CHECK(cache.GetTxIndex(uint256(1), txindex, fFound));
+    cache.SetMaxUsage(nEntryUsage * 3);
+    cache.FillTxIndex(uint256(5), MakeTxIndex(5, 1, 0));
+    BOOST_CHECK(cache.GetTxIndex(uint256(1), txindex, fFound));
+    BOOST_CHECK(cache.GetTxIndex(uint256(5), txindex, fFound));
+    BOOST_CHECK(!cache.GetTxIndex(uint256(2), txindex, fFound));
+    BOOST_CHECK(!cache.GetTxIndex(uint256(3), txindex, fFound));
+    BOOST_CHECK(!cache.GetTxIndex(uint256(4), txindex, fFound));
+}
+
+BOOST_AUTO_TEST_CASE(coinscache_fill)
+{
+    CCoinsCache cache;
+    CTxIndex txindex;
+    bool fFound;
+
+    // Misses are remembered
+    cache.FillTxIndex(uint256(1), CTxIndex());
+    BOOST_CHECK(cache.GetTxIndex(uint256(1), txindex, fFound));
+    BOOST_CHECK(!fFound);
+
+    // A fill from disk doesn't replace a newer index, dirty or written
+    cache.SetTxIndex(uint256(2), MakeTxIndex(2, 2, 1), true);
+    cache.FillTxIndex(uint256(2), MakeTxIndex(2, 2, 0));
+    BOOST_CHECK(cache.GetTxIndex(uint256(2), txindex, fFound));
+    BOOST_CHECK(txindex == MakeTxIndex(2, 2, 1));
+    cache.MarkClean();
+    cache.FillTxIndex(uint256(2), MakeTxIndex(2, 2, 0));
+    BOOST_CHECK(cache.GetTxIndex(uint256(2), txindex, fFound));
+    BOOST_CHECK(txindex == MakeTxIndex(2, 2, 1));
+
+    // A cached transaction doesn't count as an index
+    CTransaction tx;
+    tx.vout.resize(1);
+    cache.SetTx(uint256(3), tx);
+    BOOST_CHECK(!cache.GetTxIndex(uint256(3), txindex, fFound));
+    cache.FillTxIndex(uint256(3), MakeTxIndex(3, 1, 0));
+    BOOST_CHECK(cache.GetTxIndex(uint256(3), txindex, fFound));
+    BOOST_CHECK(fFound && cache.GetTx(uint256(3), tx));
+
+    // Spending every output drops the transaction
+    cache.SetTxIndex(uint256(3), MakeTxIndex(3, 1, 1), true);
+    BOOST_CHECK(!cache.GetTx(uint256(3), tx));
+}
+
+BOOST_AUTO_TEST_CASE(coinscache_flush)
+{
+    CTxDB txdb;
+    CTxIndex txindex;
+    uint256 hashKept(1001), hashErased(1002), hashMissing(1003);
+
+    BOOST_CHECK(txdb.UpdateTxIndex(hashKept, MakeTxIndex(7, 3, 2)));
+    BOOST_CHECK(txdb.UpdateTxIndex(hashErased, MakeTxIndex(8, 1, 0)));
+    BOOST_CHECK(txdb.FlushCoins());
+    BOOST_CHECK(txdb.UpdateTxIndex(hashErased, CTxIndex()));
+    BOOST_CHECK(txdb.FlushCoins());
+    BOOST_CHECK(!coinscache.IsDirty());
+
+    // Empty the cache so that what follows comes off the disk
+    coinscache.SetMaxUsage(0);
+    BOOST_CHECK_EQUAL(coinscache.GetUsage(), 0U);
+    coinscache.SetMaxUsage((size_t)GetArg("-dbcache", 25) << 20);
+
+    BOOST_CHECK(txdb.ReadTxIndex(hashKept, txindex));
+    BOOST_CHECK(txindex == MakeTxIndex(7, 3, 2));
+    BOOST_CHECK(!txdb.ReadTxIndex(hashErased, txindex));
+    BOOST_CHECK(!txdb.ReadTxIndex(hashMissing, txindex));
+
+    // The same again from the cache
+    BOOST_CHECK(txdb.ReadTxIndex(hashKept, txindex));
+    BOOST_CHECK(txindex == MakeTxIndex(7, 3, 2));
+    BOOST_CHECK(!txdb.ReadTxIndex(hashMissing, txindex));
+
+    BOOST_CHECK(txdb.UpdateTxIndex(hashKept, CTxIndex()));
+    BOOST_CHECK(txdb.FlushCoins());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,57 @@
+#include <limits>
+#include <boost/test/unit_test.hpp>
+
+#include "main.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(demurrage_tests)
+
+static void CheckDepth(int nDepth)
+{
+    mpq qExpected = ComputeDemurrageFactor(nDepth);
+    // First lookup fills the cache, the second one is served from it
+    BOOST_CHECK(GetDemurrageFactor(nDepth) == qExpected);
+    BOOST_CHECK(GetDemurrageFactor(nDepth) == qExpected);
+    BOOST_CHECK(GetTimeAdjustedValue(i64_to_mpq(I64_MAX_MONEY), nDepth) == qExpected * i64_to_mpq(I64_MAX_MONEY));
+}
+
+BOOST_AUTO_TEST_CASE(demurrage_factor_identity)
+{
+    BOOST_CHECK(GetDemurrageFactor(0) == 1);
+    BOOST_CHECK(ComputeDemurrageFactor(0) == 1);
+    BOOST_CHECK(GetTimeAdjustedValue(i64_to_mpq(12345), 0) == 12345);
+    BOOST_CHECK(ComputeDemurrageFactor(1) < 1);
+    BOOST_CHECK(ComputeDemurrageFactor(-1) > 1);
+}
+
+BOOST_AUTO_TEST_CASE(demurrage_factor_matches_mpfr)
+{
+    // Every depth a coin can realistically have, in both directions
+    for (int nDepth = -2*COINBASE_MATURITY; nDepth <= 4*EQ_HEIGHT; nDepth += (nDepth < 4096 ? 1 : 97))
+        CheckDepth(nDepth);
+
+    // Powers of two and their neighbours, out to the limits of an int
+    for (int nShift = 0; nShift < 31; nShift++)
+    {
+        int nDepth = (int)(1U << nShift);
+        CheckDepth(nDepth - 1);
+        CheckDepth(nDepth);
+        CheckDepth(-nDepth);
+        if (nShift < 30)
+            CheckDepth(nDepth + 1);
+    }
+    CheckDepth(std::numeric_limits<int>::max());
+    CheckDepth(std::numeric_limits<int>::min() + 1);
+}
+
+BOOST_AUTO_TEST_CASE(demurrage_factor_eviction)
+{
+    // Overflow the cache, then verify early entries were recomputed correctly
+    for (int nDepth = 1; nDepth <= (int)MAX_DEMURRAGE_FACTOR_CACHE + 100; nDepth++)
+        GetDemurrageFactor(nDepth);
+    for (int nDepth = 1; nDepth <= 200; nDepth++)
+        BOOST_CHECK(GetDemurrageFactor(nDepth) == ComputeDemurrageFactor(nDepth));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,125 @@
+//
+// Unit tests for the headers-first block download bookkeeping
+//
+#include <boost/test/unit_test.hpp>
+#include <boost/foreach.hpp>
+
+#include "main.h"
+#include "net.h"
+#include "util.h"
+
+// Tests these internal-to-main.cpp methods:
+extern BlockMap mapHeaderIndex;
+extern std::vector<CBlockIndex*> vHeaderChain;
+extern std::set<uint256> setHeadersInvalid;
+extern std::map<uint256, CBlock*> mapDownloadedBlocks;
+extern std::multimap<uint256, CBlock*> mapDownloadedBlocksByPrev;
+extern CBlockIndex* GetBestHeader();
+extern void SetBestHeader(CBlockIndex* pindex);
+extern void InvalidateHeader(const uint256& hash);
+extern void ScheduleBlockDownloads(CNode* pto, std::vector<CInv>& vGetData);
+
+using namespace std;
+
+// Add a header-only entry on top of pindexPrev with nWork more work
+static CBlockIndex* AddHeader(CBlockIndex* pindexPrev, unsigned int nId, int nWork)
+{
+    CBlockIndex* pindex = new CBlockIndex();
+    BlockMap::iterator mi = mapHeaderIndex.insert(make_pair(uint256(nId), pindex)).first;
+    pindex->phashBlock = &((*mi).first);
+    pindex->pprev = pindexPrev;
+    pindex->nHeight = pindexPrev->nHeight + 1;
+    pindex->bnChainWork = pindexPrev->bnChainWork + nWork;
+    pindex->BuildSkip();
+    return pindex;
+}
+
+static bool OnHeaderChain(CBlockIndex* pindex)
+{
+    return pindex->nHeight < (int)vHeaderChain.size() && vHeaderChain[pindex->nHeight] == pindex;
+}
+
+BOOST_AUTO_TEST_SUITE(headers_tests)
+
+BOOST_AUTO_TEST_CASE(headers_reorg)
+{
+    BOOST_CHECK(pindexBest == pindexGenesisBlock);
+    BOOST_CHECK(GetBestHeader() == pindexBest);
+
+    // Chain a: genesis, a1..a5
+    vector<CBlockIndex*> va(1, pindexGenesisBlock);
+    for (int i = 1; i <= 5; i++)
+        va.push_back(AddHeader(va.back(), 100 + i, 1));
+    SetBestHeader(va[5]);
+    BOOST_CHECK(GetBestHeader() == va[5]);
+    for (int i = 0; i <= 5; i++)
+        BOOST_CHECK(vHeaderChain[i] == va[i]);
+
+    // Chain b forks off a2 and overtakes it
+    vector<CBlockIndex*> vb(va.begin(), va.begin() + 3);
+    for (int i = 3; i <= 6; i++)
+        vb.push_back(AddHeader(vb.back(), 200 + i, i == 3 ? 2 : 1));
+    SetBestHeader(vb[6]);
+    BOOST_CHECK(GetBestHeader() == vb[6]);
+    BOOST_CHECK_EQUAL(vHeaderChain.size(), 7U);
+    for (int i = 0; i <= 6; i++)
+        BOOST_CHECK(vHeaderChain[i] == vb[i]);
+
+    // Reorg back to a shorter chain with more work
+    va.push_back(AddHeader(va[5], 106, 10));
+    SetBestHeader(va[6]);
+    BOOST_CHECK(GetBestHeader() == va[6]);
+    for (int i = 0; i <= 6; i++)
+        BOOST_CHECK(vHeaderChain[i] == va[i]);
+
+    // Invalidating a block off the best chain only marks its descendants
+    InvalidateHeader(vb[4]->GetBlockHash());
+    BOOST_CHECK(setHeadersInvalid.count(vb[4]->GetBlockHash()));
+    BOOST_CHECK(setHeadersInvalid.count(vb[6]->GetBlockHash()));
+    BOOST_CHECK(!setHeadersInvalid.count(vb[3]->GetBlockHash()));
+    BOOST_CHECK(GetBestHeader() == va[6]);
+
+    // Invalidating the best chain falls back to the best valid header
+    InvalidateHeader(va[4]->GetBlockHash());
+    BOOST_CHECK(setHeadersInvalid.count(va[5]->GetBlockHash()));
+    BOOST_CHECK(setHeadersInvalid.count(va[6]->GetBlockHash()));
+    BOOST_CHECK(GetBestHeader() == vb[3]);
+    BOOST_CHECK_EQUAL(vHeaderChain.size(), 4U);
+    BOOST_CHECK(OnHeaderChain(vb[3]) && OnHeaderChain(va[2]));
+
+    // With nothing valid left the block chain is the best header again
+    InvalidateHeader(va[1]->GetBlockHash());
+    BOOST_CHECK(vHeaderChain.empty());
+    BOOST_CHECK(GetBestHeader() == pindexBest);
+    BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapHeaderIndex)
+        BOOST_CHECK(setHeadersInvalid.count(item.first));
+
+    // Caught up: downloaded blocks and header entries are freed
+    CBlock* pblock = new CBlock();
+    pblock->hashPrevBlock = va[1]->GetBlockHash();
+    mapDownloadedBlocks[va[2]->GetBlockHash()] = pblock;
+    mapDownloadedBlocksByPrev.insert(make_pair(pblock->hashPrevBlock, pblock));
+
+    CAddress addr(CService("127.0.0.1", GetDefaultPort()));
+    CNode dummyNode(INVALID_SOCKET, addr, "", true);
+    vector<CInv> vGetData;
+    ScheduleBlockDownloads(&dummyNode, vGetData);
+    BOOST_CHECK(vGetData.empty());
+    BOOST_CHECK(mapHeaderIndex.empty());
+    BOOST_CHECK(mapDownloadedBlocks.empty());
+    BOOST_CHECK(mapDownloadedBlocksByPrev.empty());
+    BOOST_CHECK(GetBestHeader() == pindexBest);
+    setHeadersInvalid.clear();
+}
+
+BOOST_AUTO_TEST_CASE(headers_invalidate_unknown)
+{
+    // A block that never made it into the header index is still remembered
+    uint256 hash(999);
+    InvalidateHeader(hash);
+    BOOST_CHECK(setHeadersInvalid.count(hash));
+    BOOST_CHECK(GetBestHeader() == pindexBest);
+    setHeadersInvalid.clear();
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,183 @@
+#include <boost/test/unit_test.hpp>
+
+#include <boost/filesystem.hpp>
+#include <limits>
+#include <memory>
+
+#include "lsmstore.h"
+#include "util.h"
+
+using namespace std;
+
+namespace fs = boost::filesystem;
+
+static fs::path GetTestDir()
+{
+    fs::path path = fs::temp_directory_path() / strprintf("test_lsmstore_%"PRI64x, GetRand(std::numeric_limits<int64>::max()));
+    fs::remove_all(path);
+    return path;
+}
+
+static string KeyName(int n)
+{
+    return strprintf("key%06d", n);
+}
+
+BOOST_AUTO_TEST_SUITE(lsmstore_tests)
+
+BOOST_AUTO_TEST_CASE(lsmstore_readwrite)
+{
+    fs::path path = GetTestDir();
+    {
+        CLSMStore store(path);
+        BOOST_CHECK(store.Open());
+
+        CKVBatch batch;
+        batch.Write("a", "1");
+        batch.Write("b", "2");
+        batch.Write("c", "3");
+        BOOST_CHECK(store.Write(batch, false));
+
+        batch.clear();
+        batch.Erase("b");
+        batch.Write("c", "4");
+        BOOST_CHECK(store.Write(batch, true));
+
+        string strValue;
+        BOOST_CHECK(store.Read("a", strValue) && strValue == "1");
+        BOOST_CHECK(!store.Read("b", strValue));
+        BOOST_CHECK(store.Read("c", strValue) && strValue == "4");
+        BOOST_CHECK(!store.Exists("d"));
+    }
+
+    // The log is replayed on reopen
+    {
+        CLSMStore store(path);
+        BOOST_CHECK(store.Open());
+        string strValue;
+        BOOST_CHECK(store.Read("a", strValue) && strValue == "1");
+        BOOST_CHECK(!store.Read("b", strValue));
+        BOOST_CHECK(store.Read("c", strValue) && strValue == "4");
+    }
+    fs::remove_all(path);
+}
+
+BOOST_AUTO_TEST_CASE(lsmstore_garbage_log)
+{
+    fs::path path = GetTestDir();
+    {
+        CLSMStore store(path);
+        BOOST_CHECK(store.Open());
+        CKVBatch batch;
+        batch.Write("a", "1");
+        BOOST_CHECK(store.Write(batch, true));
+    }
+
+    // A record claiming more data than the log holds ends the replay
+    int nLogs = 0;
+    for (fs::directory_iterator it(path); it != fs::directory_iterator(); ++it)
+    {
+        if (it->path().extension() != ".log")
+            continue;
+        FILE* file = fopen(it->path().string().c_str(), "ab");
+        BOOST_REQUIRE(file);
+        unsigned int nSize = 0xfffffff0, nChecksum = 0;
+        fwrite(&nSize, sizeof(nSize), 1, file);
+        fwrite(&nChecksum, sizeof(nChecksum), 1, file);
+        fclose(file);
+        nLogs++;
+    }
+    BOOST_CHECK_EQUAL(nLogs, 1);
+    {
+        CLSMStore store(path);
+        BOOST_CHECK(store.Open());
+        string strValue;
+        BOOST_CHECK(store.Read("a", strValue) && strValue == "1");
+    }
+    fs::remove_all(path);
+}
+
+BOOST_AUTO_TEST_CASE(lsmstore_iterate_snapshot)
+{
+    fs::path path = GetTestDir();
+    {
+        CLSMStore store(path, 1024);
+        BOOST_CHECK(store.Open());
+
+        CKVBatch batch;
+        for (int i = 0; i < 100; i++)
+            batch.Write((i % 2 ? "odd" : "even") + KeyName(i), KeyName(i));
+        BOOST_CHECK(store.Write(batch, false));
+
+        boost::shared_ptr<CKVSnapshot> psnapshot = store.GetSnapshot();
+        BOOST_CHECK(psnapshot);
+
+        batch.clear();
+        batch.Erase("odd" + KeyName(1));
+        batch.Write("odd" + KeyName(3), "changed");
+        BOOST_CHECK(store.Write(batch, false));
+
+        // Prefix iteration sees the latest writes
+        int nCount = 0;
+        auto_ptr<CKVIterator> pit(store.NewIterator());
+        for (pit->Seek("odd"); pit->Valid() && pit->GetKey().compare(0, 3, "odd") == 0; pit->Next())
+        {
+            BOOST_CHECK(pit->GetKey() != "odd" + KeyName(1));
+            nCount++;
+        }
+        BOOST_CHECK_EQUAL(nCount, 49);
+
+        // The snapshot doesn't
+        string strValue;
+        BOOST_CHECK(store.Read("odd" + KeyName(1), strValue, psnapshot.get()));
+        BOOST_CHECK(store.Read("odd" + KeyName(3), strValue, psnapshot.get()) && strValue == KeyName(3));
+        BOOST_CHECK(store.Read("odd" + KeyName(3), strValue) && strValue == "changed");
+
+        nCount = 0;
+        string strLast;
+        pit.reset(store.NewIterator(psnapshot.get()));
+        for (pit->Seek(""); pit->Valid(); pit->Next())
+        {
+            BOOST_CHECK(pit->GetKey() > strLast);
+            strLast = pit->GetKey();
+            nCount++;
+        }
+        BOOST_CHECK_EQUAL(nCount, 100);
+    }
+    fs::remove_all(path);
+}
+
+BOOST_AUTO_TEST_CASE(lsmstore_compact)
+{
+    fs::path path = GetTestDir();
+    {
+        // A small in-memory table forces many table files
+        CLSMStore store(path, 4096);
+        BOOST_CHECK(store.Open());
+        for (int i = 0; i < 5000; i++)
+        {
+            CKVBatch batch;
+            batch.Write(KeyName(i), "first");
+            BOOST_CHECK(store.Write(batch, false));
+            batch.clear();
+            batch.Write(KeyName(i), KeyName(i));
+            if (i >= 100)
+                batch.Erase(KeyName(i - 100));
+            BOOST_CHECK(store.Write(batch, false));
+        }
+        BOOST_CHECK(store.Compact());
+        BOOST_CHECK(store.GetTableCount() < 16);
+    }
+    {
+        CLSMStore store(path, 4096);
+        BOOST_CHECK(store.Open());
+        string strValue;
+        for (int i = 0; i < 4900; i++)
+            BOOST_CHECK(!store.Read(KeyName(i), strValue));
+        for (int i = 4900; i < 5000; i++)
+            BOOST_CHECK(store.Read(KeyName(i), strValue) && strValue == KeyName(i));
+    }
+    fs::remove_all(path);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
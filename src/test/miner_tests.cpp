@@ -200,6 +200,89 @@ BOOST_AUTO_TEST_CASE(CreateNewBlock_validity)
 }
 #endif
 
+// A child paying a high fee brings its low-fee parent into the block,
+// ahead of itself and of transactions paying less than the two together
+BOOST_AUTO_TEST_CASE(CreateNewBlock_cpfp)
+{
+    CReserveKey reservekey(pwalletMain);
+    CBlock *pblock;
+
+    // Confirmed coins to spend, known only to the coins cache
+    CTransaction txFund;
+    txFund.vin.resize(1);
+    txFund.vin[0].prevout = COutPoint(uint256(1), 0);
+    txFund.vout.resize(2);
+    for (unsigned int i = 0; i < txFund.vout.size(); i++)
+    {
+        txFund.vout[i].SetInitialValue(COIN);
+        txFund.vout[i].scriptPubKey = CScript() << OP_TRUE;
+    }
+    uint256 hashFund = txFund.GetHash();
+    {
+        CTxDB txdb;
+        txdb.UpdateTxIndex(hashFund, CTxIndex(CDiskTxPos(999, 0, 0), txFund.vout.size()));
+        txdb.CacheTx(hashFund, txFund);
+    }
+
+    CTransaction txParent;
+    txParent.vin.resize(1);
+    txParent.vin[0].prevout = COutPoint(hashFund, 0);
+    txParent.vout.resize(1);
+    txParent.vout[0].SetInitialValue(COIN);
+    txParent.vout[0].scriptPubKey = CScript() << OP_TRUE;
+    uint256 hashParent = txParent.GetHash();
+    mempool.addUnchecked(hashParent, txParent);
+
+    CTransaction txChild(txParent);
+    txChild.vin[0].prevout = COutPoint(hashParent, 0);
+    txChild.vout[0].SetInitialValue(COIN - COIN / 100);
+    uint256 hashChild = txChild.GetHash();
+    mempool.addUnchecked(hashChild, txChild);
+
+    CTransaction txOther(txParent);
+    txOther.vin[0].prevout = COutPoint(hashFund, 1);
+    txOther.vout[0].SetInitialValue(COIN - COIN / 1000);
+    uint256 hashOther = txOther.GetHash();
+    mempool.addUnchecked(hashOther, txOther);
+
+    std::vector<uint256> vPackage;
+    BOOST_CHECK(mempool.GetPackage(hashChild, std::set<uint256>(), vPackage));
+    BOOST_CHECK(vPackage.size() == 2 && vPackage[0] == hashParent && vPackage[1] == hashChild);
+
+    BOOST_CHECK(pblock = CreateNewBlock(reservekey));
+    BOOST_CHECK_EQUAL(pblock->vtx.size(), 4U);
+    if (pblock->vtx.size() == 4)
+    {
+        BOOST_CHECK(pblock->vtx[1].GetHash() == hashParent);
+        BOOST_CHECK(pblock->vtx[2].GetHash() == hashChild);
+        BOOST_CHECK(pblock->vtx[3].GetHash() == hashOther);
+    }
+    delete pblock;
+
+    // Room for one transaction: the parent doesn't go in without its child
+    unsigned int nTxSize = ::GetSerializeSize(txOther, SER_NETWORK, PROTOCOL_VERSION);
+    mapArgs["-blockmaxsize"] = strprintf("%u", 1000 + nTxSize + nTxSize / 2);
+    mapArgs["-blockprioritysize"] = "0";
+    BOOST_CHECK(pblock = CreateNewBlock(reservekey));
+    BOOST_CHECK_EQUAL(pblock->vtx.size(), 2U);
+    if (pblock->vtx.size() == 2)
+        BOOST_CHECK(pblock->vtx[1].GetHash() == hashOther);
+    delete pblock;
+    mapArgs.erase("-blockmaxsize");
+    mapArgs.erase("-blockprioritysize");
+    mempool.clear();
+
+    // Leave no made-up coins in the cache for later tests or the shutdown
+    // flush; a null index drops the cached transaction with it
+    {
+        CTxDB txdb;
+        txdb.EraseTxIndex(txFund);
+        BOOST_CHECK(!txdb.ContainsTx(hashFund));
+        CTransaction txCached;
+        BOOST_CHECK(!coinscache.GetTx(hashFund, txCached));
+    }
+}
+
 BOOST_AUTO_TEST_CASE(sha256transform_equality)
 {
     unsigned int pSHA256InitState[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
@@ -21,7 +21,7 @@ using namespace boost::algorithm;
 
 extern uint256 SignatureHash(CScript scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType);
 extern bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const CTransaction& txTo, unsigned int nIn,
-                         bool fValidatePayToScriptHash, int nHashType);
+                         bool fValidatePayToScriptHash, int nHashType, const CSignatureHashContext* psighashctx);
 
 CScript
 ParseScript(string s)
@@ -442,4 +442,38 @@ BOOST_AUTO_TEST_CASE(script_combineSigs)
     BOOST_CHECK(combined == partial3c);
 }
 
+BOOST_AUTO_TEST_CASE(script_SignatureHashContext)
+{
+    CScript scriptCode = CScript() << OP_DUP << OP_CODESEPARATOR << OP_HASH160 << OP_CODESEPARATOR;
+    for (int nVersion = 1; nVersion <= 2; nVersion++)
+    {
+        CTransaction txTo;
+        txTo.nVersion = nVersion;
+        txTo.vin.resize(3);
+        for (unsigned int i = 0; i < txTo.vin.size(); i++)
+        {
+            txTo.vin[i].prevout.hash = GetRandHash();
+            txTo.vin[i].prevout.n = i;
+            txTo.vin[i].scriptSig = CScript() << OP_1 << i;
+            txTo.vin[i].nSequence = i;
+        }
+        txTo.vout.resize(2);
+        txTo.vout[0].nValue = 11;
+        txTo.vout[0].scriptPubKey = CScript() << OP_2;
+        txTo.vout[1].nValue = 22;
+        txTo.vout[1].scriptPubKey = CScript() << OP_3;
+        txTo.nLockTime = 7;
+        txTo.nRefHeight = 42;
+
+        CSignatureHashContext sighashctx(txTo);
+        for (unsigned int nIn = 0; nIn <= txTo.vin.size(); nIn++)
+            for (int nHashType = 0; nHashType < 0x100; nHashType++)
+                BOOST_CHECK(sighashctx.SignatureHash(scriptCode, nIn, nHashType) == SignatureHash(scriptCode, txTo, nIn, nHashType));
+
+        // Signing one input leaves the digests of the others unchanged
+        txTo.vin[1].scriptSig = CScript() << OP_4;
+        BOOST_CHECK(sighashctx.SignatureHash(scriptCode, 0, SIGHASH_ALL) == SignatureHash(scriptCode, txTo, 0, SIGHASH_ALL));
+    }
+}
+
 BOOST_AUTO_TEST_SUITE_END()
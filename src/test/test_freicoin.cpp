@@ -1,5 +1,7 @@
 #define BOOST_TEST_MODULE Xcoin Test Suite
 #include <boost/test/unit_test.hpp>
+#include <boost/filesystem.hpp>
+#include <limits>
 
 #include "db.h"
 #include "main.h"
@@ -12,10 +14,17 @@ extern bool fPrintToConsole;
 extern void noui_connect();
 
 struct TestingSetup {
+    boost::filesystem::path pathTemp;
     TestingSetup() {
         fPrintToDebugger = true; // don't want to write to debug.log file
         noui_connect();
         bitdb.MakeMock();
+        // The transaction database and block files go to a scratch data
+        // directory, using the default storage engine
+        pathTemp = boost::filesystem::temp_directory_path() / strprintf("test_xcoin_%"PRI64x, GetRand(std::numeric_limits<int64>::max()));
+        boost::filesystem::create_directories(pathTemp);
+        mapArgs["-datadir"] = pathTemp.string();
+        OpenTxDB();
         LoadBlockIndex(true);
         bool fFirstRun;
         pwalletMain = new CWallet("wallet.dat");
@@ -26,7 +35,9 @@ struct TestingSetup {
     {
         delete pwalletMain;
         pwalletMain = NULL;
+        CloseTxDB();
         bitdb.Flush(true);
+        boost::filesystem::remove_all(pathTemp);
     }
 };
 
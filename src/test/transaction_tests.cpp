@@ -261,4 +261,63 @@ BOOST_AUTO_TEST_CASE(test_GetThrow)
     BOOST_CHECK_THROW(t1.GetValueIn(missingInputs), runtime_error);
 }
 
+BOOST_AUTO_TEST_CASE(test_GetHashMemo)
+{
+    CBasicKeyStore keystore;
+    MapPrevTx dummyInputs;
+    std::vector<CTransaction> dummyTransactions = SetupDummyInputs(keystore, dummyInputs);
+
+    // Unserialized transactions memoize their hash
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << dummyTransactions[0];
+    CTransaction tx;
+    ss >> tx;
+    BOOST_CHECK(tx.GetHash() == dummyTransactions[0].GetHash());
+    BOOST_CHECK(tx.GetHash() == SerializeHash(tx));
+
+    // ... which copies share, until modified and invalidated
+    CTransaction txCopy(tx);
+    BOOST_CHECK(txCopy.GetHash() == tx.GetHash());
+    txCopy.nLockTime = 1;
+    txCopy.InvalidateHash();
+    BOOST_CHECK(txCopy.GetHash() == SerializeHash(txCopy));
+    BOOST_CHECK(txCopy.GetHash() != tx.GetHash());
+    txCopy.SetNull();
+    BOOST_CHECK(txCopy.GetHash() == SerializeHash(txCopy));
+
+    // Block hashes follow in-place changes to the header
+    CBlock block;
+    block.vtx.push_back(tx);
+    block.hashMerkleRoot = block.BuildMerkleTree();
+    uint256 hash = block.GetHash();
+    BOOST_CHECK(hash == Hash(BEGIN(block.nVersion), END(block.nNonce)));
+    block.nNonce++;
+    BOOST_CHECK(block.GetHash() != hash);
+    BOOST_CHECK(block.GetHash() == Hash(BEGIN(block.nVersion), END(block.nNonce)));
+}
+
+BOOST_AUTO_TEST_CASE(test_CMemoryReader)
+{
+    CBasicKeyStore keystore;
+    MapPrevTx dummyInputs;
+    std::vector<CTransaction> dummyTransactions = SetupDummyInputs(keystore, dummyInputs);
+
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << dummyTransactions[0] << dummyTransactions[1];
+    std::vector<char> vch(ss.begin(), ss.end());
+
+    // Reads objects back to back, as block files are laid out
+    CMemoryReader reader(&vch[0], &vch[0] + vch.size(), SER_DISK, CLIENT_VERSION);
+    CTransaction tx0, tx1;
+    reader >> tx0 >> tx1;
+    BOOST_CHECK(reader.empty());
+    BOOST_CHECK(tx0 == dummyTransactions[0]);
+    BOOST_CHECK(tx1.GetHash() == dummyTransactions[1].GetHash());
+
+    // ... and never past the end of the buffer
+    CMemoryReader truncated(&vch[0], &vch[0] + vch.size() - 1, SER_DISK, CLIENT_VERSION);
+    truncated >> tx0;
+    BOOST_CHECK_THROW(truncated >> tx1, std::ios_base::failure);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -3,13 +3,6 @@
 #include "main.h"
 #include "wallet.h"
 
-// how many times to run all the tests to have a chance to catch errors that only show up with particular random shuffles
-#define RUN_TESTS 100
-
-// some tests fail 1% of the time due to bad luck.
-// we repeat those tests this many times and only complain if all iterations of the test fail
-#define RANDOM_REPEATS 5
-
 using namespace std;
 
 typedef set<pair<const CWalletTx*,unsigned int> > CoinSet;
@@ -19,21 +12,41 @@ BOOST_AUTO_TEST_SUITE(wallet_tests)
 static CWallet wallet;
 static vector<COutput> vCoins;
 
-static void add_coin(int64 nValue, int nAge = 6*24, bool fIsFromMe = false, int nInput=0)
+// A coin of the wallet's own, for coins sent from the wallet to spend
+static uint256 GetFromMeCoin()
+{
+    static uint256 hash;
+    if (hash == 0)
+    {
+        CKey key;
+        key.MakeNewKey(true);
+        wallet.AddKey(key);
+        CTransaction tx;
+        tx.vout.resize(1);
+        tx.vout[0].SetInitialValue(COIN);
+        tx.vout[0].scriptPubKey.SetDestination(key.GetPubKey().GetID());
+        hash = tx.GetHash();
+        LOCK(wallet.cs_wallet);
+        wallet.mapWallet[hash] = CWalletTx(&wallet, tx);
+    }
+    return hash;
+}
+
+static void add_coin(const mpq& nValue, int nAge = 6*24, bool fIsFromMe = false, int nInput=0)
 {
     static int i;
     CTransaction* tx = new CTransaction;
     tx->nLockTime = i++;        // so all transactions get different hashes
     tx->vout.resize(nInput+1);
     tx->vout[nInput].SetInitialValue(nValue);
-    CWalletTx* wtx = new CWalletTx(&wallet, *tx);
-    delete tx;
     if (fIsFromMe)
     {
-        // IsFromMe() returns (GetDebit() > 0), and GetDebit() is 0 if vin.empty(),
-        // so stop vin being empty, and cache a non-zero Debit to fake out IsFromMe()
-        wtx->vin.resize(1);
+        // IsFromMe() returns (GetDebit() > 0), so spend a coin of the wallet
+        tx->vin.resize(1);
+        tx->vin[0].prevout = COutPoint(GetFromMeCoin(), 0);
     }
+    CWalletTx* wtx = new CWalletTx(&wallet, *tx);
+    delete tx;
     COutput output(wtx, nInput, nAge);
     vCoins.push_back(output);
 }
@@ -51,245 +64,617 @@ static bool equal_sets(CoinSet a, CoinSet b)
     return ret.first == a.end() && ret.second == b.end();
 }
 
-#if 0
 BOOST_AUTO_TEST_CASE(coin_selection_tests)
 {
-    static CoinSet setCoinsRet, setCoinsRet2;
-    static int64 nValueRet;
+    CoinSet setCoinsRet, setCoinsRet2;
+    mpq nValueRet, nValueRet2;
 
-    // test multiple times to allow for differences in the shuffle order
-    for (int i = 0; i < RUN_TESTS; i++)
+    empty_wallet();
+
+    // with an empty wallet we can't even pay one cent
+    BOOST_CHECK(!wallet.SelectCoinsMinConf( 1 * CENT, 1, 6, vCoins, setCoinsRet, nValueRet, nBestHeight));
+
+    add_coin(1*CENT, 4);        // add a new 1 cent coin
+
+    // with a new 1 cent coin, we still can't find a mature 1 cent
+    BOOST_CHECK(!wallet.SelectCoinsMinConf( 1 * CENT, 1, 6, vCoins, setCoinsRet, nValueRet, nBestHeight));
+
+    // but we can find a new 1 cent
+    BOOST_CHECK( wallet.SelectCoinsMinConf( 1 * CENT, 1, 1, vCoins, setCoinsRet, nValueRet, nBestHeight));
+    BOOST_CHECK_EQUAL(nValueRet, 1 * CENT);
+
+    add_coin(2*CENT);           // add a mature 2 cent coin
+
+    // we can't make 3 cents of mature coins
+    BOOST_CHECK(!wallet.SelectCoinsMinConf( 3 * CENT, 1, 6, vCoins, setCoinsRet, nValueRet, nBestHeight));
+
+    // we can make 3 cents of new  coins
+    BOOST_CHECK( wallet.SelectCoinsMinConf( 3 * CENT, 1, 1, vCoins, setCoinsRet, nValueRet, nBestHeight));
+    BOOST_CHECK_EQUAL(nValueRet, 3 * CENT);
+
+    add_coin(5*CENT);           // add a mature 5 cent coin,
+    add_coin(10*CENT, 3, true); // a new 10 cent coin sent from one of our own addresses
+    add_coin(20*CENT);          // and a mature 20 cent coin
+
+    // now we have new: 1+10=11 (of which 10 was self-sent), and mature: 2+5+20=27.  total = 38
+
+    // we can't make 38 cents only if we disallow new coins:
+    BOOST_CHECK(!wallet.SelectCoinsMinConf(38 * CENT, 1, 6, vCoins, setCoinsRet, nValueRet, nBestHeight));
+    // we can't even make 37 cents if we don't allow new coins even if they're from us
+    BOOST_CHECK(!wallet.SelectCoinsMinConf(38 * CENT, 6, 6, vCoins, setCoinsRet, nValueRet, nBestHeight));
+    // but we can make 37 cents if we accept new coins from ourself
+    BOOST_CHECK( wallet.SelectCoinsMinConf(37 * CENT, 1, 6, vCoins, setCoinsRet, nValueRet, nBestHeight));
+    BOOST_CHECK_EQUAL(nValueRet, 37 * CENT);
+    // and we can make 38 cents if we accept all new coins
+    BOOST_CHECK( wallet.SelectCoinsMinConf(38 * CENT, 1, 1, vCoins, setCoinsRet, nValueRet, nBestHeight));
+    BOOST_CHECK_EQUAL(nValueRet, 38 * CENT);
+
+    // try making 34 cents from 1,2,5,10,20 - we can't do it exactly, so we
+    // get the smallest total leaving a cent of change: 20+10+5
+    BOOST_CHECK( wallet.SelectCoinsMinConf(34 * CENT, 1, 1, vCoins, setCoinsRet, nValueRet, nBestHeight));
+    BOOST_CHECK_EQUAL(nValueRet, 35 * CENT);
+    BOOST_CHECK_EQUAL(setCoinsRet.size(), 3U);
+
+    // when we try making 7 cents, the smaller coins (1,2,5) are enough.  We should see just 2+5
+    BOOST_CHECK( wallet.SelectCoinsMinConf( 7 * CENT, 1, 1, vCoins, setCoinsRet, nValueRet, nBestHeight));
+    BOOST_CHECK_EQUAL(nValueRet, 7 * CENT);
+    BOOST_CHECK_EQUAL(setCoinsRet.size(), 2U);
+
+    // when we try making 8 cents, the smaller coins (1,2,5) are exactly enough.
+    BOOST_CHECK( wallet.SelectCoinsMinConf( 8 * CENT, 1, 1, vCoins, setCoinsRet, nValueRet, nBestHeight));
+    BOOST_CHECK_EQUAL(nValueRet, 8 * CENT);
+    BOOST_CHECK_EQUAL(setCoinsRet.size(), 3U);
+
+    // when we try making 9 cents, no subset of smaller coins is enough, and we get the next bigger coin (10)
+    BOOST_CHECK( wallet.SelectCoinsMinConf( 9 * CENT, 1, 1, vCoins, setCoinsRet, nValueRet, nBestHeight));
+    BOOST_CHECK_EQUAL(nValueRet, 10 * CENT);
+    BOOST_CHECK_EQUAL(setCoinsRet.size(), 1U);
+
+    // now clear out the wallet and start again to test choosing between subsets of smaller coins and the next biggest coin
+    empty_wallet();
+
+    add_coin( 6*CENT);
+    add_coin( 7*CENT);
+    add_coin( 8*CENT);
+    add_coin(20*CENT);
+    add_coin(30*CENT); // now we have 6+7+8+20+30 = 71 cents total
+
+    // check that we have 71 and not 72
+    BOOST_CHECK( wallet.SelectCoinsMinConf(71 * CENT, 1, 1, vCoins, setCoinsRet, nValueRet, nBestHeight));
+    BOOST_CHECK(!wallet.SelectCoinsMinConf(72 * CENT, 1, 1, vCoins, setCoinsRet, nValueRet, nBestHeight));
+
+    // now try making 16 cents.  the best smaller coins can do is 6+7+8 = 21; not as good at the next biggest coin, 20
+    BOOST_CHECK( wallet.SelectCoinsMinConf(16 * CENT, 1, 1, vCoins, setCoinsRet, nValueRet, nBestHeight));
+    BOOST_CHECK_EQUAL(nValueRet, 20 * CENT); // we should get 20 in one coin
+    BOOST_CHECK_EQUAL(setCoinsRet.size(), 1U);
+
+    add_coin( 5*CENT); // now we have 5+6+7+8+20+30 = 75 cents total
+
+    // now if we try making 16 cents again, the smaller coins can make 5+6+7 = 18 cents, better than the next biggest coin, 20
+    BOOST_CHECK( wallet.SelectCoinsMinConf(16 * CENT, 1, 1, vCoins, setCoinsRet, nValueRet, nBestHeight));
+    BOOST_CHECK_EQUAL(nValueRet, 18 * CENT); // we should get 18 in 3 coins
+    BOOST_CHECK_EQUAL(setCoinsRet.size(), 3U);
+
+    add_coin( 18*CENT); // now we have 5+6+7+8+18+20+30
+
+    // and now if we try making 16 cents again, the smaller coins can make 5+6+7 = 18 cents, the same as the next biggest coin, 18
+    BOOST_CHECK( wallet.SelectCoinsMinConf(16 * CENT, 1, 1, vCoins, setCoinsRet, nValueRet, nBestHeight));
+    BOOST_CHECK_EQUAL(nValueRet, 18 * CENT);  // we should get 18 in 1 coin
+    BOOST_CHECK_EQUAL(setCoinsRet.size(), 1U); // because in the event of a tie, the biggest coin wins
+
+    // now try making 11 cents.  we should get 5+6
+    BOOST_CHECK( wallet.SelectCoinsMinConf(11 * CENT, 1, 1, vCoins, setCoinsRet, nValueRet, nBestHeight));
+    BOOST_CHECK_EQUAL(nValueRet, 11 * CENT);
+    BOOST_CHECK_EQUAL(setCoinsRet.size(), 2U);
+
+    // check that the smallest bigger coin is used
+    add_coin( 1*COIN);
+    add_coin( 2*COIN);
+    add_coin( 3*COIN);
+    add_coin( 4*COIN); // now we have 5+6+7+8+18+20+30+100+200+300+400 = 1094 cents
+    BOOST_CHECK( wallet.SelectCoinsMinConf(95 * CENT, 1, 1, vCoins, setCoinsRet, nValueRet, nBestHeight));
+    BOOST_CHECK_EQUAL(nValueRet, 1 * COIN);  // we should get 1 XCN in 1 coin
+    BOOST_CHECK_EQUAL(setCoinsRet.size(), 1U);
+
+    BOOST_CHECK( wallet.SelectCoinsMinConf(195 * CENT, 1, 1, vCoins, setCoinsRet, nValueRet, nBestHeight));
+    BOOST_CHECK_EQUAL(nValueRet, 2 * COIN);  // we should get 2 XCN in 1 coin
+    BOOST_CHECK_EQUAL(setCoinsRet.size(), 1U);
+
+    // empty the wallet and start again, now with fractions of a cent, to test sub-cent change avoidance
+    empty_wallet();
+    add_coin(CENT / 10);
+    add_coin(CENT / 5);
+    add_coin(CENT * 3 / 10);
+    add_coin(CENT * 2 / 5);
+    add_coin(CENT / 2);
+
+    // try making 1 cent from 0.1 + 0.2 + 0.3 + 0.4 + 0.5 = 1.5 cents
+    // we'll get sub-cent change whatever happens, so can expect 1.0 exactly
+    BOOST_CHECK( wallet.SelectCoinsMinConf(1 * CENT, 1, 1, vCoins, setCoinsRet, nValueRet, nBestHeight));
+    BOOST_CHECK_EQUAL(nValueRet, 1 * CENT);
+
+    // but if we add a bigger coin, making it possible to avoid sub-cent change, things change:
+    add_coin(1111*CENT);
+
+    // try making 1 cent from 0.1 + 0.2 + 0.3 + 0.4 + 0.5 + 1111 = 1112.5 cents
+    BOOST_CHECK( wallet.SelectCoinsMinConf(1 * CENT, 1, 1, vCoins, setCoinsRet, nValueRet, nBestHeight));
+    BOOST_CHECK_EQUAL(nValueRet, 1 * CENT); // we should get the exact amount
+
+    // if we add more sub-cent coins:
+    add_coin(CENT * 3 / 5);
+    add_coin(CENT * 7 / 10);
+
+    // and try again to make 1.0 cents, we can still make 1.0 cents
+    BOOST_CHECK( wallet.SelectCoinsMinConf(1 * CENT, 1, 1, vCoins, setCoinsRet, nValueRet, nBestHeight));
+    BOOST_CHECK_EQUAL(nValueRet, 1 * CENT); // we should get the exact amount
+
+    // run the 'mtgox' test (see http://blockexplorer.com/tx/29a3efd3ef04f9153d47a990bd7b048a4b2d213daaa5fb8ed670fb85f13bdbcf)
+    // they tried to consolidate 10 50k coins into one 500k coin, and ended up with 50k in change
+    empty_wallet();
+    for (int i = 0; i < 20; i++)
+        add_coin(50000 * COIN);
+
+    BOOST_CHECK( wallet.SelectCoinsMinConf(500000 * COIN, 1, 1, vCoins, setCoinsRet, nValueRet, nBestHeight));
+    BOOST_CHECK_EQUAL(nValueRet, 500000 * COIN); // we should get the exact amount
+    BOOST_CHECK_EQUAL(setCoinsRet.size(), 10U); // in ten coins
+
+    // if there's not enough in the smaller coins to make at least 1 cent change (0.5+0.6+0.7 < 1.0+1.0),
+    // we need to try finding an exact subset anyway
+
+    // when there is none, we use the next biggest coin:
+    empty_wallet();
+    add_coin(CENT / 2);
+    add_coin(CENT * 3 / 5);
+    add_coin(CENT * 7 / 10);
+    add_coin(1111 * CENT);
+    BOOST_CHECK( wallet.SelectCoinsMinConf(1 * CENT, 1, 1, vCoins, setCoinsRet, nValueRet, nBestHeight));
+    BOOST_CHECK_EQUAL(nValueRet, 1111 * CENT); // we get the bigger coin
+    BOOST_CHECK_EQUAL(setCoinsRet.size(), 1U);
+
+    // but when there is, we use the exact subset (0.4 + 0.6 = 1.0)
+    empty_wallet();
+    add_coin(CENT * 2 / 5);
+    add_coin(CENT * 3 / 5);
+    add_coin(CENT * 4 / 5);
+    add_coin(1111 * CENT);
+    BOOST_CHECK( wallet.SelectCoinsMinConf(1 * CENT, 1, 1, vCoins, setCoinsRet, nValueRet, nBestHeight));
+    BOOST_CHECK_EQUAL(nValueRet, 1 * CENT);   // we should get the exact amount
+    BOOST_CHECK_EQUAL(setCoinsRet.size(), 2U); // in two coins 0.4+0.6
+
+    // test avoiding sub-cent change
+    empty_wallet();
+    add_coin(COIN / 2000);
+    add_coin(COIN / 100);
+    add_coin(1 * COIN);
+
+    // trying to make 1.0001 from these three coins
+    BOOST_CHECK( wallet.SelectCoinsMinConf(COIN * 10001 / 10000, 1, 1, vCoins, setCoinsRet, nValueRet, nBestHeight));
+    BOOST_CHECK_EQUAL(nValueRet, COIN * 10105 / 10000);   // we should get all coins
+    BOOST_CHECK_EQUAL(setCoinsRet.size(), 3U);
+
+    // but if we try to make 0.999, we should take the bigger of the two small coins to avoid sub-cent change
+    BOOST_CHECK( wallet.SelectCoinsMinConf(COIN * 999 / 1000, 1, 1, vCoins, setCoinsRet, nValueRet, nBestHeight));
+    BOOST_CHECK_EQUAL(nValueRet, COIN * 101 / 100);   // we should get 1 + 0.01
+    BOOST_CHECK_EQUAL(setCoinsRet.size(), 2U);
+
+    empty_wallet();
+}
+
+BOOST_AUTO_TEST_CASE(coin_selection_limits)
+{
+    CoinSet setCoinsRet;
+    mpq nValueRet;
+
+    // Without any tries left, all of the smaller coins are taken
+    empty_wallet();
+    add_coin(5*CENT);
+    add_coin(6*CENT);
+    add_coin(7*CENT);
+    add_coin(8*CENT);
+    BOOST_CHECK( wallet.SelectCoinsMinConf(11 * CENT, 1, 1, vCoins, setCoinsRet, nValueRet, nBestHeight));
+    BOOST_CHECK_EQUAL(nValueRet, 11 * CENT);
+    mapArgs["-selectcoinstries"] = "0";
+    BOOST_CHECK( wallet.SelectCoinsMinConf(11 * CENT, 1, 1, vCoins, setCoinsRet, nValueRet, nBestHeight));
+    BOOST_CHECK_EQUAL(nValueRet, 26 * CENT);
+    BOOST_CHECK_EQUAL(setCoinsRet.size(), 4U);
+    mapArgs.erase("-selectcoinstries");
+
+    // An exact match takes over a thousand tries to find among these
+    static const int anValues[] = {
+        3, 1122, 1128, 1198, 1384, 1420, 1642, 1762, 1874, 1928, 1952,
+        2016, 2088, 2120, 2154, 2198, 2266, 2392, 2458, 2590, 2890 };
+    empty_wallet();
+    for (unsigned int i = 0; i < sizeof(anValues)/sizeof(anValues[0]); i++)
+        add_coin(anValues[i] * CENT / 100);
+    mpq nTarget = 15373 * CENT / 100;
+    BOOST_CHECK( wallet.SelectCoinsMinConf(nTarget, 1, 1, vCoins, setCoinsRet, nValueRet, nBestHeight));
+    BOOST_CHECK_EQUAL(nValueRet, nTarget);
+    BOOST_CHECK_EQUAL(setCoinsRet.size(), 8U);
+
+    // Cut short, the search settles for the best total it has seen
+    mapArgs["-selectcoinstries"] = "1023";
+    BOOST_CHECK( wallet.SelectCoinsMinConf(nTarget, 1, 1, vCoins, setCoinsRet, nValueRet, nBestHeight));
+    BOOST_CHECK_EQUAL(nValueRet, 15474 * CENT / 100);
+    BOOST_CHECK_EQUAL(setCoinsRet.size(), 7U);
+    mapArgs.erase("-selectcoinstries");
+
+    // The time limit is looked at every 1024 tries
+    mapArgs["-selectcoinstime"] = "-1";
+    BOOST_CHECK( wallet.SelectCoinsMinConf(nTarget, 1, 1, vCoins, setCoinsRet, nValueRet, nBestHeight));
+    BOOST_CHECK_EQUAL(nValueRet, 15474 * CENT / 100);
+    BOOST_CHECK_EQUAL(setCoinsRet.size(), 7U);
+    mapArgs.erase("-selectcoinstime");
+
+    empty_wallet();
+}
+
+BOOST_AUTO_TEST_CASE(coin_selection_deterministic)
+{
+    CoinSet setCoinsRet, setCoinsRet2;
+    mpq nValueRet, nValueRet2;
+
+    // The same coins give the same selection every time
+    empty_wallet();
+    for (int i = 0; i < 100; i++)
+        add_coin(COIN);
+    BOOST_CHECK(wallet.SelectCoinsMinConf(50 * COIN, 1, 6, vCoins, setCoinsRet , nValueRet , nBestHeight));
+    BOOST_CHECK(wallet.SelectCoinsMinConf(50 * COIN, 1, 6, vCoins, setCoinsRet2, nValueRet2, nBestHeight));
+    BOOST_CHECK(equal_sets(setCoinsRet, setCoinsRet2));
+    BOOST_CHECK_EQUAL(nValueRet, 50 * COIN);
+
+    BOOST_CHECK(wallet.SelectCoinsMinConf(COIN, 1, 6, vCoins, setCoinsRet , nValueRet , nBestHeight));
+    BOOST_CHECK(wallet.SelectCoinsMinConf(COIN, 1, 6, vCoins, setCoinsRet2, nValueRet2, nBestHeight));
+    BOOST_CHECK(equal_sets(setCoinsRet, setCoinsRet2));
+    BOOST_CHECK_EQUAL(setCoinsRet.size(), 1U);
+
+    // add 75 cents in small change.  not enough to make 90 cents, so one
+    // of the competing "smallest bigger" coins is picked, always the same
+    add_coin( 5*CENT); add_coin(10*CENT); add_coin(15*CENT); add_coin(20*CENT); add_coin(25*CENT);
+    BOOST_CHECK(wallet.SelectCoinsMinConf(90*CENT, 1, 6, vCoins, setCoinsRet , nValueRet , nBestHeight));
+    BOOST_CHECK(wallet.SelectCoinsMinConf(90*CENT, 1, 6, vCoins, setCoinsRet2, nValueRet2, nBestHeight));
+    BOOST_CHECK(equal_sets(setCoinsRet, setCoinsRet2));
+    BOOST_CHECK_EQUAL(nValueRet, 1 * COIN);
+
+    // The order the coins come in only decides between coins of the same value
+    vector<COutput> vCoinsReversed(vCoins.rbegin(), vCoins.rend());
+    BOOST_CHECK(wallet.SelectCoinsMinConf(35*CENT, 1, 6, vCoins, setCoinsRet , nValueRet , nBestHeight));
+    BOOST_CHECK(wallet.SelectCoinsMinConf(35*CENT, 1, 6, vCoinsReversed, setCoinsRet2, nValueRet2, nBestHeight));
+    BOOST_CHECK(equal_sets(setCoinsRet, setCoinsRet2));
+    BOOST_CHECK_EQUAL(nValueRet, 35 * CENT);
+
+    empty_wallet();
+}
+
+BOOST_AUTO_TEST_CASE(wallet_ismine)
+{
+    CWallet keywallet;
+    CKey key[3];
+    for (int i = 0; i < 3; i++)
+        key[i].MakeNewKey(true);
+    keywallet.AddKey(key[0]);
+
+    CScript scriptPubKey, scriptPubKeyHash, scriptOther;
+    scriptPubKey << key[0].GetPubKey() << OP_CHECKSIG;
+    scriptPubKeyHash.SetDestination(key[0].GetPubKey().GetID());
+    scriptOther.SetDestination(key[2].GetPubKey().GetID());
+    BOOST_CHECK(keywallet.IsMine(scriptPubKey));
+    BOOST_CHECK(keywallet.IsMine(scriptPubKeyHash));
+    BOOST_CHECK(!keywallet.IsMine(scriptOther));
+
+    // The key hash pushed with OP_PUSHDATA1 still solves
+    CScript scriptLongPush;
+    CKeyID keyID = key[0].GetPubKey().GetID();
+    scriptLongPush << OP_DUP << OP_HASH160 << OP_PUSHDATA1;
+    scriptLongPush.push_back(20);
+    scriptLongPush.insert(scriptLongPush.end(), keyID.begin(), keyID.end());
+    scriptLongPush << OP_EQUALVERIFY << OP_CHECKSIG;
+    BOOST_CHECK(keywallet.IsMine(scriptLongPush));
+
+    // Multisig is mine once all of its keys are, bare or behind P2SH
+    vector<CKey> vKeys;
+    vKeys.push_back(key[1]);
+    vKeys.push_back(key[0]);
+    CScript scriptMulti, scriptP2SH;
+    scriptMulti.SetMultisig(2, vKeys);
+    scriptP2SH.SetDestination(scriptMulti.GetID());
+    keywallet.AddCScript(scriptMulti);
+    BOOST_CHECK(!keywallet.IsMine(scriptMulti));
+    BOOST_CHECK(!keywallet.IsMine(scriptP2SH));
+    keywallet.AddKey(key[1]);
+    BOOST_CHECK(keywallet.IsMine(scriptMulti));
+    BOOST_CHECK(keywallet.IsMine(scriptP2SH));
+
+    // One missing two keys waits for both
+    CKey keyLate[2];
+    vector<CKey> vKeysLate;
+    for (int i = 0; i < 2; i++)
     {
-        empty_wallet();
-
-        // with an empty wallet we can't even pay one cent
-        BOOST_CHECK(!wallet.SelectCoinsMinConf( 1 * CENT, 1, 6, vCoins, setCoinsRet, nValueRet, nBestHeight));
-
-        add_coin(1*CENT, 4);        // add a new 1 cent coin
-
-        // with a new 1 cent coin, we still can't find a mature 1 cent
-        BOOST_CHECK(!wallet.SelectCoinsMinConf( 1 * CENT, 1, 6, vCoins, setCoinsRet, nValueRet, nBestHeight));
-
-        // but we can find a new 1 cent
-        BOOST_CHECK( wallet.SelectCoinsMinConf( 1 * CENT, 1, 1, vCoins, setCoinsRet, nValueRet, nBestHeight));
-        BOOST_CHECK_EQUAL(nValueRet, 1 * CENT);
-
-        add_coin(2*CENT);           // add a mature 2 cent coin
-
-        // we can't make 3 cents of mature coins
-        BOOST_CHECK(!wallet.SelectCoinsMinConf( 3 * CENT, 1, 6, vCoins, setCoinsRet, nValueRet, nBestHeight));
-
-        // we can make 3 cents of new  coins
-        BOOST_CHECK( wallet.SelectCoinsMinConf( 3 * CENT, 1, 1, vCoins, setCoinsRet, nValueRet, nBestHeight));
-        BOOST_CHECK_EQUAL(nValueRet, 3 * CENT);
-
-        add_coin(5*CENT);           // add a mature 5 cent coin,
-        add_coin(10*CENT, 3, true); // a new 10 cent coin sent from one of our own addresses
-        add_coin(20*CENT);          // and a mature 20 cent coin
-
-        // now we have new: 1+10=11 (of which 10 was self-sent), and mature: 2+5+20=27.  total = 38
-
-        // we can't make 38 cents only if we disallow new coins:
-        BOOST_CHECK(!wallet.SelectCoinsMinConf(38 * CENT, 1, 6, vCoins, setCoinsRet, nValueRet, nBestHeight));
-        // we can't even make 37 cents if we don't allow new coins even if they're from us
-        BOOST_CHECK(!wallet.SelectCoinsMinConf(38 * CENT, 6, 6, vCoins, setCoinsRet, nValueRet, nBestHeight));
-        // but we can make 37 cents if we accept new coins from ourself
-        BOOST_CHECK( wallet.SelectCoinsMinConf(37 * CENT, 1, 6, vCoins, setCoinsRet, nValueRet, nBestHeight));
-        BOOST_CHECK_EQUAL(nValueRet, 37 * CENT);
-        // and we can make 38 cents if we accept all new coins
-        BOOST_CHECK( wallet.SelectCoinsMinConf(38 * CENT, 1, 1, vCoins, setCoinsRet, nValueRet, nBestHeight));
-        BOOST_CHECK_EQUAL(nValueRet, 38 * CENT);
-
-        // try making 34 cents from 1,2,5,10,20 - we can't do it exactly
-        BOOST_CHECK( wallet.SelectCoinsMinConf(34 * CENT, 1, 1, vCoins, setCoinsRet, nValueRet, nBestHeight));
-        BOOST_CHECK_GT(nValueRet, 34 * CENT);         // but should get more than 34 cents
-        BOOST_CHECK_EQUAL(setCoinsRet.size(), 3);     // the best should be 20+10+5.  it's incredibly unlikely the 1 or 2 got included (but possible)
-
-        // when we try making 7 cents, the smaller coins (1,2,5) are enough.  We should see just 2+5
-        BOOST_CHECK( wallet.SelectCoinsMinConf( 7 * CENT, 1, 1, vCoins, setCoinsRet, nValueRet, nBestHeight));
-        BOOST_CHECK_EQUAL(nValueRet, 7 * CENT);
-        BOOST_CHECK_EQUAL(setCoinsRet.size(), 2);
-
-        // when we try making 8 cents, the smaller coins (1,2,5) are exactly enough.
-        BOOST_CHECK( wallet.SelectCoinsMinConf( 8 * CENT, 1, 1, vCoins, setCoinsRet, nValueRet, nBestHeight));
-        BOOST_CHECK(nValueRet == 8 * CENT);
-        BOOST_CHECK_EQUAL(setCoinsRet.size(), 3);
-
-        // when we try making 9 cents, no subset of smaller coins is enough, and we get the next bigger coin (10)
-        BOOST_CHECK( wallet.SelectCoinsMinConf( 9 * CENT, 1, 1, vCoins, setCoinsRet, nValueRet, nBestHeight));
-        BOOST_CHECK_EQUAL(nValueRet, 10 * CENT);
-        BOOST_CHECK_EQUAL(setCoinsRet.size(), 1);
-
-        // now clear out the wallet and start again to test choosing between subsets of smaller coins and the next biggest coin
-        empty_wallet();
-
-        add_coin( 6*CENT);
-        add_coin( 7*CENT);
-        add_coin( 8*CENT);
-        add_coin(20*CENT);
-        add_coin(30*CENT); // now we have 6+7+8+20+30 = 71 cents total
-
-        // check that we have 71 and not 72
-        BOOST_CHECK( wallet.SelectCoinsMinConf(71 * CENT, 1, 1, vCoins, setCoinsRet, nValueRet, nBestHeight));
-        BOOST_CHECK(!wallet.SelectCoinsMinConf(72 * CENT, 1, 1, vCoins, setCoinsRet, nValueRet, nBestHeight));
-
-        // now try making 16 cents.  the best smaller coins can do is 6+7+8 = 21; not as good at the next biggest coin, 20
-        BOOST_CHECK( wallet.SelectCoinsMinConf(16 * CENT, 1, 1, vCoins, setCoinsRet, nValueRet, nBestHeight));
-        BOOST_CHECK_EQUAL(nValueRet, 20 * CENT); // we should get 20 in one coin
-        BOOST_CHECK_EQUAL(setCoinsRet.size(), 1);
-
-        add_coin( 5*CENT); // now we have 5+6+7+8+20+30 = 75 cents total
-
-        // now if we try making 16 cents again, the smaller coins can make 5+6+7 = 18 cents, better than the next biggest coin, 20
-        BOOST_CHECK( wallet.SelectCoinsMinConf(16 * CENT, 1, 1, vCoins, setCoinsRet, nValueRet, nBestHeight));
-        BOOST_CHECK_EQUAL(nValueRet, 18 * CENT); // we should get 18 in 3 coins
-        BOOST_CHECK_EQUAL(setCoinsRet.size(), 3);
-
-        add_coin( 18*CENT); // now we have 5+6+7+8+18+20+30
-
-        // and now if we try making 16 cents again, the smaller coins can make 5+6+7 = 18 cents, the same as the next biggest coin, 18
-        BOOST_CHECK( wallet.SelectCoinsMinConf(16 * CENT, 1, 1, vCoins, setCoinsRet, nValueRet, nBestHeight));
-        BOOST_CHECK_EQUAL(nValueRet, 18 * CENT);  // we should get 18 in 1 coin
-        BOOST_CHECK_EQUAL(setCoinsRet.size(), 1); // because in the event of a tie, the biggest coin wins
-
-        // now try making 11 cents.  we should get 5+6
-        BOOST_CHECK( wallet.SelectCoinsMinConf(11 * CENT, 1, 1, vCoins, setCoinsRet, nValueRet, nBestHeight));
-        BOOST_CHECK_EQUAL(nValueRet, 11 * CENT);
-        BOOST_CHECK_EQUAL(setCoinsRet.size(), 2);
-
-        // check that the smallest bigger coin is used
-        add_coin( 1*COIN);
-        add_coin( 2*COIN);
-        add_coin( 3*COIN);
-        add_coin( 4*COIN); // now we have 5+6+7+8+18+20+30+100+200+300+400 = 1094 cents
-        BOOST_CHECK( wallet.SelectCoinsMinConf(95 * CENT, 1, 1, vCoins, setCoinsRet, nValueRet, nBestHeight));
-        BOOST_CHECK_EQUAL(nValueRet, 1 * COIN);  // we should get 1 XCN in 1 coin
-        BOOST_CHECK_EQUAL(setCoinsRet.size(), 1);
-
-        BOOST_CHECK( wallet.SelectCoinsMinConf(195 * CENT, 1, 1, vCoins, setCoinsRet, nValueRet, nBestHeight));
-        BOOST_CHECK_EQUAL(nValueRet, 2 * COIN);  // we should get 2 XCN in 1 coin
-        BOOST_CHECK_EQUAL(setCoinsRet.size(), 1);
-
-        // empty the wallet and start again, now with fractions of a cent, to test sub-cent change avoidance
-        empty_wallet();
-        add_coin(0.1*CENT);
-        add_coin(0.2*CENT);
-        add_coin(0.3*CENT);
-        add_coin(0.4*CENT);
-        add_coin(0.5*CENT);
-
-        // try making 1 cent from 0.1 + 0.2 + 0.3 + 0.4 + 0.5 = 1.5 cents
-        // we'll get sub-cent change whatever happens, so can expect 1.0 exactly
-        BOOST_CHECK( wallet.SelectCoinsMinConf(1 * CENT, 1, 1, vCoins, setCoinsRet, nValueRet, nBestHeight));
-        BOOST_CHECK_EQUAL(nValueRet, 1 * CENT);
-
-        // but if we add a bigger coin, making it possible to avoid sub-cent change, things change:
-        add_coin(1111*CENT);
-
-        // try making 1 cent from 0.1 + 0.2 + 0.3 + 0.4 + 0.5 + 1111 = 1112.5 cents
-        BOOST_CHECK( wallet.SelectCoinsMinConf(1 * CENT, 1, 1, vCoins, setCoinsRet, nValueRet, nBestHeight));
-        BOOST_CHECK_EQUAL(nValueRet, 1 * CENT); // we should get the exact amount
-
-        // if we add more sub-cent coins:
-        add_coin(0.6*CENT);
-        add_coin(0.7*CENT);
-
-        // and try again to make 1.0 cents, we can still make 1.0 cents
-        BOOST_CHECK( wallet.SelectCoinsMinConf(1 * CENT, 1, 1, vCoins, setCoinsRet, nValueRet, nBestHeight));
-        BOOST_CHECK_EQUAL(nValueRet, 1 * CENT); // we should get the exact amount
-
-        // run the 'mtgox' test (see http://blockexplorer.com/tx/29a3efd3ef04f9153d47a990bd7b048a4b2d213daaa5fb8ed670fb85f13bdbcf)
-        // they tried to consolidate 10 50k coins into one 500k coin, and ended up with 50k in change
-        empty_wallet();
-        for (int i = 0; i < 20; i++)
-            add_coin(50000 * COIN);
-
-        BOOST_CHECK( wallet.SelectCoinsMinConf(500000 * COIN, 1, 1, vCoins, setCoinsRet, nValueRet, nBestHeight));
-        BOOST_CHECK_EQUAL(nValueRet, 500000 * COIN); // we should get the exact amount
-        BOOST_CHECK_EQUAL(setCoinsRet.size(), 10); // in ten coins
-
-        // if there's not enough in the smaller coins to make at least 1 cent change (0.5+0.6+0.7 < 1.0+1.0),
-        // we need to try finding an exact subset anyway
-
-        // sometimes it will fail, and so we use the next biggest coin:
-        empty_wallet();
-        add_coin(0.5 * CENT);
-        add_coin(0.6 * CENT);
-        add_coin(0.7 * CENT);
-        add_coin(1111 * CENT);
-        BOOST_CHECK( wallet.SelectCoinsMinConf(1 * CENT, 1, 1, vCoins, setCoinsRet, nValueRet, nBestHeight));
-        BOOST_CHECK_EQUAL(nValueRet, 1111 * CENT); // we get the bigger coin
-        BOOST_CHECK_EQUAL(setCoinsRet.size(), 1);
-
-        // but sometimes it's possible, and we use an exact subset (0.4 + 0.6 = 1.0)
-        empty_wallet();
-        add_coin(0.4 * CENT);
-        add_coin(0.6 * CENT);
-        add_coin(0.8 * CENT);
-        add_coin(1111 * CENT);
-        BOOST_CHECK( wallet.SelectCoinsMinConf(1 * CENT, 1, 1, vCoins, setCoinsRet, nValueRet, nBestHeight));
-        BOOST_CHECK_EQUAL(nValueRet, 1 * CENT);   // we should get the exact amount
-        BOOST_CHECK_EQUAL(setCoinsRet.size(), 2); // in two coins 0.4+0.6
-
-        // test avoiding sub-cent change
-        empty_wallet();
-        add_coin(0.0005 * COIN);
-        add_coin(0.01 * COIN);
-        add_coin(1 * COIN);
-
-        // trying to make 1.0001 from these three coins
-        BOOST_CHECK( wallet.SelectCoinsMinConf(1.0001 * COIN, 1, 1, vCoins, setCoinsRet, nValueRet, nBestHeight));
-        BOOST_CHECK_EQUAL(nValueRet, 1.0105 * COIN);   // we should get all coins
-        BOOST_CHECK_EQUAL(setCoinsRet.size(), 3);
-
-        // but if we try to make 0.999, we should take the bigger of the two small coins to avoid sub-cent change
-        BOOST_CHECK( wallet.SelectCoinsMinConf(0.999 * COIN, 1, 1, vCoins, setCoinsRet, nValueRet, nBestHeight));
-        BOOST_CHECK_EQUAL(nValueRet, 1.01 * COIN);   // we should get 1 + 0.01
-        BOOST_CHECK_EQUAL(setCoinsRet.size(), 2);
-
-        // test randomness
+        keyLate[i].MakeNewKey(true);
+        vKeysLate.push_back(keyLate[i]);
+    }
+    CScript scriptMultiLate, scriptP2SHLate;
+    scriptMultiLate.SetMultisig(2, vKeysLate);
+    scriptP2SHLate.SetDestination(scriptMultiLate.GetID());
+    keywallet.AddCScript(scriptMultiLate);
+    keywallet.AddKey(keyLate[1]);
+    BOOST_CHECK(!keywallet.IsMine(scriptP2SHLate));
+    keywallet.AddKey(keyLate[0]);
+    BOOST_CHECK(keywallet.IsMine(scriptP2SHLate));
+
+    // Bare multisig the wallet has no script for
+    vKeys.push_back(key[1]);
+    CScript scriptMultiUnknown;
+    scriptMultiUnknown.SetMultisig(1, vKeys);
+    BOOST_CHECK(keywallet.IsMine(scriptMultiUnknown));
+    vKeys.push_back(key[2]);
+    scriptMultiUnknown.SetMultisig(1, vKeys);
+    BOOST_CHECK(!keywallet.IsMine(scriptMultiUnknown));
+}
+
+// Block index entries for the balance tests, one transaction per block
+static vector<CBlockIndex*> vBalanceBlocks;
+
+static CBlockIndex* AddBlock(CBlockIndex* pindexPrev, const uint256& hashMerkleRoot = 0)
+{
+    CBlockIndex* pindex = new CBlockIndex();
+    BlockMap::iterator mi = mapBlockIndex.insert(make_pair(uint256(1000 + vBalanceBlocks.size()), pindex)).first;
+    pindex->phashBlock = &((*mi).first);
+    pindex->pprev = pindexPrev;
+    pindex->nHeight = pindexPrev->nHeight + 1;
+    pindex->hashMerkleRoot = hashMerkleRoot;
+    pindex->BuildSkip();
+    vBalanceBlocks.push_back(pindex);
+    return pindex;
+}
+
+// Disconnect back to the fork point, then connect up to pindexNew
+static void SetTip(CBlockIndex* pindexNew)
+{
+    for (CBlockIndex* pindex = pindexBest; pindex->pprev && pindexNew->GetAncestor(pindex->nHeight) != pindex; pindex = pindex->pprev)
+        pindex->pprev->pnext = NULL;
+    pindexNew->pnext = NULL;
+    for (CBlockIndex* pindex = pindexNew; pindex->pprev; pindex = pindex->pprev)
+        pindex->pprev->pnext = pindex;
+    pindexBest = pindexNew;
+    nBestHeight = pindexNew->nHeight;
+}
+
+// Mine wtx on top of the tip, as the only transaction of its block
+static void ConfirmTx(CWalletTx& wtx)
+{
+    CBlockIndex* pindex = AddBlock(pindexBest, wtx.GetHash());
+    wtx.hashBlock = pindex->GetBlockHash();
+    wtx.nIndex = 0;
+    SetTip(pindex);
+}
+
+static CWalletTx& AddWalletTx(CWallet& w, const CTransaction& tx)
+{
+    LOCK(w.cs_wallet);
+    CWalletTx& wtx = w.mapWallet[tx.GetHash()];
+    wtx = CWalletTx(&w, tx);
+    wtx.MarkDirty();
+    return wtx;
+}
+
+// What the balances came to before the running totals: a walk over the
+// whole wallet
+static mpq WalkBalance(const CWallet& w, int nKind, int nBlockHeight)
+{
+    LOCK(w.cs_wallet);
+    mpq nTotal = 0;
+    BOOST_FOREACH(const PAIRTYPE(const uint256, CWalletTx)& item, w.mapWallet)
+    {
+        const CWalletTx& wtx = item.second;
+        if (wtx.IsCoinBase() && wtx.GetBlocksToMaturity() > 0)
         {
-            empty_wallet();
-            for (int i2 = 0; i2 < 100; i2++)
-                add_coin(COIN);
-
-            // picking 50 from 100 coins doesn't depend on the shuffle,
-            // but does depend on randomness in the stochastic approximation code
-            BOOST_CHECK(wallet.SelectCoinsMinConf(50 * COIN, 1, 6, vCoins, setCoinsRet , nValueRet, nBestHeight));
-            BOOST_CHECK(wallet.SelectCoinsMinConf(50 * COIN, 1, 6, vCoins, setCoinsRet2, nValueRet, nBestHeight));
-            BOOST_CHECK(!equal_sets(setCoinsRet, setCoinsRet2));
-
-            int fails = 0;
-            for (int i = 0; i < RANDOM_REPEATS; i++)
-            {
-                // selecting 1 from 100 identical coins depends on the shuffle; this test will fail 1% of the time
-                // run the test RANDOM_REPEATS times and only complain if all of them fail
-                BOOST_CHECK(wallet.SelectCoinsMinConf(COIN, 1, 6, vCoins, setCoinsRet , nValueRet, nBestHeight));
-                BOOST_CHECK(wallet.SelectCoinsMinConf(COIN, 1, 6, vCoins, setCoinsRet2, nValueRet, nBestHeight));
-                if (equal_sets(setCoinsRet, setCoinsRet2))
-                    fails++;
-            }
-            BOOST_CHECK_NE(fails, RANDOM_REPEATS);
-
-            // add 75 cents in small change.  not enough to make 90 cents,
-            // then try making 90 cents.  there are multiple competing "smallest bigger" coins,
-            // one of which should be picked at random
-            add_coin( 5*CENT); add_coin(10*CENT); add_coin(15*CENT); add_coin(20*CENT); add_coin(25*CENT);
-
-            fails = 0;
-            for (int i = 0; i < RANDOM_REPEATS; i++)
-            {
-                // selecting 1 from 100 identical coins depends on the shuffle; this test will fail 1% of the time
-                // run the test RANDOM_REPEATS times and only complain if all of them fail
-                BOOST_CHECK(wallet.SelectCoinsMinConf(90*CENT, 1, 6, vCoins, setCoinsRet , nValueRet, nBestHeight));
-                BOOST_CHECK(wallet.SelectCoinsMinConf(90*CENT, 1, 6, vCoins, setCoinsRet2, nValueRet, nBestHeight));
-                if (equal_sets(setCoinsRet, setCoinsRet2))
-                    fails++;
-            }
-            BOOST_CHECK_NE(fails, RANDOM_REPEATS);
+            if (nKind == BALANCE_IMMATURE && wtx.IsInMainChain())
+                nTotal += w.GetCredit(wtx, nBlockHeight);
         }
+        else if (nKind != BALANCE_IMMATURE && wtx.IsConfirmed() == (nKind == BALANCE_CONFIRMED))
+            nTotal += wtx.GetAvailableCredit(nBlockHeight);
+    }
+    return nTotal;
+}
+
+// The totals are multiplied by demurrage factors rounded to 113 bits, so
+// they may differ from the walk far below the smallest unit
+static void CheckBalancesAt(const CWallet& w, int nBlockHeight)
+{
+    static const mpq nTolerance("1/1000000");
+    BOOST_CHECK(abs(w.GetBalance(nBlockHeight) - WalkBalance(w, BALANCE_CONFIRMED, nBlockHeight)) < nTolerance);
+    BOOST_CHECK(abs(w.GetUnconfirmedBalance(nBlockHeight) - WalkBalance(w, BALANCE_UNCONFIRMED, nBlockHeight)) < nTolerance);
+    BOOST_CHECK(abs(w.GetImmatureBalance(nBlockHeight) - WalkBalance(w, BALANCE_IMMATURE, nBlockHeight)) < nTolerance);
+}
+
+static void CheckBalances(const CWallet& w)
+{
+    CheckBalancesAt(w, nBestHeight);
+    CheckBalancesAt(w, nBestHeight + 1);
+    CheckBalancesAt(w, nBestHeight + 5);
+    CheckBalancesAt(w, nBestHeight + 1000);
+    CheckBalancesAt(w, nBestHeight + 1000000);
+}
+
+typedef set<pair<COutPoint, int> > CoinDepthSet;
+
+// What AvailableCoins gave before the unspent output index: a walk over
+// the whole wallet
+static CoinDepthSet WalkAvailableCoins(const CWallet& w, int nRefHeight, bool fOnlyConfirmed)
+{
+    LOCK(w.cs_wallet);
+    CoinDepthSet setCoins;
+    BOOST_FOREACH(const PAIRTYPE(const uint256, CWalletTx)& item, w.mapWallet)
+    {
+        const CWalletTx& wtx = item.second;
+        if (!wtx.IsFinal() || wtx.nRefHeight > nRefHeight)
+            continue;
+        if (fOnlyConfirmed && !wtx.IsConfirmed())
+            continue;
+        if (wtx.IsCoinBase() && wtx.GetBlocksToMaturity() > 0)
+            continue;
+        for (unsigned int i = 0; i < wtx.vout.size(); i++)
+            if (!wtx.IsSpent(i) && w.IsMine(wtx.vout[i]) && GetPresentValue(wtx, wtx.vout[i], nRefHeight) > 0)
+                setCoins.insert(make_pair(COutPoint(item.first, i), wtx.GetDepthInMainChain()));
+    }
+    return setCoins;
+}
+
+static void CheckAvailableCoinsAt(const CWallet& w, int nRefHeight, bool fOnlyConfirmed)
+{
+    vector<COutput> vAvailable;
+    w.AvailableCoins(vAvailable, nRefHeight, fOnlyConfirmed);
+    CoinDepthSet setAvailable;
+    BOOST_FOREACH(const COutput& output, vAvailable)
+        setAvailable.insert(make_pair(COutPoint(output.tx->GetHash(), output.i), output.nDepth));
+    BOOST_CHECK_EQUAL(setAvailable.size(), vAvailable.size());
+    BOOST_CHECK(setAvailable == WalkAvailableCoins(w, nRefHeight, fOnlyConfirmed));
+}
+
+static void CheckAvailableCoins(const CWallet& w)
+{
+    CheckAvailableCoinsAt(w, nBestHeight, true);
+    CheckAvailableCoinsAt(w, nBestHeight, false);
+    CheckAvailableCoinsAt(w, nBestHeight + 5, true);
+    CheckAvailableCoinsAt(w, nBestHeight + 5, false);
+}
+
+// Receives, confirms, spends and reorganizes on a made-up chain, with
+// fnCheck comparing the wallet against a full walk after each step
+static void RunWalletChainSteps(void (*fnCheck)(const CWallet&))
+{
+    BOOST_CHECK(pindexBest == pindexGenesisBlock);
+
+    CWallet w;
+    CKey key, keyOther;
+    key.MakeNewKey(true);
+    keyOther.MakeNewKey(true);
+    w.AddKey(key);
+    CScript scriptMine, scriptOther;
+    scriptMine.SetDestination(key.GetPubKey().GetID());
+    scriptOther.SetDestination(keyOther.GetPubKey().GetID());
+    BOOST_CHECK_EQUAL(w.GetBalance(nBestHeight), 0);
+    fnCheck(w);
+
+    // Received, unconfirmed; values that don't divide evenly under demurrage
+    CTransaction txA;
+    txA.vin.resize(1);
+    txA.vin[0].prevout = COutPoint(uint256(1), 0);
+    txA.vout.resize(4);
+    txA.vout[0].SetInitialValue(50 * COIN);
+    txA.vout[1].SetInitialValue(1234567891);
+    txA.vout[2].SetInitialValue(7 * CENT + 3);
+    txA.vout[3].SetInitialValue(20 * COIN);
+    txA.vout[0].scriptPubKey = txA.vout[1].scriptPubKey = txA.vout[2].scriptPubKey = scriptMine;
+    txA.vout[3].scriptPubKey = scriptOther;
+    CWalletTx& wtxA = AddWalletTx(w, txA);
+    BOOST_CHECK_EQUAL(w.GetBalance(nBestHeight), 0);
+    BOOST_CHECK(w.GetUnconfirmedBalance(nBestHeight) > 50 * COIN);
+    fnCheck(w);
+
+    // Confirmed: only the chain moving tells the wallet
+    ConfirmTx(wtxA);
+    BOOST_CHECK_EQUAL(w.GetUnconfirmedBalance(nBestHeight), 0);
+    BOOST_CHECK(w.GetBalance(nBestHeight) > 50 * COIN);
+    fnCheck(w);
+    CBlockIndex* pindexA = pindexBest;
+
+    // Referencing a height past the tip counts only from that height on
+    CTransaction txB;
+    txB.nRefHeight = nBestHeight + 5;
+    txB.vin.resize(1);
+    txB.vin[0].prevout = COutPoint(uint256(2), 0);
+    txB.vout.resize(1);
+    txB.vout[0].SetInitialValue(3 * COIN + 1);
+    txB.vout[0].scriptPubKey = scriptMine;
+    AddWalletTx(w, txB);
+    BOOST_CHECK_EQUAL(w.GetUnconfirmedBalance(nBestHeight), 0);
+    BOOST_CHECK(w.GetUnconfirmedBalance(txB.nRefHeight) > 0);
+    fnCheck(w);
+
+    // A coinbase of ours
+    CTransaction txC;
+    txC.nRefHeight = nBestHeight + 1;
+    txC.vin.resize(1);
+    txC.vin[0].scriptSig << 1;
+    txC.vout.resize(1);
+    txC.vout[0].SetInitialValue(25 * COIN);
+    txC.vout[0].scriptPubKey = scriptMine;
+    CWalletTx& wtxC = AddWalletTx(w, txC);
+    BOOST_CHECK(wtxC.IsCoinBase());
+    ConfirmTx(wtxC);
+    BOOST_CHECK(w.GetImmatureBalance(nBestHeight) > 0);
+    fnCheck(w);
+
+    // Spending an output of A, with change back to us
+    wtxA.MarkSpent(1);
+    CTransaction txD;
+    txD.nRefHeight = nBestHeight;
+    txD.vin.resize(1);
+    txD.vin[0].prevout = COutPoint(txA.GetHash(), 1);
+    txD.vout.resize(2);
+    txD.vout[0].SetInitialValue(1 * COIN);
+    txD.vout[0].scriptPubKey = scriptOther;
+    txD.vout[1].SetInitialValue(2 * COIN + 7);
+    txD.vout[1].scriptPubKey = scriptMine;
+    AddWalletTx(w, txD);
+    fnCheck(w);
+
+    // The chain grows past B's height and the coinbase's maturity
+    for (int i = 0; i < COINBASE_MATURITY + 20; i++)
+    {
+        SetTip(AddBlock(pindexBest));
+        if (i % 20 == 0)
+            fnCheck(w);
     }
+    BOOST_CHECK_EQUAL(w.GetImmatureBalance(nBestHeight), 0);
+    fnCheck(w);
+    CBlockIndex* pindexLong = pindexBest;
+
+    // A longer fork from before A leaves A unconfirmed and drops the
+    // coinbase
+    CBlockIndex* pindexFork = pindexGenesisBlock;
+    for (int i = 0; i < pindexLong->nHeight + 1; i++)
+        pindexFork = AddBlock(pindexFork);
+    SetTip(pindexFork);
+    BOOST_CHECK_EQUAL(w.GetImmatureBalance(nBestHeight), 0);
+    BOOST_CHECK(w.GetUnconfirmedBalance(nBestHeight) > 50 * COIN);
+    fnCheck(w);
+
+    // Blocks disconnected from the tip
+    SetTip(pindexFork->pprev->pprev);
+    fnCheck(w);
+
+    // Back to a chain with A but not yet the coinbase, then the rest of it
+    SetTip(pindexA);
+    BOOST_CHECK_EQUAL(w.GetImmatureBalance(nBestHeight), 0);
+    fnCheck(w);
+    SetTip(pindexLong);
+    fnCheck(w);
+
+    // Rebuilding from scratch comes to exactly the same totals
+    mpq nBalance = w.GetBalance(nBestHeight);
+    w.MarkDirty();
+    BOOST_CHECK_EQUAL(w.GetBalance(nBestHeight), nBalance);
+    fnCheck(w);
+
+    SetTip(pindexGenesisBlock);
+    BOOST_FOREACH(CBlockIndex* pindex, vBalanceBlocks)
+    {
+        mapBlockIndex.erase(pindex->GetBlockHash());
+        delete pindex;
+    }
+    vBalanceBlocks.clear();
+}
+
+BOOST_AUTO_TEST_CASE(wallet_balance_totals)
+{
+    RunWalletChainSteps(CheckBalances);
+}
+
+BOOST_AUTO_TEST_CASE(wallet_available_coins)
+{
+    RunWalletChainSteps(CheckAvailableCoins);
 }
-#endif
 
 BOOST_AUTO_TEST_SUITE_END()
@@ -617,6 +617,14 @@ inline const uint256 operator|(const uint256& a, const uint256& b)      { return
 inline const uint256 operator+(const uint256& a, const uint256& b)      { return (base_uint256)a +  (base_uint256)b; }
 inline const uint256 operator-(const uint256& a, const uint256& b)      { return (base_uint256)a -  (base_uint256)b; }
 
+/** Hash function for unordered containers keyed by uint256.  Transaction
+ *  and block hashes are already uniformly distributed, so their low bits
+ *  make a perfectly good bucket index. */
+struct uint256Hasher
+{
+    size_t operator()(const uint256& hash) const { return (size_t)hash.Get64(); }
+};
+
 
 
 
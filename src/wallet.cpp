@@ -19,8 +19,8 @@ using namespace std;
 
 struct CompareValueOnly
 {
-    bool operator()(const pair<mpq, pair<const CWalletTx*, unsigned int> >& t1,
-                    const pair<mpq, pair<const CWalletTx*, unsigned int> >& t2) const
+    bool operator()(const pair<int64, pair<const CWalletTx*, unsigned int> >& t1,
+                    const pair<int64, pair<const CWalletTx*, unsigned int> >& t2) const
     {
         return t1.first < t2.first;
     }
@@ -43,10 +43,99 @@ CPubKey CWallet::GenerateNewKey()
     return key.GetPubKey();
 }
 
+// Standard scriptPubKeys in their usual encoding.  Whether the wallet can
+// spend one of these is settled by setMineScripts alone.
+static bool IsExactStandard(const CScript& script)
+{
+    unsigned int nSize = script.size();
+    if (nSize == 25 && script[0] == OP_DUP && script[1] == OP_HASH160 && script[2] == 20 &&
+        script[23] == OP_EQUALVERIFY && script[24] == OP_CHECKSIG)
+        return true;
+    if (script.IsPayToScriptHash())
+        return true;
+    if ((nSize == 35 || nSize == 67) && script[0] == nSize - 2 && script[nSize - 1] == OP_CHECKSIG)
+        return true;
+    return false;
+}
+
+void CWallet::AddMineScripts(const CPubKey& vchPubKey)
+{
+    LOCK(cs_KeyStore);
+    CScript script;
+    script.SetDestination(vchPubKey.GetID());
+    setMineScripts.insert(script);
+    script.clear();
+    script << vchPubKey << OP_CHECKSIG;
+    setMineScripts.insert(script);
+
+    // Redeem scripts that were waiting for this key
+    typedef std::multimap<CKeyID, CScriptID>::iterator ScriptsByKeyIter;
+    std::pair<ScriptsByKeyIter, ScriptsByKeyIter> range = mapScriptsByKey.equal_range(vchPubKey.GetID());
+    for (ScriptsByKeyIter it = range.first; it != range.second; ++it)
+    {
+        CScript redeemScript;
+        if (GetCScript((*it).second, redeemScript) && ::IsMine(*this, redeemScript))
+        {
+            script.SetDestination((*it).second);
+            setMineScripts.insert(script);
+            setMineScripts.insert(redeemScript);
+        }
+    }
+    mapScriptsByKey.erase(range.first, range.second);
+}
+
+void CWallet::AddMineScripts(const CScript& redeemScript)
+{
+    LOCK(cs_KeyStore);
+    CScriptID scriptID = redeemScript.GetID();
+    if (::IsMine(*this, redeemScript))
+    {
+        CScript script;
+        script.SetDestination(scriptID);
+        setMineScripts.insert(script);
+        setMineScripts.insert(redeemScript);
+        return;
+    }
+
+    // Look at it again when one of the keys it is missing is added
+    vector<vector<unsigned char> > vSolutions;
+    txnouttype whichType;
+    if (!Solver(redeemScript, whichType, vSolutions))
+        return;
+    vector<CKeyID> vKeyIDs;
+    if (whichType == TX_PUBKEY)
+        vKeyIDs.push_back(CPubKey(vSolutions[0]).GetID());
+    else if (whichType == TX_PUBKEYHASH)
+        vKeyIDs.push_back(CKeyID(uint160(vSolutions[0])));
+    else if (whichType == TX_MULTISIG)
+        for (unsigned int i = 1; i < vSolutions.size() - 1; i++)
+            vKeyIDs.push_back(CPubKey(vSolutions[i]).GetID());
+    BOOST_FOREACH(const CKeyID& keyID, vKeyIDs)
+        if (!HaveKey(keyID))
+            mapScriptsByKey.insert(make_pair(keyID, scriptID));
+}
+
+bool CWallet::IsMine(const CScript& scriptPubKey) const
+{
+    {
+        LOCK(cs_KeyStore);
+        if (setMineScripts.count(scriptPubKey))
+            return true;
+    }
+    // Other forms, like bare multisig over keys in any order, still need
+    // the solver
+    if (IsExactStandard(scriptPubKey))
+        return false;
+    return ::IsMine(*this, scriptPubKey);
+}
+
 bool CWallet::AddKey(const CKey& key)
 {
     if (!CCryptoKeyStore::AddKey(key))
         return false;
+    // Encrypted keys went through AddCryptedKey
+    if (!IsCrypted())
+        AddMineScripts(key.GetPubKey());
     if (!fFileBacked)
         return true;
     if (!IsCrypted())
@@ -58,6 +147,7 @@ bool CWallet::AddCryptedKey(const CPubKey &vchPubKey, const vector<unsigned char
 {
     if (!CCryptoKeyStore::AddCryptedKey(vchPubKey, vchCryptedSecret))
         return false;
+    AddMineScripts(vchPubKey);
     if (!fFileBacked)
         return true;
     {
@@ -74,6 +164,7 @@ bool CWallet::AddCScript(const CScript& redeemScript)
 {
     if (!CCryptoKeyStore::AddCScript(redeemScript))
         return false;
+    AddMineScripts(redeemScript);
     if (!fFileBacked)
         return true;
     return CWalletDB(strWalletFile).WriteCScript(Hash160(redeemScript), redeemScript);
@@ -357,8 +448,16 @@ void CWallet::MarkDirty()
 {
     {
         LOCK(cs_wallet);
-        BOOST_FOREACH(PAIRTYPE(const uint256, CWalletTx)& item, mapWallet)
-            item.second.MarkDirty();
+        fBalanceAllDirty = true;
+    }
+}
+
+void CWallet::MarkDirty(const uint256& hash) const
+{
+    {
+        LOCK(cs_wallet);
+        if (!fBalanceAllDirty)
+            setBalanceDirty.insert(hash);
     }
 }
 
@@ -511,7 +610,10 @@ bool CWallet::EraseFromWallet(uint256 hash)
     {
         LOCK(cs_wallet);
         if (mapWallet.erase(hash))
+        {
+            MarkDirty(hash);
             CWalletDB(strWalletFile).EraseTx(hash);
+        }
     }
     return true;
 }
@@ -755,29 +857,192 @@ bool CWalletTx::WriteToDisk()
     return CWalletDB(pwallet->strWalletFile).WriteTx(GetHash(), *this);
 }
 
-// Scan the block chain (starting in pindexStart) for transactions
-// from or to us. If fUpdate is true, found transactions that already
-// exist in the wallet will be updated.
-int CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate)
+/** Runs a rescan on several threads.  Workers read blocks and match their
+ * outputs against the wallet's scripts, which it copies up front so that
+ * they don't have to take any wallet lock.  The calling thread walks the
+ * chain and applies the blocks in order under cs_wallet, a block at a time,
+ * checking the spends against mapWallet as it goes.
+ */
+class CWalletScanner
 {
-    int ret = 0;
+private:
+    // A block read and matched by a worker
+    struct CScannedBlock
+    {
+        CBlockIndex* pindex;
+        CBlock block;
+        std::vector<uint256> vHash;
+        std::vector<char> vfMatch;  // pays to the wallet
+    };
+
+    CWallet* pwallet;
+    ScriptSet setMineScripts;
+
+    boost::mutex mutex;
+    boost::condition_variable cond;
+
+    // Blocks waiting to be read, by position in the scan
+    std::deque<std::pair<unsigned int, CBlockIndex*> > queueBlocks;
+    std::map<unsigned int, CScannedBlock*> mapScanned;
+    unsigned int nQueued;
+    unsigned int nApplied;
+    bool fAbort;
+
+    // Blocks read but not yet applied are limited to this
+    static const unsigned int MAX_IN_FLIGHT = 64;
+
+    // CWallet::IsMine against the copy of the wallet's scripts
+    bool IsMine(const CScript& script) const
+    {
+        if (setMineScripts.count(script))
+            return true;
+        if (IsExactStandard(script))
+            return false;
+        return ::IsMine(*pwallet, script);
+    }
 
-    CBlockIndex* pindex = pindexStart;
+    void ThreadScan()
     {
-        LOCK(cs_wallet);
-        while (pindex)
+        loop
         {
-            CBlock block;
-            block.ReadFromDisk(pindex, true);
-            BOOST_FOREACH(CTransaction& tx, block.vtx)
+            std::pair<unsigned int, CBlockIndex*> item;
             {
-                if (AddToWalletIfInvolvingMe(tx, &block, fUpdate))
-                    ret++;
+                boost::unique_lock<boost::mutex> lock(mutex);
+                while (queueBlocks.empty() && !fAbort)
+                    cond.wait(lock);
+                if (fAbort)
+                    return;
+                item = queueBlocks.front();
+                queueBlocks.pop_front();
             }
-            pindex = pindex->pnext;
+
+            CScannedBlock* pscanned = new CScannedBlock();
+            pscanned->pindex = item.second;
+            pscanned->block.ReadFromDisk(item.second, true);
+            BOOST_FOREACH(const CTransaction& tx, pscanned->block.vtx)
+            {
+                bool fMatch = false;
+                BOOST_FOREACH(const CTxOut& txout, tx.vout)
+                    if (!fMatch && IsMine(txout.scriptPubKey))
+                        fMatch = true;
+                pscanned->vHash.push_back(tx.GetHash());
+                pscanned->vfMatch.push_back(fMatch);
+            }
+
+            boost::unique_lock<boost::mutex> lock(mutex);
+            mapScanned[item.first] = pscanned;
+            cond.notify_all();
         }
     }
-    return ret;
+
+    // Caller must hold cs_main and pwallet->cs_wallet
+    int Apply(const CScannedBlock& scanned, bool fUpdate)
+    {
+        int ret = 0;
+        for (unsigned int i = 0; i < scanned.block.vtx.size(); i++)
+        {
+            // Spends of the wallet's coins can't be matched ahead of time,
+            // since the coins may have been found earlier in this scan
+            const CTransaction& tx = scanned.block.vtx[i];
+            bool fInvolved = scanned.vfMatch[i] || pwallet->mapWallet.count(scanned.vHash[i]);
+            for (unsigned int j = 0; j < tx.vin.size() && !fInvolved; j++)
+                fInvolved = pwallet->mapWallet.count(tx.vin[j].prevout.hash);
+            if (fInvolved && pwallet->AddToWalletIfInvolvingMe(tx, &scanned.block, fUpdate))
+                ret++;
+        }
+        return ret;
+    }
+
+public:
+    CWalletScanner(CWallet* pwalletIn) : pwallet(pwalletIn), nQueued(0), nApplied(0), fAbort(false)
+    {
+        pwallet->GetMineScripts(setMineScripts);
+    }
+
+    /** Scans from pindexStart to the end of the main chain.  Progress is
+     * saved to the wallet every few seconds if fCheckpoint, so that an
+     * interrupted scan can be resumed at startup. */
+    int Scan(CBlockIndex* pindexStart, bool fUpdate, bool fCheckpoint)
+    {
+        int ret = 0;
+        CBlockIndex* pindexNext = pindexStart;
+        int64 nLastCheckpoint = GetTime();
+
+        boost::thread_group threads;
+        for (int i = 0; i < std::max(nScriptCheckThreads, 1); i++)
+            threads.create_thread(boost::bind(&CWalletScanner::ThreadScan, this));
+
+        loop
+        {
+            // Keep the workers busy with the blocks that follow
+            {
+                LOCK(cs_main);
+                boost::unique_lock<boost::mutex> lock(mutex);
+                while (pindexNext && nQueued - nApplied < MAX_IN_FLIGHT)
+                {
+                    queueBlocks.push_back(make_pair(nQueued++, pindexNext));
+                    pindexNext = pindexNext->pnext;
+                }
+                cond.notify_all();
+            }
+
+            CScannedBlock* pscanned;
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                while (!mapScanned.count(nApplied) && nApplied < nQueued && !fRequestShutdown)
+                    cond.timed_wait(lock, boost::posix_time::milliseconds(100));
+                if (!mapScanned.count(nApplied))
+                    break;
+                pscanned = mapScanned[nApplied];
+                mapScanned.erase(nApplied);
+                nApplied++;
+            }
+
+            {
+                LOCK2(cs_main, pwallet->cs_wallet);
+                ret += Apply(*pscanned, fUpdate);
+            }
+            if (fCheckpoint && GetTime() - nLastCheckpoint >= 10)
+            {
+                CWalletDB(pwallet->strWalletFile).WriteRescanBlock(CBlockLocator(pscanned->pindex));
+                nLastCheckpoint = GetTime();
+            }
+            delete pscanned;
+        }
+
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            fAbort = true;
+            cond.notify_all();
+        }
+        threads.join_all();
+
+        for (map<unsigned int, CScannedBlock*>::iterator mi = mapScanned.begin(); mi != mapScanned.end(); ++mi)
+            delete (*mi).second;
+        if (fCheckpoint && !pindexNext && nApplied == nQueued)
+            CWalletDB(pwallet->strWalletFile).EraseRescanBlock();
+        return ret;
+    }
+};
+
+// Scan the block chain (starting in pindexStart) for transactions
+// from or to us. If fUpdate is true, found transactions that already
+// exist in the wallet will be updated.
+// Callers must not hold cs_main or cs_wallet without cs_rescan; both are
+// taken a block at a time
+int CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate)
+{
+    if (!pindexStart)
+        return 0;
+    LOCK(cs_rescan);
+
+    // Full rescans leave a checkpoint behind until they finish
+    bool fCheckpoint = (fUpdate && fFileBacked);
+    if (fCheckpoint)
+        CWalletDB(strWalletFile).WriteRescanBlock(CBlockLocator(pindexStart));
+
+    CWalletScanner scanner(this);
+    return scanner.Scan(pindexStart, fUpdate, fCheckpoint);
 }
 
 int CWallet::ScanForWalletTransaction(const uint256& hashTx)
@@ -795,49 +1060,51 @@ void CWallet::ReacceptWalletTransactions()
     bool fRepeat = true;
     while (fRepeat)
     {
-        LOCK(cs_wallet);
         fRepeat = false;
         vector<CDiskTxPos> vMissingTx;
-        BOOST_FOREACH(PAIRTYPE(const uint256, CWalletTx)& item, mapWallet)
         {
-            CWalletTx& wtx = item.second;
-            if (wtx.IsCoinBase() && wtx.IsSpent(0))
-                continue;
-
-            CTxIndex txindex;
-            bool fUpdated = false;
-            if (txdb.ReadTxIndex(wtx.GetHash(), txindex))
+            LOCK(cs_wallet);
+            BOOST_FOREACH(PAIRTYPE(const uint256, CWalletTx)& item, mapWallet)
             {
-                // Update fSpent if a tx got spent somewhere else by a copy of wallet.dat
-                if (txindex.vSpent.size() != wtx.vout.size())
-                {
-                    printf("ERROR: ReacceptWalletTransactions() : txindex.vSpent.size() %"PRIszu" != wtx.vout.size() %"PRIszu"\n", txindex.vSpent.size(), wtx.vout.size());
+                CWalletTx& wtx = item.second;
+                if (wtx.IsCoinBase() && wtx.IsSpent(0))
                     continue;
-                }
-                for (unsigned int i = 0; i < txindex.vSpent.size(); i++)
+
+                CTxIndex txindex;
+                bool fUpdated = false;
+                if (txdb.ReadTxIndex(wtx.GetHash(), txindex))
                 {
-                    if (wtx.IsSpent(i))
+                    // Update fSpent if a tx got spent somewhere else by a copy of wallet.dat
+                    if (txindex.vSpent.size() != wtx.vout.size())
+                    {
+                        printf("ERROR: ReacceptWalletTransactions() : txindex.vSpent.size() %"PRIszu" != wtx.vout.size() %"PRIszu"\n", txindex.vSpent.size(), wtx.vout.size());
                         continue;
-                    if (!txindex.vSpent[i].IsNull() && IsMine(wtx.vout[i]))
+                    }
+                    for (unsigned int i = 0; i < txindex.vSpent.size(); i++)
+                    {
+                        if (wtx.IsSpent(i))
+                            continue;
+                        if (!txindex.vSpent[i].IsNull() && IsMine(wtx.vout[i]))
+                        {
+                            wtx.MarkSpent(i);
+                            fUpdated = true;
+                            vMissingTx.push_back(txindex.vSpent[i]);
+                        }
+                    }
+                    if (fUpdated)
                     {
-                        wtx.MarkSpent(i);
-                        fUpdated = true;
-                        vMissingTx.push_back(txindex.vSpent[i]);
+                        printf("ReacceptWalletTransactions found spent coin %sbc %s\n", FormatMoney(wtx.GetCredit(0)).c_str(), wtx.GetHash().ToString().c_str());
+                        wtx.MarkDirty();
+                        wtx.WriteToDisk();
                     }
                 }
-                if (fUpdated)
+                else
                 {
-                    printf("ReacceptWalletTransactions found spent coin %sbc %s\n", FormatMoney(wtx.GetCredit(0)).c_str(), wtx.GetHash().ToString().c_str());
-                    wtx.MarkDirty();
-                    wtx.WriteToDisk();
+                    // Re-accept any txes of ours that aren't already in a block
+                    if (!wtx.IsCoinBase())
+                        wtx.AcceptWalletTransaction(txdb, false);
                 }
             }
-            else
-            {
-                // Re-accept any txes of ours that aren't already in a block
-                if (!wtx.IsCoinBase())
-                    wtx.AcceptWalletTransaction(txdb, false);
-            }
         }
         if (!vMissingTx.empty())
         {
@@ -928,145 +1195,295 @@ void CWallet::ResendWalletTransactions()
 //
 
 
-mpq CWallet::GetBalance(int nBlockHeight) const
+// Caller must hold cs_wallet
+void CWallet::UpdateBalances() const
 {
-    mpq nTotal = 0;
+    // Blocks only added on top leave settled entries as they are
+    if (pindexBalance != pindexBest)
     {
-        LOCK(cs_wallet);
+        if (pindexBalance && (!pindexBest || pindexBest->GetAncestor(pindexBalance->nHeight) != pindexBalance))
+            fBalanceAllDirty = true;
+        pindexBalance = pindexBest;
+    }
+
+    set<uint256> setUpdate;
+    if (fBalanceAllDirty)
+    {
+        mapBalanceEntries.clear();
+        setBalanceUnsettled.clear();
+        setUnspent.clear();
+        for (int nKind = 0; nKind < BALANCE_KINDS; nKind++)
+            nBalanceSum[nKind] = 0;
         for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+            setUpdate.insert((*it).first);
+        fBalanceAllDirty = false;
+    }
+    else
+    {
+        setUpdate.swap(setBalanceDirty);
+        setUpdate.insert(setBalanceUnsettled.begin(), setBalanceUnsettled.end());
+    }
+    setBalanceDirty.clear();
+
+    int nTipHeight = (pindexBalance ? pindexBalance->nHeight : -1);
+    BOOST_FOREACH(const uint256& hash, setUpdate)
+    {
+        // Take out what the transaction added before
+        map<uint256, CWalletBalanceEntry>::iterator mi = mapBalanceEntries.find(hash);
+        if (mi != mapBalanceEntries.end())
         {
-            const CWalletTx* pcoin = &(*it).second;
-            if (pcoin->IsFinal() && pcoin->IsConfirmed())
-                nTotal += pcoin->GetAvailableCredit(nBlockHeight);
+            if ((*mi).second.fSummed)
+                nBalanceSum[(*mi).second.nKind] -= (*mi).second.nValue;
+            BOOST_FOREACH(unsigned int n, (*mi).second.vUnspent)
+                setUnspent.erase(COutPoint(hash, n));
+            mapBalanceEntries.erase(mi);
         }
-    }
+        setBalanceUnsettled.erase(hash);
 
-    return nTotal;
-}
+        map<uint256, CWalletTx>::const_iterator it = mapWallet.find(hash);
+        if (it == mapWallet.end())
+            continue;
+        const CWalletTx& wtx = (*it).second;
 
-mpq CWallet::GetUnconfirmedBalance(int nBlockHeight) const
-{
-    mpq nTotal = 0;
-    {
-        LOCK(cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        CWalletBalanceEntry entry;
+        entry.nRefHeight = wtx.nRefHeight;
+        entry.nValue = 0;
+        entry.nBlockHeight = -1;
+        if (wtx.IsCoinBase() && wtx.GetBlocksToMaturity() > 0)
         {
-            const CWalletTx* pcoin = &(*it).second;
-            if (!pcoin->IsFinal() || !pcoin->IsConfirmed())
-                nTotal += pcoin->GetAvailableCredit(nBlockHeight);
+            // Immature coins count whether spent or not
+            entry.nKind = BALANCE_IMMATURE;
+            entry.fSettled = false;
+            if (wtx.IsInMainChain())
+                BOOST_FOREACH(const CTxOut& txout, wtx.vout)
+                    if (IsMine(txout))
+                        entry.nValue += GetTimeAdjustedValue(txout.nValue, -wtx.nRefHeight);
+        }
+        else
+        {
+            bool fConfirmed = wtx.IsFinal() && wtx.IsConfirmed();
+            entry.nKind = fConfirmed ? BALANCE_CONFIRMED : BALANCE_UNCONFIRMED;
+            int nDepth = fConfirmed ? wtx.GetDepthInMainChain() : 0;
+            entry.fSettled = fConfirmed && nDepth >= 1 && wtx.nRefHeight <= nTipHeight;
+            if (entry.fSettled)
+                entry.nBlockHeight = nTipHeight - nDepth + 1;
+            for (unsigned int i = 0; i < wtx.vout.size(); i++)
+            {
+                if (!wtx.IsSpent(i) && IsMine(wtx.vout[i]))
+                {
+                    entry.nValue += GetTimeAdjustedValue(wtx.vout[i].nValue, -wtx.nRefHeight);
+                    entry.vUnspent.push_back(i);
+                    setUnspent.insert(COutPoint(hash, i));
+                }
+            }
         }
+        entry.fSummed = (entry.nKind == BALANCE_IMMATURE || wtx.nRefHeight <= nTipHeight);
+
+        if (entry.fSummed)
+            nBalanceSum[entry.nKind] += entry.nValue;
+        if (!entry.fSettled)
+            setBalanceUnsettled.insert(hash);
+        mapBalanceEntries.insert(make_pair(hash, entry));
     }
-    return nTotal;
 }
 
-mpq CWallet::GetImmatureBalance(int nBlockHeight) const
+// Demurrage shrinks every output by the same factor per block, so the
+// balance at any height from the tip on is the sum of the values at height
+// zero times one factor.  Heights below the tip are summed up the long way.
+mpq CWallet::GetBalanceOfKind(int nKind, int nBlockHeight) const
 {
-    mpq nTotal = 0;
+    LOCK(cs_wallet);
+    UpdateBalances();
+    if (!pindexBalance || nBlockHeight < pindexBalance->nHeight)
     {
-        LOCK(cs_wallet);
+        mpq nTotal = 0;
         for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
         {
-            const CWalletTx& pcoin = (*it).second;
-            if (pcoin.IsCoinBase() && pcoin.GetBlocksToMaturity() > 0 && pcoin.IsInMainChain())
-                nTotal += GetCredit(pcoin,nBlockHeight);
+            const CWalletTx& wtx = (*it).second;
+            if (nKind == BALANCE_IMMATURE)
+            {
+                if (wtx.IsCoinBase() && wtx.GetBlocksToMaturity() > 0 && wtx.IsInMainChain())
+                    nTotal += GetCredit(wtx, nBlockHeight);
+            }
+            else if ((wtx.IsFinal() && wtx.IsConfirmed()) == (nKind == BALANCE_CONFIRMED))
+                nTotal += wtx.GetAvailableCredit(nBlockHeight);
         }
+        return nTotal;
+    }
+
+    mpq nTotal = GetTimeAdjustedValue(nBalanceSum[nKind], nBlockHeight);
+    BOOST_FOREACH(const uint256& hash, setBalanceUnsettled)
+    {
+        const CWalletBalanceEntry& entry = mapBalanceEntries[hash];
+        if (!entry.fSummed && entry.nKind == nKind && entry.nRefHeight <= nBlockHeight)
+            nTotal += GetTimeAdjustedValue(entry.nValue, nBlockHeight);
     }
     return nTotal;
 }
 
+mpq CWallet::GetBalance(int nBlockHeight) const
+{
+    return GetBalanceOfKind(BALANCE_CONFIRMED, nBlockHeight);
+}
+
+mpq CWallet::GetUnconfirmedBalance(int nBlockHeight) const
+{
+    return GetBalanceOfKind(BALANCE_UNCONFIRMED, nBlockHeight);
+}
+
+mpq CWallet::GetImmatureBalance(int nBlockHeight) const
+{
+    return GetBalanceOfKind(BALANCE_IMMATURE, nBlockHeight);
+}
+
 // populate vCoins with vector of spendable COutputs
-void CWallet::AvailableCoins(vector<COutput>& vCoins, int nRefHeight, bool fOnlyConfirmed) const
+// Present value of a coin in whole base units, rounded down
+static int64 GetCoinValue(const mpq& qValue)
+{
+    return mpz_to_i64(qValue.get_num() / qValue.get_den());
+}
+
+// pvValues, if given, gets the present value of each coin at nRefHeight
+// in whole base units, for SelectCoinsMinConf
+void CWallet::AvailableCoins(vector<COutput>& vCoins, int nRefHeight, bool fOnlyConfirmed, vector<int64>* pvValues) const
 {
     vCoins.clear();
+    if (pvValues)
+        pvValues->clear();
 
     if ( nRefHeight < 0 )
         nRefHeight = nBestHeight;
 
     {
         LOCK(cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
+        UpdateBalances();
 
-            if (!pcoin->IsFinal())
-                continue;
+        // Only transactions with unspent outputs of ours are looked at;
+        // setUnspent has the outputs of each one next to each other
+        set<COutPoint>::const_iterator it = setUnspent.begin();
+        while (it != setUnspent.end())
+        {
+            const uint256 hash = (*it).hash;
+            const CWalletTx* pcoin = &(*mapWallet.find(hash)).second;
+            const CWalletBalanceEntry& entry = mapBalanceEntries[hash];
 
+            bool fUsable = true;
+            if (!entry.fSettled && !pcoin->IsFinal())
+                fUsable = false;
             if (pcoin->nRefHeight > nRefHeight)
-                continue;
+                fUsable = false;
+            if (fOnlyConfirmed && entry.nKind != BALANCE_CONFIRMED)
+                fUsable = false;
 
-            if (fOnlyConfirmed && !pcoin->IsConfirmed())
-                continue;
-
-            if (pcoin->IsCoinBase() && pcoin->GetBlocksToMaturity() > 0)
-                continue;
-
-            for (unsigned int i = 0; i < pcoin->vout.size(); i++)
-                if (!(pcoin->IsSpent(i)) && IsMine(pcoin->vout[i]) && GetPresentValue(*pcoin, pcoin->vout[i], nRefHeight) > 0)
-                    vCoins.push_back(COutput(pcoin, i, pcoin->GetDepthInMainChain()));
+            int nDepth = entry.fSettled ? pindexBalance->nHeight - entry.nBlockHeight + 1 : pcoin->GetDepthInMainChain();
+            for (; it != setUnspent.end() && (*it).hash == hash; ++it)
+            {
+                if (!fUsable)
+                    continue;
+                mpq qValue = GetPresentValue(*pcoin, pcoin->vout[(*it).n], nRefHeight);
+                if (qValue <= 0)
+                    continue;
+                vCoins.push_back(COutput(pcoin, (*it).n, nDepth));
+                if (pvValues)
+                    pvValues->push_back(GetCoinValue(qValue));
+            }
         }
     }
 }
 
-static void ApproximateBestSubset(vector<pair<mpq, pair<const CWalletTx*,unsigned int> > >vValue, const mpq& nTotalLower, const mpq& nTargetValue,
-                                  vector<char>& vfBest, mpq& nBest, int iterations = 1000)
+// Depth-first search over vValue, sorted largest first, for the subset
+// with the smallest total of at least nTarget.  Stops early on an exact
+// match, which needs no change output, or when the budget runs out; vfBest
+// then holds the best subset seen so far.
+static void FindBestSubset(const vector<pair<int64, pair<const CWalletTx*,unsigned int> > >& vValue, int64 nTotalLower, int64 nTarget,
+                           vector<char>& vfBest, int64& nBest, int64 nMaxTries, int64 nTimeLimit)
 {
-    vector<char> vfIncluded;
-
-    vfBest.assign(vValue.size(), true);
+    unsigned int nCoins = vValue.size();
+    vfBest.assign(nCoins, true);
     nBest = nTotalLower;
 
-    for (int nRep = 0; nRep < iterations && nBest != nTargetValue; nRep++)
+    // Sum of the coins from i on, to prune branches that can't reach nTarget
+    vector<int64> vRemaining(nCoins + 1, 0);
+    for (unsigned int i = nCoins; i > 0; i--)
+        vRemaining[i - 1] = vRemaining[i] + vValue[i - 1].first;
+
+    vector<char> vfIncluded(nCoins, false);
+    int64 nTotal = 0;
+    unsigned int i = 0;
+    for (int64 nTries = 0; nTries < nMaxTries && nBest != nTarget; nTries++)
     {
-        vfIncluded.assign(vValue.size(), false);
-        mpq nTotal = 0;
-        bool fReachedTarget = false;
-        for (int nPass = 0; nPass < 2 && !fReachedTarget; nPass++)
+        if ((nTries & 1023) == 1023 && GetTimeMillis() > nTimeLimit)
+            break;
+
+        if (nTotal >= nTarget)
         {
-            for (unsigned int i = 0; i < vValue.size(); i++)
+            if (nTotal < nBest)
             {
-                if (nPass == 0 ? rand() % 2 : !vfIncluded[i])
-                {
-                    nTotal += vValue[i].first;
-                    vfIncluded[i] = true;
-                    if (nTotal >= nTargetValue)
-                    {
-                        fReachedTarget = true;
-                        if (nTotal < nBest)
-                        {
-                            nBest = nTotal;
-                            vfBest = vfIncluded;
-                        }
-                        nTotal -= vValue[i].first;
-                        vfIncluded[i] = false;
-                    }
-                }
+                nBest = nTotal;
+                vfBest.assign(vfIncluded.begin(), vfIncluded.begin() + i);
+                vfBest.resize(nCoins, false);
             }
         }
+        else if (i < nCoins && nTotal + vRemaining[i] >= nTarget)
+        {
+            // Leaving out a coin and then taking one of the same value
+            // would only repeat the branch that took the first
+            bool fSkip = (i > 0 && !vfIncluded[i - 1] && vValue[i].first == vValue[i - 1].first);
+            vfIncluded[i] = (!fSkip && nTotal + vValue[i].first < nBest);
+            if (vfIncluded[i])
+                nTotal += vValue[i].first;
+            i++;
+            continue;
+        }
+
+        // Backtrack: leave out the last coin taken and go on from there
+        while (i > 0 && !vfIncluded[i - 1])
+            i--;
+        if (i == 0)
+            break;
+        i--;
+        vfIncluded[i] = false;
+        nTotal -= vValue[i].first;
+        i++;
     }
 }
 
-bool CWallet::SelectCoinsMinConf(const mpq& nTargetValue, int nConfMine, int nConfTheirs, vector<COutput> vCoins,
+bool CWallet::SelectCoinsMinConf(const mpq& nTargetValue, int nConfMine, int nConfTheirs, const vector<COutput>& vCoins,
                                  set<pair<const CWalletTx*,unsigned int> >& setCoinsRet, mpq& nValueRet, int nRefHeight) const
 {
-    const mpq nTargetValuePlusCent = nTargetValue + CENT;
+    if ( nRefHeight < 0 )
+        nRefHeight = nBestHeight;
 
+    vector<int64> vValues;
+    vValues.reserve(vCoins.size());
+    BOOST_FOREACH(const COutput& output, vCoins)
+        vValues.push_back(GetCoinValue(GetPresentValue(*output.tx, output.tx->vout[output.i], nRefHeight)));
+    return SelectCoinsMinConf(nTargetValue, nConfMine, nConfTheirs, vCoins, vValues, setCoinsRet, nValueRet, nRefHeight);
+}
+
+bool CWallet::SelectCoinsMinConf(const mpq& nTargetValue, int nConfMine, int nConfTheirs, const vector<COutput>& vCoins, const vector<int64>& vValues,
+                                 set<pair<const CWalletTx*,unsigned int> >& setCoinsRet, mpq& nValueRet, int nRefHeight) const
+{
     setCoinsRet.clear();
     nValueRet = 0;
 
-    if ( nRefHeight < 0 )
-        nRefHeight = nBestHeight;
+    // Work in whole base units: coins round down and the target up, so a
+    // subset that covers the target here covers it exactly too
+    const mpq qTarget = RoundAbsolute(nTargetValue, ROUND_AWAY_FROM_ZERO, 0);
+    const int64 nTarget = mpz_to_i64(qTarget.get_num() / qTarget.get_den());
+    const int64 nCent = mpz_to_i64(CENT.get_num() / CENT.get_den());
+    const int64 nTargetPlusCent = nTarget + nCent;
 
     // List of values less than target
-    pair<mpq, pair<const CWalletTx*,unsigned int> > coinLowestLarger;
-    coinLowestLarger.first = i64_to_mpq(std::numeric_limits<int64>::max());
+    pair<int64, pair<const CWalletTx*,unsigned int> > coinLowestLarger;
+    coinLowestLarger.first = std::numeric_limits<int64>::max();
     coinLowestLarger.second.first = NULL;
-    vector<pair<mpq, pair<const CWalletTx*,unsigned int> > > vValue;
-    mpq nTotalLower = 0;
-
-    random_shuffle(vCoins.begin(), vCoins.end(), GetRandInt);
+    vector<pair<int64, pair<const CWalletTx*,unsigned int> > > vValue;
+    int64 nTotalLower = 0;
 
-    BOOST_FOREACH(COutput output, vCoins)
+    for (unsigned int nCoin = 0; nCoin < vCoins.size(); nCoin++)
     {
+        const COutput& output = vCoins[nCoin];
         const CWalletTx* pcoin = output.tx;
 
         if (output.nDepth < (pcoin->IsFromMe() ? nConfMine : nConfTheirs))
@@ -1076,17 +1493,19 @@ bool CWallet::SelectCoinsMinConf(const mpq& nTargetValue, int nConfMine, int nCo
             continue;
 
         int i = output.i;
-        mpq n = GetPresentValue(*pcoin, pcoin->vout[i], nRefHeight);
+        int64 n = vValues[nCoin];
+        if (n <= 0)
+            continue;
 
-        pair<mpq,pair<const CWalletTx*,unsigned int> > coin = make_pair(n,make_pair(pcoin, i));
+        pair<int64,pair<const CWalletTx*,unsigned int> > coin = make_pair(n,make_pair(pcoin, i));
 
-        if (n == nTargetValue)
+        if (n == nTarget)
         {
             setCoinsRet.insert(coin.second);
-            nValueRet += coin.first;
+            nValueRet += GetPresentValue(*pcoin, pcoin->vout[i], nRefHeight);
             return true;
         }
-        else if (n < nTargetValuePlusCent)
+        else if (n < nTargetPlusCent)
         {
             vValue.push_back(coin);
             nTotalLower += n;
@@ -1097,57 +1516,47 @@ bool CWallet::SelectCoinsMinConf(const mpq& nTargetValue, int nConfMine, int nCo
         }
     }
 
-    if (nTotalLower == nTargetValue)
-    {
-        for (unsigned int i = 0; i < vValue.size(); ++i)
-        {
-            setCoinsRet.insert(vValue[i].second);
-            nValueRet += vValue[i].first;
-        }
-        return true;
-    }
-
-    if (nTotalLower < nTargetValue)
+    vector<char> vfBest;
+    int64 nBest = nTotalLower;
+    if (nTotalLower < nTarget)
     {
         if (coinLowestLarger.second.first == NULL)
             return false;
-        setCoinsRet.insert(coinLowestLarger.second);
-        nValueRet += coinLowestLarger.first;
-        return true;
+    }
+    else if (nTotalLower == nTarget)
+    {
+        vfBest.assign(vValue.size(), true);
+    }
+    else
+    {
+        // Look for an exact match first, then for the smallest total that
+        // leaves at least a cent of change
+        stable_sort(vValue.rbegin(), vValue.rend(), CompareValueOnly());
+        int64 nMaxTries = GetArg("-selectcoinstries", 100000);
+        int64 nTimeLimit = GetTimeMillis() + GetArg("-selectcoinstime", 100);
+        FindBestSubset(vValue, nTotalLower, nTarget, vfBest, nBest, nMaxTries, nTimeLimit);
+        if (nBest != nTarget && nTotalLower >= nTargetPlusCent)
+            FindBestSubset(vValue, nTotalLower, nTargetPlusCent, vfBest, nBest, nMaxTries, nTimeLimit);
     }
 
-    // Solve subset sum by stochastic approximation
-    sort(vValue.rbegin(), vValue.rend(), CompareValueOnly());
-    vector<char> vfBest;
-    mpq nBest;
-
-    ApproximateBestSubset(vValue, nTotalLower, nTargetValue, vfBest, nBest, 1000);
-    if (nBest != nTargetValue && nTotalLower >= nTargetValuePlusCent)
-        ApproximateBestSubset(vValue, nTotalLower, nTargetValuePlusCent, vfBest, nBest, 1000);
-
-    // If we have a bigger coin and (either the stochastic approximation didn't find a good solution,
-    //                                   or the next bigger coin is closer), return the bigger coin
+    // If we have a bigger coin and (either the search didn't find a good solution,
+    //                                or the next bigger coin is closer), return the bigger coin
     if (coinLowestLarger.second.first &&
-        ((nBest != nTargetValue && nBest < nTargetValuePlusCent) || coinLowestLarger.first <= nBest))
+        (nTotalLower < nTarget || (nBest != nTarget && nBest < nTargetPlusCent) || coinLowestLarger.first <= nBest))
     {
         setCoinsRet.insert(coinLowestLarger.second);
-        nValueRet += coinLowestLarger.first;
+        vfBest.assign(vValue.size(), false);
+        nBest = coinLowestLarger.first;
     }
-    else {
-        for (unsigned int i = 0; i < vValue.size(); i++)
-            if (vfBest[i])
-            {
-                setCoinsRet.insert(vValue[i].second);
-                nValueRet += vValue[i].first;
-            }
 
-        //// debug print
-        printf("SelectCoins() best subset: ");
-        for (unsigned int i = 0; i < vValue.size(); i++)
-            if (vfBest[i])
-                printf("%s ", FormatMoney(vValue[i].first).c_str());
-        printf("total %s\n", FormatMoney(nBest).c_str());
-    }
+    for (unsigned int i = 0; i < vValue.size(); i++)
+        if (vfBest[i])
+            setCoinsRet.insert(vValue[i].second);
+    BOOST_FOREACH(const PAIRTYPE(const CWalletTx*,unsigned int)& coin, setCoinsRet)
+        nValueRet += GetPresentValue(*coin.first, coin.first->vout[coin.second], nRefHeight);
+
+    if (setCoinsRet.size() > 1)
+        printf("SelectCoins() best subset of %"PRIszu" coins, total %s\n", setCoinsRet.size(), FormatMoney(nValueRet).c_str());
 
     return true;
 }
@@ -1157,12 +1566,14 @@ bool CWallet::SelectCoins(const mpq& nTargetValue, set<pair<const CWalletTx*,uns
     if ( nRefHeight < 0 )
         nRefHeight = nBestHeight;
 
+    // Present values are worked out once, not again in every pass
     vector<COutput> vCoins;
-    AvailableCoins(vCoins, nRefHeight);
+    vector<int64> vValues;
+    AvailableCoins(vCoins, nRefHeight, true, &vValues);
 
-    return (SelectCoinsMinConf(nTargetValue, 1, 6, vCoins, setCoinsRet, nValueRet, nRefHeight) ||
-            SelectCoinsMinConf(nTargetValue, 1, 1, vCoins, setCoinsRet, nValueRet, nRefHeight) ||
-            SelectCoinsMinConf(nTargetValue, 0, 1, vCoins, setCoinsRet, nValueRet, nRefHeight));
+    return (SelectCoinsMinConf(nTargetValue, 1, 6, vCoins, vValues, setCoinsRet, nValueRet, nRefHeight) ||
+            SelectCoinsMinConf(nTargetValue, 1, 1, vCoins, vValues, setCoinsRet, nValueRet, nRefHeight) ||
+            SelectCoinsMinConf(nTargetValue, 0, 1, vCoins, vValues, setCoinsRet, nValueRet, nRefHeight));
 }
 
 
@@ -1268,8 +1679,9 @@ bool CWallet::CreateTransaction(const vector<pair<CScript, mpq> >& vecSend, int
 
                 // Sign
                 int nIn = 0;
+                CSignatureHashContext sighashctx(wtxNew);
                 BOOST_FOREACH(const PAIRTYPE(const CWalletTx*,unsigned int)& coin, setCoins)
-                    if (!SignSignature(*this, *coin.first, wtxNew, nIn++))
+                    if (!SignSignature(*this, *coin.first, wtxNew, nIn++, SIGHASH_ALL, &sighashctx))
                         return false;
 
                 // Limit size
@@ -62,6 +62,40 @@ public:
     )
 };
 
+/** Kinds of wallet balance */
+enum BalanceKind
+{
+    BALANCE_CONFIRMED,
+    BALANCE_UNCONFIRMED,
+    BALANCE_IMMATURE,
+    BALANCE_KINDS
+};
+
+/** What one wallet transaction adds to its kind of balance.  The value is
+ * taken at height zero, so that a sum of them only needs to be multiplied
+ * by the demurrage factor of the height asked for. */
+class CWalletBalanceEntry
+{
+public:
+    int nKind;
+    int nRefHeight;
+    mpq nValue;
+
+    // Summed into CWallet::nBalanceSum; entries from later than the tip
+    // are added per query instead
+    bool fSummed;
+
+    // Only a reorganization can change a settled entry
+    bool fSettled;
+
+    // Height of the block holding the transaction, if settled
+    int nBlockHeight;
+
+    // Outputs that are mine and unspent, unless the transaction is an
+    // immature coinbase
+    std::vector<unsigned int> vUnspent;
+};
+
 /** A CWallet is an extension of a keystore, which also maintains a set of transactions and balances,
  * and provides the ability to create new transactions.
  */
@@ -78,8 +112,36 @@ private:
     // the maximum wallet format version: memory-only variable that specifies to what version this wallet may be upgraded
     int nWalletMaxVersion;
 
+    // Balances as of pindexBalance, brought up to date by UpdateBalances.
+    // Changed transactions are in setBalanceDirty; those whose kind may
+    // change as the chain grows are in setBalanceUnsettled.
+    mutable std::map<uint256, CWalletBalanceEntry> mapBalanceEntries;
+    mutable std::set<uint256> setBalanceDirty;
+    mutable std::set<uint256> setBalanceUnsettled;
+    mutable bool fBalanceAllDirty;
+    mutable CBlockIndex* pindexBalance;
+    mutable mpq nBalanceSum[BALANCE_KINDS];
+
+    // The vUnspent of all entries, for AvailableCoins
+    mutable std::set<COutPoint> setUnspent;
+
+    // The exact scriptPubKeys the wallet can spend, kept up to date as keys
+    // and scripts are added, and the redeem scripts still missing a key by
+    // the keys they miss; guarded by cs_KeyStore
+    ScriptSet setMineScripts;
+    std::multimap<CKeyID, CScriptID> mapScriptsByKey;
+
+    void AddMineScripts(const CPubKey& vchPubKey);
+    void AddMineScripts(const CScript& redeemScript);
+
+    void UpdateBalances() const;
+    mpq GetBalanceOfKind(int nKind, int nBlockHeight) const;
+
 public:
     mutable CCriticalSection cs_wallet;
+    // Held for a whole rescan, as rescans share one checkpoint; taken
+    // before cs_main
+    CCriticalSection cs_rescan;
 
     bool fFileBacked;
     std::string strWalletFile;
@@ -99,6 +161,8 @@ public:
         nMasterKeyMaxID = 0;
         pwalletdbEncryption = NULL;
         nOrderPosNext = 0;
+        fBalanceAllDirty = true;
+        pindexBalance = NULL;
     }
     CWallet(std::string strWalletFileIn)
     {
@@ -109,6 +173,8 @@ public:
         nMasterKeyMaxID = 0;
         pwalletdbEncryption = NULL;
         nOrderPosNext = 0;
+        fBalanceAllDirty = true;
+        pindexBalance = NULL;
     }
 
     std::map<uint256, CWalletTx> mapWallet;
@@ -122,8 +188,10 @@ public:
     // check whether we are allowed to upgrade (or already support) to the named feature
     bool CanSupportFeature(enum WalletFeature wf) { return nWalletMaxVersion >= wf; }
 
-    void AvailableCoins(std::vector<COutput>& vCoins, int nRefHeight=-1, bool fOnlyConfirmed=true) const;
-    bool SelectCoinsMinConf(const mpq& nTargetValue, int nConfMine, int nConfTheirs, std::vector<COutput> vCoins, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, mpq& nValueRet, int nRefHeight=-1) const;
+    void AvailableCoins(std::vector<COutput>& vCoins, int nRefHeight=-1, bool fOnlyConfirmed=true, std::vector<int64>* pvValues=NULL) const;
+    bool SelectCoinsMinConf(const mpq& nTargetValue, int nConfMine, int nConfTheirs, const std::vector<COutput>& vCoins, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, mpq& nValueRet, int nRefHeight=-1) const;
+    // vValues holds the present value of each coin in whole base units
+    bool SelectCoinsMinConf(const mpq& nTargetValue, int nConfMine, int nConfTheirs, const std::vector<COutput>& vCoins, const std::vector<int64>& vValues, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, mpq& nValueRet, int nRefHeight) const;
 
     // keystore implementation
     // Generate a new key
@@ -131,16 +199,40 @@ public:
     // Adds a key to the store, and saves it to disk.
     bool AddKey(const CKey& key);
     // Adds a key to the store, without saving it to disk (used by LoadWallet)
-    bool LoadKey(const CKey& key) { return CCryptoKeyStore::AddKey(key); }
+    bool LoadKey(const CKey& key)
+    {
+        if (!CCryptoKeyStore::AddKey(key))
+            return false;
+        AddMineScripts(key.GetPubKey());
+        return true;
+    }
 
     bool LoadMinVersion(int nVersion) { nWalletVersion = nVersion; nWalletMaxVersion = std::max(nWalletMaxVersion, nVersion); return true; }
 
     // Adds an encrypted key to the store, and saves it to disk.
     bool AddCryptedKey(const CPubKey &vchPubKey, const std::vector<unsigned char> &vchCryptedSecret);
     // Adds an encrypted key to the store, without saving it to disk (used by LoadWallet)
-    bool LoadCryptedKey(const CPubKey &vchPubKey, const std::vector<unsigned char> &vchCryptedSecret) { SetMinVersion(FEATURE_WALLETCRYPT); return CCryptoKeyStore::AddCryptedKey(vchPubKey, vchCryptedSecret); }
+    bool LoadCryptedKey(const CPubKey &vchPubKey, const std::vector<unsigned char> &vchCryptedSecret)
+    {
+        SetMinVersion(FEATURE_WALLETCRYPT);
+        if (!CCryptoKeyStore::AddCryptedKey(vchPubKey, vchCryptedSecret))
+            return false;
+        AddMineScripts(vchPubKey);
+        return true;
+    }
     bool AddCScript(const CScript& redeemScript);
-    bool LoadCScript(const CScript& redeemScript) { return CCryptoKeyStore::AddCScript(redeemScript); }
+    bool LoadCScript(const CScript& redeemScript)
+    {
+        if (!CCryptoKeyStore::AddCScript(redeemScript))
+            return false;
+        AddMineScripts(redeemScript);
+        return true;
+    }
+    void GetMineScripts(ScriptSet& setRet) const
+    {
+        LOCK(cs_KeyStore);
+        setRet = setMineScripts;
+    }
 
     bool Unlock(const SecureString& strWalletPassphrase);
     bool ChangeWalletPassphrase(const SecureString& strOldWalletPassphrase, const SecureString& strNewWalletPassphrase);
@@ -161,6 +253,7 @@ public:
     TxItems OrderedTxItems(std::list<CAccountingEntry>& acentries, std::string strAccount = "");
 
     void MarkDirty();
+    void MarkDirty(const uint256& hash) const;
     bool AddToWallet(const CWalletTx& wtxIn);
     bool AddToWalletIfInvolvingMe(const CTransaction& tx, const CBlock* pblock, bool fUpdate = false, bool fFindBlock = false);
     bool EraseFromWallet(uint256 hash);
@@ -193,9 +286,10 @@ public:
 
     bool IsMine(const CTxIn& txin) const;
     mpq GetDebit(const CTxIn& txin, int nBlockHeight) const;
+    bool IsMine(const CScript& scriptPubKey) const;
     bool IsMine(const CTxOut& txout) const
     {
-        return ::IsMine(*this, txout.scriptPubKey);
+        return IsMine(txout.scriptPubKey);
     }
     mpq GetCredit(const CTransaction& tx, const CTxOut& txout, int nBlockHeight) const
     {
@@ -485,12 +579,16 @@ public:
                 fReturn = true;
             }
         }
+        if (fReturn)
+            MarkDirty();
         return fReturn;
     }
 
     // make sure balances are recalculated
     void MarkDirty()
     {
+        if (pwallet)
+            pwallet->MarkDirty(GetHash());
     }
 
     void BindWallet(CWallet *pwalletIn)
@@ -507,6 +605,7 @@ public:
         if (!vfSpent[nOut])
         {
             vfSpent[nOut] = true;
+            MarkDirty();
         }
     }
 
@@ -92,6 +92,24 @@ public:
         return Read(std::string("bestblock"), locator);
     }
 
+    // Where an unfinished rescan should pick up again
+    bool WriteRescanBlock(const CBlockLocator& locator)
+    {
+        nWalletDBUpdated++;
+        return Write(std::string("rescanblock"), locator);
+    }
+
+    bool ReadRescanBlock(CBlockLocator& locator)
+    {
+        return Read(std::string("rescanblock"), locator);
+    }
+
+    bool EraseRescanBlock()
+    {
+        nWalletDBUpdated++;
+        return Erase(std::string("rescanblock"));
+    }
+
     bool WriteOrderPosNext(int64 nOrderPosNext)
     {
         nWalletDBUpdated++;